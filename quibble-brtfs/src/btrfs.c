@@ -56,10 +56,34 @@ typedef struct {
     void* top_tree;
 } root;
 
+#define PREFETCH_MAGIC 0x31465051 // "QPF1"
+#define PREFETCH_MAX_RUN 0x400000 // 4 MB
+#define PREFETCH_MAX_TOTAL 0x10000000 // 256 MB
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_entries;
+    BTRFS_UUID uuid;
+} prefetch_header;
+
+typedef struct {
+    uint64_t address;
+    uint64_t generation;
+    uint32_t size;
+    uint32_t reserved;
+} prefetch_entry;
+
+typedef struct {
+    uint64_t address;
+    uint32_t size;
+    uint8_t* data;
+} cache_entry;
+
 typedef struct {
     EFI_SIMPLE_FILE_SYSTEM_PROTOCOL proto;
     EFI_QUIBBLE_PROTOCOL quibble_proto;
     EFI_OPEN_SUBVOL_PROTOCOL open_subvol_proto;
+    EFI_QUIBBLE_PREFETCH_PROTOCOL prefetch_proto;
     superblock* sb;
     EFI_HANDLE controller;
     EFI_BLOCK_IO_PROTOCOL* block;
@@ -71,6 +95,16 @@ typedef struct {
     root* chunk_root;
     LIST_ENTRY list_entry;
     root* fsroot;
+    bool recording;
+    prefetch_entry* record;
+    unsigned int record_count;
+    unsigned int record_alloc;
+    cache_entry* cache;
+    unsigned int cache_count;
+#ifdef BTRFS_STATS
+    unsigned int open_files;
+    bool file_read;
+#endif
 } volume;
 
 typedef struct {
@@ -139,6 +173,22 @@ uint32_t calc_crc32c(uint32_t seed, uint8_t* msg, unsigned int msglen);
 
 LIST_ENTRY volumes;
 
+#ifdef BTRFS_STATS
+typedef struct {
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+    uint64_t frees;
+} btrfs_stats;
+
+static btrfs_stats stats;
+static bool stats_printed = false;
+static EFI_BOOT_SERVICES stats_bs;
+static EFI_ALLOCATE_POOL real_allocate_pool;
+static EFI_FREE_POOL real_free_pool;
+#endif
+
 void do_print(const char* s) {
     if (info_proto)
         info_proto->Print(s);
@@ -217,25 +267,75 @@ static EFI_STATUS bootstrap_roots(volume* vol) {
     return EFI_SUCCESS;
 }
 
-static EFI_STATUS read_data(volume* vol, uint64_t address, uint32_t size, void* data) {
-    EFI_STATUS Status;
+#ifdef BTRFS_STATS
+static EFI_STATUS EFIAPI stats_allocate_pool(EFI_MEMORY_TYPE PoolType, UINTN Size, VOID** Buffer) {
+    stats.allocs++;
+    stats.alloc_bytes += Size;
+
+    return real_allocate_pool(PoolType, Size, Buffer);
+}
+
+static EFI_STATUS EFIAPI stats_free_pool(VOID* Buffer) {
+    stats.frees++;
+
+    return real_free_pool(Buffer);
+}
+
+static void print_stats() {
+    char s[255], *p;
+
+    p = stpcpy(s, "btrfs: ");
+    p = dec_to_str(p, stats.reads);
+    p = stpcpy(p, " reads (");
+    p = dec_to_str(p, stats.read_bytes);
+    p = stpcpy(p, " bytes), ");
+    p = dec_to_str(p, stats.allocs);
+    p = stpcpy(p, " allocations (");
+    p = dec_to_str(p, stats.alloc_bytes);
+    p = stpcpy(p, " bytes), ");
+    p = dec_to_str(p, stats.frees);
+    p = stpcpy(p, " frees\n");
+
+    do_print(s);
+}
+#endif
+
+// All disk access goes through here, so that the driver can be run against
+// something other than a real EFI_BLOCK_IO_PROTOCOL (e.g. an image file).
+static EFI_STATUS read_blocks(EFI_BLOCK_IO_PROTOCOL* block, uint64_t offset, UINTN size, void* data) {
+#ifdef BTRFS_STATS
+    stats.reads++;
+    stats.read_bytes += size;
+#endif
+
+    return block->ReadBlocks(block, block->Media->MediaId, offset / block->Media->BlockSize, size, data);
+}
+
+static chunk* find_chunk(volume* vol, uint64_t address) {
     LIST_ENTRY* le;
-    chunk* c = NULL;
-    CHUNK_ITEM_STRIPE* stripes;
 
     le = vol->chunks.Flink;
     while (le != &vol->chunks) {
-        chunk* c2 = _CR(le, chunk, list_entry);
+        chunk* c = _CR(le, chunk, list_entry);
 
-        if (address >= c2->address && address < c2->address + c2->chunk_item.size) {
-            c = c2;
-            break;
-        } else if (c2->address > address)
+        if (address >= c->address && address < c->address + c->chunk_item.size)
+            return c;
+        else if (c->address > address)
             break;
 
         le = le->Flink;
     }
 
+    return NULL;
+}
+
+static EFI_STATUS read_data_disk(volume* vol, uint64_t address, uint32_t size, void* data) {
+    EFI_STATUS Status;
+    chunk* c;
+    CHUNK_ITEM_STRIPE* stripes;
+
+    c = find_chunk(vol, address);
+
     if (!c) {
         char s[100], *p;
 
@@ -271,9 +371,7 @@ static EFI_STATUS read_data(volume* vol, uint64_t address, uint32_t size, void*
         // FIXME - use other stripe if csum error
 
         if (stripes[i].dev_id == vol->sb->dev_item.dev_id) {
-            Status = vol->block->ReadBlocks(vol->block, vol->block->Media->MediaId,
-                                            (stripes[i].offset + address - c->address) / vol->block->Media->BlockSize,
-                                            size, data);
+            Status = read_blocks(vol->block, stripes[i].offset + address - c->address, size, data);
             if (EFI_ERROR(Status)) {
                 do_print_error("ReadBlocks", Status);
                 continue;
@@ -286,6 +384,114 @@ static EFI_STATUS read_data(volume* vol, uint64_t address, uint32_t size, void*
     return EFI_VOLUME_CORRUPTED;
 }
 
+static bool read_from_cache(volume* vol, uint64_t address, uint32_t size, void* data) {
+    unsigned int lo = 0, hi = vol->cache_count;
+    cache_entry* ce;
+
+    // find the last entry starting at or before address
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+
+        if (vol->cache[mid].address <= address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0)
+        return false;
+
+    ce = &vol->cache[lo - 1];
+
+    if (address + size > ce->address + ce->size)
+        return false;
+
+    memcpy(data, ce->data + address - ce->address, size);
+
+    return true;
+}
+
+static void record_read(volume* vol, uint64_t address, uint32_t size, void* data) {
+    EFI_STATUS Status;
+    prefetch_entry* ent;
+    tree_header* th = (tree_header*)data;
+
+    // Large reads are already sequential, and replay would refuse them anyway.
+    if (size > PREFETCH_MAX_RUN)
+        return;
+
+    if (vol->record_count == vol->record_alloc) {
+        prefetch_entry* new_record;
+        unsigned int new_alloc = vol->record_alloc == 0 ? 256 : (vol->record_alloc * 2);
+
+        Status = bs->AllocatePool(EfiBootServicesData, new_alloc * sizeof(prefetch_entry), (void**)&new_record);
+        if (EFI_ERROR(Status)) {
+            do_print_error("AllocatePool", Status);
+            vol->recording = false;
+            return;
+        }
+
+        if (vol->record) {
+            memcpy(new_record, vol->record, vol->record_count * sizeof(prefetch_entry));
+            bs->FreePool(vol->record);
+        }
+
+        vol->record = new_record;
+        vol->record_alloc = new_alloc;
+    }
+
+    ent = &vol->record[vol->record_count];
+
+    ent->address = address;
+    ent->size = size;
+    ent->reserved = 0;
+
+    // Tree blocks contain their own address and generation, which lets us spot
+    // stale entries on replay. Data extents are left as 0, as reading them back
+    // by logical address always gives the current contents anyway.
+    if (size == vol->sb->leaf_size && th->address == address)
+        ent->generation = th->generation;
+    else
+        ent->generation = 0;
+
+    vol->record_count++;
+}
+
+static bool prefetch_entry_valid(volume* vol, const prefetch_entry* ent) {
+    uint32_t block_size = vol->block->Media->BlockSize;
+
+    if (ent->size == 0 || ent->size > PREFETCH_MAX_RUN)
+        return false;
+
+    if (ent->address % block_size != 0 || ent->size % block_size != 0)
+        return false;
+
+    if (ent->address + ent->size < ent->address)
+        return false;
+
+    // entries with a generation are tree blocks, which we check the header of on replay
+    if (ent->generation != 0 && ent->size != vol->sb->leaf_size)
+        return false;
+
+    return true;
+}
+
+static EFI_STATUS read_data(volume* vol, uint64_t address, uint32_t size, void* data) {
+    EFI_STATUS Status;
+
+    if (vol->cache_count == 0 || !read_from_cache(vol, address, size, data)) {
+        Status = read_data_disk(vol, address, size, data);
+        if (EFI_ERROR(Status))
+            return Status;
+    }
+
+    if (vol->recording)
+        record_read(vol, address, size, data);
+
+    return EFI_SUCCESS;
+}
+
 static int keycmp(KEY* key1, KEY* key2) {
     if (key1->obj_id < key2->obj_id)
         return -1;
@@ -332,6 +538,8 @@ static EFI_STATUS find_item(volume* vol, root* r, traverse_ptr* tp, KEY* searchk
         Status = bs->AllocatePool(EfiBootServicesData, vol->sb->leaf_size, &r->top_tree);
         if (EFI_ERROR(Status)) {
             do_print_error("AllocatePool", Status);
+            bs->FreePool(tp->positions);
+            bs->FreePool(tp->data);
             return Status;
         }
 
@@ -340,6 +548,8 @@ static EFI_STATUS find_item(volume* vol, root* r, traverse_ptr* tp, KEY* searchk
             do_print_error("read_data", Status);
             bs->FreePool(r->top_tree);
             r->top_tree = NULL;
+            bs->FreePool(tp->positions);
+            bs->FreePool(tp->data);
             return Status;
         }
     }
@@ -351,6 +561,8 @@ static EFI_STATUS find_item(volume* vol, root* r, traverse_ptr* tp, KEY* searchk
             Status = read_data(vol, addr, vol->sb->leaf_size, (uint8_t*)tp->data + (i * vol->sb->leaf_size));
             if (EFI_ERROR(Status)) {
                 do_print_error("read_data", Status);
+                bs->FreePool(tp->positions);
+                bs->FreePool(tp->data);
                 return Status;
             }
         }
@@ -370,6 +582,9 @@ static EFI_STATUS find_item(volume* vol, root* r, traverse_ptr* tp, KEY* searchk
 
             do_print(s);
 
+            bs->FreePool(tp->positions);
+            bs->FreePool(tp->data);
+
             return EFI_VOLUME_CORRUPTED;
         }
 
@@ -472,6 +687,7 @@ static EFI_STATUS next_item(volume* vol, traverse_ptr* tp) {
 }
 
 static void free_traverse_ptr(traverse_ptr* tp) {
+    bs->FreePool(tp->positions);
     bs->FreePool(tp->data);
 }
 
@@ -810,11 +1026,7 @@ static EFI_STATUS find_file_in_dir(volume* vol, root* r, uint64_t inode_num, WCH
 
     // convert name from UTF-16 to UTF-8
 
-    Status = utf16_to_utf8(NULL, 0, &fnlen, name, name_len * sizeof(WCHAR));
-    if (EFI_ERROR(Status)) {
-        do_print_error("utf16_to_utf8", Status);
-        return Status;
-    }
+    fnlen = UTF16_TO_UTF8_MAX(name_len * sizeof(WCHAR));
 
     Status = bs->AllocatePool(EfiBootServicesData, fnlen, (void**)&fn);
     if (EFI_ERROR(Status)) {
@@ -921,11 +1133,7 @@ static EFI_STATUS find_file_in_dir_cached(volume* vol, inode* ino, WCHAR* name,
 
     // convert name from UTF-16 to UTF-8
 
-    Status = utf16_to_utf8(NULL, 0, &fnlen, name, name_len * sizeof(WCHAR));
-    if (EFI_ERROR(Status)) {
-        do_print_error("utf16_to_utf8", Status);
-        return Status;
-    }
+    fnlen = UTF16_TO_UTF8_MAX(name_len * sizeof(WCHAR));
 
     Status = bs->AllocatePool(EfiBootServicesData, fnlen, (void**)&fn);
     if (EFI_ERROR(Status)) {
@@ -1290,6 +1498,10 @@ static EFI_STATUS EFIAPI file_open(struct _EFI_FILE_HANDLE* File, struct _EFI_FI
     ino2->vol = ino->vol;
     ino2->name = path;
 
+#ifdef BTRFS_STATS
+    ino->vol->open_files++;
+#endif
+
     *NewHandle = &ino2->proto;
 
     return EFI_SUCCESS;
@@ -1317,6 +1529,18 @@ static EFI_STATUS EFIAPI file_close(struct _EFI_FILE_HANDLE* File) {
         }
     }
 
+#ifdef BTRFS_STATS
+    // Print the stats once, the first time a volume is left with nothing open after a file has
+    // been read from it. In a normal boot that's quibble closing the root directory just before
+    // ExitBootServices; it also opens and closes the root beforehand, but without reading anything.
+    ino->vol->open_files--;
+
+    if (ino->vol->open_files == 0 && ino->vol->file_read && !stats_printed) {
+        print_stats();
+        stats_printed = true;
+    }
+#endif
+
     bs->FreePool(ino);
 
     return EFI_SUCCESS;
@@ -1349,20 +1573,36 @@ static EFI_STATUS read_dir(inode* ino, UINTN* bufsize, void* buf) {
     }
 
     di = &(_CR(ino->dir_position, inode_child, list_entry)->dir_item);
+    info = (EFI_FILE_INFO*)buf;
 
-    Status = utf8_to_utf16(NULL, 0, &fnlen, di->name, di->n);
-    if (EFI_ERROR(Status)) {
-        do_print_error("utf8_to_utf16", Status);
-        return Status;
-    }
+    if (*bufsize >= offsetof(EFI_FILE_INFO, FileName[0]) + UTF8_TO_UTF16_MAX(di->n) + sizeof(WCHAR)) {
+        // buffer is big enough whatever the name turns out to be, so convert it straight in
 
-    if (*bufsize < offsetof(EFI_FILE_INFO, FileName[0]) + fnlen) {
-        *bufsize = offsetof(EFI_FILE_INFO, FileName[0]) + fnlen;
-        return EFI_BUFFER_TOO_SMALL;
+        Status = utf8_to_utf16(info->FileName, UTF8_TO_UTF16_MAX(di->n), &fnlen, di->name, di->n);
+        if (EFI_ERROR(Status)) {
+            do_print_error("utf8_to_utf16", Status);
+            return Status;
+        }
+    } else {
+        Status = utf8_to_utf16(NULL, 0, &fnlen, di->name, di->n);
+        if (EFI_ERROR(Status)) {
+            do_print_error("utf8_to_utf16", Status);
+            return Status;
+        }
+
+        if (*bufsize < offsetof(EFI_FILE_INFO, FileName[0]) + fnlen) {
+            *bufsize = offsetof(EFI_FILE_INFO, FileName[0]) + fnlen;
+            return EFI_BUFFER_TOO_SMALL;
+        }
+
+        Status = utf8_to_utf16(info->FileName, fnlen, &fnlen, di->name, di->n);
+        if (EFI_ERROR(Status)) {
+            do_print_error("utf8_to_utf16", Status);
+            return Status;
+        }
     }
 
     *bufsize = offsetof(EFI_FILE_INFO, FileName[0]) + fnlen;
-    info = (EFI_FILE_INFO*)buf;
 
     info->Size = offsetof(EFI_FILE_INFO, FileName[0]) + fnlen;
     //info->FileSize = ino->inode_item.st_size; // FIXME
@@ -1372,12 +1612,6 @@ static EFI_STATUS read_dir(inode* ino, UINTN* bufsize, void* buf) {
 //         info->ModificationTime; // FIXME
     info->Attribute = di->type == BTRFS_TYPE_DIRECTORY ? EFI_FILE_DIRECTORY : 0;
 
-    Status = utf8_to_utf16(info->FileName, fnlen, &fnlen, di->name, di->n);
-    if (EFI_ERROR(Status)) {
-        do_print_error("utf8_to_utf16", Status);
-        return Status;
-    }
-
     info->FileName[fnlen / sizeof(WCHAR)] = 0;
 
     ino->position++;
@@ -1558,6 +1792,38 @@ end:
     return Status;
 }
 
+// Decompresses a whole extent. LZO extents start with their total length, which lzo_decompress doesn't want.
+static EFI_STATUS decompress_extent(uint8_t compression, uint8_t* inbuf, uint32_t inlen, uint8_t* outbuf, uint32_t outlen) {
+    EFI_STATUS Status;
+
+    if (compression == BTRFS_COMPRESSION_ZLIB) {
+        Status = zlib_decompress(inbuf, inlen, outbuf, outlen);
+        if (EFI_ERROR(Status)) {
+            do_print_error("zlib_decompress", Status);
+            return Status;
+        }
+    } else if (compression == BTRFS_COMPRESSION_LZO) {
+        if (inlen < sizeof(uint32_t)) {
+            do_print("extent data was truncated\n");
+            return EFI_INVALID_PARAMETER;
+        }
+
+        Status = lzo_decompress(inbuf + sizeof(uint32_t), inlen - sizeof(uint32_t), outbuf, outlen, sizeof(uint32_t));
+        if (EFI_ERROR(Status)) {
+            do_print_error("lzo_decompress", Status);
+            return Status;
+        }
+    } else if (compression == BTRFS_COMPRESSION_ZSTD) {
+        Status = zstd_decompress(inbuf, inlen, outbuf, outlen);
+        if (EFI_ERROR(Status)) {
+            do_print_error("zstd_decompress", Status);
+            return Status;
+        }
+    }
+
+    return EFI_SUCCESS;
+}
+
 static EFI_STATUS read_file(inode* ino, UINTN* bufsize, void* buf) {
     EFI_STATUS Status;
     unsigned int to_read, left;
@@ -1575,6 +1841,10 @@ static EFI_STATUS read_file(inode* ino, UINTN* bufsize, void* buf) {
 
     // FIXME - check is actually file (check st_mode)
 
+#ifdef BTRFS_STATS
+    ino->vol->file_read = true;
+#endif
+
     if (ino->position >= ino->inode_item.st_size) { // past end of file
         *bufsize = 0;
         return EFI_SUCCESS;
@@ -1594,229 +1864,203 @@ static EFI_STATUS read_file(inode* ino, UINTN* bufsize, void* buf) {
     le = ino->extents.Flink;
     while (le != &ino->extents) {
         extent* ext = _CR(le, extent, list_entry);
+        EXTENT_DATA2* ed2 = (EXTENT_DATA2*)&ext->extent_data.data[0];
+        uint64_t ext_len, off;
+        unsigned int size;
 
-        if (ext->offset <= ino->position + to_read && ext->offset >= ino->position) {
-            if (ext->extent_data.compression != BTRFS_COMPRESSION_NONE &&
-                ext->extent_data.compression != BTRFS_COMPRESSION_ZLIB &&
-                ext->extent_data.compression != BTRFS_COMPRESSION_LZO &&
-                ext->extent_data.compression != BTRFS_COMPRESSION_ZSTD) {
-                char s[255], *p;
-
-                p = stpcpy(s, "unsupported compression type ");
-                p = dec_to_str(p, ext->extent_data.compression);
-                p = stpcpy(p, "\n");
-
-                do_print(s);
-
-                return EFI_UNSUPPORTED;
-            }
+        if (ext->extent_data.type == EXTENT_TYPE_INLINE)
+            ext_len = ext->extent_data.decoded_size;
+        else
+            ext_len = ed2->num_bytes;
 
-            if (ext->extent_data.encryption != 0) {
-                do_print("encryption not supported\n");
-                return EFI_UNSUPPORTED;
-            }
+        if (ext->offset + ext_len <= pos) { // before what we want
+            le = le->Flink;
+            continue;
+        }
 
-            if (ext->extent_data.encoding != 0) {
-                do_print("other encodings not supported\n");
-                return EFI_UNSUPPORTED;
-            }
+        if (ext->offset >= pos + left) // after what we want
+            break;
 
-            if (ext->extent_data.type == EXTENT_TYPE_INLINE) {
-                if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE)
-                    memcpy(dest, &ext->extent_data.data[pos - ext->offset], ext->extent_data.decoded_size - pos + ext->offset);
-                else {
-                    uint8_t* decomp;
-                    bool decomp_alloc;
-                    uint32_t read;
-                    uint16_t inlen = ext->size - (uint16_t)offsetof(EXTENT_DATA, data[0]);
+        if (ext->extent_data.compression != BTRFS_COMPRESSION_NONE &&
+            ext->extent_data.compression != BTRFS_COMPRESSION_ZLIB &&
+            ext->extent_data.compression != BTRFS_COMPRESSION_LZO &&
+            ext->extent_data.compression != BTRFS_COMPRESSION_ZSTD) {
+            char s[255], *p;
 
-                    if (ext->extent_data.decoded_size == 0 || ext->extent_data.decoded_size > 0xffffffff) {
-                        char s[255], *p;
+            p = stpcpy(s, "unsupported compression type ");
+            p = dec_to_str(p, ext->extent_data.compression);
+            p = stpcpy(p, "\n");
 
-                        p = stpcpy(s, "ed->decoded_size was invalid (");
-                        p = hex_to_str(p, ext->extent_data.decoded_size);
-                        p = stpcpy(p, ")\n");
+            do_print(s);
 
-                        do_print(p);
+            return EFI_UNSUPPORTED;
+        }
 
-                        return EFI_INVALID_PARAMETER;
-                    }
+        if (ext->extent_data.encryption != 0) {
+            do_print("encryption not supported\n");
+            return EFI_UNSUPPORTED;
+        }
 
-                    read = (uint32_t)ext->extent_data.decoded_size - pos;
+        if (ext->extent_data.encoding != 0) {
+            do_print("other encodings not supported\n");
+            return EFI_UNSUPPORTED;
+        }
 
-                    if (read > ino->inode_item.st_size)
-                        read = ino->inode_item.st_size;
+        if (ext->offset > pos) { // account for holes, which have already been zeroed
+            dest += ext->offset - pos;
+            left -= (unsigned int)(ext->offset - pos);
+            pos = ext->offset;
+        }
 
-                    if (pos > 0) {
-                        Status = bs->AllocatePool(EfiBootServicesData, ext->extent_data.decoded_size, (void**)&decomp);
-                        if (EFI_ERROR(Status)) {
-                            do_print("out of memory\n");
-                            return Status;
-                        }
+        off = pos - ext->offset;
 
-                        decomp_alloc = true;
-                    } else {
-                        decomp = dest;
-                        decomp_alloc = false;
-                    }
+        size = left;
+        if (ext_len - off < size)
+            size = (unsigned int)(ext_len - off);
 
-                    if (ext->extent_data.compression == BTRFS_COMPRESSION_ZLIB) {
-                        Status = zlib_decompress(ext->extent_data.data, inlen, decomp, (uint32_t)(read + pos));
-                        if (EFI_ERROR(Status)) {
-                            do_print_error("zlib_decompress", Status);
-                            if (decomp_alloc) bs->FreePool(decomp);
-                            return Status;
-                        }
-                    } else if (ext->extent_data.compression == BTRFS_COMPRESSION_LZO) {
-                        if (inlen < sizeof(uint32_t)) {
-                            do_print("extent data was truncated\n");
-                            if (decomp_alloc) bs->FreePool(decomp);
-                            return EFI_INVALID_PARAMETER;
-                        } else
-                            inlen -= sizeof(uint32_t);
-
-                        Status = lzo_decompress((uint8_t*)ext->extent_data.data + sizeof(uint32_t), inlen, decomp, (uint32_t)(read + pos), sizeof(uint32_t));
-                        if (EFI_ERROR(Status)) {
-                            do_print_error("lzo_decompress", Status);
-                            if (decomp_alloc) bs->FreePool(decomp);
-                            return Status;
-                        }
-                    } else if (ext->extent_data.compression == BTRFS_COMPRESSION_ZSTD) {
-                        Status = zstd_decompress(ext->extent_data.data, inlen, decomp, (uint32_t)(read + pos));
-                        if (EFI_ERROR(Status)) {
-                            do_print_error("zstd_decompress", Status);
-                            if (decomp_alloc) bs->FreePool(decomp);
-                            return Status;
-                        }
-                    }
+        if (ext->extent_data.type == EXTENT_TYPE_INLINE) {
+            uint16_t inlen = ext->size - (uint16_t)offsetof(EXTENT_DATA, data[0]);
 
-                    if (decomp_alloc) {
-                        memcpy(dest, decomp + pos, read);
-                        bs->FreePool(decomp);
-                    }
+            if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE) {
+                if (off + size > inlen) {
+                    do_print("inline extent was truncated\n");
+                    return EFI_VOLUME_CORRUPTED;
                 }
 
-                dest += ext->extent_data.decoded_size - pos + ext->offset;
-                left -= ext->extent_data.decoded_size - pos + ext->offset;
-                pos = ext->extent_data.decoded_size + ext->offset;
+                memcpy(dest, &ext->extent_data.data[off], size);
+            } else {
+                uint8_t* decomp;
 
-                if (left == 0)
-                    break;
-            } else if (ext->extent_data.type == EXTENT_TYPE_REGULAR) {
-                EXTENT_DATA2* ed2 = (EXTENT_DATA2*)&ext->extent_data.data[0];
-                uint64_t size;
-                uint8_t* tmp;
-
-                if (ext->offset > pos) { // account for holes
-                    if (ext->offset - pos >= left) {
-                        pos = ext->offset;
-                        break;
-                    }
+                if (ext->extent_data.decoded_size == 0 || ext->extent_data.decoded_size > 0xffffffff) {
+                    char s[255], *p;
 
-                    dest += ext->offset - pos;
-                    left -= ext->offset - pos;
-                    pos = ext->offset;
-                }
+                    p = stpcpy(s, "ed->decoded_size was invalid (");
+                    p = hex_to_str(p, ext->extent_data.decoded_size);
+                    p = stpcpy(p, ")\n");
 
-                // FIXME - only use tmp if necessary
-                // FIXME - unaligned reads
+                    do_print(s);
 
-                size = ed2->num_bytes - pos + ext->offset;
-                if (size > left)
-                    size = sector_align(left, ino->vol->block->Media->BlockSize);
+                    return EFI_INVALID_PARAMETER;
+                }
 
-                if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE) {
-                    Status = bs->AllocatePool(EfiBootServicesData, size, (void**)&tmp);
+                // decompress straight into the buffer if we want all of it
+                if (off == 0 && size == ext->extent_data.decoded_size)
+                    decomp = dest;
+                else {
+                    Status = bs->AllocatePool(EfiBootServicesData, ext->extent_data.decoded_size, (void**)&decomp);
                     if (EFI_ERROR(Status)) {
-                        do_print_error("AllocatePool", Status);
+                        do_print("out of memory\n");
                         return Status;
                     }
+                }
 
-                    Status = read_data(ino->vol, ed2->address + ed2->offset + pos - ext->offset, size, tmp);
-                    if (EFI_ERROR(Status)) {
-                        do_print_error("read_data", Status);
-                        bs->FreePool(tmp);
-                        return Status;
-                    }
+                Status = decompress_extent(ext->extent_data.compression, ext->extent_data.data, inlen, decomp,
+                                           (uint32_t)ext->extent_data.decoded_size);
+                if (EFI_ERROR(Status)) {
+                    do_print_error("decompress_extent", Status);
+                    if (decomp != dest) bs->FreePool(decomp);
+                    return Status;
+                }
 
-                    memcpy(dest, tmp, size);
-                } else {
-                    uint8_t* comp;
+                if (decomp != dest) {
+                    memcpy(dest, decomp + off, size);
+                    bs->FreePool(decomp);
+                }
+            }
+        } else if (ext->extent_data.type == EXTENT_TYPE_REGULAR) {
+            uint8_t* tmp;
+
+            if (ext->extent_data.compression == BTRFS_COMPRESSION_NONE) {
+                uint32_t block_size = ino->vol->block->Media->BlockSize;
+                uint64_t addr = ed2->address + ed2->offset + off;
 
-                    Status = bs->AllocatePool(EfiBootServicesData, ext->extent_data.decoded_size, (void**)&tmp);
+                if (addr % block_size == 0 && size % block_size == 0) {
+                    Status = read_data(ino->vol, addr, size, dest);
                     if (EFI_ERROR(Status)) {
-                        do_print_error("AllocatePool", Status);
+                        do_print_error("read_data", Status);
                         return Status;
                     }
+                } else {
+                    // The disk can only be read in whole blocks, so read those the range
+                    // touches into a temporary buffer. Extents are sector-aligned, so this
+                    // doesn't go outside the extent.
+                    uint64_t start = addr - (addr % block_size);
+                    uint32_t len = (uint32_t)sector_align(addr + size - start, block_size);
 
-                    Status = bs->AllocatePool(EfiBootServicesData, ed2->size, (void**)&comp);
+                    Status = bs->AllocatePool(EfiBootServicesData, len, (void**)&tmp);
                     if (EFI_ERROR(Status)) {
                         do_print_error("AllocatePool", Status);
-                        bs->FreePool(tmp);
                         return Status;
                     }
 
-                    Status = read_data(ino->vol, ed2->address, ed2->size, comp);
+                    Status = read_data(ino->vol, start, len, tmp);
                     if (EFI_ERROR(Status)) {
                         do_print_error("read_data", Status);
-                        bs->FreePool(comp);
                         bs->FreePool(tmp);
                         return Status;
                     }
 
-                    if (ext->extent_data.compression == BTRFS_COMPRESSION_ZLIB) {
-                        Status = zlib_decompress(comp, ed2->size, tmp, ext->extent_data.decoded_size);
-                        if (EFI_ERROR(Status)) {
-                            do_print_error("zlib_decompress", Status);
-                            bs->FreePool(comp);
-                            bs->FreePool(tmp);
-                            return Status;
-                        }
-                    } else if (ext->extent_data.compression == BTRFS_COMPRESSION_LZO) {
-                        if (ed2->size < sizeof(uint32_t)) {
-                            do_print("extent data was truncated\n");
-                            bs->FreePool(comp);
-                            bs->FreePool(tmp);
-                            return EFI_INVALID_PARAMETER;
-                        }
-
-                        Status = lzo_decompress(comp + sizeof(uint32_t), ed2->size - sizeof(uint32_t), tmp, ext->extent_data.decoded_size, sizeof(uint32_t));
-                        if (EFI_ERROR(Status)) {
-                            do_print_error("lzo_decompress", Status);
-                            bs->FreePool(comp);
-                            bs->FreePool(tmp);
-                            return Status;
-                        }
-                    } else if (ext->extent_data.compression == BTRFS_COMPRESSION_ZSTD) {
-                        Status = zstd_decompress(comp, ed2->size, tmp, ext->extent_data.decoded_size);
-                        if (EFI_ERROR(Status)) {
-                            do_print_error("zstd_decompress", Status);
-                            bs->FreePool(comp);
-                            bs->FreePool(tmp);
-                            return Status;
-                        }
-                    }
+                    memcpy(dest, tmp + addr - start, size);
+
+                    bs->FreePool(tmp);
+                }
+            } else {
+                uint8_t* comp;
+
+                if (ed2->offset + off + size > ext->extent_data.decoded_size || ed2->size > 0xffffffff) {
+                    do_print("compressed extent was invalid\n");
+                    return EFI_VOLUME_CORRUPTED;
+                }
 
-                    memcpy(dest, tmp + ed2->offset, size);
+                Status = bs->AllocatePool(EfiBootServicesData, ext->extent_data.decoded_size, (void**)&tmp);
+                if (EFI_ERROR(Status)) {
+                    do_print_error("AllocatePool", Status);
+                    return Status;
+                }
 
+                Status = bs->AllocatePool(EfiBootServicesData, ed2->size, (void**)&comp);
+                if (EFI_ERROR(Status)) {
+                    do_print_error("AllocatePool", Status);
+                    bs->FreePool(tmp);
+                    return Status;
+                }
+
+                Status = read_data(ino->vol, ed2->address, (uint32_t)ed2->size, comp);
+                if (EFI_ERROR(Status)) {
+                    do_print_error("read_data", Status);
                     bs->FreePool(comp);
+                    bs->FreePool(tmp);
+                    return Status;
                 }
 
-                bs->FreePool(tmp);
+                Status = decompress_extent(ext->extent_data.compression, comp, (uint32_t)ed2->size, tmp,
+                                           (uint32_t)ext->extent_data.decoded_size);
+                if (EFI_ERROR(Status)) {
+                    do_print_error("decompress_extent", Status);
+                    bs->FreePool(comp);
+                    bs->FreePool(tmp);
+                    return Status;
+                }
 
-                dest += size;
-                pos += size;
-                left -= size;
+                // ed2->offset is where this file's part starts, if the extent is shared
+                memcpy(dest, tmp + ed2->offset + off, size);
 
-                if (left == 0)
-                    break;
+                bs->FreePool(comp);
+                bs->FreePool(tmp);
             }
         }
 
+        dest += size;
+        pos += size;
+        left -= size;
+
+        if (left == 0)
+            break;
+
         le = le->Flink;
     }
 
-    ino->position = pos;
+    ino->position += to_read;
 
     *bufsize = to_read;
 
@@ -1992,6 +2236,31 @@ static EFI_STATUS EFIAPI file_get_position(struct _EFI_FILE_HANDLE* File, UINT64
     return EFI_UNSUPPORTED;
 }
 
+static void btrfs_time_to_efi(const BTRFS_TIME* bt, EFI_TIME* t) {
+    uint64_t days = bt->seconds / 86400;
+    unsigned int secs = bt->seconds % 86400;
+    uint64_t era, doe, yoe, doy, mp;
+
+    // BTRFS_TIME is seconds since 1970 in UTC - convert days to a civil date, with years starting in March
+
+    days += 719468; // from 0000-03-01
+    era = days / 146097;
+    doe = days - (era * 146097);
+    yoe = (doe - (doe / 1460) + (doe / 36524) - (doe / 146096)) / 365;
+    doy = doe - ((365 * yoe) + (yoe / 4) - (yoe / 100));
+    mp = ((5 * doy) + 2) / 153;
+
+    memset(t, 0, sizeof(EFI_TIME));
+
+    t->Day = (uint8_t)(doy - (((153 * mp) + 2) / 5) + 1);
+    t->Month = (uint8_t)(mp < 10 ? mp + 3 : mp - 9);
+    t->Year = (uint16_t)((era * 400) + yoe + (t->Month <= 2 ? 1 : 0));
+    t->Hour = secs / 3600;
+    t->Minute = (secs / 60) % 60;
+    t->Second = secs % 60;
+    t->Nanosecond = bt->nanoseconds;
+}
+
 static EFI_STATUS EFIAPI file_get_info(struct _EFI_FILE_HANDLE* File, EFI_GUID* InformationType, UINTN* BufferSize, VOID* Buffer) {
     EFI_STATUS Status;
     inode* ino = _CR(File, inode, proto);
@@ -2031,9 +2300,9 @@ static EFI_STATUS EFIAPI file_get_info(struct _EFI_FILE_HANDLE* File, EFI_GUID*
         info->Size = size;
         info->FileSize = ino->inode_item.st_size;
         info->PhysicalSize = ino->inode_item.st_blocks;
-//         info->CreateTime; // FIXME
-//         info->LastAccessTime; // FIXME
-//         info->ModificationTime; // FIXME
+        btrfs_time_to_efi(&ino->inode_item.otime, &info->CreateTime);
+        btrfs_time_to_efi(&ino->inode_item.st_atime, &info->LastAccessTime);
+        btrfs_time_to_efi(&ino->inode_item.st_mtime, &info->ModificationTime);
         info->Attribute = ino->inode_item.st_mode & __S_IFDIR ? EFI_FILE_DIRECTORY : 0;
 
         if (ino->name)
@@ -2110,6 +2379,10 @@ static EFI_STATUS EFIAPI open_volume(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* This, EFI_
     ino->inode = SUBVOL_ROOT_INODE;
     ino->vol = vol;
 
+#ifdef BTRFS_STATS
+    vol->open_files++;
+#endif
+
     *Root = &ino->proto;
 
     return EFI_SUCCESS;
@@ -2360,22 +2633,8 @@ static EFI_STATUS EFIAPI open_subvol(EFI_OPEN_SUBVOL_PROTOCOL* This, UINT64 Subv
         le = pathbits.Flink;
         while (le != &pathbits) {
             path_segment* ps = _CR(le, path_segment, list_entry);
-            unsigned int pslen;
-
-            Status = utf8_to_utf16(NULL, 0, &pslen, ps->name, strlen(ps->name));
-            if (EFI_ERROR(Status)) {
-                do_print_error("utf8_to_utf16", Status);
-
-                while (!IsListEmpty(&pathbits)) {
-                    path_segment* ps = _CR(pathbits.Flink, path_segment, list_entry);
-                    RemoveEntryList(&ps->list_entry);
-                    bs->FreePool(ps);
-                }
-
-                return Status;
-            }
 
-            len += pslen + sizeof(WCHAR);
+            len += UTF8_TO_UTF16_MAX(strlen(ps->name)) + sizeof(WCHAR);
 
             le = le->Flink;
         }
@@ -2434,7 +2693,7 @@ static EFI_STATUS EFIAPI open_subvol(EFI_OPEN_SUBVOL_PROTOCOL* This, UINT64 Subv
             bs->FreePool(ps);
         }
 
-        name[len / sizeof(WCHAR)] = 0;
+        *s = 0;
     }
 
     Status = bs->AllocatePool(EfiBootServicesData, sizeof(inode), (void**)&ino);
@@ -2458,6 +2717,10 @@ static EFI_STATUS EFIAPI open_subvol(EFI_OPEN_SUBVOL_PROTOCOL* This, UINT64 Subv
     ino->vol = vol;
     ino->name = name;
 
+#ifdef BTRFS_STATS
+    vol->open_files++;
+#endif
+
     *File = &ino->proto;
 
     return EFI_SUCCESS;
@@ -2480,6 +2743,250 @@ static EFI_STATUS get_driver_name(EFI_QUIBBLE_PROTOCOL* This, CHAR16* DriverName
     return EFI_SUCCESS;
 }
 
+static void sift_down_prefetch(prefetch_entry* entries, unsigned int root, unsigned int num) {
+    while (true) {
+        unsigned int child = (root * 2) + 1;
+        prefetch_entry tmp;
+
+        if (child >= num)
+            return;
+
+        if (child + 1 < num && entries[child + 1].address > entries[child].address)
+            child++;
+
+        if (entries[root].address >= entries[child].address)
+            return;
+
+        tmp = entries[root];
+        entries[root] = entries[child];
+        entries[child] = tmp;
+
+        root = child;
+    }
+}
+
+static void sort_prefetch_entries(prefetch_entry* entries, unsigned int num) {
+    bool sorted = true;
+
+    // Manifests are written out sorted, so this is usually a single pass. Otherwise heapsort,
+    // which needs no extra memory and can't be made quadratic by a crafted manifest.
+
+    for (unsigned int i = 1; i < num; i++) {
+        if (entries[i - 1].address > entries[i].address) {
+            sorted = false;
+            break;
+        }
+    }
+
+    if (sorted)
+        return;
+
+    for (unsigned int i = num / 2; i > 0; i--) {
+        sift_down_prefetch(entries, i - 1, num);
+    }
+
+    for (unsigned int i = num - 1; i > 0; i--) {
+        prefetch_entry tmp = entries[0];
+
+        entries[0] = entries[i];
+        entries[i] = tmp;
+
+        sift_down_prefetch(entries, 0, i);
+    }
+}
+
+static EFI_STATUS EFIAPI prefetch_replay(EFI_QUIBBLE_PREFETCH_PROTOCOL* This, VOID* Manifest, UINTN ManifestSize) {
+    EFI_STATUS Status;
+    volume* vol = _CR(This, volume, prefetch_proto);
+    prefetch_header* h = (prefetch_header*)Manifest;
+    prefetch_entry* entries;
+    unsigned int i, stale = 0;
+    uint64_t total = 0;
+
+    if (ManifestSize < sizeof(prefetch_header) || h->magic != PREFETCH_MAGIC)
+        return EFI_INVALID_PARAMETER;
+
+    if ((uint64_t)h->num_entries * sizeof(prefetch_entry) > ManifestSize - sizeof(prefetch_header))
+        return EFI_INVALID_PARAMETER;
+
+    if (memcmp(&h->uuid, &vol->sb->uuid, sizeof(BTRFS_UUID))) // for a different filesystem
+        return EFI_NOT_FOUND;
+
+    if (vol->cache)
+        return EFI_ALREADY_STARTED;
+
+    if (h->num_entries == 0)
+        return EFI_SUCCESS;
+
+    entries = (prefetch_entry*)&h[1];
+
+    // Check every entry before we trust any of them - a single bad one means
+    // the manifest is damaged, so we drop the whole thing.
+
+    for (i = 0; i < h->num_entries; i++) {
+        if (!prefetch_entry_valid(vol, &entries[i])) {
+            char s[255], *p;
+
+            p = stpcpy(s, "Prefetch manifest entry ");
+            p = dec_to_str(p, i);
+            p = stpcpy(p, " is invalid, ignoring manifest.\n");
+
+            do_print(s);
+
+            return EFI_INVALID_PARAMETER;
+        }
+    }
+
+    if (!vol->chunks_loaded) {
+        Status = load_chunks(vol);
+        if (EFI_ERROR(Status)) {
+            do_print_error("load_chunks", Status);
+            return Status;
+        }
+    }
+
+    sort_prefetch_entries(entries, h->num_entries);
+
+    Status = bs->AllocatePool(EfiBootServicesData, h->num_entries * sizeof(cache_entry), (void**)&vol->cache);
+    if (EFI_ERROR(Status)) {
+        do_print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    i = 0;
+
+    while (i < h->num_entries && total < PREFETCH_MAX_TOTAL) {
+        chunk* c = find_chunk(vol, entries[i].address);
+        uint64_t start = entries[i].address;
+        uint64_t end = start + entries[i].size;
+        unsigned int j = i + 1, old_count = vol->cache_count;
+        uint8_t* buf;
+
+        if (!c || end > c->address + c->chunk_item.size) {
+            i++;
+            continue;
+        }
+
+        // coalesce adjacent and overlapping entries within the same chunk into one read
+
+        while (j < h->num_entries && entries[j].address <= end) {
+            uint64_t end2 = entries[j].address + entries[j].size;
+
+            if (end2 > end) {
+                if (end2 > c->address + c->chunk_item.size || end2 - start > PREFETCH_MAX_RUN)
+                    break;
+
+                end = end2;
+            }
+
+            j++;
+        }
+
+        Status = bs->AllocatePool(EfiBootServicesData, end - start, (void**)&buf);
+        if (EFI_ERROR(Status)) {
+            do_print_error("AllocatePool", Status);
+            break;
+        }
+
+        Status = read_data_disk(vol, start, (uint32_t)(end - start), buf);
+        if (EFI_ERROR(Status)) {
+            do_print_error("read_data_disk", Status);
+            bs->FreePool(buf);
+            i = j;
+            continue;
+        }
+
+        for (unsigned int k = i; k < j; k++) {
+            if (entries[k].generation != 0) {
+                tree_header* th = (tree_header*)(buf + entries[k].address - start);
+
+                if (th->address != entries[k].address || th->generation != entries[k].generation) {
+                    stale++;
+                    continue;
+                }
+            }
+
+            vol->cache[vol->cache_count].address = entries[k].address;
+            vol->cache[vol->cache_count].size = entries[k].size;
+            vol->cache[vol->cache_count].data = buf + entries[k].address - start;
+            vol->cache_count++;
+        }
+
+        if (vol->cache_count == old_count)
+            bs->FreePool(buf);
+        else
+            total += end - start;
+
+        i = j;
+    }
+
+    {
+        char s[255], *p;
+
+        p = stpcpy(s, "Prefetched ");
+        p = dec_to_str(p, total);
+        p = stpcpy(p, " bytes (");
+        p = dec_to_str(p, vol->cache_count);
+        p = stpcpy(p, " entries, ");
+        p = dec_to_str(p, stale);
+        p = stpcpy(p, " stale).\n");
+
+        do_print(s);
+    }
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI prefetch_record(EFI_QUIBBLE_PREFETCH_PROTOCOL* This, BOOLEAN Enable) {
+    volume* vol = _CR(This, volume, prefetch_proto);
+
+    vol->recording = Enable;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI prefetch_get_manifest(EFI_QUIBBLE_PREFETCH_PROTOCOL* This, VOID* Manifest, UINTN* ManifestSize) {
+    volume* vol = _CR(This, volume, prefetch_proto);
+    prefetch_header* h = (prefetch_header*)Manifest;
+    unsigned int num = 0;
+    UINTN size;
+
+    // sort, and remove duplicates by keeping the largest read at each address
+
+    sort_prefetch_entries(vol->record, vol->record_count);
+
+    for (unsigned int i = 0; i < vol->record_count; i++) {
+        if (num > 0 && vol->record[num - 1].address == vol->record[i].address) {
+            if (vol->record[i].size > vol->record[num - 1].size)
+                vol->record[num - 1] = vol->record[i];
+
+            continue;
+        }
+
+        vol->record[num] = vol->record[i];
+        num++;
+    }
+
+    vol->record_count = num;
+
+    size = sizeof(prefetch_header) + (num * sizeof(prefetch_entry));
+
+    if (*ManifestSize < size) {
+        *ManifestSize = size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    h->magic = PREFETCH_MAGIC;
+    h->num_entries = num;
+    memcpy(&h->uuid, &vol->sb->uuid, sizeof(BTRFS_UUID));
+
+    memcpy(&h[1], vol->record, num * sizeof(prefetch_entry));
+
+    *ManifestSize = size;
+
+    return EFI_SUCCESS;
+}
+
 static EFI_STATUS EFIAPI drv_start(EFI_DRIVER_BINDING_PROTOCOL* This, EFI_HANDLE ControllerHandle,
                                    EFI_DEVICE_PATH_PROTOCOL* RemainingDevicePath) {
     EFI_STATUS Status;
@@ -2488,6 +2995,7 @@ static EFI_STATUS EFIAPI drv_start(EFI_DRIVER_BINDING_PROTOCOL* This, EFI_HANDLE
     EFI_GUID fs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
     EFI_GUID quibble_guid = EFI_QUIBBLE_PROTOCOL_GUID;
     EFI_GUID open_subvol_guid = EFI_OPEN_SUBVOL_GUID;
+    EFI_GUID prefetch_guid = EFI_QUIBBLE_PREFETCH_PROTOCOL_GUID;
     EFI_BLOCK_IO_PROTOCOL* block;
     uint32_t sblen;
     superblock* sb;
@@ -2539,7 +3047,7 @@ static EFI_STATUS EFIAPI drv_start(EFI_DRIVER_BINDING_PROTOCOL* This, EFI_HANDLE
     // read superblock
     // FIXME - check other superblocks?
 
-    Status = block->ReadBlocks(block, block->Media->MediaId, superblock_addrs[0] / block->Media->BlockSize, sblen, sb);
+    Status = read_blocks(block, superblock_addrs[0], sblen, sb);
     if (EFI_ERROR(Status)) {
         bs->FreePool(sb);
         bs->CloseProtocol(ControllerHandle, &block_guid, This->DriverBindingHandle, ControllerHandle);
@@ -2592,9 +3100,14 @@ static EFI_STATUS EFIAPI drv_start(EFI_DRIVER_BINDING_PROTOCOL* This, EFI_HANDLE
 
     vol->open_subvol_proto.OpenSubvol = open_subvol;
 
+    vol->prefetch_proto.Replay = prefetch_replay;
+    vol->prefetch_proto.Record = prefetch_record;
+    vol->prefetch_proto.GetManifest = prefetch_get_manifest;
+
     Status = bs->InstallMultipleProtocolInterfaces(&ControllerHandle, &fs_guid, &vol->proto,
                                                    &quibble_guid, &vol->quibble_proto,
-                                                   &open_subvol_guid, &vol->open_subvol_proto, NULL);
+                                                   &open_subvol_guid, &vol->open_subvol_proto,
+                                                   &prefetch_guid, &vol->prefetch_proto, NULL);
     if (EFI_ERROR(Status)) {
         do_print_error("InstallMultipleProtocolInterfaces", Status);
         bs->FreePool(sb);
@@ -2664,6 +3177,16 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
     systable = SystemTable;
     bs = SystemTable->BootServices;
 
+#ifdef BTRFS_STATS
+    // count allocations by interposing on a private copy of the boot services table
+    stats_bs = *bs;
+    real_allocate_pool = stats_bs.AllocatePool;
+    real_free_pool = stats_bs.FreePool;
+    stats_bs.AllocatePool = stats_allocate_pool;
+    stats_bs.FreePool = stats_free_pool;
+    bs = &stats_bs;
+#endif
+
     get_info_protocol(ImageHandle);
 
     InitializeListHead(&volumes);
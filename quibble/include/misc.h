@@ -40,4 +40,9 @@ char* hex_to_str(char* s, uint64_t v);
 char* dec_to_str(char* s, uint64_t v);
 EFI_STATUS utf8_to_utf16(WCHAR* dest, unsigned int dest_max, unsigned int* dest_len, const char* src, unsigned int src_len);
 EFI_STATUS utf16_to_utf8(char* dest, unsigned int dest_max, unsigned int* dest_len, const WCHAR* src, unsigned int src_len);
+
+// Largest possible output of utf8_to_utf16 and utf16_to_utf8, in bytes, for src_len
+// bytes of input - allocate this much and the sizing call can be skipped.
+#define UTF8_TO_UTF16_MAX(src_len) ((src_len) * sizeof(WCHAR))
+#define UTF16_TO_UTF8_MAX(src_len) (((src_len) / sizeof(WCHAR)) * 3)
 const char* error_string(EFI_STATUS Status);
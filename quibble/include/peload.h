@@ -41,8 +41,44 @@ typedef EFI_STATUS (EFIAPI* EFI_PE_LOADER_LOAD) (
     OUT EFI_PE_IMAGE** Image
 );
 
+// Pages returned must be freeable with FreePages, as the image will free them itself.
+typedef EFI_STATUS (EFIAPI* EFI_PE_LOADER_ALLOCATE_PAGES) (
+    IN UINTN Pages,
+    OUT EFI_PHYSICAL_ADDRESS* Address
+);
+
+typedef EFI_STATUS (EFIAPI* EFI_PE_LOADER_LOAD_AT) (
+    IN EFI_FILE_HANDLE File,
+    IN void* BaseAddress,
+    IN EFI_PE_LOADER_ALLOCATE_PAGES AllocatePages,
+    OUT EFI_PE_IMAGE** Image
+);
+
+// Data is an image already laid out in memory, allocated with AllocatePages. The image takes ownership of it.
+typedef EFI_STATUS (EFIAPI* EFI_PE_LOADER_LOAD_FROM_MEMORY) (
+    IN void* Data,
+    IN UINTN Pages,
+    IN void* VirtualAddress,
+    OUT EFI_PE_IMAGE** Image
+);
+
+// While set, images are loaded without being relocated, and the caller has to call Prepare on each of them.
+typedef void (EFIAPI* EFI_PE_LOADER_DEFER_RELOCATIONS) (
+    IN BOOLEAN Defer
+);
+
+// While set, LoadAt reads the whole of each file in order, working out its SHA-256 hash and PE checksum
+// as it goes - see GetFileHash.
+typedef void (EFIAPI* EFI_PE_LOADER_HASH_FILES) (
+    IN BOOLEAN Hash
+);
+
 typedef struct _EFI_PE_LOADER_PROTOCOL {
     EFI_PE_LOADER_LOAD Load;
+    EFI_PE_LOADER_LOAD_AT LoadAt;
+    EFI_PE_LOADER_LOAD_FROM_MEMORY LoadFromMemory;
+    EFI_PE_LOADER_DEFER_RELOCATIONS DeferRelocations;
+    EFI_PE_LOADER_HASH_FILES HashFiles;
 } EFI_PE_LOADER_PROTOCOL;
 
 typedef EFI_STATUS (EFIAPI* EFI_PE_IMAGE_FREE) (
@@ -124,6 +160,18 @@ typedef EFI_STATUS (EFIAPI* EFI_PE_IMAGE_RELOCATE) (
     IN EFI_VIRTUAL_ADDRESS Address
 );
 
+// Safe to call on an AP, as it doesn't print anything or use boot services.
+typedef EFI_STATUS (EFIAPI* EFI_PE_IMAGE_PREPARE) (
+    IN EFI_PE_IMAGE* This
+);
+
+// Hash is 32 bytes. CheckSum is what the PE checksum of the file actually is, rather than what the header says.
+typedef EFI_STATUS (EFIAPI* EFI_PE_IMAGE_GET_FILE_HASH) (
+    IN EFI_PE_IMAGE* This,
+    OUT UINT8* Hash,
+    OUT UINT32* CheckSum
+);
+
 #pragma pack(push,1)
 
 typedef struct {
@@ -171,4 +219,6 @@ typedef struct _EFI_PE_IMAGE {
     EFI_PE_IMAGE_GET_CHARACTERISTICS GetCharacteristics;
     EFI_PE_IMAGE_GET_SECTIONS GetSections;
     EFI_PE_IMAGE_RELOCATE Relocate;
+    EFI_PE_IMAGE_PREPARE Prepare;
+    EFI_PE_IMAGE_GET_FILE_HASH GetFileHash;
 } EFI_PE_IMAGE;
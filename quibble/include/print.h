@@ -14,3 +14,4 @@ void init_gop_console();
 EFI_STATUS load_font();
 
 extern bool gop_console;
+extern bool print_quiet;
@@ -52,6 +52,7 @@ typedef struct {
     void* pa;
     unsigned int pages;
     TYPE_OF_MEMORY type;
+    bool small_pages; // don't use large pages for this, even if /LARGEPAGES is set
 } mapping;
 
 typedef struct _EFI_PE_IMAGE EFI_PE_IMAGE;
@@ -60,7 +61,7 @@ typedef struct _EFI_PE_LOADER_PROTOCOL EFI_PE_LOADER_PROTOCOL;
 
 #define MAX_PATH 260
 
-typedef struct {
+typedef struct _image {
     WCHAR name[MAX_PATH];
     WCHAR dir[MAX_PATH];
     EFI_PE_IMAGE* img;
@@ -72,6 +73,14 @@ typedef struct {
     unsigned int order;
     bool no_reloc;
     LIST_ENTRY list_entry;
+    struct _image* hash_next; // in image_hash, by name
+    struct _image* base_hash_next; // in image_base_hash, by name without extension
+    unsigned int index; // order added, which is also the order loaded in
+    uint64_t file_size; // file_size, file_time and file_checksum are only filled in for the kernel cache
+    EFI_TIME file_time;
+    uint32_t file_checksum; // from the PE header
+    bool early; // loaded before the main loop, so not in the kernel cache's blob
+    bool cached; // loaded from the kernel cache, with its imports already resolved
 } image;
 
 typedef struct {
@@ -95,22 +104,41 @@ typedef struct _command_line command_line;
 extern void* stack;
 extern EFI_HANDLE image_handle;
 extern uint64_t cpu_frequency;
-EFI_STATUS add_image(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, const WCHAR* name, TYPE_OF_MEMORY memory_type,
-                     const WCHAR* dir, bool dll, BOOT_DRIVER_LIST_ENTRY* bdle, unsigned int order,
-                     bool no_reloc);
 EFI_STATUS load_image(image* img, WCHAR* name, EFI_PE_LOADER_PROTOCOL* pe, void* va, EFI_FILE_HANDLE dir,
                       command_line* cmdline, uint16_t build);
+EFI_STATUS verify_data_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const WCHAR* name, command_line* cmdline,
+                            void** data, size_t* size);
+EFI_STATUS open_parent_dir(EFI_FILE_IO_INTERFACE* fs, FILEPATH_DEVICE_PATH* dp, EFI_FILE_HANDLE* dir);
+uint64_t get_cpu_frequency(EFI_BOOT_SERVICES* bs);
+bool preload_option(EFI_BOOT_SERVICES* bs, boot_option* opt);
+
+// file.c
 EFI_STATUS open_file(EFI_FILE_HANDLE dir, EFI_FILE_HANDLE* h, const WCHAR* name);
 EFI_STATUS read_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const WCHAR* name, void** data, size_t* size);
-EFI_STATUS open_parent_dir(EFI_FILE_IO_INTERFACE* fs, FILEPATH_DEVICE_PATH* dp, EFI_FILE_HANDLE* dir);
+EFI_STATUS preload_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const WCHAR* dir_path, const WCHAR* name);
+void add_preload_dir(EFI_FILE_HANDLE dir, const WCHAR* path);
+void remove_preload_dir(EFI_FILE_HANDLE dir);
+void free_preloaded_files(EFI_BOOT_SERVICES* bs);
+
+// images.c
+void init_images(void);
+EFI_STATUS add_image(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, const WCHAR* name, TYPE_OF_MEMORY memory_type,
+                     const WCHAR* dir, bool dll, BOOT_DRIVER_LIST_ENTRY* bdle, unsigned int order,
+                     bool no_reloc);
+EFI_STATUS add_image_imports(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, image* img, uint16_t version);
+void fix_image_order(LIST_ENTRY* images);
+EFI_STATUS resolve_image_imports(LIST_ENTRY* images, uint16_t version);
 
 // mem.c
 #ifdef _X86_
 extern bool pae;
 #endif
+extern bool large_pages;
 extern EFI_MEMORY_DESCRIPTOR* efi_runtime_map;
 extern UINTN efi_runtime_map_size, map_desc_size;
 
+void init_mappings(LIST_ENTRY* mappings);
+void free_mappings(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings);
 void* find_virtual_address(void* pa, LIST_ENTRY* mappings);
 void* fix_address_mapping(void* addr, void* pa, void* va);
 EFI_STATUS add_mapping(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void* va, void* pa, unsigned int pages,
@@ -167,3 +195,32 @@ struct _EFI_LEGACY_BIOS_PROTOCOL {
     void* CopyLegacyRegion;
     void* BootUnconventionalDevice;
 };
+
+// MP services (not in gnu-efi)
+
+#define EFI_MP_SERVICES_PROTOCOL_GUID { 0x3fdda605, 0xa76e, 0x4f46, {0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08 } }
+
+typedef struct _EFI_MP_SERVICES_PROTOCOL EFI_MP_SERVICES_PROTOCOL;
+
+typedef void (EFIAPI *EFI_AP_PROCEDURE)(IN void* ProcedureArgument);
+
+typedef EFI_STATUS (EFIAPI *EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS)(IN EFI_MP_SERVICES_PROTOCOL* This,
+                                                                      OUT UINTN* NumberOfProcessors,
+                                                                      OUT UINTN* NumberOfEnabledProcessors);
+
+typedef EFI_STATUS (EFIAPI *EFI_MP_SERVICES_STARTUP_ALL_APS)(IN EFI_MP_SERVICES_PROTOCOL* This,
+                                                             IN EFI_AP_PROCEDURE Procedure, IN BOOLEAN SingleThread,
+                                                             IN EFI_EVENT WaitEvent OPTIONAL,
+                                                             IN UINTN TimeoutInMicroSeconds,
+                                                             IN void* ProcedureArgument OPTIONAL,
+                                                             OUT UINTN** FailedCpuList OPTIONAL);
+
+struct _EFI_MP_SERVICES_PROTOCOL {
+    EFI_MP_SERVICES_GET_NUMBER_OF_PROCESSORS GetNumberOfProcessors;
+    void* GetProcessorInfo;
+    EFI_MP_SERVICES_STARTUP_ALL_APS StartupAllAPs;
+    void* StartupThisAP;
+    void* SwitchBSP;
+    void* EnableDisableAP;
+    void* WhoAmI;
+};
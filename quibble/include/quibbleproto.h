@@ -61,3 +61,30 @@ typedef void (EFIAPI* EFI_QUIBBLE_INFO_PRINT) (
 typedef struct _EFI_QUIBBLE_INFO_PROTOCOL {
     EFI_QUIBBLE_INFO_PRINT Print;
 } EFI_QUIBBLE_INFO_PROTOCOL;
+
+#define EFI_QUIBBLE_PREFETCH_PROTOCOL_GUID { 0x2E5B9C1A, 0x7F43, 0x4D8E, {0x9B, 0x16, 0x3C, 0xA4, 0x58, 0xE2, 0x0D, 0x71 } }
+
+typedef struct _EFI_QUIBBLE_PREFETCH_PROTOCOL EFI_QUIBBLE_PREFETCH_PROTOCOL;
+
+typedef EFI_STATUS (EFIAPI* EFI_QUIBBLE_PREFETCH_REPLAY) (
+    IN EFI_QUIBBLE_PREFETCH_PROTOCOL* This,
+    IN VOID* Manifest,
+    IN UINTN ManifestSize
+);
+
+typedef EFI_STATUS (EFIAPI* EFI_QUIBBLE_PREFETCH_RECORD) (
+    IN EFI_QUIBBLE_PREFETCH_PROTOCOL* This,
+    IN BOOLEAN Enable
+);
+
+typedef EFI_STATUS (EFIAPI* EFI_QUIBBLE_PREFETCH_GET_MANIFEST) (
+    IN EFI_QUIBBLE_PREFETCH_PROTOCOL* This,
+    OUT VOID* Manifest,
+    IN OUT UINTN* ManifestSize
+);
+
+typedef struct _EFI_QUIBBLE_PREFETCH_PROTOCOL {
+    EFI_QUIBBLE_PREFETCH_REPLAY Replay;
+    EFI_QUIBBLE_PREFETCH_RECORD Record;
+    EFI_QUIBBLE_PREFETCH_GET_MANIFEST GetManifest;
+} EFI_QUIBBLE_PREFETCH_PROTOCOL;
@@ -113,6 +113,34 @@ typedef EFI_STATUS (EFIAPI* EFI_REGISTRY_HIVE_STEAL_DATA) (
     OUT UINT32* Size
 );
 
+typedef EFI_STATUS (EFIAPI* EFI_REGISTRY_HIVE_NEXT_KEY) (
+    IN EFI_REGISTRY_HIVE* This,
+    IN HKEY Key,
+    IN OUT UINT32* Position,
+    OUT HKEY* SubKey,
+    OUT WCHAR* Name,
+    IN UINT32 NameLength
+);
+
+typedef struct {
+    const WCHAR* Name;
+    void* Data;
+    UINT32 DataLength;
+    UINT32 Type;
+    EFI_STATUS Status;
+} EFI_REGISTRY_VALUE_QUERY;
+
+typedef EFI_STATUS (EFIAPI* EFI_REGISTRY_HIVE_QUERY_VALUES) (
+    IN EFI_REGISTRY_HIVE* This,
+    IN HKEY Key,
+    IN OUT EFI_REGISTRY_VALUE_QUERY* Values,
+    IN UINT32 Count
+);
+
+typedef EFI_STATUS (EFIAPI* EFI_REGISTRY_HIVE_COMPACT) (
+    IN EFI_REGISTRY_HIVE* This
+);
+
 typedef struct _EFI_REGISTRY_HIVE {
     EFI_REGISTRY_HIVE_CLOSE Close;
     EFI_REGISTRY_HIVE_FIND_ROOT FindRoot;
@@ -122,4 +150,7 @@ typedef struct _EFI_REGISTRY_HIVE {
     EFI_REGISTRY_HIVE_QUERY_VALUE QueryValue;
     EFI_REGISTRY_HIVE_STEAL_DATA StealData;
     EFI_REGISTRY_HIVE_QUERY_VALUE_NO_COPY QueryValueNoCopy;
+    EFI_REGISTRY_HIVE_NEXT_KEY NextKey;
+    EFI_REGISTRY_HIVE_QUERY_VALUES QueryValues;
+    EFI_REGISTRY_HIVE_COMPACT Compact;
 } EFI_REGISTRY_HIVE;
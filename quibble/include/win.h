@@ -3257,11 +3257,16 @@ typedef struct {
     uint32_t Flags;
     uint32_t NameOffset;
     uint32_t NameLength;
-    uint32_t AliasOffset;
+    uint32_t HashedLength; // name up to its last hyphen
     uint32_t HostsOffset;
     uint32_t NumberOfHosts;
 } API_SET_NAMESPACE_ENTRY_10;
 
+typedef struct {
+    uint32_t Hash;
+    uint32_t Index;
+} API_SET_HASH_ENTRY_10;
+
 typedef struct {
     uint32_t Version;
     uint32_t Size;
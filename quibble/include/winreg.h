@@ -20,16 +20,21 @@
 #include <stdint.h>
 
 #define HV_HBLOCK_SIGNATURE 0x66676572  // "regf"
+#define HV_HBIN_SIGNATURE 0x6e696268    // "hbin"
 
 #define HSYS_MAJOR 1
 #define HSYS_MINOR 3
 #define HFILE_TYPE_PRIMARY 0
 #define HBASE_FORMAT_MEMORY 1
 
+#define CM_KEY_INDEX_LEAF       0x696c  // "li"
+#define CM_KEY_FAST_LEAF        0x666c  // "lf"
 #define CM_KEY_HASH_LEAF        0x686c  // "lh"
 #define CM_KEY_INDEX_ROOT       0x6972  // "ri"
 #define CM_KEY_NODE_SIGNATURE   0x6b6e  // "nk"
 #define CM_KEY_VALUE_SIGNATURE  0x6b76  // "vk"
+#define CM_KEY_SECURITY_SIGNATURE 0x6b73 // "sk"
+#define CM_BIG_DATA_SIGNATURE   0x6264  // "db"
 
 #define KEY_IS_VOLATILE                 0x0001
 #define KEY_HIVE_EXIT                   0x0002
@@ -47,6 +52,9 @@
 // stupid name... this means "small enough not to warrant its own cell"
 #define CM_KEY_VALUE_SPECIAL_SIZE       0x80000000
 
+// values longer than this are split into segments by a "db" cell
+#define CM_KEY_VALUE_BIG                0x3fd8
+
 #define HIVE_FILENAME_MAXLEN 31
 
 #pragma pack(push,1)
@@ -71,6 +79,15 @@ typedef struct {
     uint32_t BootRecover;
 } HBASE_BLOCK;
 
+typedef struct {
+    uint32_t Signature;
+    uint32_t FileOffset;
+    uint32_t Size;
+    uint32_t Reserved1[2];
+    uint64_t TimeStamp;
+    uint32_t Spare;
+} HBIN;
+
 typedef struct {
     uint16_t Signature;
     uint16_t Flags;
@@ -123,4 +140,20 @@ typedef struct {
     uint32_t List[1];
 } CM_KEY_INDEX;
 
+typedef struct {
+    uint16_t Signature;
+    uint16_t Reserved;
+    uint32_t Flink;
+    uint32_t Blink;
+    uint32_t ReferenceCount;
+    uint32_t DescriptorLength;
+    uint8_t Descriptor[1];
+} CM_KEY_SECURITY;
+
+typedef struct {
+    uint16_t Signature;
+    uint16_t Count;
+    uint32_t List;
+} CM_BIG_DATA;
+
 #pragma pack(pop)
@@ -24,6 +24,7 @@
 #define CR0_AM      0x00040000
 #define CR0_PG      0x80000000
 
+#define CR4_PSE     0x00000010
 #define CR4_PAE     0x00000020
 #define CR4_PGE     0x00000080
 
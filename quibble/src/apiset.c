@@ -19,23 +19,211 @@
 #include "quibble.h"
 #include "misc.h"
 #include "peload.h"
+#include "peloaddef.h"
 #include "x86.h"
 #include "print.h"
 
+#define API_SET_CACHE_SIZE 64 // must be a power of two
+#define API_SET_CACHE_NAME_LEN 64
+
+typedef struct {
+    uint16_t name_len;
+    WCHAR name[API_SET_CACHE_NAME_LEN]; // lower-cased, without extension
+    WCHAR value[API_SET_CACHE_NAME_LEN];
+} api_set_cache_entry;
+
 void* apiset;
 unsigned int apisetsize;
 void* apisetva;
 
+static api_set_cache_entry api_set_cache[API_SET_CACHE_SIZE];
+
+// Reads just the .apiset section of ApiSetSchema.dll - it's nothing but data, so there's
+// no need to load and relocate the whole image. With /VERIFY=HASH the whole file gets read anyway,
+// so that it can be checked, and the section is copied from what was checked.
+static EFI_STATUS read_api_set_section(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, command_line* cmdline) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE file;
+    IMAGE_DOS_HEADER dos_header;
+    IMAGE_NT_HEADERS nt_header;
+    IMAGE_SECTION_HEADER* sections = NULL;
+    IMAGE_SECTION_HEADER* sect = NULL;
+    EFI_PHYSICAL_ADDRESS addr;
+    UINTN size, sections_size;
+    void* verified;
+    size_t verified_size;
+
+    Status = verify_data_file(bs, dir, L"ApiSetSchema.dll", cmdline, &verified, &verified_size);
+    if (EFI_ERROR(Status)) {
+        print_error("verify_data_file", Status);
+        return Status;
+    }
+
+    Status = open_file(dir, &file, L"ApiSetSchema.dll");
+    if (EFI_ERROR(Status)) {
+        print_string("Loading of ApiSetSchema.dll failed.\n");
+        print_error("file open", Status);
+
+        if (verified)
+            bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)verified, PAGE_COUNT(verified_size));
+
+        return Status;
+    }
+
+    size = sizeof(IMAGE_DOS_HEADER);
+
+    Status = file->Read(file, &size, &dos_header);
+    if (EFI_ERROR(Status)) {
+        print_error("file->Read", Status);
+        goto end;
+    }
+
+    if (size < sizeof(IMAGE_DOS_HEADER) || dos_header.e_magic != IMAGE_DOS_SIGNATURE) {
+        print_string("ApiSetSchema.dll did not have a valid DOS header.\n");
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
+    }
+
+    Status = file->SetPosition(file, dos_header.e_lfanew);
+    if (EFI_ERROR(Status)) {
+        print_error("file->SetPosition", Status);
+        goto end;
+    }
+
+    size = offsetof(IMAGE_NT_HEADERS, OptionalHeader32);
+
+    Status = file->Read(file, &size, &nt_header);
+    if (EFI_ERROR(Status)) {
+        print_error("file->Read", Status);
+        goto end;
+    }
+
+    if (size < offsetof(IMAGE_NT_HEADERS, OptionalHeader32) || nt_header.Signature != IMAGE_NT_SIGNATURE) {
+        print_string("ApiSetSchema.dll did not have a valid PE header.\n");
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
+    }
+
+    Status = file->SetPosition(file, dos_header.e_lfanew + offsetof(IMAGE_NT_HEADERS, OptionalHeader32) +
+                                     nt_header.FileHeader.SizeOfOptionalHeader);
+    if (EFI_ERROR(Status)) {
+        print_error("file->SetPosition", Status);
+        goto end;
+    }
+
+    sections_size = nt_header.FileHeader.NumberOfSections * sizeof(IMAGE_SECTION_HEADER);
+
+    if (sections_size == 0) {
+        print_string("Could not find .apiset section in ApiSetSchema.dll.\n");
+        Status = EFI_NOT_FOUND;
+        goto end;
+    }
+
+    Status = bs->AllocatePool(EfiLoaderData, sections_size, (void**)&sections);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        sections = NULL;
+        goto end;
+    }
+
+    size = sections_size;
+
+    Status = file->Read(file, &size, sections);
+    if (EFI_ERROR(Status)) {
+        print_error("file->Read", Status);
+        goto end;
+    }
+
+    if (size < sections_size) {
+        print_string("ApiSetSchema.dll section table was truncated.\n");
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
+    }
+
+    for (unsigned int i = 0; i < nt_header.FileHeader.NumberOfSections; i++) {
+        if (!strcmp(sections[i].Name, ".apiset")) {
+            sect = &sections[i];
+            break;
+        }
+    }
+
+    if (!sect) {
+        print_string("Could not find .apiset section in ApiSetSchema.dll.\n");
+        Status = EFI_NOT_FOUND;
+        goto end;
+    }
+
+    if (sect->VirtualSize == 0) {
+        print_string(".apiset section size was 0.\n");
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
+    }
+
+    apisetsize = sect->VirtualSize;
+
+    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, PAGE_COUNT(apisetsize), &addr);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePages", Status);
+        goto end;
+    }
+
+    memset((void*)(uintptr_t)addr, 0, PAGE_COUNT(apisetsize) * EFI_PAGE_SIZE);
+
+    size = sect->SizeOfRawData < sect->VirtualSize ? sect->SizeOfRawData : sect->VirtualSize;
+
+    if (verified) {
+        if (sect->PointerToRawData > verified_size || size > verified_size - sect->PointerToRawData) {
+            print_string(".apiset section runs past the end of ApiSetSchema.dll.\n");
+            bs->FreePages(addr, PAGE_COUNT(apisetsize));
+            Status = EFI_INVALID_PARAMETER;
+            goto end;
+        }
+
+        memcpy((void*)(uintptr_t)addr, (uint8_t*)verified + sect->PointerToRawData, size);
+    } else {
+        Status = file->SetPosition(file, sect->PointerToRawData);
+        if (EFI_ERROR(Status)) {
+            print_error("file->SetPosition", Status);
+            bs->FreePages(addr, PAGE_COUNT(apisetsize));
+            goto end;
+        }
+
+        Status = file->Read(file, &size, (void*)(uintptr_t)addr);
+        if (EFI_ERROR(Status)) {
+            print_error("file->Read", Status);
+            bs->FreePages(addr, PAGE_COUNT(apisetsize));
+            goto end;
+        }
+    }
+
+    apiset = (void*)(uintptr_t)addr;
+
+end:
+    if (sections)
+        bs->FreePool(sections);
+
+    if (verified)
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)verified, PAGE_COUNT(verified_size));
+
+    file->Close(file);
+
+    return Status;
+}
+
 EFI_STATUS load_api_set(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, EFI_PE_LOADER_PROTOCOL* pe, EFI_FILE_HANDLE dir,
                         void** va, uint16_t version, LIST_ENTRY* mappings, command_line* cmdline) {
     EFI_STATUS Status;
-    IMAGE_SECTION_HEADER* sections;
-    UINTN num_sections;
-    EFI_PE_IMAGE* dll;
+
+    memset(api_set_cache, 0, sizeof(api_set_cache));
+
+    apiset = NULL;
 
     if (version == _WIN32_WINNT_WIN8) {
         image* img;
         uint32_t size;
+        IMAGE_SECTION_HEADER* sections;
+        UINTN num_sections;
+        EFI_PE_IMAGE* dll;
 
         Status = add_image(bs, images, L"ApiSetSchema.dll", LoaderSystemCode, L"system32", false, NULL, 0, false);
         if (EFI_ERROR(Status)) {
@@ -59,68 +247,35 @@ EFI_STATUS load_api_set(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, EFI_PE_LOADER
             size = ((size / EFI_PAGE_SIZE) + 1) * EFI_PAGE_SIZE;
 
         *va = (uint8_t*)*va + size;
-    } else { // only passed to NT as an image on Windows 8
-        EFI_FILE_HANDLE file;
 
-        Status = open_file(dir, &file, L"ApiSetSchema.dll");
+        Status = dll->GetSections(dll, &sections, &num_sections);
         if (EFI_ERROR(Status)) {
-            print_string("Loading of ApiSetSchema.dll failed.\n");
-            print_error("file open", Status);
+            print_error("GetSections", Status);
             return Status;
         }
 
-        Status = pe->Load(file, NULL, &dll);
-        if (EFI_ERROR(Status)) {
-            print_error("PE load", Status);
-            file->Close(file);
-            return Status;
-        }
-
-        file->Close(file);
-    }
-
-    Status = dll->GetSections(dll, &sections, &num_sections);
-    if (EFI_ERROR(Status)) {
-        print_error("GetSections", Status);
-        return Status;
-    }
+        for (unsigned int i = 0; i < num_sections; i++) {
+            if (!strcmp(sections[i].Name, ".apiset")) {
+                if (sections[i].VirtualSize == 0) {
+                    print_string(".apiset section size was 0.\n");
+                    return EFI_INVALID_PARAMETER;
+                }
 
-    apiset = NULL;
+                apiset = (uint8_t*)dll->Data + sections[i].VirtualAddress;
+                apisetsize = sections[i].VirtualSize;
 
-    for (unsigned int i = 0; i < num_sections; i++) {
-        if (!strcmp(sections[i].Name, ".apiset")) {
-            if (sections[i].VirtualSize == 0) {
-                print_string(".apiset section size was 0.\n");
-                return EFI_INVALID_PARAMETER;
+                break;
             }
-
-            apiset = (uint8_t*)dll->Data + sections[i].VirtualAddress;
-            apisetsize = sections[i].VirtualSize;
-
-            break;
         }
-    }
 
-    if (!apiset) {
-        print_string("Could not find .apiset section in ApiSetSchema.dll.\n");
-        return EFI_NOT_FOUND;
-    }
-
-    if (version >= _WIN32_WINNT_WINBLUE) {
-        EFI_PHYSICAL_ADDRESS addr;
-        void* newapiset;
-
-        Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, PAGE_COUNT(apisetsize), &addr);
-        if (EFI_ERROR(Status)) {
-            print_error("AllocatePages", Status);
-            return Status;
+        if (!apiset) {
+            print_string("Could not find .apiset section in ApiSetSchema.dll.\n");
+            return EFI_NOT_FOUND;
         }
-
-        newapiset = (void*)(uintptr_t)addr;
-
-        memcpy(newapiset, apiset, apisetsize);
-
-        apiset = newapiset;
+    } else { // only passed to NT as an image on Windows 8
+        Status = read_api_set_section(bs, dir, cmdline);
+        if (EFI_ERROR(Status))
+            return Status;
 
         apisetva = *va;
 
@@ -131,243 +286,206 @@ EFI_STATUS load_api_set(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, EFI_PE_LOADER
         }
 
         *va = (uint8_t*)*va + (PAGE_COUNT(apisetsize) * EFI_PAGE_SIZE);
-
-        dll->Free(dll);
     }
 
     return EFI_SUCCESS;
 }
 
-static bool search_api_set_80(WCHAR* dll, WCHAR* newname) {
-    API_SET_NAMESPACE_ARRAY_80* arr = (API_SET_NAMESPACE_ARRAY_80*)apiset;
-    WCHAR n[MAX_PATH];
-    unsigned int len = 0;
+static bool copy_host_name(WCHAR* newname, uint32_t offset, uint32_t length) {
+    if (length / sizeof(WCHAR) >= MAX_PATH)
+        return false;
 
-    {
-        WCHAR* s = &dll[4];
-        WCHAR* o = n;
+    memcpy(newname, (uint8_t*)apiset + offset, length);
+    newname[length / sizeof(WCHAR)] = 0;
 
-        while (s) {
-            if (*s == '.')
-                break;
-            else if (*s >= 'A' && *s <= 'Z')
-                *o = *s - 'A' + 'a';
-            else
-                *o = *s;
+    return true;
+}
 
-            s++;
-            o++;
-            len++;
-        }
+static bool api_set_name_matches(const WCHAR* name, const WCHAR* n, unsigned int len) {
+    for (unsigned int j = 0; j < len; j++) {
+        WCHAR c = name[j];
+
+        if (c >= 'A' && c <= 'Z')
+            c = c - 'A' + 'a';
+
+        if (c != n[j])
+            return false;
     }
 
+    return true;
+}
+
+static void api_set_not_found(WCHAR* dll) {
+    char s[255], *p;
+
+    p = stpcpy_utf16(s, dll);
+    p = stpcpy(p, " not found in API set array.\n");
+
+    print_string(s);
+}
+
+static bool search_api_set_80(WCHAR* dll, const WCHAR* n, unsigned int len, WCHAR* newname) {
+    API_SET_NAMESPACE_ARRAY_80* arr = (API_SET_NAMESPACE_ARRAY_80*)apiset;
+
     for (unsigned int i = 0; i < arr->Count; i++) {
         WCHAR* name = (WCHAR*)((uint8_t*)apiset + arr->Array[i].NameOffset);
-        bool found = true;
         API_SET_VALUE_ARRAY_80* val;
 
-        if (arr->Array[i].NameLength != len * sizeof(WCHAR))
-            continue;
-
-        for (unsigned int j = 0; j < len; j++) {
-            if (name[j] >= 'A' && name[j] <= 'Z') {
-                if (name[j] - 'A' + 'a' != n[j]) {
-                    found = false;
-                    break;
-                }
-            } else if (name[j] != n[j]) {
-                found = false;
-                break;
-            }
-        }
-
-        if (!found)
+        if (arr->Array[i].NameLength != len * sizeof(WCHAR) || !api_set_name_matches(name, n, len))
             continue;
 
         val = (API_SET_VALUE_ARRAY_80*)((uint8_t*)apiset + arr->Array[i].DataOffset);
 
-        if (val->Count == 0)
-            return false;
-
         for (unsigned int j = 0; j < val->Count; j++) {
-            if (val->Array[j].ValueLength > 0) {
-                memcpy(newname, (uint8_t*)apiset + val->Array[j].ValueOffset, val->Array[j].ValueLength);
-                newname[val->Array[j].ValueLength / sizeof(WCHAR)] = 0;
-                return true;
-            }
+            if (val->Array[j].ValueLength > 0)
+                return copy_host_name(newname, val->Array[j].ValueOffset, val->Array[j].ValueLength);
         }
 
         return false;
     }
 
-    {
-        char s[255], *p;
-
-        p = stpcpy_utf16(s, dll);
-        p = stpcpy(p, " not found in API set array.\n");
-
-        print_string(s);
-    }
+    api_set_not_found(dll);
 
     return false;
 }
 
-static bool search_api_set_81(WCHAR* dll, WCHAR* newname) {
+static bool search_api_set_81(WCHAR* dll, const WCHAR* n, unsigned int len, WCHAR* newname) {
     API_SET_NAMESPACE_ARRAY_81* arr = (API_SET_NAMESPACE_ARRAY_81*)apiset;
-    WCHAR n[MAX_PATH];
-    unsigned int len = 0;
-
-    {
-        WCHAR* s = &dll[4];
-        WCHAR* o = n;
-
-        while (s) {
-            if (*s == '.')
-                break;
-            else if (*s >= 'A' && *s <= 'Z')
-                *o = *s - 'A' + 'a';
-            else
-                *o = *s;
-
-            s++;
-            o++;
-            len++;
-        }
-    }
 
     for (unsigned int i = 0; i < arr->Count; i++) {
         WCHAR* name = (WCHAR*)((uint8_t*)apiset + arr->Array[i].NameOffset);
-        bool found = true;
         API_SET_VALUE_ARRAY_81* val;
 
-        if (arr->Array[i].NameLength != len * sizeof(WCHAR))
-            continue;
-
-        for (unsigned int j = 0; j < len; j++) {
-            if (name[j] >= 'A' && name[j] <= 'Z') {
-                if (name[j] - 'A' + 'a' != n[j]) {
-                    found = false;
-                    break;
-                }
-            } else if (name[j] != n[j]) {
-                found = false;
-                break;
-            }
-        }
-
-        if (!found)
+        if (arr->Array[i].NameLength != len * sizeof(WCHAR) || !api_set_name_matches(name, n, len))
             continue;
 
         val = (API_SET_VALUE_ARRAY_81*)((uint8_t*)apiset + arr->Array[i].DataOffset);
 
-        if (val->Count == 0)
-            return false;
-
         for (unsigned int j = 0; j < val->Count; j++) {
-            if (val->Array[j].ValueLength > 0) {
-                memcpy(newname, (uint8_t*)apiset + val->Array[j].ValueOffset, val->Array[j].ValueLength);
-                newname[val->Array[j].ValueLength / sizeof(WCHAR)] = 0;
-                return true;
-            }
+            if (val->Array[j].ValueLength > 0)
+                return copy_host_name(newname, val->Array[j].ValueOffset, val->Array[j].ValueLength);
         }
 
         return false;
     }
 
-    {
-        char s[255], *p;
-
-        p = stpcpy_utf16(s, dll);
-        p = stpcpy(p, " not found in API set array.\n");
-
-        print_string(s);
-    }
+    api_set_not_found(dll);
 
     return false;
 }
 
-static bool search_api_set_10(WCHAR* dll, WCHAR* newname) {
+// Windows 10 schemas have a table of hashes sorted by value, covering each name up to its
+// last hyphen - so like ntdll, we ignore the last part of the version number.
+static bool search_api_set_10(WCHAR* dll, const WCHAR* n, unsigned int len, WCHAR* newname) {
     API_SET_NAMESPACE_HEADER_10* header = (API_SET_NAMESPACE_HEADER_10*)apiset;
     API_SET_NAMESPACE_ENTRY_10* arr = (API_SET_NAMESPACE_ENTRY_10*)((uint8_t*)apiset + header->ArrayOffset);
-    WCHAR n[MAX_PATH];
-    unsigned int len = 0;
+    API_SET_HASH_ENTRY_10* hashes = (API_SET_HASH_ENTRY_10*)((uint8_t*)apiset + header->HashOffset);
+    unsigned int hashed_len = len, start = 0, end = header->Count;
+    uint32_t hash = 0;
 
-    {
-        WCHAR* s = dll;
-        WCHAR* o = n;
+    while (hashed_len > 0 && n[hashed_len - 1] != '-') {
+        hashed_len--;
+    }
 
-        while (s) {
-            if (*s == '.')
-                break;
-            else if (*s >= 'A' && *s <= 'Z')
-                *o = *s - 'A' + 'a';
-            else
-                *o = *s;
+    if (hashed_len == 0) {
+        api_set_not_found(dll);
+        return false;
+    }
 
-            s++;
-            o++;
-            len++;
-        }
+    hashed_len--;
+
+    for (unsigned int i = 0; i < hashed_len; i++) {
+        hash = (hash * header->HashMultiplier) + n[i];
     }
 
-    for (unsigned int i = 0; i < header->Count; i++) {
-        WCHAR* name = (WCHAR*)((uint8_t*)apiset + arr[i].NameOffset);
-        bool found = true;
+    while (start < end) {
+        unsigned int mid = (start + end) / 2;
+        API_SET_NAMESPACE_ENTRY_10* ent;
         API_SET_VALUE_ENTRY_81* val;
 
-        if (arr[i].NameLength != len * sizeof(WCHAR))
+        if (hashes[mid].Hash < hash) {
+            start = mid + 1;
+            continue;
+        } else if (hashes[mid].Hash > hash) {
+            end = mid;
             continue;
-
-        for (unsigned int j = 0; j < len; j++) {
-            if (name[j] >= 'A' && name[j] <= 'Z') {
-                if (name[j] - 'A' + 'a' != n[j]) {
-                    found = false;
-                    break;
-                }
-            } else if (name[j] != n[j]) {
-                found = false;
-                break;
-            }
         }
 
-        if (!found)
-            continue;
+        if (hashes[mid].Index >= header->Count)
+            break;
 
-        if (arr[i].NumberOfHosts == 0)
-            return false;
+        ent = &arr[hashes[mid].Index];
+
+        if (ent->HashedLength != hashed_len * sizeof(WCHAR) ||
+            !api_set_name_matches((WCHAR*)((uint8_t*)apiset + ent->NameOffset), n, hashed_len)) {
+            break;
+        }
 
-        val = (API_SET_VALUE_ENTRY_81*)((uint8_t*)apiset + arr[i].HostsOffset);
+        val = (API_SET_VALUE_ENTRY_81*)((uint8_t*)apiset + ent->HostsOffset);
 
-        for (unsigned int j = 0; j < arr[i].NumberOfHosts; j++) {
-            if (val[j].ValueLength > 0) {
-                memcpy(newname, (uint8_t*)apiset + val[j].ValueOffset, val[j].ValueLength);
-                newname[val[j].ValueLength / sizeof(WCHAR)] = 0;
-                return true;
-            }
+        for (unsigned int j = 0; j < ent->NumberOfHosts; j++) {
+            if (val[j].ValueLength > 0)
+                return copy_host_name(newname, val[j].ValueOffset, val[j].ValueLength);
         }
 
         return false;
     }
 
+    api_set_not_found(dll);
+
+    return false;
+}
+
+bool search_api_set(WCHAR* dll, WCHAR* newname, uint16_t version) {
+    WCHAR n[MAX_PATH];
+    unsigned int len = 0;
+    uint32_t hash = 0;
+    api_set_cache_entry* ce = NULL;
+    bool found;
+
+    // lower-case the name, and strip the extension - and the "api-" or "ext-" prefix on 8 and 8.1
+
     {
-        char s[255], *p;
+        WCHAR* s = version >= _WIN32_WINNT_WIN10 ? dll : &dll[4];
+
+        while (*s != 0 && *s != '.' && len < MAX_PATH - 1) {
+            if (*s >= 'A' && *s <= 'Z')
+                n[len] = *s - 'A' + 'a';
+            else
+                n[len] = *s;
 
-        p = stpcpy_utf16(s, dll);
-        p = stpcpy(p, " not found in API set array.\n");
+            hash = (hash * 31) + n[len];
 
-        print_string(s);
+            s++;
+            len++;
+        }
     }
 
-    return false;
-}
+    // names are looked up once when loading each image and again when resolving its imports
+
+    if (len <= API_SET_CACHE_NAME_LEN) {
+        ce = &api_set_cache[hash & (API_SET_CACHE_SIZE - 1)];
+
+        if (ce->name_len == len && !memcmp(ce->name, n, len * sizeof(WCHAR))) {
+            wcsncpy(newname, ce->value, MAX_PATH - 1);
+            return true;
+        }
+    }
 
-bool search_api_set(WCHAR* dll, WCHAR* newname, uint16_t version) {
     if (version == _WIN32_WINNT_WIN8)
-        return search_api_set_80(dll, newname);
+        found = search_api_set_80(dll, n, len, newname);
     else if (version == _WIN32_WINNT_WINBLUE)
-        return search_api_set_81(dll, newname);
+        found = search_api_set_81(dll, n, len, newname);
     else if (version == _WIN32_WINNT_WIN10)
-        return search_api_set_10(dll, newname);
+        found = search_api_set_10(dll, n, len, newname);
     else
         return false;
+
+    if (found && ce && wcslen(newname) < API_SET_CACHE_NAME_LEN) {
+        ce->name_len = (uint16_t)len;
+        memcpy(ce->name, n, len * sizeof(WCHAR));
+        wcsncpy(ce->value, newname, API_SET_CACHE_NAME_LEN - 1);
+    }
+
+    return found;
 }
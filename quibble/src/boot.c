@@ -22,12 +22,14 @@
 #include "quibble.h"
 #include "reg.h"
 #include "peload.h"
+#include "peloaddef.h"
 #include "misc.h"
 #include "win.h"
 #include "x86.h"
 #include "tinymt32.h"
 #include "quibbleproto.h"
 #include "print.h"
+#include "sha256.h"
 
 // #define DEBUG_EARLY_FAULTS
 
@@ -82,23 +84,100 @@ typedef struct {
     };
 } loader_store;
 
+#define IMAGE_REGION_CHUNK 0x400000 // images region is 4MB-aligned and grown 4MB at a time, for the sake of large pages
+#define IMAGE_REGION_INITIAL_CHUNKS 8
+
 typedef struct _command_line {
     char* debug_type;
     WCHAR* hal;
     WCHAR* kernel;
     uint64_t subvol;
+    bool prefetch;
+    bool compact_hive;
+    bool kernel_cache;
+    bool parallel_load;
+    unsigned int verify;
+    bool large_pages;
 #ifdef _X86_
     unsigned int pae;
     unsigned int nx;
 #endif
 } command_line;
 
+#define PREFETCH_MANIFEST_NAME_LEN 22 // prefetch-xxxxxxxx.bin
+
+#define VERIFY_NONE 0
+#define VERIFY_CHECKSUM 1
+#define VERIFY_HASH 2
+
+#define KERNEL_CACHE_MAGIC 0x48434b51 // "QKCH"
+#define KERNEL_CACHE_FORMAT 3
+#define KERNEL_CACHE_NOT_IN_BLOB 0xffffffff
+#define KERNEL_CACHE_MAX_ENTRIES 4096
+
+#pragma pack(push,1)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t format;
+    uint32_t num_entries;
+    uint32_t strings_size; // bytes of names following the entries
+    uint32_t blob_offset; // page-aligned
+    uint32_t blob_pages;
+    uint64_t va; // where the kernel was loaded
+    uint64_t apiset_size; // ApiSetSchema.dll on 8.1 and above, where it isn't an image
+    EFI_TIME apiset_time;
+    uint32_t apiset_checksum;
+    uint8_t table_hash[SHA256_HASH_SIZE]; // of the entries and strings
+    uint8_t blob_hash[SHA256_HASH_SIZE];
+} kernel_cache_header;
+
+typedef struct {
+    uint64_t va;
+    uint64_t file_size;
+    EFI_TIME file_time;
+    uint32_t file_checksum; // from the PE header, in case the filesystem's times can't be trusted
+    uint32_t name_offset; // in WCHARs, from the start of the strings
+    uint32_t dir_offset;
+    uint32_t blob_page; // or KERNEL_CACHE_NOT_IN_BLOB if loaded before the main loop
+    uint32_t pages;
+    uint32_t order;
+    uint32_t memory_type;
+    uint8_t dll;
+    uint8_t no_reloc;
+    uint8_t reserved[2];
+} kernel_cache_entry;
+
+#pragma pack(pop)
+
 EFI_SYSTEM_TABLE* systable;
 NLS_DATA_BLOCK nls;
 size_t acp_size, oemcp_size, lang_size;
 void* errata_inf = NULL;
 size_t errata_inf_size = 0;
 LIST_ENTRY images;
+static struct {
+    EFI_PHYSICAL_ADDRESS start;
+    size_t size;
+    size_t used;
+    bool overflowed;
+} image_region;
+static bool kernel_cache_hit;
+static uint8_t* allowed_hashes;
+static unsigned int num_allowed_hashes;
+static uint64_t apiset_file_size;
+static EFI_TIME apiset_file_time;
+static uint32_t apiset_file_checksum;
+
+#ifdef IMAGE_STATS
+static struct {
+    uint64_t load_cycles;
+    uint64_t imports_cycles;
+    uint64_t resolve_cycles;
+    uint64_t contiguous_cycles;
+    uint64_t prepare_cycles;
+} image_stats;
+#endif
 void* stack;
 EFI_HANDLE image_handle;
 bool kdnet_loaded = false;
@@ -119,6 +198,9 @@ void* shadow_fb;
 bool have_csm;
 uint8_t edid[128];
 bool have_edid = false;
+static EFI_QUIBBLE_PREFETCH_PROTOCOL* prefetch_proto = NULL;
+static EFI_HANDLE prefetch_handle = NULL;
+static WCHAR prefetch_manifest[PREFETCH_MANIFEST_NAME_LEN];
 
 typedef void (EFIAPI* change_stack_cb) (
     EFI_BOOT_SERVICES* bs,
@@ -126,38 +208,12 @@ typedef void (EFIAPI* change_stack_cb) (
 );
 
 static const WCHAR system_root[] = L"\\SystemRoot\\";
+static const WCHAR kernel_cache_file[] = L"kernelcache.bin";
+static const WCHAR kernel_cache_temp_file[] = L"kernelcache.tmp";
+static const WCHAR allowed_hashes_file[] = L"hashes.txt";
 
 // FIXME - calls to protocols should include pointer to callback to display any errors (and also TRACE etc.?)
 
-EFI_STATUS add_image(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, const WCHAR* name, TYPE_OF_MEMORY memory_type,
-                     const WCHAR* dir, bool dll, BOOT_DRIVER_LIST_ENTRY* bdle, unsigned int order,
-                     bool no_reloc) {
-    EFI_STATUS Status;
-    image* img;
-
-    Status = bs->AllocatePool(EfiLoaderData, sizeof(image), (void**)&img);
-    if (EFI_ERROR(Status)) {
-        print_error("AllocatePool", Status);
-        return Status;
-    }
-
-    // FIXME - show error if name too long?
-
-    wcsncpy(img->name, name, sizeof(img->name) / sizeof(WCHAR));
-    wcsncpy(img->dir, dir, sizeof(img->dir) / sizeof(WCHAR));
-    InsertTailList(images, &img->list_entry);
-
-    img->img = NULL;
-    img->import_list = NULL;
-    img->memory_type = memory_type;
-    img->dll = dll;
-    img->bdle = bdle;
-    img->order = order;
-    img->no_reloc = no_reloc;
-
-    return EFI_SUCCESS;
-}
-
 static unsigned int julian_day(unsigned int year, unsigned int month, unsigned int day) {
     int a, b, c;
 
@@ -208,7 +264,7 @@ static void get_system_time(int64_t* time) {
     *time = t;
 }
 
-static uint64_t get_cpu_frequency(EFI_BOOT_SERVICES* bs) {
+uint64_t get_cpu_frequency(EFI_BOOT_SERVICES* bs) {
     uint64_t tsc1, tsc2;
 
     static const UINTN delay = 50; // 50 ms
@@ -264,7 +320,9 @@ static loader_store* initialize_loader_block(EFI_BOOT_SERVICES* bs, char* option
 
     memset(store, 0, sizeof(loader_store));
 
-    cpu_frequency = get_cpu_frequency(bs);
+    // the menu may already have needed this for its countdown
+    if (cpu_frequency == 0)
+        cpu_frequency = get_cpu_frequency(bs);
 
     if (version <= _WIN32_WINNT_WS03) {
         block1a = &store->loader_block_ws03.Block1a;
@@ -1410,179 +1468,25 @@ static void find_apic() {
     apic = (void*)((uintptr_t)apic & 0xfffff000);
 }
 
-static EFI_STATUS open_file_case_insensitive(EFI_FILE_HANDLE dir, WCHAR** pname, EFI_FILE_HANDLE* h) {
-    EFI_STATUS Status;
-    unsigned int len, bs;
-    UINTN size;
-    WCHAR* name = *pname;
-    WCHAR tmp[MAX_PATH];
-
-    len = wcslen(name);
-    bs = len;
-
-    for (unsigned int i = 0; i < len; i++) {
-        if (name[i] == '\\') {
-            bs = i;
-            break;
-        }
-    }
-
-    memcpy(tmp, name, bs * sizeof(WCHAR));
-    tmp[bs] = 0;
-
-    Status = dir->Open(dir, h, tmp, EFI_FILE_MODE_READ, 0);
-    if (Status != EFI_NOT_FOUND) {
-        if (name[bs] == 0)
-            *pname = &name[bs];
-        else
-            *pname = &name[bs + 1];
-
-        return Status;
-    }
-
-    Status = dir->SetPosition(dir, 0);
-    if (EFI_ERROR(Status)) {
-        print_error("dir->SetPosition", Status);
-        return Status;
-    }
-
-    do {
-        WCHAR* fn;
-        WCHAR buf[1024];
-
-        size = sizeof(buf);
-
-        Status = dir->Read(dir, &size, buf);
-        if (EFI_ERROR(Status)) {
-            print_error("dir->Read", Status);
-            return Status;
-        }
-
-        if (size == 0)
-            break;
-
-        fn = ((EFI_FILE_INFO*)buf)->FileName;
-
-        if (!wcsicmp(tmp, fn)) {
-            if (name[bs] == 0)
-                *pname = &name[bs];
-            else
-                *pname = &name[bs + 1];
-
-            return dir->Open(dir, h, fn, EFI_FILE_MODE_READ, 0);
-        }
-    } while (true);
-
-    return EFI_NOT_FOUND;
-}
-
-EFI_STATUS open_file(EFI_FILE_HANDLE dir, EFI_FILE_HANDLE* h, const WCHAR* name) {
-    EFI_FILE_HANDLE orig_dir = dir;
-    EFI_STATUS Status;
-
-    Status = dir->Open(dir, h, (WCHAR*)name, EFI_FILE_MODE_READ, 0);
-    if (Status != EFI_NOT_FOUND)
-        return Status;
-
-    while (name[0] != 0) {
-        Status = open_file_case_insensitive(dir, (WCHAR**)&name, h);
-        if (EFI_ERROR(Status)) {
-            if (dir != orig_dir)
-                dir->Close(dir);
-
-            return Status;
-        }
-
-        if (dir != orig_dir)
-            dir->Close(dir);
-
-        if (name[0] == 0)
-            return EFI_SUCCESS;
+static bool get_dword_value(EFI_REGISTRY_VALUE_QUERY* v, uint32_t* val) {
+    if (EFI_ERROR(v->Status) || v->Type != REG_DWORD || v->DataLength != sizeof(uint32_t))
+        return false;
 
-        dir = *h;
-    }
+    *val = *(uint32_t*)v->Data;
 
-    return EFI_INVALID_PARAMETER;
+    return true;
 }
 
-EFI_STATUS read_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const WCHAR* name, void** data, size_t* size) {
-    EFI_STATUS Status;
-    EFI_FILE_HANDLE file;
-    size_t file_size, pages;
-    EFI_PHYSICAL_ADDRESS addr;
-
-    Status = open_file(dir, &file, name);
-    if (EFI_ERROR(Status))
-        return Status;
-
-    {
-        EFI_FILE_INFO file_info;
-        EFI_GUID guid = EFI_FILE_INFO_ID;
-        UINTN size = sizeof(EFI_FILE_INFO);
-
-        Status = file->GetInfo(file, &guid, &size, &file_info);
-
-        if (Status == EFI_BUFFER_TOO_SMALL) {
-            EFI_FILE_INFO* file_info2;
-
-            Status = bs->AllocatePool(EfiLoaderData, size, (void**)&file_info2);
-            if (EFI_ERROR(Status)) {
-                print_error("AllocatePool", Status);
-                file->Close(file);
-                return Status;
-            }
-
-            Status = file->GetInfo(file, &guid, &size, file_info2);
-            if (EFI_ERROR(Status)) {
-                print_error("file->GetInfo", Status);
-                bs->FreePool(file_info2);
-                file->Close(file);
-                return Status;
-            }
-
-            file_size = file_info2->FileSize;
-
-            bs->FreePool(file_info2);
-        } else if (EFI_ERROR(Status)) {
-            print_error("file->GetInfo", Status);
-            file->Close(file);
-            return Status;
-        } else
-            file_size = file_info.FileSize;
-    }
-
-    pages = file_size / EFI_PAGE_SIZE;
-    if (file_size % EFI_PAGE_SIZE != 0)
-        pages++;
-
-    if (pages == 0) {
-        file->Close(file);
-        return EFI_INVALID_PARAMETER;
-    }
-
-    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &addr);
-    if (EFI_ERROR(Status)) {
-        print_error("AllocatePages", Status);
-        file->Close(file);
-        return Status;
-    }
-
-    *data = (uint8_t*)(uintptr_t)addr;
-    *size = file_size;
-
-    {
-        UINTN read_size = pages * EFI_PAGE_SIZE;
+// Copies a string returned by QueryValues into buf, adding a terminating null.
+static EFI_STATUS copy_string_value(EFI_REGISTRY_VALUE_QUERY* v, WCHAR* buf, size_t size) {
+    if (EFI_ERROR(v->Status))
+        return v->Status;
 
-        Status = file->Read(file, &read_size, *data);
-        if (EFI_ERROR(Status)) {
-            print_error("file->Read", Status);
-            bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)*data, pages);
-            file->Close(file);
-            return Status;
-        }
-    }
+    if (v->DataLength + sizeof(WCHAR) > size)
+        return EFI_BUFFER_TOO_SMALL;
 
-    file->Close(file);
+    memcpy(buf, v->Data, v->DataLength);
+    buf[v->DataLength / sizeof(WCHAR)] = 0;
 
     return EFI_SUCCESS;
 }
@@ -1590,8 +1494,9 @@ EFI_STATUS read_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const WCHAR* na
 static EFI_STATUS load_nls(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, EFI_REGISTRY_HIVE* hive, HKEY ccs, uint16_t build) {
     EFI_STATUS Status;
     HKEY key;
-    WCHAR s[255], acp[MAX_PATH], oemcp[MAX_PATH], lang[MAX_PATH];
+    WCHAR s[255], acp_name[255], oemcp_name[255], acp[MAX_PATH], oemcp[MAX_PATH], lang[MAX_PATH];
     uint32_t length, type;
+    EFI_REGISTRY_VALUE_QUERY values[2];
 
     Status = hive->FindKey(hive, ccs, L"Control\\Nls\\CodePage", &key);
     if (EFI_ERROR(Status)) {
@@ -1599,21 +1504,27 @@ static EFI_STATUS load_nls(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, EFI_
         return Status;
     }
 
-    // query CCS\Control\Nls\CodePage\ACP
+    // query CCS\Control\Nls\CodePage\ACP and OEMCP
 
-    length = sizeof(s);
+    values[0].Name = L"ACP";
+    values[1].Name = L"OEMCP";
 
-    Status = hive->QueryValue(hive, key, L"ACP", s, &length, &type);
+    Status = hive->QueryValues(hive, key, values, sizeof(values) / sizeof(values[0]));
     if (EFI_ERROR(Status)) {
-        print_error("hive->QueryValue", Status);
+        print_error("hive->QueryValues", Status);
         return Status;
     }
 
-    if (type != REG_SZ && type != REG_EXPAND_SZ) {
+    if (EFI_ERROR(values[0].Status)) {
+        print_error("hive->QueryValues", values[0].Status);
+        return values[0].Status;
+    }
+
+    if (values[0].Type != REG_SZ && values[0].Type != REG_EXPAND_SZ) {
         char s[255], *p;
 
         p = stpcpy(s, "Type of Control\\Nls\\CodePage\\ACP value was ");
-        p = hex_to_str(p, type);
+        p = hex_to_str(p, values[0].Type);
         p = stpcpy(p, ", expected REG_SZ.\n");
 
         print_string(s);
@@ -1621,29 +1532,22 @@ static EFI_STATUS load_nls(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, EFI_
         return EFI_INVALID_PARAMETER;
     }
 
-    length = sizeof(acp);
-
-    Status = hive->QueryValue(hive, key, s, acp, &length, &type);
+    Status = copy_string_value(&values[0], acp_name, sizeof(acp_name));
     if (EFI_ERROR(Status)) {
-        print_error("hive->QueryValue", Status);
+        print_error("copy_string_value", Status);
         return Status;
     }
 
-    // query CCS\Control\Nls\CodePage\OEMCP
-
-    length = sizeof(s);
-
-    Status = hive->QueryValue(hive, key, L"OEMCP", s, &length, &type);
-    if (EFI_ERROR(Status)) {
-        print_error("hive->QueryValue", Status);
-        return Status;
+    if (EFI_ERROR(values[1].Status)) {
+        print_error("hive->QueryValues", values[1].Status);
+        return values[1].Status;
     }
 
-    if (type != REG_SZ && type != REG_EXPAND_SZ) {
+    if (values[1].Type != REG_SZ && values[1].Type != REG_EXPAND_SZ) {
         char s[255], *p;
 
         p = stpcpy(s, "Type of Control\\Nls\\CodePage\\OEMCP value was ");
-        p = hex_to_str(p, type);
+        p = hex_to_str(p, values[1].Type);
         p = stpcpy(p, ", expected REG_SZ.\n");
 
         print_string(s);
@@ -1651,11 +1555,32 @@ static EFI_STATUS load_nls(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, EFI_
         return EFI_INVALID_PARAMETER;
     }
 
-    length = sizeof(oemcp);
+    Status = copy_string_value(&values[1], oemcp_name, sizeof(oemcp_name));
+    if (EFI_ERROR(Status)) {
+        print_error("copy_string_value", Status);
+        return Status;
+    }
+
+    // look up the filenames for both codepages
 
-    Status = hive->QueryValue(hive, key, s, oemcp, &length, &type);
+    values[0].Name = acp_name;
+    values[1].Name = oemcp_name;
+
+    Status = hive->QueryValues(hive, key, values, sizeof(values) / sizeof(values[0]));
     if (EFI_ERROR(Status)) {
-        print_error("hive->QueryValue", Status);
+        print_error("hive->QueryValues", Status);
+        return Status;
+    }
+
+    Status = copy_string_value(&values[0], acp, sizeof(acp));
+    if (EFI_ERROR(Status)) {
+        print_error("copy_string_value", Status);
+        return Status;
+    }
+
+    Status = copy_string_value(&values[1], oemcp, sizeof(oemcp));
+    if (EFI_ERROR(Status)) {
+        print_error("copy_string_value", Status);
         return Status;
     }
 
@@ -1754,19 +1679,33 @@ static EFI_STATUS load_nls(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, EFI_
     return EFI_SUCCESS;
 }
 
+// Works out where a service's image is, relative to the Windows directory. image_path is
+// MAX_PATH characters long.
+static void get_service_image_path(EFI_REGISTRY_VALUE_QUERY* value, const WCHAR* name, WCHAR* image_path) {
+    if ((value->Type != REG_SZ && value->Type != REG_EXPAND_SZ) ||
+        EFI_ERROR(copy_string_value(value, image_path, MAX_PATH * sizeof(WCHAR)))) {
+        wcsncpy(image_path, L"system32\\drivers\\", MAX_PATH);
+        wcsncat(image_path, name, MAX_PATH);
+        wcsncat(image_path, L".sys", MAX_PATH);
+    }
+
+    // remove \SystemRoot\ prefix if present
+    if (wcslen(image_path) > (sizeof(system_root) / sizeof(WCHAR)) - 1 && !memcmp(image_path, system_root, (sizeof(system_root) / sizeof(WCHAR)) - 1))
+        memcpy(image_path, &image_path[(sizeof(system_root) / sizeof(WCHAR)) - 1], (wcslen(image_path) * sizeof(WCHAR)) - sizeof(system_root) + (2*sizeof(WCHAR)));
+}
+
 static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, HKEY ccs, LIST_ENTRY* images, LIST_ENTRY* boot_drivers,
                                LIST_ENTRY* mappings, void** va, LIST_ENTRY* core_drivers, int32_t hwconfig, WCHAR* fs_driver) {
     EFI_STATUS Status;
     HKEY services, sgokey;
     WCHAR name[255], group[255], *sgo;
-    unsigned int i;
+    UINT32 position;
     LIST_ENTRY drivers;
     LIST_ENTRY* le;
     uint32_t length, reg_type;
     size_t boot_list_size;
 
     static const WCHAR reg_prefix[] = L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\";
-    static const WCHAR system_root[] = L"\\SystemRoot\\";
 
     InitializeListHead(&drivers);
 
@@ -1776,45 +1715,51 @@ static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, H
         return Status;
     }
 
-    i = 0;
+    position = 0;
 
     do {
         HKEY key;
+        EFI_REGISTRY_VALUE_QUERY values[5];
         uint32_t type, start, tag;
         WCHAR image_path[MAX_PATH], dir[MAX_PATH], *image_name;
         size_t pos;
         driver* d;
         bool is_fs_driver;
 
-        Status = hive->EnumKeys(hive, services, i, name, sizeof(name) / sizeof(WCHAR));
+        Status = hive->NextKey(hive, services, &position, &key, name, sizeof(name) / sizeof(WCHAR));
 
         if (Status == EFI_NOT_FOUND)
             break;
-        else if (EFI_ERROR(Status))
-            print_error("hive->EnumKeys", Status);
+        else if (EFI_ERROR(Status)) {
+            print_error("hive->NextKey", Status);
+
+            // name too long - the cursor has already moved on, so skip this key
+
+            if (Status == EFI_BUFFER_TOO_SMALL)
+                continue;
 
-        Status = hive->FindKey(hive, services, name, &key);
-        if (EFI_ERROR(Status)) {
-            print_error("hive->FindKey", Status);
             return Status;
         }
 
-        Status = hive->QueryValue(hive, key, L"Type", &type, &length, &reg_type);
+        values[0].Name = L"Type";
+        values[1].Name = L"Start";
+        values[2].Name = L"ImagePath";
+        values[3].Name = L"Group";
+        values[4].Name = L"Tag";
 
-        if (EFI_ERROR(Status) || reg_type != REG_DWORD || (type != SERVICE_KERNEL_DRIVER && type != SERVICE_FILE_SYSTEM_DRIVER)) {
-            i++;
+        Status = hive->QueryValues(hive, key, values, sizeof(values) / sizeof(values[0]));
+        if (EFI_ERROR(Status)) {
+            print_error("hive->QueryValues", Status);
             continue;
         }
 
-        is_fs_driver = fs_driver && !wcsicmp(name, fs_driver);
+        if (!get_dword_value(&values[0], &type) || (type != SERVICE_KERNEL_DRIVER && type != SERVICE_FILE_SYSTEM_DRIVER))
+            continue;
 
-        length = sizeof(start);
+        is_fs_driver = fs_driver && !wcsicmp(name, fs_driver);
 
-        Status = hive->QueryValue(hive, key, L"Start", &start, &length, &reg_type);
-        if (EFI_ERROR(Status) || reg_type != REG_DWORD || (start != SERVICE_BOOT_START && !is_fs_driver)) {
-            i++;
+        if (!get_dword_value(&values[1], &start) || (start != SERVICE_BOOT_START && !is_fs_driver))
             continue;
-        }
 
         if (hwconfig != -1 && !is_fs_driver) {
             HKEY sokey;
@@ -1832,28 +1777,13 @@ static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, H
                 if (!EFI_ERROR(Status) && reg_type == REG_DWORD) {
                     start = soval;
 
-                    if (start != SERVICE_BOOT_START) {
-                        i++;
+                    if (start != SERVICE_BOOT_START)
                         continue;
-                    }
                 }
             }
         }
 
-        length = sizeof(image_path);
-
-        Status = hive->QueryValue(hive, key, L"ImagePath", image_path, &length, &reg_type);
-
-        if (EFI_ERROR(Status) || (reg_type != REG_SZ && reg_type != REG_EXPAND_SZ)) {
-            wcsncpy(image_path, L"system32\\drivers\\", sizeof(image_path) / sizeof(WCHAR));
-            wcsncat(image_path, name, sizeof(image_path) / sizeof(WCHAR));
-            wcsncat(image_path, L".sys", sizeof(image_path) / sizeof(WCHAR));
-        } else
-            image_path[length / sizeof(WCHAR)] = 0;
-
-        // remove \SystemRoot\ prefix if present
-        if (wcslen(image_path) > (sizeof(system_root) / sizeof(WCHAR)) - 1 && !memcmp(image_path, system_root, (sizeof(system_root) / sizeof(WCHAR)) - 1))
-            memcpy(image_path, &image_path[(sizeof(system_root) / sizeof(WCHAR)) - 1], (wcslen(image_path) * sizeof(WCHAR)) - sizeof(system_root) + (2*sizeof(WCHAR)));
+        get_service_image_path(&values[2], name, image_path);
 
         pos = wcslen(image_path) - 1;
         while (true) {
@@ -1911,13 +1841,7 @@ static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, H
 
         d->group = NULL;
 
-        length = sizeof(group);
-
-        Status = hive->QueryValue(hive, key, L"Group", group, &length, &reg_type);
-
-        if (!EFI_ERROR(Status) && reg_type == REG_SZ) {
-            group[length / sizeof(WCHAR)] = 0;
-
+        if (values[3].Type == REG_SZ && !EFI_ERROR(copy_string_value(&values[3], group, sizeof(group)))) {
             Status = bs->AllocatePool(EfiLoaderData, (wcslen(group) + 1) * sizeof(WCHAR), (void**)&d->group);
             if (EFI_ERROR(Status)) {
                 print_error("AllocatePool", Status);
@@ -1931,18 +1855,12 @@ static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, H
             memcpy(d->group, group, (wcslen(group) + 1) * sizeof(WCHAR));
         }
 
-        length = sizeof(tag);
-
-        Status = hive->QueryValue(hive, key, L"Tag", &tag, &length, &reg_type);
-
-        if (!EFI_ERROR(Status) && reg_type == REG_DWORD)
+        if (get_dword_value(&values[4], &tag))
             d->tag = tag;
         else
             d->tag = 0xffffffff;
 
         InsertTailList(&drivers, &d->list_entry);
-
-        i++;
     } while (true);
 
     // order by group
@@ -1996,7 +1914,7 @@ static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, H
                 LIST_ENTRY* le2 = le->Flink;
                 driver* d = _CR(le, driver, list_entry);
 
-                if (!wcsicmp(s, d->group)) {
+                if (d->group && !wcsicmp(s, d->group)) {
                     RemoveEntryList(&d->list_entry);
                     InsertTailList(&list, &d->list_entry);
                 }
@@ -2134,7 +2052,7 @@ static EFI_STATUS load_drivers(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive, H
 
             bdle->LdrEntry = NULL;
 
-            if (core_drivers && !wcsicmp(d->group, L"Core")) {
+            if (core_drivers && d->group && !wcsicmp(d->group, L"Core")) {
                 InsertTailList(core_drivers, &bdle->Link);
             } else {
                 InsertTailList(boot_drivers, &bdle->Link);
@@ -2195,7 +2113,7 @@ static EFI_STATUS load_errata_inf(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive
     EFI_STATUS Status;
     HKEY key;
     WCHAR name[MAX_PATH];
-    uint32_t length, type;
+    EFI_REGISTRY_VALUE_QUERY value;
 
     static WCHAR infdir[] = L"inf\\";
 
@@ -2211,11 +2129,17 @@ static EFI_STATUS load_errata_inf(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive
 
     memcpy(name, infdir, sizeof(infdir));
 
-    length = sizeof(name) - sizeof(infdir) + sizeof(WCHAR);
+    value.Name = L"InfName";
+
+    Status = hive->QueryValues(hive, key, &value, 1);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->QueryValues", Status);
+        return Status;
+    }
 
-    Status = hive->QueryValue(hive, key, L"InfName", &name[(sizeof(infdir) / sizeof(WCHAR)) - 1], &length, &type);
+    Status = copy_string_value(&value, &name[(sizeof(infdir) / sizeof(WCHAR)) - 1], sizeof(name) - sizeof(infdir) + sizeof(WCHAR));
     if (EFI_ERROR(Status)) {
-        print_error("hive->QueryValueNoCopy", Status);
+        print_error("copy_string_value", Status);
         return Status;
     }
 
@@ -2256,47 +2180,19 @@ static EFI_STATUS load_errata_inf(EFI_BOOT_SERVICES* bs, EFI_REGISTRY_HIVE* hive
     return Status;
 }
 
-static EFI_STATUS load_registry(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, EFI_REGISTRY_PROTOCOL* reg,
-                                void** data, uint32_t* size, LIST_ENTRY* images, LIST_ENTRY* drivers, LIST_ENTRY* mappings,
-                                void** va, uint16_t version, uint16_t build, EFI_FILE_HANDLE windir, LIST_ENTRY* core_drivers,
-                                WCHAR* fs_driver) {
+// Finds where CurrentControlSet should point to.
+static EFI_STATUS find_current_control_set(EFI_REGISTRY_HIVE* hive, HKEY rootkey, HKEY* ccs) {
     EFI_STATUS Status;
-    EFI_FILE_HANDLE file = NULL;
-    EFI_REGISTRY_HIVE* hive;
+    HKEY key;
     uint32_t set, length, type;
-    HKEY rootkey, key, ccs;
     WCHAR ccs_name[14];
-    int32_t hwconfig = -1;
-
-    Status = open_file(system32, &file, L"config\\SYSTEM");
-    if (EFI_ERROR(Status))
-        return Status;
-
-    Status = reg->OpenHive(file, &hive);
-    if (EFI_ERROR(Status)) {
-        print_error("OpenHive", Status);
-        file->Close(file);
-        return Status;
-    }
-
-    Status = file->Close(file);
-    if (EFI_ERROR(Status))
-        print_error("file close", Status);
-
-    // find where CurrentControlSet should point to
 
     // FIXME - LastKnownGood?
 
-    Status = hive->FindRoot(hive, &rootkey);
-    if (EFI_ERROR(Status)) {
-        print_error("hive->FindRoot", Status);
-        goto end;
-    }
-
     Status = hive->FindKey(hive, rootkey, L"Select", &key);
     if (EFI_ERROR(Status)) {
         print_error("hive->FindKey", Status);
-        goto end;
+        return Status;
     }
 
     length = sizeof(set);
@@ -2304,7 +2200,7 @@ static EFI_STATUS load_registry(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32,
     Status = hive->QueryValue(hive, key, L"Default", &set, &length, &type);
     if (EFI_ERROR(Status)) {
         print_error("hive->QueryValue", Status);
-        goto end;
+        return Status;
     }
 
     if (type != REG_DWORD) {
@@ -2316,14 +2212,13 @@ static EFI_STATUS load_registry(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32,
 
         print_string(s);
 
-        Status = EFI_INVALID_PARAMETER;
-        goto end;
+        return EFI_INVALID_PARAMETER;
     }
 
     wcsncpy(ccs_name, L"ControlSet00x", sizeof(ccs_name) / sizeof(WCHAR));
     ccs_name[12] = (set % 10) + '0';
 
-    Status = hive->FindKey(hive, rootkey, ccs_name, &ccs);
+    Status = hive->FindKey(hive, rootkey, ccs_name, ccs);
     if (EFI_ERROR(Status)) {
         char s[255], *p;
 
@@ -2334,29 +2229,68 @@ static EFI_STATUS load_registry(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32,
         print_string(s);
 
         print_error("hive->FindKey", Status);
-        goto end;
+        return Status;
     }
 
-    if (version >= _WIN32_WINNT_WIN8) {
-        Status = hive->FindKey(hive, rootkey, L"HardwareConfig", &key);
-        if (EFI_ERROR(Status)) {
-            print_error("hive->FindKey", Status);
-            goto end;
-        }
-
-        length = sizeof(hwconfig);
-
-        // FIXME - should be identifying based on BIOS version etc.?
-        // FIXME - looks like we should be creating a random GUID if no BIOS match
+    return EFI_SUCCESS;
+}
 
-        Status = hive->QueryValue(hive, key, L"LastId", &hwconfig, &length, &type);
-        if (EFI_ERROR(Status)) {
-            print_error("hive->QueryValue", Status);
-            goto end;
-        }
+static EFI_STATUS load_registry(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32, EFI_REGISTRY_PROTOCOL* reg,
+                                void** data, uint32_t* size, LIST_ENTRY* images, LIST_ENTRY* drivers, LIST_ENTRY* mappings,
+                                void** va, uint16_t version, uint16_t build, EFI_FILE_HANDLE windir, LIST_ENTRY* core_drivers,
+                                WCHAR* fs_driver, bool compact) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE file = NULL;
+    EFI_REGISTRY_HIVE* hive;
+    uint32_t length, type;
+    HKEY rootkey, key, ccs;
+    int32_t hwconfig = -1;
 
-        if (type != REG_DWORD) {
-            char s[255], *p;
+    Status = open_file(system32, &file, L"config\\SYSTEM");
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = reg->OpenHive(file, &hive);
+    if (EFI_ERROR(Status)) {
+        print_error("OpenHive", Status);
+        file->Close(file);
+        return Status;
+    }
+
+    Status = file->Close(file);
+    if (EFI_ERROR(Status))
+        print_error("file close", Status);
+
+    Status = hive->FindRoot(hive, &rootkey);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->FindRoot", Status);
+        goto end;
+    }
+
+    Status = find_current_control_set(hive, rootkey, &ccs);
+    if (EFI_ERROR(Status))
+        goto end;
+
+    if (version >= _WIN32_WINNT_WIN8) {
+        Status = hive->FindKey(hive, rootkey, L"HardwareConfig", &key);
+        if (EFI_ERROR(Status)) {
+            print_error("hive->FindKey", Status);
+            goto end;
+        }
+
+        length = sizeof(hwconfig);
+
+        // FIXME - should be identifying based on BIOS version etc.?
+        // FIXME - looks like we should be creating a random GUID if no BIOS match
+
+        Status = hive->QueryValue(hive, key, L"LastId", &hwconfig, &length, &type);
+        if (EFI_ERROR(Status)) {
+            print_error("hive->QueryValue", Status);
+            goto end;
+        }
+
+        if (type != REG_DWORD) {
+            char s[255], *p;
 
             p = stpcpy(s, "HardwareConfig\\LastId value type was ");
             p = hex_to_str(p, type);
@@ -2388,6 +2322,12 @@ static EFI_STATUS load_registry(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE system32,
     if (EFI_ERROR(Status))
         print_error("load_errata_inf", Status);
 
+    if (compact) {
+        Status = hive->Compact(hive);
+        if (EFI_ERROR(Status))
+            print_error("hive->Compact", Status); // non-fatal, the hive is left as it was
+    }
+
     Status = hive->StealData(hive, data, size);
     if (EFI_ERROR(Status)) {
         print_error("hive->StealData", Status);
@@ -2569,12 +2509,110 @@ static EFI_STATUS generate_images_list(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images
     return EFI_SUCCESS;
 }
 
+// Reserves the physical memory the images get loaded into, so they end up contiguous
+// without needing to be moved afterwards. If this fails, images are loaded wherever
+// and make_images_contiguous moves them, as before.
+static void reserve_image_region(EFI_BOOT_SERVICES* bs) {
+    EFI_STATUS Status;
+
+    image_region.start = 0;
+    image_region.size = 0;
+    image_region.used = 0;
+    image_region.overflowed = false;
+
+    for (unsigned int chunks = IMAGE_REGION_INITIAL_CHUNKS; chunks > 0; chunks /= 2) {
+        size_t size = chunks * IMAGE_REGION_CHUNK;
+        size_t alloc_pages = (size + IMAGE_REGION_CHUNK - EFI_PAGE_SIZE) / EFI_PAGE_SIZE;
+        EFI_PHYSICAL_ADDRESS addr, aligned, end;
+
+        // FIXME - loop through memory map and find address ourselves
+
+        Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, alloc_pages, &addr);
+        if (EFI_ERROR(Status))
+            continue;
+
+        // align to 4MB, and give back the slack on either side
+
+        aligned = addr;
+        if ((aligned % IMAGE_REGION_CHUNK) != 0)
+            aligned += IMAGE_REGION_CHUNK - (aligned % IMAGE_REGION_CHUNK);
+
+        end = addr + (alloc_pages * EFI_PAGE_SIZE);
+
+        if (aligned != addr)
+            bs->FreePages(addr, (aligned - addr) / EFI_PAGE_SIZE);
+
+        if (aligned + size != end)
+            bs->FreePages(aligned + size, (end - aligned - size) / EFI_PAGE_SIZE);
+
+        image_region.start = aligned;
+        image_region.size = size;
+
+        return;
+    }
+
+    print_string("Could not reserve memory for images.\n");
+}
+
+// Frees the part of the images region beyond offset keep.
+static void trim_image_region(EFI_BOOT_SERVICES* bs, size_t keep) {
+    if (keep >= image_region.size)
+        return;
+
+    bs->FreePages(image_region.start + keep, (image_region.size - keep) / EFI_PAGE_SIZE);
+    image_region.size = keep;
+}
+
+// Called by the PE loader once it knows how big an image is.
+static EFI_STATUS EFIAPI allocate_image_pages(UINTN pages, EFI_PHYSICAL_ADDRESS* address) {
+    EFI_BOOT_SERVICES* bs = systable->BootServices;
+    size_t size = pages * EFI_PAGE_SIZE;
+
+    if (image_region.size != 0 && !image_region.overflowed) {
+        while (image_region.used + size > image_region.size) {
+            EFI_PHYSICAL_ADDRESS addr = image_region.start + image_region.size;
+            EFI_STATUS Status;
+
+            Status = bs->AllocatePages(AllocateAddress, EfiLoaderData, IMAGE_REGION_CHUNK / EFI_PAGE_SIZE, &addr);
+            if (EFI_ERROR(Status)) {
+                print_string("Could not grow images region, falling back to moving images.\n");
+                image_region.overflowed = true;
+                break;
+            }
+
+            image_region.size += IMAGE_REGION_CHUNK;
+        }
+
+        if (!image_region.overflowed) {
+            *address = image_region.start + image_region.used;
+            image_region.used += size;
+
+            return EFI_SUCCESS;
+        }
+    }
+
+    return bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, address);
+}
+
 static EFI_STATUS make_images_contiguous(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images) {
     EFI_STATUS Status;
     LIST_ENTRY* le;
     size_t size = 0;
     EFI_PHYSICAL_ADDRESS addr;
 
+    // normally the images will have been loaded into the reserved region already
+
+    if (image_region.size != 0 && !image_region.overflowed) {
+        size_t keep = image_region.used;
+
+        if ((keep % IMAGE_REGION_CHUNK) != 0)
+            keep += IMAGE_REGION_CHUNK - (keep % IMAGE_REGION_CHUNK);
+
+        trim_image_region(bs, keep);
+
+        return EFI_SUCCESS;
+    }
+
     le = images->Flink;
     while (le != images) {
         image* img = _CR(le, image, list_entry);
@@ -2623,6 +2661,10 @@ static EFI_STATUS make_images_contiguous(EFI_BOOT_SERVICES* bs, LIST_ENTRY* imag
         le = le->Flink;
     }
 
+    // the images that were in the region have been moved out of it, so free what's left
+
+    trim_image_region(bs, image_region.used);
+
     return EFI_SUCCESS;
 }
 
@@ -2660,22 +2702,250 @@ static EFI_STATUS load_drvdb(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE windir, void
     return EFI_SUCCESS;
 }
 
+// Returns what the kernel cache uses to tell whether a file has changed: its size, its modification
+// time, and the checksum in its PE header. Leaves the file positioned at the start.
+static EFI_STATUS get_file_key(EFI_FILE_HANDLE file, uint64_t* size, EFI_TIME* time, uint32_t* checksum) {
+    EFI_STATUS Status;
+    EFI_GUID guid = EFI_FILE_INFO_ID;
+    WCHAR buf[(sizeof(EFI_FILE_INFO) / sizeof(WCHAR)) + MAX_PATH];
+    UINTN buf_size = sizeof(buf);
+    EFI_FILE_INFO* info = (EFI_FILE_INFO*)buf;
+    IMAGE_DOS_HEADER dos_header;
+    IMAGE_NT_HEADERS nt_header;
+    UINTN read_size;
+
+    memset(buf, 0, sizeof(buf));
+
+    Status = file->GetInfo(file, &guid, &buf_size, buf);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    // some filesystem drivers don't fill in the times, in which case we can't tell if a file's changed
+    if (info->ModificationTime.Year == 0 || info->ModificationTime.Month == 0 || info->ModificationTime.Day == 0)
+        return EFI_UNSUPPORTED;
+
+    *size = info->FileSize;
+    *time = info->ModificationTime;
+
+    // the CheckSum field is in the same place in the 32- and 64-bit optional headers
+
+    read_size = sizeof(IMAGE_DOS_HEADER);
+
+    Status = file->Read(file, &read_size, &dos_header);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    if (read_size < sizeof(IMAGE_DOS_HEADER) || dos_header.e_magic != IMAGE_DOS_SIGNATURE)
+        return EFI_INVALID_PARAMETER;
+
+    Status = file->SetPosition(file, dos_header.e_lfanew);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    read_size = offsetof(IMAGE_NT_HEADERS, OptionalHeader32.CheckSum) + sizeof(uint32_t);
+
+    Status = file->Read(file, &read_size, &nt_header);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    if (read_size < offsetof(IMAGE_NT_HEADERS, OptionalHeader32.CheckSum) + sizeof(uint32_t) ||
+        nt_header.Signature != IMAGE_NT_SIGNATURE)
+        return EFI_INVALID_PARAMETER;
+
+    *checksum = nt_header.OptionalHeader32.CheckSum;
+
+    return file->SetPosition(file, 0);
+}
+
+static char* hash_to_str(char* s, const uint8_t* hash) {
+    static const char hex[] = "0123456789abcdef";
+
+    for (unsigned int i = 0; i < SHA256_HASH_SIZE; i++) {
+        *s = hex[hash[i] >> 4];
+        s++;
+        *s = hex[hash[i] & 0xf];
+        s++;
+    }
+
+    *s = 0;
+
+    return s;
+}
+
+static EFI_STATUS check_allowed_hash(const WCHAR* name, const uint8_t* hash) {
+    char s[255], *p;
+
+    for (unsigned int i = 0; i < num_allowed_hashes; i++) {
+        if (!memcmp(&allowed_hashes[i * SHA256_HASH_SIZE], hash, SHA256_HASH_SIZE))
+            return EFI_SUCCESS;
+    }
+
+    p = stpcpy(s, "Hash of ");
+    p = stpcpy_utf16(p, name);
+    p = stpcpy(p, " (");
+    p = hash_to_str(p, hash);
+    p = stpcpy(p, ") not in allowed list.\n");
+
+    print_string(s);
+
+    return EFI_SECURITY_VIOLATION;
+}
+
+// Checks an image against the policy set by /VERIFY, using the hash and checksum worked out while it was read in.
+static EFI_STATUS verify_image(image* img, command_line* cmdline) {
+    EFI_STATUS Status;
+    uint8_t hash[SHA256_HASH_SIZE];
+    UINT32 checksum;
+
+    Status = img->img->GetFileHash(img->img, hash, &checksum);
+    if (EFI_ERROR(Status)) {
+        print_error("GetFileHash", Status);
+        return Status;
+    }
+
+    if (cmdline->verify == VERIFY_CHECKSUM) {
+        UINT32 expected = img->img->GetCheckSum(img->img);
+        char s[255], *p;
+
+        if (expected != 0 && checksum == expected)
+            return EFI_SUCCESS;
+
+        p = stpcpy(s, "Checksum of ");
+        p = stpcpy_utf16(p, img->name);
+
+        if (expected == 0)
+            p = stpcpy(p, " not set.\n");
+        else {
+            p = stpcpy(p, " was ");
+            p = hex_to_str(p, checksum);
+            p = stpcpy(p, ", expected ");
+            p = hex_to_str(p, expected);
+            p = stpcpy(p, ".\n");
+        }
+
+        print_string(s);
+
+        return EFI_SECURITY_VIOLATION;
+    } else
+        return check_allowed_hash(img->name, hash);
+}
+
+// For files that get passed to the kernel as data rather than loaded as images. With /VERIFY=HASH, reads
+// the whole file and checks it against the allowed list, returning its contents so that the caller uses
+// exactly what was checked. Otherwise there's nothing to check, and *data is set to NULL.
+EFI_STATUS verify_data_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const WCHAR* name, command_line* cmdline,
+                            void** data, size_t* size) {
+    EFI_STATUS Status;
+    uint8_t hash[SHA256_HASH_SIZE];
+    sha256_ctx ctx;
+
+    *data = NULL;
+
+    if (cmdline->verify != VERIFY_HASH)
+        return EFI_SUCCESS;
+
+    Status = read_file(bs, dir, name, data, size);
+    if (EFI_ERROR(Status)) {
+        print_error("read_file", Status);
+        *data = NULL;
+        return Status;
+    }
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, *data, *size);
+    sha256_final(&ctx, hash);
+
+    Status = check_allowed_hash(name, hash);
+    if (EFI_ERROR(Status)) {
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)*data, PAGE_COUNT(*size));
+        *data = NULL;
+        return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+#ifdef IMAGE_STATS
+// FNV-1a of the image's sections - not the whole image, as the gaps between them are undefined
+static uint32_t image_checksum(image* img) {
+    uint8_t* data = (uint8_t*)(uintptr_t)img->img->GetAddress(img->img);
+    IMAGE_SECTION_HEADER* sections;
+    UINTN num_sections;
+    uint32_t hash = 0x811c9dc5;
+
+    if (EFI_ERROR(img->img->GetSections(img->img, &sections, &num_sections)))
+        return 0;
+
+    for (unsigned int i = 0; i < num_sections; i++) {
+        for (uint32_t j = 0; j < sections[i].VirtualSize; j++) {
+            hash ^= data[sections[i].VirtualAddress + j];
+            hash *= 0x01000193;
+        }
+    }
+
+    return hash;
+}
+
+static void print_image_stats(LIST_ENTRY* images) {
+    LIST_ENTRY* le;
+    char s[255], *p;
+    uint32_t total = 0x811c9dc5;
+
+    le = images->Flink;
+    while (le != images) {
+        image* img = _CR(le, image, list_entry);
+        uint32_t hash = image_checksum(img);
+
+        p = stpcpy(s, "images: ");
+        p = stpcpy_utf16(p, img->name);
+        p = stpcpy(p, " checksum ");
+        p = hex_to_str(p, hash);
+        p = stpcpy(p, "\n");
+
+        print_string(s);
+
+        total = (total ^ hash) * 0x01000193;
+
+        le = le->Flink;
+    }
+
+    p = stpcpy(s, "images: loaded in ");
+    p = dec_to_str(p, image_stats.load_cycles);
+    p = stpcpy(p, " cycles, imports found in ");
+    p = dec_to_str(p, image_stats.imports_cycles);
+    p = stpcpy(p, ", prepared in ");
+    p = dec_to_str(p, image_stats.prepare_cycles);
+    p = stpcpy(p, ", resolved in ");
+    p = dec_to_str(p, image_stats.resolve_cycles);
+    p = stpcpy(p, ", made contiguous in ");
+    p = dec_to_str(p, image_stats.contiguous_cycles);
+    p = stpcpy(p, "\n");
+
+    print_string(s);
+
+    p = stpcpy(s, "images: overall checksum ");
+    p = hex_to_str(p, total);
+    p = stpcpy(p, "\n");
+
+    print_string(s);
+}
+#endif
+
 EFI_STATUS load_image(image* img, WCHAR* name, EFI_PE_LOADER_PROTOCOL* pe, void* va, EFI_FILE_HANDLE dir,
                       command_line* cmdline, uint16_t build) {
     EFI_STATUS Status;
     EFI_FILE_HANDLE file;
     bool is_kdstub = false;
+#ifdef IMAGE_STATS
+    uint64_t start_cycles;
+#endif
 
     if (!wcsicmp(name, L"kdcom.dll") && cmdline->debug_type && strcmp(cmdline->debug_type, "com")) {
         unsigned int len = strlen(cmdline->debug_type);
         unsigned int wlen;
         WCHAR* newfile;
 
-        Status = utf8_to_utf16(NULL, 0, &wlen, cmdline->debug_type, len);
-        if (EFI_ERROR(Status)) {
-            print_error("utf8_to_utf16", Status);
-            return Status;
-        }
+        wlen = UTF8_TO_UTF16_MAX(len);
 
         Status = systable->BootServices->AllocatePool(EfiLoaderData, wlen + (7 * sizeof(WCHAR)), (void**)&newfile);
         if (EFI_ERROR(Status)) {
@@ -2816,13 +3086,42 @@ EFI_STATUS load_image(image* img, WCHAR* name, EFI_PE_LOADER_PROTOCOL* pe, void*
 
     img->va = va;
 
-    Status = pe->Load(file, !is_kdstub ? va : NULL, &img->img);
+    if (cmdline->kernel_cache) {
+        Status = get_file_key(file, &img->file_size, &img->file_time, &img->file_checksum);
+        if (EFI_ERROR(Status)) {
+            // not fatal - we just can't tell if this file changes, so don't cache anything
+            print_error("get_file_key", Status);
+            print_string("Not using kernel cache.\n");
+            cmdline->kernel_cache = false;
+        }
+    }
+
+#ifdef IMAGE_STATS
+    start_cycles = __rdtsc();
+#endif
+
+    Status = pe->LoadAt(file, !is_kdstub ? va : NULL, allocate_image_pages, &img->img);
+
+#ifdef IMAGE_STATS
+    image_stats.load_cycles += __rdtsc() - start_cycles;
+#endif
+
     if (EFI_ERROR(Status)) {
         print_error("PE load", Status);
         file->Close(file);
         return Status;
     }
 
+    if (cmdline->verify != VERIFY_NONE) {
+        Status = verify_image(img, cmdline);
+        if (EFI_ERROR(Status)) {
+            img->img->Free(img->img);
+            img->img = NULL;
+            file->Close(file);
+            return Status;
+        }
+    }
+
     {
         char s[255], *p;
 
@@ -2842,6 +3141,11 @@ EFI_STATUS load_image(image* img, WCHAR* name, EFI_PE_LOADER_PROTOCOL* pe, void*
     if (is_kdstub) {
         kdstub = img;
 
+        // we call into kdstub before the other images get prepared, so it needs relocating now
+        Status = img->img->Prepare(img->img);
+        if (EFI_ERROR(Status))
+            print_error("Prepare", Status);
+
         Status = allocate_kdnet_hw_context(img->img, &debug_device_descriptor, build);
         if (EFI_ERROR(Status)) {
             print_error("allocate_kdnet_hw_context", Status);
@@ -2856,113 +3160,143 @@ EFI_STATUS load_image(image* img, WCHAR* name, EFI_PE_LOADER_PROTOCOL* pe, void*
     return Status;
 }
 
-static void fix_image_order(LIST_ENTRY* images) {
-    image* kernel = _CR(images->Flink, image, list_entry);
-    image* hal = _CR(images->Flink->Flink, image, list_entry);
-    LIST_ENTRY* le;
-    LIST_ENTRY list;
-    unsigned int max_order = 0;
+typedef struct {
+    image** list;
+    EFI_STATUS* results;
+    long count;
+    volatile long next;
+} prepare_queue;
 
-    RemoveEntryList(&kernel->list_entry);
-    RemoveEntryList(&hal->list_entry);
+// Runs on the BSP and on every AP. Each processor takes the next image off the queue until there
+// are none left - which image ends up on which processor doesn't matter, as they're independent.
+static void EFIAPI prepare_worker(void* arg) {
+    prepare_queue* q = (prepare_queue*)arg;
 
-    le = images->Flink;
-    while (le != images) {
-        image* img = _CR(le, image, list_entry);
+    while (true) {
+#ifdef _MSC_VER
+        long i = _InterlockedIncrement(&q->next) - 1;
+#else
+        long i = __sync_add_and_fetch(&q->next, 1) - 1;
+#endif
 
-        if (img->order > max_order)
-            max_order = img->order;
+        if (i >= q->count)
+            break;
 
-        le = le->Flink;
+        q->results[i] = q->list[i]->img->Prepare(q->list[i]->img);
     }
+}
 
-    InitializeListHead(&list);
+// Applies the relocations LoadAt deferred, sharing the work out between all the processors if the
+// firmware gives us MP services, and doing it all on the BSP if it doesn't.
+static EFI_STATUS prepare_images(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images) {
+    EFI_STATUS Status;
+    EFI_GUID mp_guid = EFI_MP_SERVICES_PROTOCOL_GUID;
+    EFI_MP_SERVICES_PROTOCOL* mp;
+    EFI_EVENT event = NULL;
+    UINTN num_procs = 1, num_enabled = 1;
+    bool aps_started = false;
+    prepare_queue q;
+    LIST_ENTRY* le;
+    unsigned int i;
 
-    for (unsigned int i = 0; i <= max_order; i++) {
-        le = images->Flink;
+    q.count = 0;
+    q.next = 0;
 
-        while (le != images) {
-            LIST_ENTRY* le2 = le->Flink;
-            image* img = _CR(le, image, list_entry);
+    le = images->Flink;
+    while (le != images) {
+        q.count++;
+        le = le->Flink;
+    }
 
-            if (img->order == i) {
-                RemoveEntryList(&img->list_entry);
-                InsertTailList(&list, &img->list_entry);
-            }
+    if (q.count == 0)
+        return EFI_SUCCESS;
 
-            le = le2;
-        }
+    Status = bs->AllocatePool(EfiLoaderData, q.count * (sizeof(image*) + sizeof(EFI_STATUS)), (void**)&q.list);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
     }
 
-    // kernel and HAL always need to be first
+    q.results = (EFI_STATUS*)&q.list[q.count];
 
-    InsertHeadList(&list, &hal->list_entry);
-    InsertHeadList(&list, &kernel->list_entry);
+    i = 0;
+    le = images->Flink;
+    while (le != images) {
+        q.list[i] = _CR(le, image, list_entry);
+        q.results[i] = EFI_SUCCESS;
+        i++;
 
-    // move list
-    images->Flink = list.Flink;
-    images->Blink = list.Blink;
-    images->Flink->Blink = images;
-    images->Blink->Flink = images;
-}
+        le = le->Flink;
+    }
 
-static EFI_STATUS resolve_forward(char* name, uint64_t* address) {
-    WCHAR dll[MAX_PATH];
-    LIST_ENTRY* le;
-    char* func;
-
-    {
-        WCHAR* s;
-        char* c;
-
-        c = name;
-        s = dll;
-
-        while (*c != 0 && *c != '.') {
-            *s = *c;
-            s++;
-            c++;
+    Status = bs->LocateProtocol(&mp_guid, NULL, (void**)&mp);
+    if (!EFI_ERROR(Status)) {
+        Status = mp->GetNumberOfProcessors(mp, &num_procs, &num_enabled);
+        if (EFI_ERROR(Status))
+            print_error("GetNumberOfProcessors", Status);
+        else if (num_enabled > 1) {
+            // non-blocking, so that the BSP can work through the queue too
+            Status = bs->CreateEvent(0, 0, NULL, NULL, &event);
+            if (EFI_ERROR(Status)) {
+                print_error("CreateEvent", Status);
+                event = NULL;
+            } else {
+                Status = mp->StartupAllAPs(mp, prepare_worker, false, event, 0, &q, NULL);
+                if (EFI_ERROR(Status))
+                    print_error("StartupAllAPs", Status);
+                else
+                    aps_started = true;
+            }
         }
+    }
 
-        *s = 0;
+    if (!aps_started)
+        num_enabled = 1;
 
-        func = c;
+    prepare_worker(&q);
 
-        if (*func == '.')
-            func++;
-    }
+    if (aps_started) {
+        UINTN index;
 
-    // FIXME - handle ordinals
+        Status = bs->WaitForEvent(1, &event, &index);
+        if (EFI_ERROR(Status)) {
+            print_error("WaitForEvent", Status);
+            halt(); // can't free the queue while the APs might still be using it
+        }
+    }
 
-    le = images.Flink;
-    while (le != &images) {
-        image* img = _CR(le, image, list_entry);
-        WCHAR name[MAX_PATH];
+    if (event)
+        bs->CloseEvent(event);
 
-        wcsncpy(name, img->name, sizeof(name) / sizeof(WCHAR));
+    for (i = 0; i < q.count; i++) {
+        if (EFI_ERROR(q.results[i])) {
+            char s[255], *p;
 
-        {
-            WCHAR* s = name;
+            p = stpcpy(s, "Could not relocate ");
+            p = stpcpy_utf16(p, q.list[i]->name);
+            p = stpcpy(p, ".\n");
 
-            while (*s != 0) {
-                if (*s == '.') {
-                    *s = 0;
-                    break;
-                }
+            print_string(s);
 
-                s++;
-            }
+            print_error("Prepare", q.results[i]); // non-fatal, as with relocating in LoadAt
         }
+    }
 
-        if (wcsicmp(name, dll)) {
-            le = le->Flink;
-            continue;
-        }
+    {
+        char s[255], *p;
 
-        return img->img->FindExport(img->img, func, address, resolve_forward);
+        p = stpcpy(s, "Prepared ");
+        p = dec_to_str(p, q.count);
+        p = stpcpy(p, " images on ");
+        p = dec_to_str(p, num_enabled);
+        p = stpcpy(p, num_enabled == 1 ? " processor.\n" : " processors.\n");
+
+        print_string(s);
     }
 
-    return EFI_NOT_FOUND;
+    bs->FreePool(q.list);
+
+    return EFI_SUCCESS;
 }
 
 static EFI_STATUS initialize_csm(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs) {
@@ -3096,6 +3430,14 @@ static void parse_option(const char* option, size_t len, command_line* cmdline)
     static const char hal[] = "HAL=";
     static const char kernel[] = "KERNEL=";
     static const char subvol[] = "SUBVOL=";
+    static const char prefetch[] = "PREFETCH";
+    static const char compacthive[] = "COMPACTHIVE";
+    static const char kernelcache[] = "KERNELCACHE";
+    static const char parallelload[] = "PARALLELLOAD";
+    static const char verify[] = "VERIFY=";
+    static const char checksum[] = "CHECKSUM";
+    static const char hash[] = "HASH";
+    static const char largepages[] = "LARGEPAGES";
 #ifdef _X86_
     static const char pae[] = "PAE";
     static const char nopae[] = "NOPAE";
@@ -3127,11 +3469,7 @@ static void parse_option(const char* option, size_t len, command_line* cmdline)
     } else if (len > sizeof(hal) - 1 && !strnicmp(option, hal, sizeof(hal) - 1)) {
         unsigned int wlen;
 
-        Status = utf8_to_utf16(NULL, 0, &wlen, &option[sizeof(hal) - 1], len - sizeof(hal) + 1);
-        if (EFI_ERROR(Status)) {
-            print_error("utf8_to_utf16", Status);
-            return;
-        }
+        wlen = UTF8_TO_UTF16_MAX(len - sizeof(hal) + 1);
 
         Status = systable->BootServices->AllocatePool(EfiLoaderData, wlen + sizeof(WCHAR), (void**)&cmdline->hal);
         if (EFI_ERROR(Status)) {
@@ -3151,11 +3489,7 @@ static void parse_option(const char* option, size_t len, command_line* cmdline)
     } else if (len > sizeof(kernel) - 1 && !strnicmp(option, kernel, sizeof(kernel) - 1)) {
         unsigned int wlen;
 
-        Status = utf8_to_utf16(NULL, 0, &wlen, &option[sizeof(kernel) - 1], len - sizeof(kernel) + 1);
-        if (EFI_ERROR(Status)) {
-            print_error("utf8_to_utf16", Status);
-            return;
-        }
+        wlen = UTF8_TO_UTF16_MAX(len - sizeof(kernel) + 1);
 
         Status = systable->BootServices->AllocatePool(EfiLoaderData, wlen + sizeof(WCHAR), (void**)&cmdline->kernel);
         if (EFI_ERROR(Status)) {
@@ -3197,6 +3531,26 @@ static void parse_option(const char* option, size_t len, command_line* cmdline)
         }
 
         cmdline->subvol = sn;
+    } else if (len == sizeof(prefetch) - 1 && !strnicmp(option, prefetch, sizeof(prefetch) - 1)) {
+        cmdline->prefetch = true;
+    } else if (len == sizeof(compacthive) - 1 && !strnicmp(option, compacthive, sizeof(compacthive) - 1)) {
+        cmdline->compact_hive = true;
+    } else if (len == sizeof(kernelcache) - 1 && !strnicmp(option, kernelcache, sizeof(kernelcache) - 1)) {
+        cmdline->kernel_cache = true;
+    } else if (len == sizeof(parallelload) - 1 && !strnicmp(option, parallelload, sizeof(parallelload) - 1)) {
+        cmdline->parallel_load = true;
+    } else if (len > sizeof(verify) - 1 && !strnicmp(option, verify, sizeof(verify) - 1)) {
+        const char* val = option + sizeof(verify) - 1;
+        size_t vallen = len - sizeof(verify) + 1;
+
+        if (vallen == sizeof(checksum) - 1 && !strnicmp(val, checksum, sizeof(checksum) - 1))
+            cmdline->verify = VERIFY_CHECKSUM;
+        else if (vallen == sizeof(hash) - 1 && !strnicmp(val, hash, sizeof(hash) - 1))
+            cmdline->verify = VERIFY_HASH;
+        else
+            print_string("Unrecognized VERIFY value.\n");
+    } else if (len == sizeof(largepages) - 1 && !strnicmp(option, largepages, sizeof(largepages) - 1)) {
+        cmdline->large_pages = true;
 #ifdef _X86_
     } else if (len == sizeof(pae) - 1 && !strnicmp(option, pae, sizeof(pae) - 1))
         cmdline->pae = PAE_FORCEENABLE;
@@ -3631,221 +3985,1127 @@ static EFI_STATUS load_fonts(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE windir) {
     return EFI_SUCCESS;
 }
 
-#if defined(_MSC_VER) && defined(__x86_64__)
-void call_startup(void* stack, void* loader_block, void* KiSystemStartup);
-#endif
-
-static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE root, char* options,
-                       char* path, char* arc_name, EFI_PE_LOADER_PROTOCOL* pe, EFI_REGISTRY_PROTOCOL* reg,
-                       command_line* cmdline, WCHAR* fs_driver) {
+static EFI_STATUS open_quibble_dir(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE* dir) {
     EFI_STATUS Status;
-    EFI_FILE_HANDLE windir = NULL, system32 = NULL, drivers_dir = NULL;
-    LIST_ENTRY mappings;
-    KERNEL_ENTRY_POINT KiSystemStartup;
-    LIST_ENTRY* le;
-    void* va;
-    void* va2;
-    loader_store* store;
-    unsigned int store_pages;
-    gdt_entry* gdt;
-    idt_entry* idt;
-    KTSS* tssphys;
-    KTSS* tss;
-    KTSS* nmitss = NULL;
-    KTSS* dftss = NULL;
-    KTSS* mctss = NULL;
-    void* usd;
-    void* store_va;
-    void* registry;
-    uint32_t reg_size;
-    LIST_ENTRY drivers;
-    LIST_ENTRY core_drivers;
-    uint32_t version_ms, version_ls;
-    uint16_t version;
-    uint16_t build, revision;
-    LOADER_BLOCK1A* block1a;
-    LOADER_BLOCK1B* block1b;
-    void** registry_base;
-    uint32_t* registry_length;
-    LOADER_BLOCK2* block2;
-    LOADER_EXTENSION_BLOCK1A* extblock1a;
-    LOADER_EXTENSION_BLOCK1B* extblock1b;
-    LOADER_EXTENSION_BLOCK3* extblock3;
-    uintptr_t* loader_pages_spanned;
-    unsigned int pathlen, pathwlen;
-    WCHAR* pathw;
-    KPCR* pcrva = NULL;
-    bool kdstub_export_loaded = false;
-
-    static const WCHAR drivers_dir_path[] = L"system32\\drivers";
-
-    pathlen = strlen(path);
+    EFI_GUID guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+    EFI_GUID guid2 = SIMPLE_FILE_SYSTEM_PROTOCOL;
+    EFI_LOADED_IMAGE_PROTOCOL* image;
+    EFI_FILE_IO_INTERFACE* fs;
 
-    Status = utf8_to_utf16(NULL, 0, &pathwlen, path, pathlen);
+    Status = bs->OpenProtocol(image_handle, &guid, (void**)&image, image_handle, NULL,
+                              EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
     if (EFI_ERROR(Status)) {
-        print_error("utf8_to_utf16", Status);
+        print_error("OpenProtocol", Status);
         return Status;
     }
 
-    Status = bs->AllocatePool(EfiLoaderData, pathwlen + sizeof(WCHAR), (void**)&pathw);
-    if (EFI_ERROR(Status)) {
-        print_error("AllocatePool", Status);
-        return Status;
+    if (!image->DeviceHandle) {
+        Status = EFI_NOT_FOUND;
+        goto end;
     }
 
-    Status = utf8_to_utf16(pathw, pathwlen, &pathwlen, path, pathlen);
+    Status = bs->OpenProtocol(image->DeviceHandle, &guid2, (void**)&fs, image_handle, NULL,
+                              EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
     if (EFI_ERROR(Status)) {
-        print_error("utf8_to_utf16", Status);
-        return Status;
+        print_error("OpenProtocol", Status);
+        goto end;
     }
 
-    pathw[pathwlen / sizeof(WCHAR)] = 0;
+    Status = open_parent_dir(fs, (FILEPATH_DEVICE_PATH*)image->FilePath, dir);
 
-    // check if \\Windows exists
-    Status = open_file(root, &windir, pathw);
-    if (EFI_ERROR(Status)) {
-        char s[255], *p;
+    bs->CloseProtocol(image->DeviceHandle, &guid2, image_handle, NULL);
 
-        p = stpcpy(s, "Could not open ");
-        p = stpcpy_utf16(p, pathw);
-        p = stpcpy(p, " on volume.\n");
+end:
+    bs->CloseProtocol(image_handle, &guid, image_handle, NULL);
 
-        print_string(s);
+    return Status;
+}
 
-        print_error("Open", Status);
-        return Status;
+static bool parse_hash(const char* s, uint8_t* hash) {
+    for (unsigned int i = 0; i < SHA256_HASH_SIZE * 2; i++) {
+        uint8_t v;
+
+        if (s[i] >= '0' && s[i] <= '9')
+            v = s[i] - '0';
+        else if (s[i] >= 'a' && s[i] <= 'f')
+            v = s[i] - 'a' + 0xa;
+        else if (s[i] >= 'A' && s[i] <= 'F')
+            v = s[i] - 'A' + 0xa;
+        else
+            return false;
+
+        if (i & 1)
+            hash[i / 2] |= v;
+        else
+            hash[i / 2] = v << 4;
     }
 
-    Status = open_file(windir, &system32, L"system32");
+    return true;
+}
+
+// Reads the list of hashes allowed by /VERIFY=HASH, from a file next to freeldr.ini. This is in
+// the format sha256sum writes - a hash at the start of each line, and anything after it ignored.
+static EFI_STATUS load_allowed_hashes(EFI_BOOT_SERVICES* bs) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE dir;
+    char* data;
+    size_t size, pos, max_hashes;
+
+    Status = open_quibble_dir(bs, &dir);
     if (EFI_ERROR(Status)) {
-        print_string("Could not open system32.\n");
-        print_error("open_file", Status);
+        print_error("open_quibble_dir", Status);
         return Status;
     }
 
-    InitializeListHead(&images);
-    InitializeListHead(&mappings);
+    Status = read_file(bs, dir, allowed_hashes_file, (void**)&data, &size);
 
-    Status = add_image(bs, &images, L"ntoskrnl.exe", LoaderSystemCode, L"system32", false, NULL, 0, false);
-    if (EFI_ERROR(Status)) {
-        print_error("add_image", Status);
-        goto end;
-    }
+    dir->Close(dir);
 
-    Status = add_image(bs, &images, L"hal.dll", LoaderHalCode, L"system32", true, NULL, 0, false);
     if (EFI_ERROR(Status)) {
-        print_error("add_image", Status);
-        goto end;
+        print_string("Could not read hashes.txt.\n");
+        print_error("read_file", Status);
+        return Status;
     }
 
-#ifdef _X86_
-    va = (void*)0x80000000;
-#elif defined(__x86_64__)
-    va = (void*)0xfffff80000000000;
-#endif
+    // every hash takes up at least a line's worth of characters
+    max_hashes = (size / ((SHA256_HASH_SIZE * 2) + 1)) + 1;
 
-    Status = process_memory_map(bs, &va, &mappings);
+    Status = bs->AllocatePool(EfiLoaderData, max_hashes * SHA256_HASH_SIZE, (void**)&allowed_hashes);
     if (EFI_ERROR(Status)) {
-        print_error("process_memory_map", Status);
-        goto end;
+        print_error("AllocatePool", Status);
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, PAGE_COUNT(size));
+        return Status;
     }
 
-    InitializeListHead(&drivers);
-    InitializeListHead(&core_drivers);
+    num_allowed_hashes = 0;
+    pos = 0;
 
-#ifdef _X86_
-    // load kernel at 81800000, to match Windows
-    // FIXME - make sure no overlap! Load registry before kernel, and only then errata.inf?
+    while (pos < size) {
+        size_t end = pos, len;
 
-    va2 = (void*)0x81800000;
-#elif defined(__x86_64__)
-    va2 = (void*)0xfffff80800000000;
-#endif
+        while (end < size && data[end] != '\n') {
+            end++;
+        }
 
-    Status = load_kernel(_CR(images.Flink, image, list_entry), pe, va2, system32, cmdline);
-    if (EFI_ERROR(Status)) {
-        print_error("load_kernel", Status);
-        goto end;
-    }
+        len = end - pos;
 
-    Status = _CR(images.Flink, image, list_entry)->img->GetVersion(_CR(images.Flink, image, list_entry)->img, &version_ms, &version_ls);
-    if (EFI_ERROR(Status)) {
-        print_error("GetVersion", Status);
-        goto end;
-    }
+        if (len > 0 && data[pos + len - 1] == '\r')
+            len--;
 
-    version = ((version_ms >> 16) << 8) | (version_ms & 0xff);
-    build = version_ls >> 16;
-    revision = version_ls & 0xffff;
+        // skip blank lines and comments
+        if (len > 0 && data[pos] != '#') {
+            if (len >= SHA256_HASH_SIZE * 2 && num_allowed_hashes < max_hashes &&
+                (len == SHA256_HASH_SIZE * 2 || data[pos + (SHA256_HASH_SIZE * 2)] == ' ' ||
+                 data[pos + (SHA256_HASH_SIZE * 2)] == '\t') &&
+                parse_hash(&data[pos], &allowed_hashes[num_allowed_hashes * SHA256_HASH_SIZE])) {
+                num_allowed_hashes++;
+            } else
+                print_string("Ignoring malformed line in hashes.txt.\n");
+        }
 
-    // Some checked builds have the wrong version number
-    if (build == 9200)
-        version = _WIN32_WINNT_WIN8;
-    else if (build == 9600)
-        version = _WIN32_WINNT_WINBLUE;
-    else if (version == 0x0700)
-        version = _WIN32_WINNT_WIN7;
+        pos = end + 1;
+    }
+
+    bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, PAGE_COUNT(size));
 
     {
         char s[255], *p;
 
-        p = stpcpy(s, "Booting NT version ");
-        p = dec_to_str(p, version >> 8);
-        p = stpcpy(p, ".");
-        p = dec_to_str(p, version & 0xff);
-        p = stpcpy(p, ".");
-        p = dec_to_str(p, build);
-        p = stpcpy(p, ".");
-        p = dec_to_str(p, revision);
-        p = stpcpy(p, ".\n");
+        p = stpcpy(s, "Loaded ");
+        p = dec_to_str(p, num_allowed_hashes);
+        p = stpcpy(p, " allowed hashes.\n");
 
         print_string(s);
     }
 
+    return EFI_SUCCESS;
+}
 
-    Status = load_registry(bs, system32, reg, &registry, &reg_size, &images, &drivers, &mappings, &va, version, build,
-                           windir, &core_drivers, fs_driver);
-    if (EFI_ERROR(Status)) {
-        print_error("load_registry", Status);
-        goto end;
+// Each volume and Windows directory gets its own manifest, named after a hash of the entry's
+// SystemPath and subvolume, so that entries don't keep overwriting each other's.
+static void get_prefetch_manifest_name(boot_option* opt, command_line* cmdline, WCHAR* name) {
+    uint32_t hash = 0x811c9dc5; // FNV-1a
+    const char* c = opt->system_path;
+
+    static const WCHAR prefix[] = L"prefetch-";
+    static const WCHAR suffix[] = L".bin";
+    static const char hex[] = "0123456789abcdef";
+
+    while (*c != 0) {
+        hash = (hash ^ (uint8_t)*c) * 0x01000193;
+        c++;
     }
 
-#if 0
-    Status = set_video_mode(bs, image_handle);
-    if (EFI_ERROR(Status)) {
-        print_error("set_video_mode", Status);
-        goto end;
+    for (unsigned int i = 0; i < sizeof(uint64_t); i++) {
+        hash = (hash ^ (uint8_t)(cmdline->subvol >> (i * 8))) * 0x01000193;
     }
-#endif
-    // FIXME - make sure va doesn't collide with identity-mapped EFI space
 
-    if (version >= _WIN32_WINNT_WIN8) {
-        Status = load_api_set(bs, &images, pe, system32, &va, version, &mappings, cmdline);
-        if (EFI_ERROR(Status)) {
-            print_error("load_api_set", Status);
-            goto end;
-        }
+    memcpy(name, prefix, sizeof(prefix) - sizeof(WCHAR));
+    name += (sizeof(prefix) / sizeof(WCHAR)) - 1;
+
+    for (unsigned int i = 0; i < 8; i++) {
+        name[i] = hex[(hash >> (28 - (i * 4))) & 0xf];
     }
 
-    if (version >= _WIN32_WINNT_WINBLUE) {
-        Status = add_image(bs, &images, L"crashdmp.sys", LoaderSystemCode, drivers_dir_path, false, NULL, 0, false);
-        if (EFI_ERROR(Status)) {
-            print_error("add_image", Status);
-            goto end;
-        }
+    memcpy(&name[8], suffix, sizeof(suffix));
+}
+
+static void start_prefetch(EFI_BOOT_SERVICES* bs, EFI_HANDLE fs_handle, const WCHAR* manifest) {
+    EFI_STATUS Status;
+    EFI_GUID guid = EFI_QUIBBLE_PREFETCH_PROTOCOL_GUID;
+    EFI_FILE_HANDLE dir;
+    void* data;
+    size_t size;
+
+    Status = bs->OpenProtocol(fs_handle, &guid, (void**)&prefetch_proto, image_handle, NULL,
+                              EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+    if (EFI_ERROR(Status)) {
+        print_string("Filesystem driver does not support prefetching.\n");
+        prefetch_proto = NULL;
+        return;
     }
 
-    va = va2;
+    memcpy(prefetch_manifest, manifest, sizeof(prefetch_manifest));
 
-    Status = open_file(windir, &drivers_dir, drivers_dir_path);
+    Status = open_quibble_dir(bs, &dir);
     if (EFI_ERROR(Status))
-        drivers_dir = NULL;
-
-    le = images.Flink;
-    while (le != &images) {
-        image* img = _CR(le, image, list_entry);
+        print_error("open_quibble_dir", Status);
+    else {
+        Status = read_file(bs, dir, prefetch_manifest, &data, &size);
 
-        // FIXME - if we fail opening a driver, fail according to ErrorType value (FS driver should be uber-fail?)
+        dir->Close(dir);
+
+        if (Status == EFI_NOT_FOUND)
+            print_string("No prefetch manifest found, will create one.\n");
+        else if (EFI_ERROR(Status))
+            print_error("read_file", Status);
+        else {
+            Status = prefetch_proto->Replay(prefetch_proto, data, size);
+            if (EFI_ERROR(Status) && Status != EFI_ALREADY_STARTED)
+                print_error("Replay", Status); // non-fatal
+
+            bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, PAGE_COUNT(size));
+        }
+    }
+
+    Status = prefetch_proto->Record(prefetch_proto, true);
+    if (EFI_ERROR(Status))
+        print_error("Record", Status);
+
+    prefetch_handle = fs_handle;
+}
+
+// We can't know that the boot will succeed, so this is written just before we hand over to the kernel.
+static EFI_STATUS save_prefetch_manifest(EFI_BOOT_SERVICES* bs) {
+    EFI_STATUS Status;
+    UINTN size = 0;
+    void* data;
+    EFI_FILE_HANDLE dir, file;
+
+    prefetch_proto->Record(prefetch_proto, false);
+
+    Status = prefetch_proto->GetManifest(prefetch_proto, NULL, &size);
+    if (Status != EFI_BUFFER_TOO_SMALL) {
+        print_error("GetManifest", Status);
+        return Status;
+    }
+
+    Status = bs->AllocatePool(EfiLoaderData, size, &data);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    Status = prefetch_proto->GetManifest(prefetch_proto, data, &size);
+    if (EFI_ERROR(Status)) {
+        print_error("GetManifest", Status);
+        goto end;
+    }
+
+    Status = open_quibble_dir(bs, &dir);
+    if (EFI_ERROR(Status)) {
+        print_error("open_quibble_dir", Status);
+        goto end;
+    }
+
+    // delete old file first, so we don't have to worry about truncating it
+    Status = dir->Open(dir, &file, (WCHAR*)prefetch_manifest, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    if (!EFI_ERROR(Status))
+        file->Delete(file);
+
+    Status = dir->Open(dir, &file, (WCHAR*)prefetch_manifest,
+                       EFI_FILE_MODE_CREATE | EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    if (EFI_ERROR(Status)) {
+        print_error("Open", Status);
+        dir->Close(dir);
+        goto end;
+    }
+
+    Status = file->Write(file, &size, data);
+    if (EFI_ERROR(Status))
+        print_error("Write", Status);
+
+    file->Close(file);
+    dir->Close(dir);
+
+end:
+    bs->FreePool(data);
+
+    return Status;
+}
+
+static bool kernel_cache_allowed(command_line* cmdline) {
+    // these change which files get loaded, or need setting up on every boot
+    // or, with /VERIFY, need checking against the files on disk
+    return cmdline->kernel_cache && !cmdline->debug_type && !cmdline->hal && !cmdline->kernel &&
+           cmdline->verify == VERIFY_NONE;
+}
+
+static bool same_time(const EFI_TIME* t1, const EFI_TIME* t2) {
+    return t1->Year == t2->Year && t1->Month == t2->Month && t1->Day == t2->Day && t1->Hour == t2->Hour &&
+           t1->Minute == t2->Minute && t1->Second == t2->Second && t1->Nanosecond == t2->Nanosecond;
+}
+
+// Finds the file that the main loop in boot would load an image from, and returns its key.
+static EFI_STATUS get_image_file_key(EFI_FILE_HANDLE windir, EFI_FILE_HANDLE drivers_dir, const WCHAR* dir,
+                                     const WCHAR* name, uint64_t* size, EFI_TIME* time, uint32_t* checksum) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE d, file;
+
+    Status = open_file(windir, &d, dir);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = open_file(d, &file, name);
+
+    d->Close(d);
+
+    if (Status == EFI_NOT_FOUND && drivers_dir)
+        Status = open_file(drivers_dir, &file, name);
+
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = get_file_key(file, size, time, checksum);
+
+    file->Close(file);
+
+    return Status;
+}
+
+static void free_kernel_cache_blob(EFI_BOOT_SERVICES* bs, EFI_PHYSICAL_ADDRESS addr, size_t pages) {
+    bs->FreePages(addr, pages);
+
+    // give the space back to the images region, if that's where it came from
+    if (addr + (pages * EFI_PAGE_SIZE) == image_region.start + image_region.used)
+        image_region.used -= pages * EFI_PAGE_SIZE;
+}
+
+static bool check_kernel_cache(kernel_cache_header* header, kernel_cache_entry* entries, WCHAR* strings,
+                               EFI_FILE_HANDLE windir, EFI_FILE_HANDLE drivers_dir, void* va) {
+    unsigned int strings_len = header->strings_size / sizeof(WCHAR);
+    uint32_t blob_page = 0;
+    uintptr_t cur_va = (uintptr_t)va;
+    LIST_ENTRY* le = images.Flink;
+
+    // the strings table has to be terminated, so none of the offsets can run off the end
+    if (strings_len == 0 || strings[strings_len - 1] != 0)
+        return false;
+
+    if (header->va != (uintptr_t)va || header->apiset_size != apiset_file_size ||
+        !same_time(&header->apiset_time, &apiset_file_time) || header->apiset_checksum != apiset_file_checksum)
+        return false;
+
+    for (unsigned int i = 0; i < header->num_entries; i++) {
+        kernel_cache_entry* ent = &entries[i];
+        const WCHAR* name;
+        const WCHAR* dir;
+        uint64_t size;
+        EFI_TIME time;
+        uint32_t checksum;
+
+        if (ent->name_offset >= strings_len || ent->dir_offset >= strings_len || ent->pages == 0)
+            return false;
+
+        name = &strings[ent->name_offset];
+        dir = &strings[ent->dir_offset];
+
+        // the images we already know about have to be the same, and in the same order
+
+        if (le != &images) {
+            image* img = _CR(le, image, list_entry);
+
+            if (wcsicmp(img->name, name) || wcsicmp(img->dir, dir) || img->dll != ent->dll ||
+                img->memory_type != ent->memory_type)
+                return false;
+
+            le = le->Flink;
+
+            if (img->img) {
+                if (ent->blob_page != KERNEL_CACHE_NOT_IN_BLOB || img->file_size != ent->file_size ||
+                    !same_time(&img->file_time, &ent->file_time) || img->file_checksum != ent->file_checksum ||
+                    PAGE_COUNT(img->img->GetSize(img->img)) != ent->pages)
+                    return false;
+
+                cur_va += ent->pages * EFI_PAGE_SIZE;
+                continue;
+            }
+        }
+
+        if (ent->blob_page != blob_page || ent->va != cur_va)
+            return false;
+
+        if (EFI_ERROR(get_image_file_key(windir, drivers_dir, dir, name, &size, &time, &checksum)) ||
+            size != ent->file_size || !same_time(&time, &ent->file_time) || checksum != ent->file_checksum) {
+            char s[255], *p;
+
+            p = stpcpy(s, "Kernel cache out of date, as ");
+            p = stpcpy_utf16(p, name);
+            p = stpcpy(p, " has changed.\n");
+
+            print_string(s);
+
+            return false;
+        }
+
+        blob_page += ent->pages;
+        cur_va += ent->pages * EFI_PAGE_SIZE;
+    }
+
+    // something new in the driver list
+    if (le != &images)
+        return false;
+
+    return blob_page == header->blob_pages;
+}
+
+// Called just before the main loop in boot, once we know the driver list. Everything not yet loaded
+// gets loaded from the cache with a single read, already relocated and with its imports resolved.
+static bool load_kernel_cache(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE windir, EFI_FILE_HANDLE drivers_dir,
+                              EFI_PE_LOADER_PROTOCOL* pe, void* va) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE dir, file;
+    kernel_cache_header header;
+    kernel_cache_entry* entries = NULL;
+    EFI_PE_IMAGE** pes = NULL;
+    EFI_PHYSICAL_ADDRESS addr;
+    WCHAR* strings;
+    size_t table_size;
+    UINTN size;
+    LIST_ENTRY* le;
+    bool ret = false;
+
+    Status = open_quibble_dir(bs, &dir);
+    if (EFI_ERROR(Status)) {
+        print_error("open_quibble_dir", Status);
+        return false;
+    }
+
+    Status = dir->Open(dir, &file, (WCHAR*)kernel_cache_file, EFI_FILE_MODE_READ, 0);
+
+    dir->Close(dir);
+
+    if (Status == EFI_NOT_FOUND) {
+        print_string("No kernel cache found, will create one.\n");
+        return false;
+    } else if (EFI_ERROR(Status)) {
+        print_error("Open", Status);
+        return false;
+    }
+
+    size = sizeof(header);
+
+    Status = file->Read(file, &size, &header);
+    if (EFI_ERROR(Status) || size != sizeof(header) || header.magic != KERNEL_CACHE_MAGIC ||
+        header.format != KERNEL_CACHE_FORMAT || header.num_entries == 0 ||
+        header.num_entries > KERNEL_CACHE_MAX_ENTRIES || header.strings_size > KERNEL_CACHE_MAX_ENTRIES * 2 * MAX_PATH * sizeof(WCHAR)) {
+        print_string("Kernel cache invalid, ignoring.\n");
+        goto end;
+    }
+
+    table_size = (header.num_entries * sizeof(kernel_cache_entry)) + header.strings_size;
+
+    if (header.blob_offset < sizeof(header) + table_size) {
+        print_string("Kernel cache invalid, ignoring.\n");
+        goto end;
+    }
+
+    Status = bs->AllocatePool(EfiLoaderData, table_size, (void**)&entries);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        goto end;
+    }
+
+    size = table_size;
+
+    Status = file->Read(file, &size, entries);
+    if (EFI_ERROR(Status) || size != table_size) {
+        print_string("Kernel cache invalid, ignoring.\n");
+        goto end;
+    }
+
+    // The blob is code we're about to run, so a torn write mustn't get past us. Check the
+    // table before trusting any of its offsets, and the blob once it's been read.
+
+    {
+        sha256_ctx ctx;
+        uint8_t hash[SHA256_HASH_SIZE];
+
+        sha256_init(&ctx);
+        sha256_update(&ctx, entries, table_size);
+        sha256_final(&ctx, hash);
+
+        if (memcmp(hash, header.table_hash, sizeof(hash))) {
+            print_string("Kernel cache table is corrupt, ignoring.\n");
+            goto end;
+        }
+    }
+
+    strings = (WCHAR*)&entries[header.num_entries];
+
+    if (!check_kernel_cache(&header, entries, strings, windir, drivers_dir, va)) {
+        print_string("Kernel cache does not match, ignoring.\n");
+        goto end;
+    }
+
+    Status = bs->AllocatePool(EfiLoaderData, header.num_entries * sizeof(EFI_PE_IMAGE*), (void**)&pes);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        goto end;
+    }
+
+    memset(pes, 0, header.num_entries * sizeof(EFI_PE_IMAGE*));
+
+    // Add the images we've not come across yet, in the order they were originally found in. If this
+    // fails part-way through, the main loop will load whatever's been added the normal way.
+
+    le = images.Flink;
+
+    for (unsigned int i = 0; i < header.num_entries; i++) {
+        kernel_cache_entry* ent = &entries[i];
+
+        if (le != &images) {
+            le = le->Flink;
+            continue;
+        }
+
+        Status = add_image(bs, &images, &strings[ent->name_offset], ent->memory_type, &strings[ent->dir_offset],
+                           ent->dll, NULL, ent->order, ent->no_reloc);
+        if (EFI_ERROR(Status)) {
+            print_error("add_image", Status);
+            goto end;
+        }
+    }
+
+    // everything's already in load order, so this is one big read
+
+    Status = allocate_image_pages(header.blob_pages, &addr);
+    if (EFI_ERROR(Status)) {
+        print_error("allocate_image_pages", Status);
+        goto end;
+    }
+
+    Status = file->SetPosition(file, header.blob_offset);
+    if (!EFI_ERROR(Status)) {
+        size = header.blob_pages * EFI_PAGE_SIZE;
+
+        Status = file->Read(file, &size, (void*)(uintptr_t)addr);
+        if (!EFI_ERROR(Status) && size != header.blob_pages * EFI_PAGE_SIZE)
+            Status = EFI_VOLUME_CORRUPTED;
+    }
+
+    if (EFI_ERROR(Status)) {
+        print_error("kernel cache read", Status);
+        free_kernel_cache_blob(bs, addr, header.blob_pages);
+        goto end;
+    }
+
+    {
+        sha256_ctx ctx;
+        uint8_t hash[SHA256_HASH_SIZE];
+
+        sha256_init(&ctx);
+        sha256_update(&ctx, (void*)(uintptr_t)addr, header.blob_pages * EFI_PAGE_SIZE);
+        sha256_final(&ctx, hash);
+
+        if (memcmp(hash, header.blob_hash, sizeof(hash))) {
+            print_string("Kernel cache is corrupt, ignoring.\n");
+            free_kernel_cache_blob(bs, addr, header.blob_pages);
+            goto end;
+        }
+    }
+
+    for (unsigned int i = 0; i < header.num_entries; i++) {
+        kernel_cache_entry* ent = &entries[i];
+
+        if (ent->blob_page == KERNEL_CACHE_NOT_IN_BLOB)
+            continue;
+
+        Status = pe->LoadFromMemory((uint8_t*)(uintptr_t)addr + (ent->blob_page * EFI_PAGE_SIZE), ent->pages,
+                                    (void*)(uintptr_t)ent->va, &pes[i]);
+        if (EFI_ERROR(Status)) {
+            print_error("LoadFromMemory", Status);
+
+            // the images we've created will free their own pages
+            for (unsigned int j = 0; j < header.num_entries; j++) {
+                if (pes[j])
+                    pes[j]->Free(pes[j]);
+                else if (j >= i && entries[j].blob_page != KERNEL_CACHE_NOT_IN_BLOB)
+                    bs->FreePages(addr + (entries[j].blob_page * EFI_PAGE_SIZE), entries[j].pages);
+            }
+
+            if (addr + (header.blob_pages * EFI_PAGE_SIZE) == image_region.start + image_region.used)
+                image_region.used -= header.blob_pages * EFI_PAGE_SIZE;
+
+            goto end;
+        }
+    }
+
+    le = images.Flink;
+
+    for (unsigned int i = 0; i < header.num_entries; i++) {
+        image* img = _CR(le, image, list_entry);
+
+        img->order = entries[i].order;
+        img->no_reloc = entries[i].no_reloc;
+
+        if (pes[i]) {
+            img->img = pes[i];
+            img->va = (void*)(uintptr_t)entries[i].va;
+            img->file_size = entries[i].file_size;
+            img->file_time = entries[i].file_time;
+            img->file_checksum = entries[i].file_checksum;
+            img->cached = true;
+        }
+
+        le = le->Flink;
+    }
+
+    {
+        char s[255], *p;
+
+        p = stpcpy(s, "Loaded ");
+        p = dec_to_str(p, header.num_entries);
+        p = stpcpy(p, " images from kernel cache.\n");
+
+        print_string(s);
+    }
+
+    ret = true;
+
+end:
+    if (pes)
+        bs->FreePool(pes);
+
+    if (entries)
+        bs->FreePool(entries);
+
+    file->Close(file);
+
+    return ret;
+}
+
+// Renames an open file within its directory.
+static EFI_STATUS rename_file(EFI_FILE_HANDLE file, const WCHAR* name) {
+    EFI_STATUS Status;
+    EFI_GUID guid = EFI_FILE_INFO_ID;
+    WCHAR buf[(sizeof(EFI_FILE_INFO) / sizeof(WCHAR)) + MAX_PATH];
+    EFI_FILE_INFO* info = (EFI_FILE_INFO*)buf;
+    UINTN buf_size = sizeof(buf);
+    size_t len = wcslen(name);
+
+    if (offsetof(EFI_FILE_INFO, FileName[0]) + ((len + 1) * sizeof(WCHAR)) > sizeof(buf))
+        return EFI_INVALID_PARAMETER;
+
+    Status = file->GetInfo(file, &guid, &buf_size, info);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    memcpy(info->FileName, name, (len + 1) * sizeof(WCHAR));
+    info->Size = offsetof(EFI_FILE_INFO, FileName[0]) + ((len + 1) * sizeof(WCHAR));
+
+    return file->SetInfo(file, &guid, info->Size, info);
+}
+
+// Like the prefetch manifest, this is written just before we hand over to the kernel.
+static EFI_STATUS save_kernel_cache(EFI_BOOT_SERVICES* bs, void* va) {
+    EFI_STATUS Status;
+    LIST_ENTRY* le;
+    unsigned int num_images = 0;
+    image** list = NULL;
+    uint8_t* table = NULL;
+    size_t strings_size = 0, table_size;
+    kernel_cache_header* header;
+    kernel_cache_entry* entries;
+    WCHAR* strings;
+    uint32_t blob_pages = 0, str_pos = 0;
+    EFI_FILE_HANDLE dir, file;
+    UINTN size;
+    sha256_ctx ctx;
+
+    le = images.Flink;
+    while (le != &images) {
+        image* img = _CR(le, image, list_entry);
+
+        strings_size += (wcslen(img->name) + 1 + wcslen(img->dir) + 1) * sizeof(WCHAR);
+        num_images++;
+
+        le = le->Flink;
+    }
+
+    if (num_images > KERNEL_CACHE_MAX_ENTRIES)
+        return EFI_INVALID_PARAMETER;
+
+    // put back in the order they were loaded, which fix_image_order changed
+
+    Status = bs->AllocatePool(EfiLoaderData, num_images * sizeof(image*), (void**)&list);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    memset(list, 0, num_images * sizeof(image*));
+
+    le = images.Flink;
+    while (le != &images) {
+        image* img = _CR(le, image, list_entry);
+
+        if (img->index >= num_images || list[img->index]) {
+            Status = EFI_INVALID_PARAMETER;
+            goto end;
+        }
+
+        list[img->index] = img;
+
+        le = le->Flink;
+    }
+
+    table_size = sizeof(kernel_cache_header) + (num_images * sizeof(kernel_cache_entry)) + strings_size;
+    table_size = PAGE_COUNT(table_size) * EFI_PAGE_SIZE;
+
+    Status = bs->AllocatePool(EfiLoaderData, table_size, (void**)&table);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        goto end;
+    }
+
+    memset(table, 0, table_size);
+
+    header = (kernel_cache_header*)table;
+    entries = (kernel_cache_entry*)&header[1];
+    strings = (WCHAR*)&entries[num_images];
+
+    for (unsigned int i = 0; i < num_images; i++) {
+        image* img = list[i];
+        kernel_cache_entry* ent = &entries[i];
+        size_t len;
+
+        ent->va = (uintptr_t)img->va;
+        ent->file_size = img->file_size;
+        ent->file_time = img->file_time;
+        ent->file_checksum = img->file_checksum;
+        ent->pages = PAGE_COUNT(img->img->GetSize(img->img));
+        ent->order = img->order;
+        ent->memory_type = img->memory_type;
+        ent->dll = img->dll;
+        ent->no_reloc = img->no_reloc;
+
+        if (img->early)
+            ent->blob_page = KERNEL_CACHE_NOT_IN_BLOB;
+        else {
+            ent->blob_page = blob_pages;
+            blob_pages += ent->pages;
+        }
+
+        len = wcslen(img->name) + 1;
+        ent->name_offset = str_pos;
+        memcpy(&strings[str_pos], img->name, len * sizeof(WCHAR));
+        str_pos += len;
+
+        len = wcslen(img->dir) + 1;
+        ent->dir_offset = str_pos;
+        memcpy(&strings[str_pos], img->dir, len * sizeof(WCHAR));
+        str_pos += len;
+    }
+
+    header->magic = KERNEL_CACHE_MAGIC;
+    header->format = KERNEL_CACHE_FORMAT;
+    header->num_entries = num_images;
+    header->strings_size = strings_size;
+    header->blob_offset = table_size;
+    header->blob_pages = blob_pages;
+    header->va = (uintptr_t)va;
+    header->apiset_size = apiset_file_size;
+    header->apiset_time = apiset_file_time;
+    header->apiset_checksum = apiset_file_checksum;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, entries, (num_images * sizeof(kernel_cache_entry)) + strings_size);
+    sha256_final(&ctx, header->table_hash);
+
+    sha256_init(&ctx);
+
+    for (unsigned int i = 0; i < num_images; i++) {
+        if (!list[i]->early)
+            sha256_update(&ctx, (void*)(uintptr_t)list[i]->img->GetAddress(list[i]->img), entries[i].pages * EFI_PAGE_SIZE);
+    }
+
+    sha256_final(&ctx, header->blob_hash);
+
+    Status = open_quibble_dir(bs, &dir);
+    if (EFI_ERROR(Status)) {
+        print_error("open_quibble_dir", Status);
+        goto end;
+    }
+
+    // Write to a temporary file and rename it over the old one once it's complete, so that
+    // if we're interrupted there's either the old cache or none at all. Clear out anything
+    // left over from a previous attempt first, so we don't have to worry about truncating it.
+
+    Status = dir->Open(dir, &file, (WCHAR*)kernel_cache_temp_file, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    if (!EFI_ERROR(Status))
+        file->Delete(file);
+
+    Status = dir->Open(dir, &file, (WCHAR*)kernel_cache_temp_file,
+                       EFI_FILE_MODE_CREATE | EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    if (EFI_ERROR(Status)) {
+        print_error("Open", Status);
+        dir->Close(dir);
+        goto end;
+    }
+
+    size = table_size;
+
+    Status = file->Write(file, &size, table);
+
+    for (unsigned int i = 0; i < num_images && !EFI_ERROR(Status); i++) {
+        if (list[i]->early)
+            continue;
+
+        size = entries[i].pages * EFI_PAGE_SIZE;
+
+        Status = file->Write(file, &size, (void*)(uintptr_t)list[i]->img->GetAddress(list[i]->img));
+    }
+
+    if (!EFI_ERROR(Status))
+        Status = file->Flush(file);
+
+    if (EFI_ERROR(Status)) {
+        print_error("Write", Status);
+
+        // don't leave a partial file lying around
+        file->Delete(file);
+        dir->Close(dir);
+        goto end;
+    }
+
+    // SetInfo won't rename over an existing file, so the old cache has to go first
+
+    {
+        EFI_FILE_HANDLE old;
+
+        if (!EFI_ERROR(dir->Open(dir, &old, (WCHAR*)kernel_cache_file, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0)))
+            old->Delete(old);
+    }
+
+    dir->Close(dir);
+
+    Status = rename_file(file, kernel_cache_file);
+    if (EFI_ERROR(Status)) {
+        print_error("rename_file", Status);
+        file->Delete(file);
+        goto end;
+    }
+
+    file->Close(file);
+
+end:
+    if (table)
+        bs->FreePool(table);
+
+    bs->FreePool(list);
+
+    return Status;
+}
+
+#if defined(_MSC_VER) && defined(__x86_64__)
+void call_startup(void* stack, void* loader_block, void* KiSystemStartup);
+#endif
+
+static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE root, char* options,
+                       char* path, char* arc_name, EFI_PE_LOADER_PROTOCOL* pe, EFI_REGISTRY_PROTOCOL* reg,
+                       command_line* cmdline, WCHAR* fs_driver) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE windir = NULL, system32 = NULL, drivers_dir = NULL;
+    LIST_ENTRY mappings;
+    KERNEL_ENTRY_POINT KiSystemStartup;
+    LIST_ENTRY* le;
+    void* va;
+    void* va2;
+    loader_store* store;
+    unsigned int store_pages;
+    gdt_entry* gdt;
+    idt_entry* idt;
+    KTSS* tssphys;
+    KTSS* tss;
+    KTSS* nmitss = NULL;
+    KTSS* dftss = NULL;
+    KTSS* mctss = NULL;
+    void* usd;
+    void* store_va;
+    void* registry;
+    uint32_t reg_size;
+    LIST_ENTRY drivers;
+    LIST_ENTRY core_drivers;
+    uint32_t version_ms, version_ls;
+    uint16_t version;
+    uint16_t build, revision;
+    LOADER_BLOCK1A* block1a;
+    LOADER_BLOCK1B* block1b;
+    void** registry_base;
+    uint32_t* registry_length;
+    LOADER_BLOCK2* block2;
+    LOADER_EXTENSION_BLOCK1A* extblock1a;
+    LOADER_EXTENSION_BLOCK1B* extblock1b;
+    LOADER_EXTENSION_BLOCK3* extblock3;
+    uintptr_t* loader_pages_spanned;
+    unsigned int pathlen, pathwlen;
+    WCHAR* pathw;
+    KPCR* pcrva = NULL;
+    bool kdstub_export_loaded = false;
+#ifdef IMAGE_STATS
+    uint64_t imports_start, imports_load_cycles, resolve_start;
+#endif
+
+    static const WCHAR drivers_dir_path[] = L"system32\\drivers";
+
+    pathlen = strlen(path);
+
+    pathwlen = UTF8_TO_UTF16_MAX(pathlen);
+
+    Status = bs->AllocatePool(EfiLoaderData, pathwlen + sizeof(WCHAR), (void**)&pathw);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    Status = utf8_to_utf16(pathw, pathwlen, &pathwlen, path, pathlen);
+    if (EFI_ERROR(Status)) {
+        print_error("utf8_to_utf16", Status);
+        bs->FreePool(pathw);
+        return Status;
+    }
+
+    pathw[pathwlen / sizeof(WCHAR)] = 0;
+
+    // check if \\Windows exists
+    Status = open_file(root, &windir, pathw);
+    if (EFI_ERROR(Status)) {
+        char s[255], *p;
+
+        p = stpcpy(s, "Could not open ");
+        p = stpcpy_utf16(p, pathw);
+        p = stpcpy(p, " on volume.\n");
+
+        print_string(s);
+
+        print_error("Open", Status);
+        return Status;
+    }
+
+    Status = open_file(windir, &system32, L"system32");
+    if (EFI_ERROR(Status)) {
+        print_string("Could not open system32.\n");
+        print_error("open_file", Status);
+        return Status;
+    }
+
+    // so that anything the menu preloaded gets picked up
+    add_preload_dir(windir, L"");
+    add_preload_dir(system32, L"system32");
+
+    InitializeListHead(&images);
+    init_images();
+    kernel_cache_hit = false;
+#ifdef IMAGE_STATS
+    memset(&image_stats, 0, sizeof(image_stats));
+#endif
+    init_mappings(&mappings);
+
+    Status = add_image(bs, &images, L"ntoskrnl.exe", LoaderSystemCode, L"system32", false, NULL, 0, false);
+    if (EFI_ERROR(Status)) {
+        print_error("add_image", Status);
+        goto end;
+    }
+
+    Status = add_image(bs, &images, L"hal.dll", LoaderHalCode, L"system32", true, NULL, 0, false);
+    if (EFI_ERROR(Status)) {
+        print_error("add_image", Status);
+        goto end;
+    }
+
+#ifdef _X86_
+    va = (void*)0x80000000;
+#elif defined(__x86_64__)
+    va = (void*)0xfffff80000000000;
+#endif
+
+    Status = process_memory_map(bs, &va, &mappings);
+    if (EFI_ERROR(Status)) {
+        print_error("process_memory_map", Status);
+        goto end;
+    }
+
+    InitializeListHead(&drivers);
+    InitializeListHead(&core_drivers);
+
+#ifdef _X86_
+    // load kernel at 81800000, to match Windows
+    // FIXME - make sure no overlap! Load registry before kernel, and only then errata.inf?
+
+    va2 = (void*)0x81800000;
+#elif defined(__x86_64__)
+    va2 = (void*)0xfffff80800000000;
+#endif
+
+    reserve_image_region(bs);
+
+    // leave relocating until we've read everything in, so it can be done on all processors at once
+    if (cmdline->parallel_load)
+        pe->DeferRelocations(true);
+
+    if (cmdline->verify != VERIFY_NONE)
+        pe->HashFiles(true);
+
+    if (cmdline->verify == VERIFY_HASH) {
+        Status = load_allowed_hashes(bs);
+        if (EFI_ERROR(Status)) {
+            print_error("load_allowed_hashes", Status);
+            goto end;
+        }
+    }
+
+    Status = load_kernel(_CR(images.Flink, image, list_entry), pe, va2, system32, cmdline);
+    if (EFI_ERROR(Status)) {
+        print_error("load_kernel", Status);
+        goto end;
+    }
+
+    Status = _CR(images.Flink, image, list_entry)->img->GetVersion(_CR(images.Flink, image, list_entry)->img, &version_ms, &version_ls);
+    if (EFI_ERROR(Status)) {
+        print_error("GetVersion", Status);
+        goto end;
+    }
+
+    version = ((version_ms >> 16) << 8) | (version_ms & 0xff);
+    build = version_ls >> 16;
+    revision = version_ls & 0xffff;
+
+    // Some checked builds have the wrong version number
+    if (build == 9200)
+        version = _WIN32_WINNT_WIN8;
+    else if (build == 9600)
+        version = _WIN32_WINNT_WINBLUE;
+    else if (version == 0x0700)
+        version = _WIN32_WINNT_WIN7;
+
+    {
+        char s[255], *p;
+
+        p = stpcpy(s, "Booting NT version ");
+        p = dec_to_str(p, version >> 8);
+        p = stpcpy(p, ".");
+        p = dec_to_str(p, version & 0xff);
+        p = stpcpy(p, ".");
+        p = dec_to_str(p, build);
+        p = stpcpy(p, ".");
+        p = dec_to_str(p, revision);
+        p = stpcpy(p, ".\n");
+
+        print_string(s);
+    }
+
+
+    Status = load_registry(bs, system32, reg, &registry, &reg_size, &images, &drivers, &mappings, &va, version, build,
+                           windir, &core_drivers, fs_driver, cmdline->compact_hive);
+    if (EFI_ERROR(Status)) {
+        print_error("load_registry", Status);
+        goto end;
+    }
+
+#if 0
+    Status = set_video_mode(bs, image_handle);
+    if (EFI_ERROR(Status)) {
+        print_error("set_video_mode", Status);
+        goto end;
+    }
+#endif
+    // FIXME - make sure va doesn't collide with identity-mapped EFI space
+
+    if (version >= _WIN32_WINNT_WIN8) {
+        Status = load_api_set(bs, &images, pe, system32, &va, version, &mappings, cmdline);
+        if (EFI_ERROR(Status)) {
+            print_error("load_api_set", Status);
+            goto end;
+        }
+    }
+
+    if (version >= _WIN32_WINNT_WINBLUE) {
+        Status = add_image(bs, &images, L"crashdmp.sys", LoaderSystemCode, drivers_dir_path, false, NULL, 0, false);
+        if (EFI_ERROR(Status)) {
+            print_error("add_image", Status);
+            goto end;
+        }
+    }
+
+    va = va2;
+
+    Status = open_file(windir, &drivers_dir, drivers_dir_path);
+    if (EFI_ERROR(Status))
+        drivers_dir = NULL;
+    else
+        add_preload_dir(drivers_dir, drivers_dir_path);
+
+    if (kernel_cache_allowed(cmdline)) {
+        // the API set schema decides which DLLs the imports end up pointing to
+        if (version >= _WIN32_WINNT_WIN8) {
+            Status = get_image_file_key(windir, NULL, L"system32", L"ApiSetSchema.dll", &apiset_file_size,
+                                        &apiset_file_time, &apiset_file_checksum);
+            if (EFI_ERROR(Status)) {
+                print_error("get_image_file_key", Status);
+                cmdline->kernel_cache = false;
+            }
+        } else {
+            apiset_file_size = 0;
+            memset(&apiset_file_time, 0, sizeof(EFI_TIME));
+            apiset_file_checksum = 0;
+        }
+    }
+
+    if (kernel_cache_allowed(cmdline)) {
+
+        le = images.Flink;
+        while (le != &images) {
+            image* img = _CR(le, image, list_entry);
+
+            img->early = img->img != NULL;
+
+            le = le->Flink;
+        }
+
+        kernel_cache_hit = load_kernel_cache(bs, windir, drivers_dir, pe, va2);
+    }
+
+#ifdef IMAGE_STATS
+    imports_start = __rdtsc();
+    imports_load_cycles = image_stats.load_cycles;
+#endif
+
+    le = images.Flink;
+    while (le != &images) {
+        image* img = _CR(le, image, list_entry);
+
+        // FIXME - if we fail opening a driver, fail according to ErrorType value (FS driver should be uber-fail?)
 
         if (!img->img) {
             bool is_driver_dir = false;
@@ -3894,8 +5154,11 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
                     goto end;
                 }
 
+                add_preload_dir(dir, img->dir);
+
                 Status = load_image(img, img->name, pe, va, dir, cmdline, build);
 
+                remove_preload_dir(dir);
                 dir->Close(dir);
 
                 if (Status == EFI_NOT_FOUND)
@@ -3912,193 +5175,90 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
             UINT32 size = img->img->GetSize(img->img);
 
             if ((size % EFI_PAGE_SIZE) != 0)
-                size = ((size / EFI_PAGE_SIZE) + 1) * EFI_PAGE_SIZE;
-
-            va = (uint8_t*)va + size;
-        }
-
-        {
-            EFI_IMPORT_LIST list;
-            UINTN size;
-
-            size = sizeof(list);
-
-            Status = img->img->ListImports(img->img, &list, &size);
-            if (Status == EFI_BUFFER_TOO_SMALL) {
-                Status = bs->AllocatePool(EfiLoaderData, size, (void**)&img->import_list);
-                if (EFI_ERROR(Status)) {
-                    print_error("AllocatePool", Status);
-                    goto end;
-                }
-
-                Status = img->img->ListImports(img->img, img->import_list, &size);
-                if (EFI_ERROR(Status)) {
-                    print_error("img->ListImports", Status);
-                    goto end;
-                }
-
-                for (unsigned int i = 0; i < img->import_list->NumberOfImports; i++) {
-                    WCHAR s[MAX_PATH];
-                    unsigned int j;
-                    char* name = (char*)((uint8_t*)img->import_list + img->import_list->Imports[i]);
-
-                    // FIXME - check length
-
-                    j = 0;
-                    do {
-                        s[j] = name[j];
-                        j++;
-                    } while (name[j] != 0);
-
-                    s[j] = 0;
-
-                    // API set DLLs
-                    if (version >= _WIN32_WINNT_WIN8 && (s[0] == 'E' || s[0] == 'e') && (s[1] == 'X' || s[1] == 'x') &&
-                        (s[2] == 'T' || s[2] == 't') && s[3] == '-') {
-                        WCHAR newname[MAX_PATH];
-
-                        if (!search_api_set(s, newname, version))
-                            continue;
-
-                        {
-                            char t[255], *p;
-
-                            p = stpcpy(t, "Using ");
-                            p = stpcpy_utf16(p, newname);
-                            p = stpcpy(p, " instead of ");
-                            p = stpcpy_utf16(p, s);
-                            p = stpcpy(p, ".\n");
-
-                            print_string(t);
-                        }
-
-                        wcsncpy(s, newname, sizeof(s) / sizeof(WCHAR));
-                    }
-
-                    {
-                        LIST_ENTRY* le2 = images.Flink;
-                        bool found = false;
-                        bool no_reloc = img->no_reloc;
-
-                        if (le == &images || le == images.Flink || img->no_reloc) // kernel or HAL
-                            no_reloc = true;
-
-                        while (le2 != &images) {
-                            image* img2 = _CR(le2, image, list_entry);
-
-                            if (!wcsicmp(s, img2->name)) {
-                                found = true;
-
-                                if (no_reloc)
-                                    img2->no_reloc = true;
-
-                                if (img2->order >= img->order)
-                                    img2->order = img->order == 0 ? 0 : img->order - 1;
-
-                                break;
-                            }
-
-                            le2 = le2->Flink;
-                        }
-
-                        if (!found) {
-                            Status = add_image(bs, &images, s, LoaderSystemCode, img->dir, true, NULL, img->order == 0 ? 0 : img->order - 1, no_reloc);
-                            if (EFI_ERROR(Status))
-                                print_error("add_image", Status);
-                        }
-                    }
-                }
-            } else if (EFI_ERROR(Status)) {
-                print_error("img->ListImports", Status);
-                goto end;
-            }
-        }
-
-        le = le->Flink;
-    }
-
-    if (drivers_dir)
-        drivers_dir->Close(drivers_dir);
-
-    if (IsListEmpty(&images)) {
-        print_string("Error - no images loaded.\n");
-        Status = EFI_INVALID_PARAMETER;
-        goto end;
-    }
-
-    fix_image_order(&images);
-
-    le = images.Flink;
-    while (le != &images) {
-        image* img = _CR(le, image, list_entry);
+                size = ((size / EFI_PAGE_SIZE) + 1) * EFI_PAGE_SIZE;
+
+            va = (uint8_t*)va + size;
+        }
 
-        if (!img->import_list) {
+        // imports were already resolved when the cache was written
+        if (img->cached) {
             le = le->Flink;
             continue;
         }
 
-        for (unsigned int i = 0; i < img->import_list->NumberOfImports; i++) {
-            WCHAR s[MAX_PATH];
-            unsigned int j;
-            char* name = (char*)((uint8_t*)img->import_list + img->import_list->Imports[i]);
-
-            j = 0;
-            do {
-                s[j] = name[j];
-                j++;
-            } while (name[j] != 0);
+        Status = add_image_imports(bs, &images, img, version);
+        if (EFI_ERROR(Status)) {
+            print_error("add_image_imports", Status);
+            goto end;
+        }
 
-            s[j] = 0;
+        le = le->Flink;
+    }
 
-            if (version >= _WIN32_WINNT_WIN8 && (s[0] == 'E' || s[0] == 'e') && (s[1] == 'X' || s[1] == 'x') &&
-                (s[2] == 'T' || s[2] == 't') && s[3] == '-') {
-                WCHAR newname[MAX_PATH];
+#ifdef IMAGE_STATS
+    // don't count the time spent loading images, which is counted separately
+    image_stats.imports_cycles = __rdtsc() - imports_start - (image_stats.load_cycles - imports_load_cycles);
+#endif
 
-                if (!search_api_set(s, newname, version))
-                    continue;
+    if (cmdline->parallel_load) {
+#ifdef IMAGE_STATS
+        uint64_t prepare_start = __rdtsc();
+#endif
 
-                wcsncpy(s, newname, sizeof(s) / sizeof(WCHAR));
-            }
+        pe->DeferRelocations(false);
 
-            {
-                LIST_ENTRY* le2 = images.Flink;
+        Status = prepare_images(bs, &images);
+        if (EFI_ERROR(Status)) {
+            print_error("prepare_images", Status);
+            goto end;
+        }
 
-                while (le2 != &images) {
-                    image* img2 = _CR(le2, image, list_entry);
+#ifdef IMAGE_STATS
+        image_stats.prepare_cycles = __rdtsc() - prepare_start;
+#endif
+    }
 
-                    if (!wcsicmp(s, img2->name)) {
-                        Status = img->img->ResolveImports(img->img, name, img2->img, resolve_forward);
-                        if (EFI_ERROR(Status)) {
-                            char t[255], *p;
+    if (drivers_dir)
+        drivers_dir->Close(drivers_dir);
 
-                            p = stpcpy(t, "Error when resolving imports for ");
-                            p = stpcpy_utf16(p, img->name);
-                            p = stpcpy(p, " and ");
-                            p = stpcpy_utf16(p, s);
-                            p = stpcpy(p, ".\n");
+    // everything that could have been preloaded has been loaded by now
+    free_preloaded_files(bs);
 
-                            print_string(t);
+    if (IsListEmpty(&images)) {
+        print_string("Error - no images loaded.\n");
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
+    }
 
-                            print_error("ResolveImports", Status);
-                            goto end;
-                        }
-                        break;
-                    }
+    fix_image_order(&images);
 
-                    le2 = le2->Flink;
-                }
-            }
-        }
+#ifdef IMAGE_STATS
+    resolve_start = __rdtsc();
+#endif
 
-        le = le->Flink;
+    Status = resolve_image_imports(&images, version);
+    if (EFI_ERROR(Status)) {
+        print_error("resolve_image_imports", Status);
+        goto end;
     }
 
+#ifdef IMAGE_STATS
+    image_stats.resolve_cycles = __rdtsc() - resolve_start;
+    resolve_start = __rdtsc();
+#endif
+
     Status = make_images_contiguous(bs, &images);
     if (EFI_ERROR(Status)) {
         print_error("make_images_contiguous", Status);
         goto end;
     }
 
+#ifdef IMAGE_STATS
+    image_stats.contiguous_cycles = __rdtsc() - resolve_start;
+
+    print_image_stats(&images);
+#endif
+
     // avoid problems caused by large pages, by shunting virtual address
     // to next 4MB boundary
     va = (uint8_t*)va + (0x400000 - ((uintptr_t)va % 0x400000));
@@ -4494,6 +5654,20 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     root->Close(root);
 
+    if (prefetch_proto) {
+        Status = save_prefetch_manifest(bs);
+        if (EFI_ERROR(Status))
+            print_error("save_prefetch_manifest", Status); // non-fatal
+    }
+
+    if (kernel_cache_allowed(cmdline) && !kernel_cache_hit) {
+        Status = save_kernel_cache(bs, va2);
+        if (EFI_ERROR(Status))
+            print_error("save_kernel_cache", Status); // non-fatal
+        else
+            print_string("Saved kernel cache.\n");
+    }
+
     if (kdstub_export_loaded && kdnet_scratch) {
         Status = add_mapping(bs, &mappings, va, kdnet_scratch,
                              PAGE_COUNT(store->debug_device_descriptor.TransportData.HwContextSize), LoaderFirmwarePermanent);
@@ -4535,6 +5709,8 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 
     fix_store_mapping(store, store_va, &mappings, version, build);
 
+    large_pages = cmdline->large_pages;
+
     Status = enable_paging(image_handle, bs, &mappings, block1a, va, loader_pages_spanned);
     if (EFI_ERROR(Status)) {
         print_error("enable_paging", Status);
@@ -4586,6 +5762,8 @@ static EFI_STATUS boot(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, EFI_FILE_
 #endif
 
 end:
+    free_preloaded_files(bs);
+
     if (windir) {
         EFI_STATUS Status2 = windir->Close(windir);
         if (EFI_ERROR(Status2))
@@ -4609,14 +5787,24 @@ end:
         bs->FreePool(img);
     }
 
-    while (!IsListEmpty(&mappings)) {
-        mapping* m = _CR(mappings.Flink, mapping, list_entry);
+    if (cmdline->parallel_load)
+        pe->DeferRelocations(false);
 
-        RemoveEntryList(&m->list_entry);
+    if (cmdline->verify != VERIFY_NONE)
+        pe->HashFiles(false);
 
-        bs->FreePool(m);
+    if (allowed_hashes) {
+        bs->FreePool(allowed_hashes);
+        allowed_hashes = NULL;
+        num_allowed_hashes = 0;
     }
 
+    init_images();
+
+    trim_image_region(bs, image_region.used);
+
+    free_mappings(bs, &mappings);
+
     return Status;
 }
 
@@ -5222,6 +6410,323 @@ static EFI_STATUS parse_arc_name(EFI_BOOT_SERVICES* bs, char* system_path, EFI_F
     return EFI_SUCCESS;
 }
 
+static void replace_option_slashes(char* options) {
+    // replace slashes in options with spaces
+    char* c = options;
+
+    while (*c != 0) {
+        if (*c == '/')
+            *c = ' ';
+
+        c++;
+    }
+}
+
+// Opens the root of the volume, or of the subvolume given by /SUBVOL.
+static EFI_STATUS open_root(EFI_BOOT_SERVICES* bs, EFI_HANDLE fs_handle, EFI_FILE_IO_INTERFACE* fs,
+                            command_line* cmdline, EFI_FILE_HANDLE* root) {
+    EFI_STATUS Status;
+
+    if (cmdline->subvol != 0) {
+        EFI_GUID open_subvol_guid = EFI_OPEN_SUBVOL_GUID;
+        EFI_OPEN_SUBVOL_PROTOCOL* open_subvol;
+
+        Status = bs->OpenProtocol(fs_handle, &open_subvol_guid, (void**)&open_subvol, image_handle, NULL,
+                                  EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+
+        if (EFI_ERROR(Status)) {
+            print_string("Could not open EFI_OPEN_SUBVOL_PROTOCOL on filesystem driver.\n");
+            print_error("OpenProtocol", Status);
+        } else {
+            Status = open_subvol->OpenSubvol(open_subvol, cmdline->subvol, root);
+            if (!EFI_ERROR(Status))
+                return Status;
+
+            print_error("OpenSubvol", Status);
+        }
+    }
+
+    Status = fs->OpenVolume(fs, root);
+    if (EFI_ERROR(Status))
+        print_error("OpenVolume", Status);
+
+    return Status;
+}
+
+// State kept by preload_option between calls from the menu.
+typedef struct {
+    boot_option* opt;
+    unsigned int stage;
+    EFI_HANDLE fs_handle;
+    EFI_FILE_HANDLE root;
+    EFI_FILE_HANDLE windir;
+    EFI_FILE_HANDLE system32;
+    WCHAR* windir_path;
+    command_line cmdline;
+    EFI_REGISTRY_HIVE* hive;
+    HKEY services;
+    UINT32 position;
+} preload_state;
+
+#define PRELOAD_VOLUME 0
+#define PRELOAD_HIVE 1
+#define PRELOAD_KERNEL 2
+#define PRELOAD_DRIVERS 3
+#define PRELOAD_DONE 4
+
+static preload_state preload;
+
+// Opens the entry's volume, which makes the filesystem driver load its chunk tree, and its
+// Windows directory, and starts the prefetch if it has /PREFETCH.
+static EFI_STATUS preload_volume(EFI_BOOT_SERVICES* bs, boot_option* opt) {
+    EFI_STATUS Status;
+    EFI_FILE_IO_INTERFACE* fs;
+    char* arc_name;
+    char* path;
+    unsigned int pathlen, pathwlen;
+
+    if (!opt->system_path)
+        return EFI_INVALID_PARAMETER;
+
+    Status = parse_arc_name(bs, opt->system_path, &fs, &arc_name, &path, &preload.fs_handle);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    bs->FreePool(arc_name);
+
+    if (opt->options) {
+        replace_option_slashes(opt->options);
+        parse_options(opt->options, &preload.cmdline);
+    }
+
+    if (preload.cmdline.prefetch) {
+        WCHAR manifest[PREFETCH_MANIFEST_NAME_LEN];
+
+        get_prefetch_manifest_name(opt, &preload.cmdline, manifest);
+        start_prefetch(bs, preload.fs_handle, manifest);
+    }
+
+    Status = open_root(bs, preload.fs_handle, fs, &preload.cmdline, &preload.root);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    pathlen = strlen(path);
+    pathwlen = UTF8_TO_UTF16_MAX(pathlen);
+
+    Status = bs->AllocatePool(EfiLoaderData, pathwlen + sizeof(WCHAR), (void**)&preload.windir_path);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = utf8_to_utf16(preload.windir_path, pathwlen, &pathwlen, path, pathlen);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    preload.windir_path[pathwlen / sizeof(WCHAR)] = 0;
+
+    Status = open_file(preload.root, &preload.windir, preload.windir_path);
+    if (EFI_ERROR(Status)) {
+        preload.windir = NULL;
+        return Status;
+    }
+
+    Status = open_file(preload.windir, &preload.system32, L"system32");
+    if (EFI_ERROR(Status)) {
+        preload.system32 = NULL;
+        return Status;
+    }
+
+    add_preload_dir(preload.windir, L"");
+    add_preload_dir(preload.system32, L"system32");
+
+    return EFI_SUCCESS;
+}
+
+// Reads the SYSTEM hive, and opens it to find the boot drivers.
+static EFI_STATUS preload_hive(EFI_BOOT_SERVICES* bs) {
+    EFI_STATUS Status;
+    EFI_REGISTRY_PROTOCOL* reg;
+    EFI_FILE_HANDLE file;
+    HKEY rootkey, ccs;
+
+    Status = preload_file(bs, preload.system32, L"system32", L"config\\SYSTEM");
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = load_reg_proto(bs, image_handle, &reg);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    // this is the copy we've just read
+    Status = open_file(preload.system32, &file, L"config\\SYSTEM");
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = reg->OpenHive(file, &preload.hive);
+
+    file->Close(file);
+
+    if (EFI_ERROR(Status)) {
+        preload.hive = NULL;
+        return Status;
+    }
+
+    Status = preload.hive->FindRoot(preload.hive, &rootkey);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = find_current_control_set(preload.hive, rootkey, &ccs);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = preload.hive->FindKey(preload.hive, ccs, L"Services", &preload.services);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    preload.position = 0;
+
+    return EFI_SUCCESS;
+}
+
+static void preload_kernel(EFI_BOOT_SERVICES* bs) {
+    // Not finding these isn't an error here, as we might be trying the wrong name - the
+    // boot proper will sort it out.
+
+    preload_file(bs, preload.system32, L"system32", preload.cmdline.kernel ? preload.cmdline.kernel : L"ntoskrnl.exe");
+    preload_file(bs, preload.system32, L"system32", preload.cmdline.hal ? preload.cmdline.hal : L"hal.dll");
+}
+
+// Reads the next boot driver listed in the hive. Returns EFI_NOT_FOUND once there are no more.
+// This doesn't look at StartOverride or at the filesystem driver, so load_drivers may still
+// load a few from disk.
+static EFI_STATUS preload_next_driver(EFI_BOOT_SERVICES* bs) {
+    EFI_STATUS Status;
+    WCHAR name[255];
+
+    do {
+        HKEY key;
+        EFI_REGISTRY_VALUE_QUERY values[3];
+        uint32_t type, start;
+        WCHAR image_path[MAX_PATH];
+
+        Status = preload.hive->NextKey(preload.hive, preload.services, &preload.position, &key, name,
+                                       sizeof(name) / sizeof(WCHAR));
+        if (Status == EFI_BUFFER_TOO_SMALL)
+            continue;
+        else if (EFI_ERROR(Status))
+            return Status;
+
+        values[0].Name = L"Type";
+        values[1].Name = L"Start";
+        values[2].Name = L"ImagePath";
+
+        Status = preload.hive->QueryValues(preload.hive, key, values, sizeof(values) / sizeof(values[0]));
+        if (EFI_ERROR(Status))
+            continue;
+
+        if (!get_dword_value(&values[0], &type) || (type != SERVICE_KERNEL_DRIVER && type != SERVICE_FILE_SYSTEM_DRIVER))
+            continue;
+
+        if (!get_dword_value(&values[1], &start) || start != SERVICE_BOOT_START)
+            continue;
+
+        get_service_image_path(&values[2], name, image_path);
+
+        preload_file(bs, preload.windir, L"", image_path);
+
+        return EFI_SUCCESS;
+    } while (true);
+}
+
+// Called from the menu while the timeout is running, to make a start on the default entry.
+// Each call does a little more, so that the menu can keep counting down and checking for
+// keypresses in between, and returns false once there's nothing left to do. Anything done
+// here has to be harmless if the user picks something else: files are only read into memory,
+// for boot to use if the entry it's given is this one.
+bool preload_option(EFI_BOOT_SERVICES* bs, boot_option* opt) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (preload.opt != opt) {
+        if (preload.opt)
+            return false;
+
+        preload.opt = opt;
+        preload.stage = PRELOAD_VOLUME;
+    }
+
+    // don't scribble over the menu
+    print_quiet = true;
+
+    if (preload.stage == PRELOAD_VOLUME)
+        Status = preload_volume(bs, opt);
+    else if (preload.stage == PRELOAD_HIVE)
+        Status = preload_hive(bs);
+    else if (preload.stage == PRELOAD_KERNEL)
+        preload_kernel(bs);
+    else if (preload.stage == PRELOAD_DRIVERS) {
+        Status = preload_next_driver(bs);
+
+        // stay on this stage until we run out of drivers
+        if (!EFI_ERROR(Status)) {
+            print_quiet = false;
+            return true;
+        }
+    }
+
+    print_quiet = false;
+
+    if (EFI_ERROR(Status) || preload.stage == PRELOAD_DRIVERS)
+        preload.stage = PRELOAD_DONE;
+    else if (preload.stage != PRELOAD_DONE)
+        preload.stage++;
+
+    return preload.stage != PRELOAD_DONE;
+}
+
+// Closes everything preload_option had open. The files it read are kept if free_files is
+// false, for boot to use.
+static void end_preload(EFI_BOOT_SERVICES* bs, bool free_files) {
+    EFI_GUID guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+
+    if (!preload.opt)
+        return;
+
+    if (preload.hive)
+        preload.hive->Close(preload.hive);
+
+    if (preload.system32) {
+        remove_preload_dir(preload.system32);
+        preload.system32->Close(preload.system32);
+    }
+
+    if (preload.windir) {
+        remove_preload_dir(preload.windir);
+        preload.windir->Close(preload.windir);
+    }
+
+    if (preload.root)
+        preload.root->Close(preload.root);
+
+    if (preload.windir_path)
+        bs->FreePool(preload.windir_path);
+
+    if (preload.cmdline.debug_type)
+        bs->FreePool(preload.cmdline.debug_type);
+
+    if (preload.cmdline.hal)
+        bs->FreePool(preload.cmdline.hal);
+
+    if (preload.cmdline.kernel)
+        bs->FreePool(preload.cmdline.kernel);
+
+    if (preload.fs_handle)
+        bs->CloseProtocol(preload.fs_handle, &guid, image_handle, NULL);
+
+    if (free_files)
+        free_preloaded_files(bs);
+
+    memset(&preload, 0, sizeof(preload));
+}
+
 static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle) {
     EFI_STATUS Status;
     UINTN Event;
@@ -5238,8 +6743,14 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
     command_line cmdline;
     EFI_FILE_HANDLE root = NULL;
     WCHAR* fs_driver = NULL;
+    WCHAR manifest[PREFETCH_MANIFEST_NAME_LEN];
 
     Status = show_menu(systable, &opt);
+
+    // throw away anything the menu preloaded for a different entry
+    if (EFI_ERROR(Status) || preload.opt != opt)
+        end_preload(bs, true);
+
     if (Status == EFI_ABORTED)
         return;
     else if (EFI_ERROR(Status)) {
@@ -5259,17 +6770,7 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
         return;
     }
 
-    {
-        // replace slashes in options with spaces
-        char* c = opt->options;
-
-        while (*c != 0) {
-            if (*c == '/')
-                *c = ' ';
-
-            c++;
-        }
-    }
+    replace_option_slashes(opt->options);
 
     Status = load_reg_proto(bs, image_handle, &reg);
     if (EFI_ERROR(Status)) {
@@ -5361,35 +6862,34 @@ static void EFIAPI stack_changed(EFI_BOOT_SERVICES* bs, EFI_HANDLE image_handle)
 
     if (opt->options)
         parse_options(opt->options, &cmdline);
+    else
+        memset(&cmdline, 0, sizeof(command_line));
 
-    if (cmdline.subvol != 0) {
-        EFI_GUID open_subvol_guid = EFI_OPEN_SUBVOL_GUID;
-        EFI_OPEN_SUBVOL_PROTOCOL* open_subvol;
-
-        Status = bs->OpenProtocol(fs_handle, &open_subvol_guid, (void**)&open_subvol, image_handle, NULL,
-                                  EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+    get_prefetch_manifest_name(opt, &cmdline, manifest);
 
-        if (EFI_ERROR(Status)) {
-            print_string("Could not open EFI_OPEN_SUBVOL_PROTOCOL on filesystem driver.\n");
-            print_error("OpenProtocol", Status);
-        } else {
-            Status = open_subvol->OpenSubvol(open_subvol, cmdline.subvol, &root);
-            if (EFI_ERROR(Status))
-                print_error("OpenSubvol", Status);
-        }
+    // discard any prefetching the menu started that doesn't apply to this entry
+    if (prefetch_proto && (!cmdline.prefetch || prefetch_handle != fs_handle || wcsicmp(prefetch_manifest, manifest))) {
+        prefetch_proto->Record(prefetch_proto, false);
+        prefetch_proto = NULL;
+        prefetch_handle = NULL;
     }
 
-    if (!root) {
-        Status = fs->OpenVolume(fs, &root);
-        if (EFI_ERROR(Status)) {
-            print_error("OpenVolume", Status);
-            bs->FreePool(arc_name);
-            bs->CloseProtocol(fs_handle, &quibble_guid, image_handle, NULL);
-            bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
-            return;
-        }
+    if (cmdline.prefetch && !prefetch_proto)
+        start_prefetch(bs, fs_handle, manifest);
+
+    Status = open_root(bs, fs_handle, fs, &cmdline, &root);
+    if (EFI_ERROR(Status)) {
+        end_preload(bs, true);
+        bs->FreePool(arc_name);
+        bs->CloseProtocol(fs_handle, &quibble_guid, image_handle, NULL);
+        bs->WaitForEvent(1, &systable->ConIn->WaitForKey, &Event);
+        return;
     }
 
+    // Now our own root is open, the menu's handles can be closed without the filesystem driver
+    // thinking it's finished with the volume.
+    end_preload(bs, false);
+
     Status = boot(image_handle, bs, root, opt->options, path, arc_name, pe, reg, &cmdline, fs_driver);
 
     // shouldn't return
@@ -5517,7 +7017,12 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable
         goto end2;
     }
 
+#ifdef IMAGE_STATS
+    // fixed seed, so that security cookies and hence image checksums are the same every boot
+    Status = pe_register(systable->BootServices, 0);
+#else
     Status = pe_register(systable->BootServices, get_random_seed());
+#endif
     if (EFI_ERROR(Status)) {
         print_string("Error registering PE loader protocol.\n");
         goto end;
@@ -0,0 +1,546 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <string.h>
+#include "quibble.h"
+#include "misc.h"
+#include "print.h"
+
+// Opening and reading files by path. This is separate from boot.c, so that it can be built
+// for the host and run against the Btrfs driver there.
+
+#define MAX_PRELOAD_DIRS 8
+
+typedef struct {
+    LIST_ENTRY list_entry;
+    WCHAR* path;
+    void* data;
+    size_t size;
+    EFI_FILE_INFO* info;
+} preloaded_file;
+
+typedef struct {
+    EFI_FILE_PROTOCOL proto;
+    EFI_BOOT_SERVICES* bs;
+    preloaded_file* pf;
+    uint64_t position;
+} preloaded_handle;
+
+typedef struct {
+    EFI_FILE_HANDLE dir;
+    const WCHAR* path;
+} preload_dir;
+
+static LIST_ENTRY preloaded_files = { &preloaded_files, &preloaded_files };
+static preload_dir preload_dirs[MAX_PRELOAD_DIRS];
+static unsigned int num_preload_dirs = 0;
+static EFI_BOOT_SERVICES* preload_bs;
+
+static EFI_STATUS open_preloaded_file(EFI_FILE_HANDLE dir, EFI_FILE_HANDLE* file, const WCHAR* name);
+
+static EFI_STATUS open_file_case_insensitive(EFI_FILE_HANDLE dir, WCHAR** pname, EFI_FILE_HANDLE* h) {
+    EFI_STATUS Status;
+    unsigned int len, bs;
+    UINTN size;
+    WCHAR* name = *pname;
+    WCHAR tmp[MAX_PATH];
+
+    len = wcslen(name);
+    bs = len;
+
+    for (unsigned int i = 0; i < len; i++) {
+        if (name[i] == '\\') {
+            bs = i;
+            break;
+        }
+    }
+
+    memcpy(tmp, name, bs * sizeof(WCHAR));
+    tmp[bs] = 0;
+
+    Status = dir->Open(dir, h, tmp, EFI_FILE_MODE_READ, 0);
+    if (Status != EFI_NOT_FOUND) {
+        if (name[bs] == 0)
+            *pname = &name[bs];
+        else
+            *pname = &name[bs + 1];
+
+        return Status;
+    }
+
+    Status = dir->SetPosition(dir, 0);
+    if (EFI_ERROR(Status)) {
+        print_error("dir->SetPosition", Status);
+        return Status;
+    }
+
+    do {
+        WCHAR* fn;
+        WCHAR buf[1024];
+
+        size = sizeof(buf);
+
+        Status = dir->Read(dir, &size, buf);
+        if (EFI_ERROR(Status)) {
+            print_error("dir->Read", Status);
+            return Status;
+        }
+
+        if (size == 0)
+            break;
+
+        fn = ((EFI_FILE_INFO*)buf)->FileName;
+
+        if (!wcsicmp(tmp, fn)) {
+            if (name[bs] == 0)
+                *pname = &name[bs];
+            else
+                *pname = &name[bs + 1];
+
+            return dir->Open(dir, h, fn, EFI_FILE_MODE_READ, 0);
+        }
+    } while (true);
+
+    return EFI_NOT_FOUND;
+}
+
+EFI_STATUS open_file(EFI_FILE_HANDLE dir, EFI_FILE_HANDLE* h, const WCHAR* name) {
+    EFI_FILE_HANDLE orig_dir = dir;
+    EFI_STATUS Status;
+
+    if (!IsListEmpty(&preloaded_files)) {
+        Status = open_preloaded_file(dir, h, name);
+        if (Status != EFI_NOT_FOUND)
+            return Status;
+    }
+
+    Status = dir->Open(dir, h, (WCHAR*)name, EFI_FILE_MODE_READ, 0);
+    if (Status != EFI_NOT_FOUND)
+        return Status;
+
+    while (name[0] != 0) {
+        Status = open_file_case_insensitive(dir, (WCHAR**)&name, h);
+        if (EFI_ERROR(Status)) {
+            if (dir != orig_dir)
+                dir->Close(dir);
+
+            return Status;
+        }
+
+        if (dir != orig_dir)
+            dir->Close(dir);
+
+        if (name[0] == 0)
+            return EFI_SUCCESS;
+
+        dir = *h;
+    }
+
+    return EFI_INVALID_PARAMETER;
+}
+
+static EFI_STATUS get_file_info(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE file, EFI_FILE_INFO** info) {
+    EFI_STATUS Status;
+    EFI_GUID guid = EFI_FILE_INFO_ID;
+    UINTN size = 0;
+
+    Status = file->GetInfo(file, &guid, &size, NULL);
+    if (Status != EFI_BUFFER_TOO_SMALL) {
+        if (!EFI_ERROR(Status))
+            Status = EFI_INVALID_PARAMETER;
+
+        print_error("file->GetInfo", Status);
+        return Status;
+    }
+
+    Status = bs->AllocatePool(EfiLoaderData, size, (void**)info);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    Status = file->GetInfo(file, &guid, &size, *info);
+    if (EFI_ERROR(Status)) {
+        print_error("file->GetInfo", Status);
+        bs->FreePool(*info);
+        return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS read_whole_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE file, EFI_MEMORY_TYPE memory_type,
+                                  size_t file_size, void** data) {
+    EFI_STATUS Status;
+    size_t pages;
+    EFI_PHYSICAL_ADDRESS addr;
+    UINTN read_size;
+
+    pages = file_size / EFI_PAGE_SIZE;
+    if (file_size % EFI_PAGE_SIZE != 0)
+        pages++;
+
+    if (pages == 0)
+        return EFI_INVALID_PARAMETER;
+
+    Status = bs->AllocatePages(AllocateAnyPages, memory_type, pages, &addr);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePages", Status);
+        return Status;
+    }
+
+    *data = (uint8_t*)(uintptr_t)addr;
+
+    read_size = pages * EFI_PAGE_SIZE;
+
+    Status = file->Read(file, &read_size, *data);
+    if (EFI_ERROR(Status)) {
+        print_error("file->Read", Status);
+        bs->FreePages(addr, pages);
+        return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS read_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const WCHAR* name, void** data, size_t* size) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE file;
+    EFI_FILE_INFO* info;
+    size_t file_size;
+
+    Status = open_file(dir, &file, name);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = get_file_info(bs, file, &info);
+    if (EFI_ERROR(Status)) {
+        file->Close(file);
+        return Status;
+    }
+
+    file_size = info->FileSize;
+
+    bs->FreePool(info);
+
+    Status = read_whole_file(bs, file, EfiLoaderData, file_size, data);
+    if (EFI_ERROR(Status)) {
+        file->Close(file);
+        return Status;
+    }
+
+    *size = file_size;
+
+    file->Close(file);
+
+    return EFI_SUCCESS;
+}
+
+// Files read by preload_file while the boot menu was waiting, keyed by their path relative to
+// the Windows directory. open_file hands these out from memory rather than opening them again,
+// when the directory it's given is one it's been told the path of by add_preload_dir.
+
+static bool join_path(WCHAR* dest, const WCHAR* dir_path, const WCHAR* name) {
+    size_t dir_len = wcslen(dir_path), name_len = wcslen(name);
+
+    if (dir_len + 1 + name_len + 1 > MAX_PATH)
+        return false;
+
+    if (dir_len == 0) {
+        memcpy(dest, name, (name_len + 1) * sizeof(WCHAR));
+        return true;
+    }
+
+    memcpy(dest, dir_path, dir_len * sizeof(WCHAR));
+    dest[dir_len] = '\\';
+    memcpy(&dest[dir_len + 1], name, (name_len + 1) * sizeof(WCHAR));
+
+    return true;
+}
+
+static preloaded_file* find_preloaded_file(const WCHAR* path) {
+    LIST_ENTRY* le = preloaded_files.Flink;
+
+    while (le != &preloaded_files) {
+        preloaded_file* pf = _CR(le, preloaded_file, list_entry);
+
+        if (!wcsicmp(pf->path, path))
+            return pf;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+static EFI_STATUS EFIAPI preloaded_open(struct _EFI_FILE_HANDLE* File, struct _EFI_FILE_HANDLE** NewHandle,
+                                        CHAR16* FileName, UINT64 OpenMode, UINT64 Attributes) {
+    UNUSED(File);
+    UNUSED(NewHandle);
+    UNUSED(FileName);
+    UNUSED(OpenMode);
+    UNUSED(Attributes);
+
+    return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI preloaded_close(struct _EFI_FILE_HANDLE* File) {
+    preloaded_handle* h = _CR(File, preloaded_handle, proto);
+
+    h->bs->FreePool(h);
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI preloaded_delete(struct _EFI_FILE_HANDLE* File) {
+    UNUSED(File);
+
+    return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS EFIAPI preloaded_read(struct _EFI_FILE_HANDLE* File, UINTN* BufferSize, VOID* Buffer) {
+    preloaded_handle* h = _CR(File, preloaded_handle, proto);
+
+    if (h->position >= h->pf->size) {
+        *BufferSize = 0;
+        return EFI_SUCCESS;
+    }
+
+    if (*BufferSize > h->pf->size - h->position)
+        *BufferSize = (UINTN)(h->pf->size - h->position);
+
+    memcpy(Buffer, (uint8_t*)h->pf->data + h->position, *BufferSize);
+
+    h->position += *BufferSize;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI preloaded_write(struct _EFI_FILE_HANDLE* File, UINTN* BufferSize, VOID* Buffer) {
+    UNUSED(File);
+    UNUSED(BufferSize);
+    UNUSED(Buffer);
+
+    return EFI_WRITE_PROTECTED;
+}
+
+static EFI_STATUS EFIAPI preloaded_get_position(struct _EFI_FILE_HANDLE* File, UINT64* Position) {
+    preloaded_handle* h = _CR(File, preloaded_handle, proto);
+
+    *Position = h->position;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI preloaded_set_position(struct _EFI_FILE_HANDLE* File, UINT64 Position) {
+    preloaded_handle* h = _CR(File, preloaded_handle, proto);
+
+    if (Position == 0xffffffffffffffff)
+        h->position = h->pf->size;
+    else
+        h->position = Position;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI preloaded_get_info(struct _EFI_FILE_HANDLE* File, EFI_GUID* InformationType,
+                                            UINTN* BufferSize, VOID* Buffer) {
+    preloaded_handle* h = _CR(File, preloaded_handle, proto);
+    EFI_GUID guid = EFI_FILE_INFO_ID;
+
+    if (memcmp(InformationType, &guid, sizeof(EFI_GUID)))
+        return EFI_UNSUPPORTED;
+
+    if (*BufferSize < h->pf->info->Size) {
+        *BufferSize = (UINTN)h->pf->info->Size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    memcpy(Buffer, h->pf->info, (size_t)h->pf->info->Size);
+    *BufferSize = (UINTN)h->pf->info->Size;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI preloaded_set_info(struct _EFI_FILE_HANDLE* File, EFI_GUID* InformationType,
+                                            UINTN BufferSize, VOID* Buffer) {
+    UNUSED(File);
+    UNUSED(InformationType);
+    UNUSED(BufferSize);
+    UNUSED(Buffer);
+
+    return EFI_WRITE_PROTECTED;
+}
+
+static EFI_STATUS EFIAPI preloaded_flush(struct _EFI_FILE_HANDLE* File) {
+    UNUSED(File);
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS open_preloaded_file(EFI_FILE_HANDLE dir, EFI_FILE_HANDLE* file, const WCHAR* name) {
+    EFI_STATUS Status;
+    WCHAR path[MAX_PATH];
+    preloaded_file* pf = NULL;
+    preloaded_handle* h;
+
+    for (unsigned int i = 0; i < num_preload_dirs; i++) {
+        if (preload_dirs[i].dir == dir) {
+            if (!join_path(path, preload_dirs[i].path, name))
+                return EFI_NOT_FOUND;
+
+            pf = find_preloaded_file(path);
+            break;
+        }
+    }
+
+    if (!pf)
+        return EFI_NOT_FOUND;
+
+    Status = preload_bs->AllocatePool(EfiLoaderData, sizeof(preloaded_handle), (void**)&h);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    memset(h, 0, sizeof(preloaded_handle));
+
+    h->proto.Revision = EFI_FILE_PROTOCOL_REVISION;
+    h->proto.Open = preloaded_open;
+    h->proto.Close = preloaded_close;
+    h->proto.Delete = preloaded_delete;
+    h->proto.Read = preloaded_read;
+    h->proto.Write = preloaded_write;
+    h->proto.GetPosition = preloaded_get_position;
+    h->proto.SetPosition = preloaded_set_position;
+    h->proto.GetInfo = preloaded_get_info;
+    h->proto.SetInfo = preloaded_set_info;
+    h->proto.Flush = preloaded_flush;
+    h->bs = preload_bs;
+    h->pf = pf;
+    h->position = 0;
+
+    *file = &h->proto;
+
+    return EFI_SUCCESS;
+}
+
+// Reads dir_path\name, where dir is the handle for dir_path, so that later calls to open_file
+// for it come from memory.
+EFI_STATUS preload_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const WCHAR* dir_path, const WCHAR* name) {
+    EFI_STATUS Status;
+    WCHAR path[MAX_PATH];
+    EFI_FILE_HANDLE file;
+    preloaded_file* pf;
+
+    if (!join_path(path, dir_path, name))
+        return EFI_INVALID_PARAMETER;
+
+    if (find_preloaded_file(path))
+        return EFI_SUCCESS;
+
+    preload_bs = bs;
+
+    Status = bs->AllocatePool(EfiBootServicesData, sizeof(preloaded_file), (void**)&pf);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    Status = bs->AllocatePool(EfiBootServicesData, (wcslen(path) + 1) * sizeof(WCHAR), (void**)&pf->path);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        bs->FreePool(pf);
+        return Status;
+    }
+
+    memcpy(pf->path, path, (wcslen(path) + 1) * sizeof(WCHAR));
+
+    Status = open_file(dir, &file, name);
+    if (EFI_ERROR(Status))
+        goto end;
+
+    Status = get_file_info(bs, file, &pf->info);
+    if (EFI_ERROR(Status)) {
+        file->Close(file);
+        goto end;
+    }
+
+    if (pf->info->Attribute & EFI_FILE_DIRECTORY) {
+        Status = EFI_INVALID_PARAMETER;
+        bs->FreePool(pf->info);
+        file->Close(file);
+        goto end;
+    }
+
+    pf->size = pf->info->FileSize;
+
+    Status = read_whole_file(bs, file, EfiBootServicesData, pf->size, &pf->data);
+
+    file->Close(file);
+
+    if (EFI_ERROR(Status)) {
+        bs->FreePool(pf->info);
+        goto end;
+    }
+
+    InsertTailList(&preloaded_files, &pf->list_entry);
+
+    return EFI_SUCCESS;
+
+end:
+    bs->FreePool(pf->path);
+    bs->FreePool(pf);
+
+    return Status;
+}
+
+void add_preload_dir(EFI_FILE_HANDLE dir, const WCHAR* path) {
+    if (num_preload_dirs == MAX_PRELOAD_DIRS)
+        return;
+
+    preload_dirs[num_preload_dirs].dir = dir;
+    preload_dirs[num_preload_dirs].path = path;
+    num_preload_dirs++;
+}
+
+void remove_preload_dir(EFI_FILE_HANDLE dir) {
+    for (unsigned int i = 0; i < num_preload_dirs; i++) {
+        if (preload_dirs[i].dir == dir) {
+            preload_dirs[i] = preload_dirs[num_preload_dirs - 1];
+            num_preload_dirs--;
+            return;
+        }
+    }
+}
+
+// Frees everything preload_file read, and forgets the directories given to add_preload_dir.
+void free_preloaded_files(EFI_BOOT_SERVICES* bs) {
+    while (!IsListEmpty(&preloaded_files)) {
+        preloaded_file* pf = _CR(preloaded_files.Flink, preloaded_file, list_entry);
+
+        RemoveEntryList(&pf->list_entry);
+
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)pf->data, (pf->size + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE);
+        bs->FreePool(pf->info);
+        bs->FreePool(pf->path);
+        bs->FreePool(pf);
+    }
+
+    num_preload_dirs = 0;
+}
@@ -0,0 +1,404 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <string.h>
+#include "quibble.h"
+#include "peload.h"
+#include "misc.h"
+#include "print.h"
+
+// The list of images we're going to load, and the hash tables used to look them up by name.
+// This is separate from boot.c, so that it can be built for the host and tested there.
+
+#define IMAGE_HASH_SIZE 64 // must be a power of two
+
+static image* image_hash[IMAGE_HASH_SIZE];
+static image* image_base_hash[IMAGE_HASH_SIZE];
+static unsigned int next_image_index;
+
+// Hashes an image name case-insensitively - if base is true, only up to the extension.
+static uint32_t image_name_hash(const WCHAR* name, bool base) {
+    uint32_t hash = 0;
+
+    while (*name != 0 && (!base || *name != '.')) {
+        WCHAR c = *name;
+
+        if (c >= 'a' && c <= 'z')
+            c = c - 'a' + 'A';
+
+        hash = (hash * 31) + c;
+        name++;
+    }
+
+    return hash;
+}
+
+static void index_image(image* img) {
+    image** ptr;
+
+    img->hash_next = NULL;
+    img->base_hash_next = NULL;
+
+    // add to the end of the chains, so that we find the first image of a name, as before
+
+    ptr = &image_hash[image_name_hash(img->name, false) & (IMAGE_HASH_SIZE - 1)];
+
+    while (*ptr) {
+        ptr = &(*ptr)->hash_next;
+    }
+
+    *ptr = img;
+
+    ptr = &image_base_hash[image_name_hash(img->name, true) & (IMAGE_HASH_SIZE - 1)];
+
+    while (*ptr) {
+        ptr = &(*ptr)->base_hash_next;
+    }
+
+    *ptr = img;
+}
+
+static image* find_image(const WCHAR* name) {
+    image* img = image_hash[image_name_hash(name, false) & (IMAGE_HASH_SIZE - 1)];
+
+    while (img) {
+        if (!wcsicmp(name, img->name))
+            return img;
+
+        img = img->hash_next;
+    }
+
+    return NULL;
+}
+
+// Finds an image by its name without the extension, as used by forwarders.
+static image* find_image_base(const WCHAR* base) {
+    image* img = image_base_hash[image_name_hash(base, true) & (IMAGE_HASH_SIZE - 1)];
+
+    while (img) {
+        unsigned int i = 0;
+
+        while (true) {
+            WCHAR c1 = img->name[i] == '.' ? 0 : img->name[i];
+            WCHAR c2 = base[i] == '.' ? 0 : base[i];
+
+            if (c1 >= 'a' && c1 <= 'z')
+                c1 = c1 - 'a' + 'A';
+
+            if (c2 >= 'a' && c2 <= 'z')
+                c2 = c2 - 'a' + 'A';
+
+            if (c1 != c2)
+                break;
+
+            if (c1 == 0)
+                return img;
+
+            i++;
+        }
+
+        img = img->base_hash_next;
+    }
+
+    return NULL;
+}
+
+EFI_STATUS add_image(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, const WCHAR* name, TYPE_OF_MEMORY memory_type,
+                     const WCHAR* dir, bool dll, BOOT_DRIVER_LIST_ENTRY* bdle, unsigned int order,
+                     bool no_reloc) {
+    EFI_STATUS Status;
+    image* img;
+
+    Status = bs->AllocatePool(EfiLoaderData, sizeof(image), (void**)&img);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    // FIXME - show error if name too long?
+
+    wcsncpy(img->name, name, sizeof(img->name) / sizeof(WCHAR));
+    wcsncpy(img->dir, dir, sizeof(img->dir) / sizeof(WCHAR));
+    InsertTailList(images, &img->list_entry);
+    index_image(img);
+
+    img->img = NULL;
+    img->import_list = NULL;
+    img->memory_type = memory_type;
+    img->dll = dll;
+    img->bdle = bdle;
+    img->order = order;
+    img->no_reloc = no_reloc;
+    img->index = next_image_index++;
+    img->file_size = 0;
+    memset(&img->file_time, 0, sizeof(EFI_TIME));
+    img->file_checksum = 0;
+    img->early = false;
+    img->cached = false;
+
+    return EFI_SUCCESS;
+}
+
+// Empties the hash tables - the images themselves belong to the caller's list.
+void init_images(void) {
+    memset(image_hash, 0, sizeof(image_hash));
+    memset(image_base_hash, 0, sizeof(image_base_hash));
+    next_image_index = 0;
+}
+
+// Looks through the imports of an image that's just been loaded, and adds any DLLs we've not
+// come across yet to the end of the list, so that the main loop in boot() gets to them.
+EFI_STATUS add_image_imports(EFI_BOOT_SERVICES* bs, LIST_ENTRY* images, image* img, uint16_t version) {
+    EFI_STATUS Status;
+    EFI_IMPORT_LIST list;
+    UINTN size;
+
+    size = sizeof(list);
+
+    Status = img->img->ListImports(img->img, &list, &size);
+    if (Status == EFI_BUFFER_TOO_SMALL) {
+        Status = bs->AllocatePool(EfiLoaderData, size, (void**)&img->import_list);
+        if (EFI_ERROR(Status)) {
+            print_error("AllocatePool", Status);
+            return Status;
+        }
+
+        Status = img->img->ListImports(img->img, img->import_list, &size);
+        if (EFI_ERROR(Status)) {
+            print_error("img->ListImports", Status);
+            return Status;
+        }
+
+        for (unsigned int i = 0; i < img->import_list->NumberOfImports; i++) {
+            WCHAR s[MAX_PATH];
+            unsigned int j;
+            char* name = (char*)((uint8_t*)img->import_list + img->import_list->Imports[i]);
+
+            // FIXME - check length
+
+            j = 0;
+            do {
+                s[j] = name[j];
+                j++;
+            } while (name[j] != 0);
+
+            s[j] = 0;
+
+            // API set DLLs
+            if (version >= _WIN32_WINNT_WIN8 && (s[0] == 'E' || s[0] == 'e') && (s[1] == 'X' || s[1] == 'x') &&
+                (s[2] == 'T' || s[2] == 't') && s[3] == '-') {
+                WCHAR newname[MAX_PATH];
+
+                if (!search_api_set(s, newname, version))
+                    continue;
+
+                {
+                    char t[255], *p;
+
+                    p = stpcpy(t, "Using ");
+                    p = stpcpy_utf16(p, newname);
+                    p = stpcpy(p, " instead of ");
+                    p = stpcpy_utf16(p, s);
+                    p = stpcpy(p, ".\n");
+
+                    print_string(t);
+                }
+
+                wcsncpy(s, newname, sizeof(s) / sizeof(WCHAR));
+            }
+
+            {
+                image* img2 = find_image(s);
+                bool no_reloc = img->no_reloc;
+
+                if (&img->list_entry == images || &img->list_entry == images->Flink || img->no_reloc) // kernel or HAL
+                    no_reloc = true;
+
+                if (img2) {
+                    if (no_reloc)
+                        img2->no_reloc = true;
+
+                    if (img2->order >= img->order)
+                        img2->order = img->order == 0 ? 0 : img->order - 1;
+                } else {
+                    Status = add_image(bs, images, s, LoaderSystemCode, img->dir, true, NULL, img->order == 0 ? 0 : img->order - 1, no_reloc);
+                    if (EFI_ERROR(Status))
+                        print_error("add_image", Status);
+                }
+            }
+        }
+    } else if (EFI_ERROR(Status)) {
+        print_error("img->ListImports", Status);
+        return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Puts the images in the order NT wants them in the loader block: the kernel and HAL, then
+// everything else in order of the boot drivers that brought them in.
+void fix_image_order(LIST_ENTRY* images) {
+    image* kernel = _CR(images->Flink, image, list_entry);
+    image* hal = _CR(images->Flink->Flink, image, list_entry);
+    LIST_ENTRY* le;
+    LIST_ENTRY list;
+    unsigned int max_order = 0;
+
+    RemoveEntryList(&kernel->list_entry);
+    RemoveEntryList(&hal->list_entry);
+
+    le = images->Flink;
+    while (le != images) {
+        image* img = _CR(le, image, list_entry);
+
+        if (img->order > max_order)
+            max_order = img->order;
+
+        le = le->Flink;
+    }
+
+    InitializeListHead(&list);
+
+    for (unsigned int i = 0; i <= max_order; i++) {
+        le = images->Flink;
+
+        while (le != images) {
+            LIST_ENTRY* le2 = le->Flink;
+            image* img = _CR(le, image, list_entry);
+
+            if (img->order == i) {
+                RemoveEntryList(&img->list_entry);
+                InsertTailList(&list, &img->list_entry);
+            }
+
+            le = le2;
+        }
+    }
+
+    // kernel and HAL always need to be first
+
+    InsertHeadList(&list, &hal->list_entry);
+    InsertHeadList(&list, &kernel->list_entry);
+
+    // move list
+    images->Flink = list.Flink;
+    images->Blink = list.Blink;
+    images->Flink->Blink = images;
+    images->Blink->Flink = images;
+}
+
+static EFI_STATUS resolve_forward(char* name, uint64_t* address) {
+    WCHAR dll[MAX_PATH];
+    image* img;
+    char* func;
+
+    {
+        WCHAR* s;
+        char* c;
+
+        c = name;
+        s = dll;
+
+        while (*c != 0 && *c != '.') {
+            *s = *c;
+            s++;
+            c++;
+        }
+
+        *s = 0;
+
+        func = c;
+
+        if (*func == '.')
+            func++;
+    }
+
+    // FIXME - handle ordinals
+
+    img = find_image_base(dll);
+    if (!img)
+        return EFI_NOT_FOUND;
+
+    return img->img->FindExport(img->img, func, address, resolve_forward);
+}
+
+// Fills in the import address tables, once all the images are loaded and relocated.
+EFI_STATUS resolve_image_imports(LIST_ENTRY* images, uint16_t version) {
+    EFI_STATUS Status;
+    LIST_ENTRY* le;
+
+    le = images->Flink;
+    while (le != images) {
+        image* img = _CR(le, image, list_entry);
+
+        if (!img->import_list) {
+            le = le->Flink;
+            continue;
+        }
+
+        for (unsigned int i = 0; i < img->import_list->NumberOfImports; i++) {
+            WCHAR s[MAX_PATH];
+            unsigned int j;
+            char* name = (char*)((uint8_t*)img->import_list + img->import_list->Imports[i]);
+
+            j = 0;
+            do {
+                s[j] = name[j];
+                j++;
+            } while (name[j] != 0);
+
+            s[j] = 0;
+
+            if (version >= _WIN32_WINNT_WIN8 && (s[0] == 'E' || s[0] == 'e') && (s[1] == 'X' || s[1] == 'x') &&
+                (s[2] == 'T' || s[2] == 't') && s[3] == '-') {
+                WCHAR newname[MAX_PATH];
+
+                if (!search_api_set(s, newname, version))
+                    continue;
+
+                wcsncpy(s, newname, sizeof(s) / sizeof(WCHAR));
+            }
+
+            {
+                image* img2 = find_image(s);
+
+                if (img2) {
+                    Status = img->img->ResolveImports(img->img, name, img2->img, resolve_forward);
+                    if (EFI_ERROR(Status)) {
+                        char t[255], *p;
+
+                        p = stpcpy(t, "Error when resolving imports for ");
+                        p = stpcpy_utf16(p, img->name);
+                        p = stpcpy(p, " and ");
+                        p = stpcpy_utf16(p, s);
+                        p = stpcpy(p, ".\n");
+
+                        print_string(t);
+
+                        print_error("ResolveImports", Status);
+                        return Status;
+                    }
+                }
+            }
+        }
+
+        le = le->Flink;
+    }
+
+    return EFI_SUCCESS;
+}
@@ -16,6 +16,7 @@
  * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <stdint.h>
+#include <string.h>
 #include <intrin.h>
 #include "quibble.h"
 #include "misc.h"
@@ -28,12 +29,31 @@ HARDWARE_PTE* page_directory;
 HARDWARE_PTE_PAE* pdpt;
 #elif defined(__x86_64__)
 HARDWARE_PTE_PAE* pml4;
+static bool huge_pages;
 #endif
 
+bool large_pages = false;
+
+// Page tables are handed out from a single block, rather than being allocated and added to the mappings
+// one at a time.
+static EFI_PHYSICAL_ADDRESS page_table_pool;
+static unsigned int page_table_pool_size = 0, page_table_pool_used = 0;
+
 #ifdef __x86_64__
 #define HAL_MEMORY 0xffffffffffc00000
 #endif
 
+#ifdef _X86_
+#define LARGE_PAGE_SIZE 0x400000
+#define LARGE_PAGE_SIZE_PAE 0x200000
+#elif defined(__x86_64__)
+#define LARGE_PAGE_SIZE 0x200000
+#define HUGE_PAGE_SIZE 0x40000000
+#endif
+
+#define MAPPING_INDEX_INITIAL_SIZE 256
+#define PAGE_TABLE_POOL_SLACK 16 // for the mappings enable_paging adds after counting
+
 EFI_MEMORY_DESCRIPTOR* efi_memory_map;
 EFI_MEMORY_DESCRIPTOR* efi_runtime_map;
 UINTN efi_map_size, efi_runtime_map_size, map_desc_size;
@@ -59,19 +79,107 @@ void* fix_address_mapping(void* addr, void* pa, void* va) {
     return (uint8_t*)addr - (uint8_t*)pa + (uint8_t*)va;
 }
 
-void* find_virtual_address(void* pa, LIST_ENTRY* mappings) {
-    LIST_ENTRY* le;
+// The mappings list is kept in order of physical address, which is how everything else walks it.
+// Alongside it we keep an array of the same entries in the same order, so that adding a mapping
+// or looking up an address is a binary search rather than a walk of the whole list.
+static mapping** mapping_index = NULL;
+static unsigned int mapping_index_count = 0, mapping_index_size = 0;
 
-    le = mappings->Flink;
-    while (le != mappings) {
-        mapping* m = _CR(le, mapping, list_entry);
+void init_mappings(LIST_ENTRY* mappings) {
+    InitializeListHead(mappings);
+    mapping_index_count = 0;
+}
+
+void free_mappings(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings) {
+    while (!IsListEmpty(mappings)) {
+        mapping* m = _CR(mappings->Flink, mapping, list_entry);
+
+        RemoveEntryList(&m->list_entry);
+
+        bs->FreePool(m);
+    }
+
+    if (mapping_index) {
+        bs->FreePool(mapping_index);
+        mapping_index = NULL;
+    }
+
+    mapping_index_count = 0;
+    mapping_index_size = 0;
+}
 
-        if (m->va) {
-            if ((uint8_t*)pa >= (uint8_t*)m->pa && (uint8_t*)pa < (uint8_t*)m->pa + (m->pages * EFI_PAGE_SIZE))
-                return (uint8_t*)pa - (uint8_t*)m->pa + (uint8_t*)m->va;
+// Returns the position of the first mapping which starts after pa.
+static unsigned int find_mapping_index(void* pa) {
+    unsigned int start = 0, end = mapping_index_count;
+
+    while (start < end) {
+        unsigned int mid = (start + end) / 2;
+
+        if ((uint8_t*)mapping_index[mid]->pa > (uint8_t*)pa)
+            end = mid;
+        else
+            start = mid + 1;
+    }
+
+    return start;
+}
+
+static EFI_STATUS insert_mapping(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, unsigned int pos, mapping* m) {
+    if (mapping_index_count == mapping_index_size) {
+        EFI_STATUS Status;
+        mapping** new_index;
+        unsigned int new_size = mapping_index_size == 0 ? MAPPING_INDEX_INITIAL_SIZE : (mapping_index_size * 2);
+
+        Status = bs->AllocatePool(EfiLoaderData, new_size * sizeof(mapping*), (void**)&new_index);
+        if (EFI_ERROR(Status)) {
+            print_error("AllocatePool", Status);
+            return Status;
         }
 
-        le = le->Flink;
+        if (mapping_index) {
+            memcpy(new_index, mapping_index, mapping_index_count * sizeof(mapping*));
+            bs->FreePool(mapping_index);
+        }
+
+        mapping_index = new_index;
+        mapping_index_size = new_size;
+    }
+
+    if (pos < mapping_index_count) {
+        InsertHeadList(mapping_index[pos]->list_entry.Blink, &m->list_entry);
+        memmove(&mapping_index[pos + 1], &mapping_index[pos], (mapping_index_count - pos) * sizeof(mapping*));
+    } else
+        InsertTailList(mappings, &m->list_entry);
+
+    mapping_index[pos] = m;
+    mapping_index_count++;
+
+    return EFI_SUCCESS;
+}
+
+static void remove_mapping(EFI_BOOT_SERVICES* bs, unsigned int pos) {
+    mapping* m = mapping_index[pos];
+
+    RemoveEntryList(&m->list_entry);
+
+    memmove(&mapping_index[pos], &mapping_index[pos + 1], (mapping_index_count - pos - 1) * sizeof(mapping*));
+    mapping_index_count--;
+
+    bs->FreePool(m);
+}
+
+void* find_virtual_address(void* pa, LIST_ENTRY* mappings) {
+    unsigned int pos = find_mapping_index(pa);
+
+    UNUSED(mappings);
+
+    if (pos > 0) {
+        mapping* m = mapping_index[pos - 1];
+
+        // mappings don't overlap, so this is the only one which can contain pa
+
+        if (m->va && (uint8_t*)pa < (uint8_t*)m->pa + (m->pages * EFI_PAGE_SIZE))
+            return (uint8_t*)pa - (uint8_t*)m->pa + (uint8_t*)m->va;
     }
 
     {
@@ -87,12 +195,204 @@ void* find_virtual_address(void* pa, LIST_ENTRY* mappings) {
     return NULL;
 }
 
-static EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintptr_t va, uintptr_t pa, unsigned int pages) {
-    uintptr_t pfn = pa >> EFI_PAGE_SHIFT;
+// Adds the tables, each covering 1 << shift bytes, that [start, end] needs to the set, and returns how
+// many weren't already there. If set is NULL, just returns how many there are.
+static unsigned int count_tables(uintptr_t* set, unsigned int set_size, uintptr_t start, uintptr_t end,
+                                 unsigned int shift, unsigned int level) {
+    unsigned int count = 0;
+
+    for (uintptr_t i = start >> shift; i <= end >> shift; i++) {
+        uintptr_t key = ((i << 2) | level) + 1;
+        unsigned int slot;
+
+        if (!set) {
+            count++;
+            continue;
+        }
+
+        slot = ((uint32_t)key * 0x9e3779b1) & (set_size - 1);
+
+        while (set[slot] != 0 && set[slot] != key) {
+            slot = (slot + 1) & (set_size - 1);
+        }
+
+        if (set[slot] == 0) {
+            set[slot] = key;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static unsigned int count_mapping_tables(uintptr_t* set, unsigned int set_size, mapping* m) {
+    uintptr_t start = (uintptr_t)m->va;
+    uintptr_t end = start + (m->pages * EFI_PAGE_SIZE) - 1;
+    unsigned int count = 0;
+#ifdef _X86_
+    unsigned int pt_shift = pae ? 21 : 22;
+#elif defined(__x86_64__)
+    unsigned int pt_shift = 21;
+#endif
+    uintptr_t pt_mask = ((uintptr_t)1 << pt_shift) - 1;
+
+    if (large_pages && !m->small_pages && !((start - (uintptr_t)m->pa) & pt_mask)) {
+        // only the ends will need page tables, if that
+
+        if (start & pt_mask)
+            count += count_tables(set, set_size, start, start, pt_shift, 0);
+
+        if ((end + 1) & pt_mask)
+            count += count_tables(set, set_size, end, end, pt_shift, 0);
+    } else
+        count += count_tables(set, set_size, start, end, pt_shift, 0);
+
+#ifdef __x86_64__
+    count += count_tables(set, set_size, start, end, 30, 1);
+    count += count_tables(set, set_size, start, end, 39, 2);
+#endif
+
+    return count;
+}
+
+// Works out how many page tables we'll need to map everything, so they can be allocated in one go.
+// Lots of mappings share tables, so we keep a set of the ones we've already counted.
+static unsigned int count_page_tables(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings) {
+    EFI_STATUS Status;
+    LIST_ENTRY* le;
+    unsigned int upper = 0, count = 0, set_size = 1;
+    uintptr_t* set;
+
+    le = mappings->Flink;
+    while (le != mappings) {
+        mapping* m = _CR(le, mapping, list_entry);
+
+        if (m->va)
+            upper += count_mapping_tables(NULL, 0, m);
+
+        le = le->Flink;
+    }
+
+    while (set_size < upper * 2) {
+        set_size <<= 1;
+    }
+
+    Status = bs->AllocatePool(EfiLoaderData, set_size * sizeof(uintptr_t), (void**)&set);
+    if (EFI_ERROR(Status)) // not fatal, we'll just allocate more than we need
+        return upper;
+
+    memset(set, 0, set_size * sizeof(uintptr_t));
+
+    le = mappings->Flink;
+    while (le != mappings) {
+        mapping* m = _CR(le, mapping, list_entry);
+
+        if (m->va)
+            count += count_mapping_tables(set, set_size, m);
+
+        le = le->Flink;
+    }
+
+    bs->FreePool(set);
+
+    return count;
+}
+
+// Allocates the block of memory that page tables get handed out from. If this fails, we carry
+// on allocating page tables one at a time.
+static EFI_STATUS allocate_page_table_pool(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings) {
+    EFI_STATUS Status;
+    EFI_PHYSICAL_ADDRESS addr;
+    unsigned int pages = count_page_tables(bs, mappings) + PAGE_TABLE_POOL_SLACK;
+
+    page_table_pool_size = 0;
+    page_table_pool_used = 0;
+
+    Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, pages, &addr);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePages", Status);
+        return EFI_SUCCESS;
+    }
+
+    Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, pages, LoaderMemoryData);
+    if (EFI_ERROR(Status)) {
+        print_error("add_mapping", Status);
+        bs->FreePages(addr, pages);
+        return Status;
+    }
+
+    memset((void*)(uintptr_t)addr, 0, pages * EFI_PAGE_SIZE);
+
+    page_table_pool = addr;
+    page_table_pool_size = pages;
+
+    return EFI_SUCCESS;
+}
 
 #ifdef _X86_
+static bool in_page_table_pool(uintptr_t addr) {
+    return addr >= page_table_pool && addr < page_table_pool + (page_table_pool_size * EFI_PAGE_SIZE);
+}
+#endif
+
+// Returns a zeroed page to use as a page table, from the pool if there's any left.
+static EFI_STATUS allocate_page_table(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, EFI_PHYSICAL_ADDRESS* addr) {
+    EFI_STATUS Status;
+
+    if (page_table_pool_used < page_table_pool_size) {
+        *addr = page_table_pool + (page_table_pool_used * EFI_PAGE_SIZE);
+        page_table_pool_used++;
+
+        return EFI_SUCCESS;
+    }
+
+    Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, addr);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePages", Status);
+        return Status;
+    }
+
+#ifdef __x86_64__
+    Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)*addr, 1, LoaderMemoryData);
+    if (EFI_ERROR(Status)) {
+        print_error("add_mapping", Status);
+        return Status;
+    }
+#else
+    // on x86, enable_paging adds these to the mappings once it's done
     UNUSED(mappings);
+#endif
+
+    memset((void*)(uintptr_t)*addr, 0, EFI_PAGE_SIZE);
+
+    return EFI_SUCCESS;
+}
+
+// Checks whether an existing large page already maps va to pfn, as it would if two adjacent
+// mappings overlapped. Anything else means something else wants this address.
+static EFI_STATUS check_large_page(uintptr_t va, uintptr_t pfn, uint64_t large_pfn, uintptr_t size) {
+    if (large_pfn + ((va & (size - 1)) >> EFI_PAGE_SHIFT) == pfn)
+        return EFI_SUCCESS;
+
+    {
+        char s[255], *p;
+
+        p = stpcpy(s, "error - address ");
+        p = hex_to_str(p, va);
+        p = stpcpy(p, " already mapped by large page\n");
+
+        print_string(s);
+    }
 
+    return EFI_INVALID_PARAMETER;
+}
+
+// If large is set, we use large pages for whatever parts of the range are suitably aligned.
+static EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintptr_t va, uintptr_t pa, unsigned int pages,
+                             bool large) {
+    uintptr_t pfn = pa >> EFI_PAGE_SHIFT;
+
+#ifdef _X86_
     if (pae) {
         do {
             HARDWARE_PTE_PAE* dir = (HARDWARE_PTE_PAE*)(pdpt[va >> 30].PageFrameNumber * EFI_PAGE_SIZE);
@@ -100,18 +400,40 @@ static EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintpt
             unsigned int index2 = (va & 0x1ff000) >> 12;
             HARDWARE_PTE_PAE* page_table;
 
+            if (large && !dir[index].Valid && !(va & (LARGE_PAGE_SIZE_PAE - 1)) &&
+                !(pfn & ((LARGE_PAGE_SIZE_PAE / EFI_PAGE_SIZE) - 1)) && pages >= LARGE_PAGE_SIZE_PAE / EFI_PAGE_SIZE) {
+                dir[index].PageFrameNumber = pfn;
+                dir[index].Valid = 1;
+                dir[index].Write = 1;
+                dir[index].LargePage = 1;
+
+                va += LARGE_PAGE_SIZE_PAE;
+                pfn += LARGE_PAGE_SIZE_PAE / EFI_PAGE_SIZE;
+                pages -= LARGE_PAGE_SIZE_PAE / EFI_PAGE_SIZE;
+                continue;
+            }
+
+            if (dir[index].LargePage) {
+                EFI_STATUS Status = check_large_page(va, pfn, dir[index].PageFrameNumber, LARGE_PAGE_SIZE_PAE);
+                if (EFI_ERROR(Status))
+                    return Status;
+
+                va += EFI_PAGE_SIZE;
+                pfn++;
+                pages--;
+                continue;
+            }
+
             if (!dir[index].Valid) { // allocate new page table
                 EFI_STATUS Status;
                 EFI_PHYSICAL_ADDRESS addr;
 
-                Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
+                Status = allocate_page_table(bs, mappings, &addr);
                 if (EFI_ERROR(Status)) {
-                    print_error("AllocatePages", Status);
+                    print_error("allocate_page_table", Status);
                     return Status;
                 }
 
-                memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
                 dir[index].PageFrameNumber = addr / EFI_PAGE_SIZE;
                 dir[index].Valid = 1;
                 dir[index].Write = 1;
@@ -134,18 +456,40 @@ static EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintpt
             unsigned int index2 = (va & 0x3ff000) >> 12;
             HARDWARE_PTE* page_table;
 
+            if (large && !page_directory[index].Valid && !(va & (LARGE_PAGE_SIZE - 1)) &&
+                !(pfn & ((LARGE_PAGE_SIZE / EFI_PAGE_SIZE) - 1)) && pages >= LARGE_PAGE_SIZE / EFI_PAGE_SIZE) {
+                page_directory[index].PageFrameNumber = pfn;
+                page_directory[index].Valid = 1;
+                page_directory[index].Write = 1;
+                page_directory[index].LargePage = 1;
+
+                va += LARGE_PAGE_SIZE;
+                pfn += LARGE_PAGE_SIZE / EFI_PAGE_SIZE;
+                pages -= LARGE_PAGE_SIZE / EFI_PAGE_SIZE;
+                continue;
+            }
+
+            if (page_directory[index].LargePage) {
+                EFI_STATUS Status = check_large_page(va, pfn, page_directory[index].PageFrameNumber, LARGE_PAGE_SIZE);
+                if (EFI_ERROR(Status))
+                    return Status;
+
+                va += EFI_PAGE_SIZE;
+                pfn++;
+                pages--;
+                continue;
+            }
+
             if (!page_directory[index].Valid) { // allocate new page table
                 EFI_STATUS Status;
                 EFI_PHYSICAL_ADDRESS addr;
 
-                Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
+                Status = allocate_page_table(bs, mappings, &addr);
                 if (EFI_ERROR(Status)) {
-                    print_error("AllocatePages", Status);
+                    print_error("allocate_page_table", Status);
                     return Status;
                 }
 
-                memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
                 page_directory[index].PageFrameNumber = addr / EFI_PAGE_SIZE;
                 page_directory[index].Valid = 1;
                 page_directory[index].Write = 1;
@@ -177,20 +521,12 @@ static EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintpt
             EFI_STATUS Status;
             EFI_PHYSICAL_ADDRESS addr;
 
-            Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-            if (EFI_ERROR(Status)) {
-                print_error("AllocatePages", Status);
-                return Status;
-            }
-
-            Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
+            Status = allocate_page_table(bs, mappings, &addr);
             if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
+                print_error("allocate_page_table", Status);
                 return Status;
             }
 
-            memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
             pml4[index].PageFrameNumber = addr / EFI_PAGE_SIZE;
             pml4[index].Valid = 1;
             pml4[index].Write = 1;
@@ -208,24 +544,40 @@ static EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintpt
             pdpt = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
         }
 
+        if (large && huge_pages && !pdpt[index2].Valid && !(va & (HUGE_PAGE_SIZE - 1)) &&
+            !(pfn & ((HUGE_PAGE_SIZE / EFI_PAGE_SIZE) - 1)) && pages >= HUGE_PAGE_SIZE / EFI_PAGE_SIZE) {
+            pdpt[index2].PageFrameNumber = pfn;
+            pdpt[index2].Valid = 1;
+            pdpt[index2].Write = 1;
+            pdpt[index2].LargePage = 1;
+
+            va += HUGE_PAGE_SIZE;
+            pfn += HUGE_PAGE_SIZE / EFI_PAGE_SIZE;
+            pages -= HUGE_PAGE_SIZE / EFI_PAGE_SIZE;
+            continue;
+        }
+
+        if (pdpt[index2].LargePage) {
+            EFI_STATUS Status = check_large_page(va, pfn, pdpt[index2].PageFrameNumber, HUGE_PAGE_SIZE);
+            if (EFI_ERROR(Status))
+                return Status;
+
+            va += EFI_PAGE_SIZE;
+            pfn++;
+            pages--;
+            continue;
+        }
+
         if (!pdpt[index2].Valid) {
             EFI_STATUS Status;
             EFI_PHYSICAL_ADDRESS addr;
 
-            Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-            if (EFI_ERROR(Status)) {
-                print_error("AllocatePages", Status);
-                return Status;
-            }
-
-            Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
+            Status = allocate_page_table(bs, mappings, &addr);
             if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
+                print_error("allocate_page_table", Status);
                 return Status;
             }
 
-            memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
             pdpt[index2].PageFrameNumber = addr / EFI_PAGE_SIZE;
             pdpt[index2].Valid = 1;
             pdpt[index2].Write = 1;
@@ -240,24 +592,40 @@ static EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintpt
             pd = (HARDWARE_PTE_PAE*)(uintptr_t)ptr;
         }
 
+        if (large && !pd[index3].Valid && !(va & (LARGE_PAGE_SIZE - 1)) &&
+            !(pfn & ((LARGE_PAGE_SIZE / EFI_PAGE_SIZE) - 1)) && pages >= LARGE_PAGE_SIZE / EFI_PAGE_SIZE) {
+            pd[index3].PageFrameNumber = pfn;
+            pd[index3].Valid = 1;
+            pd[index3].Write = 1;
+            pd[index3].LargePage = 1;
+
+            va += LARGE_PAGE_SIZE;
+            pfn += LARGE_PAGE_SIZE / EFI_PAGE_SIZE;
+            pages -= LARGE_PAGE_SIZE / EFI_PAGE_SIZE;
+            continue;
+        }
+
+        if (pd[index3].LargePage) {
+            EFI_STATUS Status = check_large_page(va, pfn, pd[index3].PageFrameNumber, LARGE_PAGE_SIZE);
+            if (EFI_ERROR(Status))
+                return Status;
+
+            va += EFI_PAGE_SIZE;
+            pfn++;
+            pages--;
+            continue;
+        }
+
         if (!pd[index3].Valid) {
             EFI_STATUS Status;
             EFI_PHYSICAL_ADDRESS addr;
 
-            Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-            if (EFI_ERROR(Status)) {
-                print_error("AllocatePages", Status);
-                return Status;
-            }
-
-            Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
+            Status = allocate_page_table(bs, mappings, &addr);
             if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
+                print_error("allocate_page_table", Status);
                 return Status;
             }
 
-            memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
             pd[index3].PageFrameNumber = addr / EFI_PAGE_SIZE;
             pd[index3].Valid = 1;
             pd[index3].Write = 1;
@@ -285,12 +653,28 @@ static EFI_STATUS map_memory(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, uintpt
     return EFI_SUCCESS;
 }
 
+// Large pages are only used for the images, which stay put for the lifetime of the system. Everything
+// else the kernel might free or remap a page at a time, which it can't do if it's part of a large page.
+static bool needs_small_pages(TYPE_OF_MEMORY type) {
+    switch (type) {
+        case LoaderSystemCode:
+        case LoaderHalCode:
+            return false;
+
+        default:
+            return true;
+    }
+}
+
 EFI_STATUS add_mapping(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void* va, void* pa, unsigned int pages,
                        TYPE_OF_MEMORY type) {
     EFI_STATUS Status;
     mapping* m;
-    LIST_ENTRY* le;
-    void* pa_end = (uint8_t*)pa + (pages * EFI_PAGE_SIZE) - 1;
+    unsigned int pos;
+    uint8_t* pa_end = (uint8_t*)pa + (pages * EFI_PAGE_SIZE);
+
+    if (pages == 0)
+        return EFI_SUCCESS;
 
     Status = bs->AllocatePool(EfiLoaderData, sizeof(mapping), (void**)&m);
     if (EFI_ERROR(Status)) {
@@ -302,102 +686,77 @@ EFI_STATUS add_mapping(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void* va, vo
     m->pa = pa;
     m->pages = pages;
     m->type = type;
+    m->small_pages = needs_small_pages(type);
 
-    le = mappings->Flink;
-    while (le != mappings) {
-        mapping* m2 = _CR(le, mapping, list_entry);
-        void* pa2_end = (uint8_t*)m2->pa + (m2->pages * EFI_PAGE_SIZE) - 1;
-
-        if (pa_end > m2->pa && pa_end <= pa2_end) { // split off beginning of block
-            mapping* m3;
-            size_t pages2;
-
-            if (m2->type != LoaderFree) {
-                print_string("error - cutting into non-free mapping\n");
-                halt();
-                return EFI_INVALID_PARAMETER;
-            }
+    // Find the first mapping we overlap, or where we go if we don't overlap anything. The firmware's
+    // memory map is usually in order, so check for adding to the end before doing a search.
 
-            pages2 = ((uint8_t*)pa2_end - (uint8_t*)pa_end) / EFI_PAGE_SIZE;
-
-            if (pages2 > 0) {
-                Status = bs->AllocatePool(EfiLoaderData, sizeof(mapping), (void**)&m3);
-                if (EFI_ERROR(Status)) {
-                    print_error("AllocatePool", Status);
-                    return Status;
-                }
-
-                m3->va = NULL;
-                m3->pa = (uint8_t*)pa_end + 1;
-                m3->pages = pages2;
-                m3->type = m2->type;
+    if (mapping_index_count > 0 && (uint8_t*)mapping_index[mapping_index_count - 1]->pa +
+        (mapping_index[mapping_index_count - 1]->pages * EFI_PAGE_SIZE) <= (uint8_t*)pa) {
+        pos = mapping_index_count;
+    } else {
+        pos = find_mapping_index(pa);
 
-                InsertHeadList(&m2->list_entry, &m3->list_entry);
-            }
+        if (pos > 0 && (uint8_t*)mapping_index[pos - 1]->pa + (mapping_index[pos - 1]->pages * EFI_PAGE_SIZE) > (uint8_t*)pa)
+            pos--;
+    }
 
-            m2->pages = ((uint8_t*)pa_end + 1 - (uint8_t*)m2->pa) / EFI_PAGE_SIZE;
+    while (pos < mapping_index_count && (uint8_t*)mapping_index[pos]->pa < pa_end) {
+        mapping* m2 = mapping_index[pos];
+        uint8_t* pa2_end = (uint8_t*)m2->pa + (m2->pages * EFI_PAGE_SIZE);
 
-            pa2_end = (uint8_t*)m2->pa + (m2->pages * EFI_PAGE_SIZE) - 1;
+        if (m2->type != LoaderFree) {
+            print_string("error - cutting into non-free mapping\n");
+            halt();
+            return EFI_INVALID_PARAMETER;
         }
 
-        if (m->pa > m2->pa && m->pa < pa2_end) { // split off end of block
-            mapping* m3;
-            size_t pages2;
-
-            if (m2->type != LoaderFree) {
-                print_string("error - cutting into non-free mapping\n");
-                halt();
-                return EFI_INVALID_PARAMETER;
-            }
-
-            pages2 = ((uint8_t*)pa2_end + 1 - (uint8_t*)m->pa) / EFI_PAGE_SIZE;
+        if ((uint8_t*)m2->pa < (uint8_t*)pa) { // keep beginning of block
+            if (pa2_end > pa_end) { // and end, so split in two with us in the middle
+                mapping* m3;
 
-            if (pages2 > 0) {
                 Status = bs->AllocatePool(EfiLoaderData, sizeof(mapping), (void**)&m3);
                 if (EFI_ERROR(Status)) {
                     print_error("AllocatePool", Status);
+                    bs->FreePool(m);
                     return Status;
                 }
 
                 m3->va = NULL;
-                m3->pa = m->pa;
-                m3->pages = pages2;
+                m3->pa = pa_end;
+                m3->pages = (pa2_end - pa_end) / EFI_PAGE_SIZE;
                 m3->type = m2->type;
+                m3->small_pages = m2->small_pages;
 
-                InsertHeadList(&m2->list_entry, &m3->list_entry);
-            }
-
-            m2->pages = ((uint8_t*)m->pa - (uint8_t*)m2->pa) / EFI_PAGE_SIZE;
-
-            pa2_end = (uint8_t*)m2->pa + (m2->pages * EFI_PAGE_SIZE) - 1;
-        }
-
-        if ((m2->pa >= m->pa && pa2_end <= pa_end) || m2->pages == 0) { // remove block entirely
-            LIST_ENTRY* le2 = le->Flink;
+                Status = insert_mapping(bs, mappings, pos + 1, m3);
+                if (EFI_ERROR(Status)) {
+                    print_error("insert_mapping", Status);
+                    bs->FreePool(m3);
+                    bs->FreePool(m);
+                    return Status;
+                }
 
-            if (m2->type != LoaderFree) {
-                print_string("error - cutting into non-free mapping\n");
-                halt();
-                return EFI_INVALID_PARAMETER;
+                m2->pages = ((uint8_t*)pa - (uint8_t*)m2->pa) / EFI_PAGE_SIZE;
+                pos++;
+                break;
             }
 
-            RemoveEntryList(&m2->list_entry);
-            bs->FreePool(m2);
-
-            le = le2;
-            continue;
-        }
-
-        if (m2->pa > m->pa) {
-            InsertHeadList(m2->list_entry.Blink, &m->list_entry);
-
-            return EFI_SUCCESS;
-        }
-
-        le = le->Flink;
+            m2->pages = ((uint8_t*)pa - (uint8_t*)m2->pa) / EFI_PAGE_SIZE;
+            pos++;
+        } else if (pa2_end > pa_end) { // keep end of block
+            m2->pages = (pa2_end - pa_end) / EFI_PAGE_SIZE;
+            m2->pa = pa_end;
+            break;
+        } else // remove block entirely
+            remove_mapping(bs, pos);
     }
 
-    InsertTailList(mappings, &m->list_entry);
+    Status = insert_mapping(bs, mappings, pos, m);
+    if (EFI_ERROR(Status)) {
+        print_error("insert_mapping", Status);
+        bs->FreePool(m);
+        return Status;
+    }
 
     return EFI_SUCCESS;
 }
@@ -685,20 +1044,12 @@ static EFI_STATUS add_hal_mappings(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings)
         EFI_STATUS Status;
         EFI_PHYSICAL_ADDRESS addr;
 
-        Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-        if (EFI_ERROR(Status)) {
-            print_error("AllocatePages", Status);
-            return Status;
-        }
-
-        Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
+        Status = allocate_page_table(bs, mappings, &addr);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("allocate_page_table", Status);
             return Status;
         }
 
-        memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
         pml4[(HAL_MEMORY >> 39) & 0x1ff].PageFrameNumber = addr / EFI_PAGE_SIZE;
         pml4[(HAL_MEMORY >> 39) & 0x1ff].Valid = 1;
         pml4[(HAL_MEMORY >> 39) & 0x1ff].Write = 1;
@@ -717,20 +1068,12 @@ static EFI_STATUS add_hal_mappings(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings)
         EFI_STATUS Status;
         EFI_PHYSICAL_ADDRESS addr;
 
-        Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-        if (EFI_ERROR(Status)) {
-            print_error("AllocatePages", Status);
-            return Status;
-        }
-
-        Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
+        Status = allocate_page_table(bs, mappings, &addr);
         if (EFI_ERROR(Status)) {
-            print_error("add_mapping", Status);
+            print_error("allocate_page_table", Status);
             return Status;
         }
 
-        memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
         pdpt[(HAL_MEMORY >> 30) & 0x1ff].PageFrameNumber = addr / EFI_PAGE_SIZE;
         pdpt[(HAL_MEMORY >> 30) & 0x1ff].Valid = 1;
         pdpt[(HAL_MEMORY >> 30) & 0x1ff].Write = 1;
@@ -750,20 +1093,12 @@ static EFI_STATUS add_hal_mappings(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings)
             EFI_STATUS Status;
             EFI_PHYSICAL_ADDRESS addr;
 
-            Status = bs->AllocatePages(AllocateAnyPages, EfiBootServicesData, 1, &addr);
-            if (EFI_ERROR(Status)) {
-                print_error("AllocatePages", Status);
-                return Status;
-            }
-
-            Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)addr, 1, LoaderMemoryData);
+            Status = allocate_page_table(bs, mappings, &addr);
             if (EFI_ERROR(Status)) {
-                print_error("add_mapping", Status);
+                print_error("allocate_page_table", Status);
                 return Status;
             }
 
-            memset((void*)(uintptr_t)addr, 0, EFI_PAGE_SIZE);
-
             pd[((HAL_MEMORY >> 21) & 0x1ff) + i].PageFrameNumber = addr / EFI_PAGE_SIZE;
             pd[((HAL_MEMORY >> 21) & 0x1ff) + i].Valid = 1;
             pd[((HAL_MEMORY >> 21) & 0x1ff) + i].Write = 1;
@@ -876,6 +1211,25 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
 
     size = 0;
 
+    if (large_pages) {
+        int cpu_info[4];
+
+#ifdef _X86_
+        if (!pae) {
+            __cpuid(cpu_info, 1);
+
+            if (!(cpu_info[3] & 0x8)) { // PSE not supported
+                print_string("CPU does not support large pages.\n");
+                large_pages = false;
+            }
+        }
+#elif defined(__x86_64__)
+        __cpuid(cpu_info, 0x80000001);
+
+        huge_pages = cpu_info[3] & 0x4000000;
+#endif
+    }
+
     // mark first page as LoaderFirmwarePermanent
     Status = add_mapping(bs, mappings, 0, 0, 1, LoaderFirmwarePermanent);
     if (EFI_ERROR(Status)) {
@@ -950,6 +1304,12 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
     }
 #endif
 
+    Status = allocate_page_table_pool(bs, mappings);
+    if (EFI_ERROR(Status)) {
+        print_error("allocate_page_table_pool", Status);
+        return Status;
+    }
+
     num_entries = 0;
 
     le = mappings->Flink;
@@ -1012,14 +1372,40 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
             mapping* m = _CR(le, mapping, list_entry);
 
             if (m->va) {
+                mapping* last = m;
+                unsigned int pages = m->pages;
+                bool large = large_pages && !m->small_pages;
+
                 if ((uint8_t*)systable >= (uint8_t*)m->pa && (uint8_t*)systable < (uint8_t*)m->pa + (m->pages * EFI_PAGE_SIZE))
                     new_ST = (EFI_SYSTEM_TABLE*)((uint8_t*)systable - (uint8_t*)m->pa + (uint8_t*)m->va);
 
-                Status = map_memory(bs, mappings, (uintptr_t)m->va, (uintptr_t)m->pa, m->pages);
+                // Map any following mappings that carry on at the same offset in the same go, so that
+                // large pages can span them - the images region is laid out like this.
+                if (large) {
+                    while (last->list_entry.Flink != mappings) {
+                        mapping* m2 = _CR(last->list_entry.Flink, mapping, list_entry);
+
+                        if (!m2->va || m2->small_pages || (uint8_t*)m2->pa != (uint8_t*)m->pa + (pages * EFI_PAGE_SIZE) ||
+                            (uint8_t*)m2->va != (uint8_t*)m->va + (pages * EFI_PAGE_SIZE))
+                            break;
+
+                        if ((uint8_t*)systable >= (uint8_t*)m2->pa && (uint8_t*)systable < (uint8_t*)m2->pa + (m2->pages * EFI_PAGE_SIZE))
+                            new_ST = (EFI_SYSTEM_TABLE*)((uint8_t*)systable - (uint8_t*)m2->pa + (uint8_t*)m2->va);
+
+                        pages += m2->pages;
+                        last = m2;
+                    }
+                }
+
+                Status = map_memory(bs, mappings, (uintptr_t)m->va, (uintptr_t)m->pa, pages, large);
                 if (EFI_ERROR(Status)) {
                     print_error("map_memory", Status);
                     return Status;
                 }
+
+                // map_memory can add mappings for new page tables, but not in place of one that's mapped
+                le = last->list_entry.Flink;
+                continue;
             }
 
             le = le->Flink;
@@ -1027,7 +1413,7 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
     }
 
     // map first page (doesn't get mapped above because VA is 0)
-    Status = map_memory(bs, mappings, 0, 0, 1);
+    Status = map_memory(bs, mappings, 0, 0, 1, false);
     if (EFI_ERROR(Status)) {
         print_error("map_memory", Status);
         return Status;
@@ -1035,7 +1421,7 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
 
 #ifdef _X86_
     if (pae) { // map cr3
-        Status = map_memory(bs, mappings, ((uintptr_t)pdpt + MM_KSEG0_BASE), (uintptr_t)pdpt, 1);
+        Status = map_memory(bs, mappings, ((uintptr_t)pdpt + MM_KSEG0_BASE), (uintptr_t)pdpt, 1, false);
         if (EFI_ERROR(Status)) {
             print_error("map_memory", Status);
             return Status;
@@ -1047,7 +1433,7 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
             HARDWARE_PTE_PAE* dir = (HARDWARE_PTE_PAE*)(pdpt[i].PageFrameNumber * EFI_PAGE_SIZE);
 
             for (unsigned int j = 0; j < EFI_PAGE_SIZE / sizeof(HARDWARE_PTE_PAE); j++) {
-                if (dir[j].Valid) {
+                if (dir[j].Valid && !dir[j].LargePage && !in_page_table_pool(dir[j].PageFrameNumber * EFI_PAGE_SIZE)) {
                     Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)(dir[j].PageFrameNumber * EFI_PAGE_SIZE),
                                          1, LoaderMemoryData);
                     if (EFI_ERROR(Status)) {
@@ -1065,7 +1451,8 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
         }
     } else {
         for (unsigned int i = 0; i < EFI_PAGE_SIZE / sizeof(HARDWARE_PTE); i++) {
-            if (page_directory[i].Valid) {
+            if (page_directory[i].Valid && !page_directory[i].LargePage &&
+                !in_page_table_pool(page_directory[i].PageFrameNumber * EFI_PAGE_SIZE)) {
                 Status = add_mapping(bs, mappings, NULL, (void*)(uintptr_t)(page_directory[i].PageFrameNumber * EFI_PAGE_SIZE),
                                      1, LoaderMemoryData);
                 if (EFI_ERROR(Status)) {
@@ -1084,7 +1471,7 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
 #endif
 
     if (apic) {
-        Status = map_memory(bs, mappings, APIC_BASE, (uintptr_t)apic, 1);
+        Status = map_memory(bs, mappings, APIC_BASE, (uintptr_t)apic, 1, false);
         if (EFI_ERROR(Status)) {
             print_error("map_memory", Status);
             return Status;
@@ -1097,7 +1484,7 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
         return Status;
     }
 
-    Status = map_memory(bs, mappings, (uintptr_t)va, (uintptr_t)mdl_pa, mdl_pages);
+    Status = map_memory(bs, mappings, (uintptr_t)va, (uintptr_t)mdl_pa, mdl_pages, false);
     if (EFI_ERROR(Status)) {
         print_error("map_memory", Status);
         return Status;
@@ -1165,6 +1552,10 @@ EFI_STATUS enable_paging(EFI_HANDLE image_handle, EFI_BOOT_SERVICES* bs, LIST_EN
         // disable PAE
         __writecr4(__readcr4() & ~CR4_PAE);
 
+        // enable 4MB pages
+        if (large_pages)
+            __writecr4(__readcr4() | CR4_PSE);
+
         // set cr3
         __writecr3((uintptr_t)page_directory);
     }
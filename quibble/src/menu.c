@@ -16,6 +16,7 @@
  * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <string.h>
+#include <intrin.h>
 #include "quibble.h"
 #include "misc.h"
 #include "x86.h"
@@ -284,11 +285,7 @@ static EFI_STATUS populate_options_from_ini(LIST_ENTRY* ini_sections, unsigned i
 
                 memcpy(opt->name, v->value, len + 1);
             } else {
-                Status = utf8_to_utf16(NULL, 0, &wlen, v->value, len);
-                if (EFI_ERROR(Status)) {
-                    print_error("utf8_to_utf16", Status);
-                    return Status;
-                }
+                wlen = UTF8_TO_UTF16_MAX(len);
 
                 Status = systable->BootServices->AllocatePool(EfiLoaderData, wlen + sizeof(WCHAR), (void**)&opt->namew);
                 if (EFI_ERROR(Status)) {
@@ -299,6 +296,8 @@ static EFI_STATUS populate_options_from_ini(LIST_ENTRY* ini_sections, unsigned i
                 Status = utf8_to_utf16(opt->namew, wlen, &wlen, v->value, len);
                 if (EFI_ERROR(Status)) {
                     print_error("utf8_to_utf16", Status);
+                    systable->BootServices->FreePool(opt->namew);
+                    opt->namew = NULL;
                     return Status;
                 }
 
@@ -698,7 +697,10 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
     EFI_SIMPLE_TEXT_OUT_PROTOCOL* con = systable->ConOut;
     bool cursor_visible = con->Mode->CursorVisible;
     unsigned int timer = 10;
+    unsigned int timeout;
     bool timer_cancelled = false;
+    bool preload_started = false, preloading = false;
+    uint64_t start;
 
     static const uint64_t one_second = 10000000;
 
@@ -818,6 +820,15 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
             goto end;
         }
 
+        // The timer only wakes us up to redraw the countdown - what it shows is worked out from
+        // the TSC, as the preloading can hold us up for longer than a second at a time.
+
+        if (cpu_frequency == 0)
+            cpu_frequency = get_cpu_frequency(systable->BootServices);
+
+        timeout = timer;
+        start = __rdtsc();
+
         Status = systable->BootServices->SetTimer(evt, TimerPeriodic, one_second);
         if (EFI_ERROR(Status)) {
             print_error("SetTimer", Status);
@@ -832,14 +843,29 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
             events[0] = evt;
             events[1] = systable->ConIn->WaitForKey;
 
-            Status = systable->BootServices->WaitForEvent(2, events, &index);
-            if (EFI_ERROR(Status)) {
-                print_error("WaitForEvent", Status);
-                goto end;
+            if (preloading) {
+                // do the next bit of preloading, unless something's happened in the meantime
+                if (systable->BootServices->CheckEvent(events[1]) == EFI_SUCCESS)
+                    index = 1;
+                else if (systable->BootServices->CheckEvent(events[0]) == EFI_SUCCESS)
+                    index = 0;
+                else {
+                    preloading = preload_option(systable->BootServices, &options[selected_option]);
+                    continue;
+                }
+            } else {
+                Status = systable->BootServices->WaitForEvent(2, events, &index);
+                if (EFI_ERROR(Status)) {
+                    print_error("WaitForEvent", Status);
+                    goto end;
+                }
             }
 
             if (index == 0) { // timer
-                timer--;
+                // rounded, as the timer won't go off exactly on the second
+                uint64_t elapsed = (__rdtsc() - start + (cpu_frequency / 2)) / cpu_frequency;
+
+                timer = elapsed >= timeout ? 0 : (unsigned int)(timeout - elapsed);
 
                 if (gop_console) {
                     text_pos p;
@@ -883,6 +909,13 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
 
                     break;
                 }
+
+                // Nobody's touched the keyboard, so make a start on loading the default
+                // entry while we're waiting.
+                if (!preload_started) {
+                    preload_started = true;
+                    preloading = true;
+                }
             } else { // key press
                 unsigned int old_option = selected_option;
 
@@ -894,6 +927,7 @@ EFI_STATUS show_menu(EFI_SYSTEM_TABLE* systable, boot_option** ret) {
                     }
 
                     timer_cancelled = true;
+                    preloading = false;
 
                     if (gop_console) {
                         draw_rect(font_height, gop_info.VerticalResolution - (font_height * 7 / 4),
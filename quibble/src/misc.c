@@ -17,6 +17,12 @@
 
 #include "misc.h"
 #include <stdbool.h>
+#include <intrin.h>
+
+#if defined(__x86_64__) && (defined(_MSC_VER) || defined(__SSE2__))
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
 
 void wcsncpy(WCHAR* dest, const WCHAR* src, size_t n) {
     size_t i = 0;
@@ -66,10 +72,39 @@ size_t strlen(const char* s) {
     return i;
 }
 
+#ifdef USE_SSE2
+static inline __m128i fold_ascii_16(__m128i v) {
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi16(v, _mm_set1_epi16('A' - 1)),
+                                  _mm_cmpgt_epi16(_mm_set1_epi16('Z' + 1), v));
+
+    return _mm_add_epi16(v, _mm_and_si128(upper, _mm_set1_epi16('a' - 'A')));
+}
+#endif
+
 int wcsicmp(const WCHAR* s1, const WCHAR* s2) {
     size_t i = 0;
 
     while (true) {
+#ifdef USE_SSE2
+        // Skip over blocks of eight characters which match and don't contain the
+        // terminator. We don't know the lengths of the strings, so only do this when
+        // neither load can cross into the next page.
+
+        while (((uintptr_t)&s1[i] & 0xfff) <= 0x1000 - sizeof(__m128i) &&
+               ((uintptr_t)&s2[i] & 0xfff) <= 0x1000 - sizeof(__m128i)) {
+            __m128i v1 = _mm_loadu_si128((__m128i*)&s1[i]);
+            __m128i v2 = _mm_loadu_si128((__m128i*)&s2[i]);
+
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(v1, _mm_setzero_si128())) != 0)
+                break;
+
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(fold_ascii_16(v1), fold_ascii_16(v2))) != 0xffff)
+                break;
+
+            i += sizeof(__m128i) / sizeof(WCHAR);
+        }
+#endif
+
         WCHAR c1 = s1[i];
         WCHAR c2 = s2[i];
 
@@ -168,31 +203,59 @@ int strcmp(const char* s1, const char* s2) {
     }
 }
 
+#if defined(_X86_) || defined(__x86_64__)
+static size_t rep_threshold = 0;
+
+// Returns the size at which rep movsb / rep stosb become the fastest way to copy or
+// fill memory, or (size_t)-1 if the CPU doesn't advertise fast string operations.
+static size_t get_rep_threshold() {
+    int cpu_info[4];
+
+    if (rep_threshold != 0)
+        return rep_threshold;
+
+    rep_threshold = (size_t)-1;
+
+    __cpuid(cpu_info, 0);
+
+    if (cpu_info[0] >= 7) {
+        __cpuidex(cpu_info, 7, 0);
+
+        if (cpu_info[3] & 0x10) // FSRM
+            rep_threshold = 1;
+        else if (cpu_info[1] & 0x200) // ERMSB
+            rep_threshold = 128;
+    }
+
+    return rep_threshold;
+}
+#endif
+
 int memcmp(const void* s1, const void* s2, size_t n) {
-#if __INTPTR_WIDTH__ == 64
-    while (n > sizeof(uint64_t)) {
-        uint64_t c1 = *(uint64_t*)s1;
-        uint64_t c2 = *(uint64_t*)s2;
+#ifdef USE_SSE2
+    while (n >= sizeof(__m128i)) {
+        __m128i c1 = _mm_loadu_si128((__m128i*)s1);
+        __m128i c2 = _mm_loadu_si128((__m128i*)s2);
 
-        if (c1 != c2)
-            return c1 > c2 ? 1 : -1;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(c1, c2)) != 0xffff)
+            break;
 
-        s1 = (uint64_t*)s1 + 1;
-        s2 = (uint64_t*)s2 + 1;
-        n -= sizeof(uint64_t);
+        s1 = (__m128i*)s1 + 1;
+        s2 = (__m128i*)s2 + 1;
+        n -= sizeof(__m128i);
     }
 #endif
 
-    while (n > sizeof(uint32_t)) {
-        uint32_t c1 = *(uint32_t*)s1;
-        uint32_t c2 = *(uint32_t*)s2;
+    // Words are little-endian, so we can only use them to skip over matching data -
+    // the byte loop below works out which way round any difference is.
 
-        if (c1 != c2)
-            return c1 > c2 ? 1 : -1;
+    while (n >= sizeof(size_t)) {
+        if (*(size_t*)s1 != *(size_t*)s2)
+            break;
 
-        s1 = (uint32_t*)s1 + 1;
-        s2 = (uint32_t*)s2 + 1;
-        n -= sizeof(uint32_t);
+        s1 = (size_t*)s1 + 1;
+        s2 = (size_t*)s2 + 1;
+        n -= sizeof(size_t);
     }
 
     while (n > 0) {
@@ -211,6 +274,42 @@ int memcmp(const void* s1, const void* s2, size_t n) {
 }
 
 void memcpy(void* dest, const void* src, size_t n) {
+#if defined(_X86_) || defined(__x86_64__)
+    if (n >= get_rep_threshold()) {
+        __movsb((unsigned char*)dest, (const unsigned char*)src, n);
+        return;
+    }
+#endif
+
+#ifdef USE_SSE2
+    if (n >= 4 * sizeof(__m128i)) {
+        // align destination, so we can use aligned stores
+        while ((uintptr_t)dest & (sizeof(__m128i) - 1)) {
+            *(uint8_t*)dest = *(uint8_t*)src;
+
+            dest = (uint8_t*)dest + 1;
+            src = (uint8_t*)src + 1;
+            n--;
+        }
+
+        while (n >= 4 * sizeof(__m128i)) {
+            __m128i a = _mm_loadu_si128((__m128i*)src);
+            __m128i b = _mm_loadu_si128((__m128i*)src + 1);
+            __m128i c = _mm_loadu_si128((__m128i*)src + 2);
+            __m128i d = _mm_loadu_si128((__m128i*)src + 3);
+
+            _mm_store_si128((__m128i*)dest, a);
+            _mm_store_si128((__m128i*)dest + 1, b);
+            _mm_store_si128((__m128i*)dest + 2, c);
+            _mm_store_si128((__m128i*)dest + 3, d);
+
+            dest = (__m128i*)dest + 4;
+            src = (__m128i*)src + 4;
+            n -= 4 * sizeof(__m128i);
+        }
+    }
+#endif
+
 #if __INTPTR_WIDTH__ == 64
     while (n >= sizeof(uint64_t)) {
         *(uint64_t*)dest = *(uint64_t*)src;
@@ -253,7 +352,36 @@ void memcpy(void* dest, const void* src, size_t n) {
 void* memset(void* s, int c, size_t n) {
     void* orig_s = s;
 
-    // FIXME - faster if we make sure we're aligned (also in memcpy)?
+#if defined(_X86_) || defined(__x86_64__)
+    if (n >= get_rep_threshold()) {
+        __stosb((unsigned char*)s, (unsigned char)c, n);
+        return orig_s;
+    }
+#endif
+
+#ifdef USE_SSE2
+    if (n >= 4 * sizeof(__m128i)) {
+        __m128i v = _mm_set1_epi8((char)c);
+
+        // align, so we can use aligned stores
+        while ((uintptr_t)s & (sizeof(__m128i) - 1)) {
+            *(uint8_t*)s = c;
+
+            s = (uint8_t*)s + 1;
+            n--;
+        }
+
+        while (n >= 4 * sizeof(__m128i)) {
+            _mm_store_si128((__m128i*)s, v);
+            _mm_store_si128((__m128i*)s + 1, v);
+            _mm_store_si128((__m128i*)s + 2, v);
+            _mm_store_si128((__m128i*)s + 3, v);
+
+            s = (__m128i*)s + 4;
+            n -= 4 * sizeof(__m128i);
+        }
+    }
+#endif
 
 #if __INTPTR_WIDTH__ == 64
     uint64_t v;
@@ -318,8 +446,8 @@ void itow(int v, WCHAR* w) {
     bool neg = false;
 
     if (v == 0) {
-        s[0] = '0';
-        s[1] = 0;
+        w[0] = '0';
+        w[1] = 0;
         return;
     }
 
@@ -353,6 +481,108 @@ void itow(int v, WCHAR* w) {
     *w = 0;
 }
 
+// Returns the number of bytes at the start of in which are plain ASCII.
+static unsigned int ascii_run_8(const uint8_t* in, unsigned int len) {
+    unsigned int n = 0;
+
+#ifdef USE_SSE2
+    while (len - n >= sizeof(__m128i)) {
+        if (_mm_movemask_epi8(_mm_loadu_si128((__m128i*)&in[n])) != 0)
+            break;
+
+        n += sizeof(__m128i);
+    }
+#endif
+
+    while (len - n >= sizeof(size_t)) {
+        if (*(size_t*)&in[n] & (((size_t)-1 / 0xff) * 0x80))
+            break;
+
+        n += sizeof(size_t);
+    }
+
+    while (n < len && !(in[n] & 0x80)) {
+        n++;
+    }
+
+    return n;
+}
+
+// Returns the number of UTF-16 code units at the start of in which are below 0x80.
+static unsigned int ascii_run_16(const uint16_t* in, unsigned int len) {
+    unsigned int n = 0;
+
+#ifdef USE_SSE2
+    __m128i mask = _mm_set1_epi16((short)0xff80);
+
+    while (len - n >= sizeof(__m128i) / sizeof(uint16_t)) {
+        __m128i v = _mm_and_si128(_mm_loadu_si128((__m128i*)&in[n]), mask);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128())) != 0xffff)
+            break;
+
+        n += sizeof(__m128i) / sizeof(uint16_t);
+    }
+#endif
+
+    while (len - n >= sizeof(size_t) / sizeof(uint16_t)) {
+        if (*(size_t*)&in[n] & (((size_t)-1 / 0xffff) * 0xff80))
+            break;
+
+        n += sizeof(size_t) / sizeof(uint16_t);
+    }
+
+    while (n < len && in[n] < 0x80) {
+        n++;
+    }
+
+    return n;
+}
+
+static void widen_ascii(uint16_t* out, const uint8_t* in, unsigned int len) {
+#ifdef USE_SSE2
+    while (len >= sizeof(__m128i)) {
+        __m128i v = _mm_loadu_si128((__m128i*)in);
+
+        _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+        _mm_storeu_si128((__m128i*)out + 1, _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+
+        in += sizeof(__m128i);
+        out += sizeof(__m128i);
+        len -= sizeof(__m128i);
+    }
+#endif
+
+    while (len > 0) {
+        *out = *in;
+        out++;
+        in++;
+        len--;
+    }
+}
+
+static void narrow_ascii(uint8_t* out, const uint16_t* in, unsigned int len) {
+#ifdef USE_SSE2
+    while (len >= sizeof(__m128i)) {
+        __m128i a = _mm_loadu_si128((__m128i*)in);
+        __m128i b = _mm_loadu_si128((__m128i*)in + 1);
+
+        _mm_storeu_si128((__m128i*)out, _mm_packus_epi16(a, b));
+
+        in += sizeof(__m128i);
+        out += sizeof(__m128i);
+        len -= sizeof(__m128i);
+    }
+#endif
+
+    while (len > 0) {
+        *out = (uint8_t)*in;
+        out++;
+        in++;
+        len--;
+    }
+}
+
 EFI_STATUS utf8_to_utf16(WCHAR* dest, unsigned int dest_max, unsigned int* dest_len, const char* src, unsigned int src_len) {
     EFI_STATUS Status = EFI_SUCCESS;
     uint8_t* in = (uint8_t*)src;
@@ -362,9 +592,22 @@ EFI_STATUS utf8_to_utf16(WCHAR* dest, unsigned int dest_max, unsigned int* dest_
     for (unsigned int i = 0; i < src_len; i++) {
         uint32_t cp;
 
-        if (!(in[i] & 0x80))
-            cp = in[i];
-        else if ((in[i] & 0xe0) == 0xc0) {
+        if (!(in[i] & 0x80)) {
+            unsigned int run = ascii_run_8(&in[i], src_len - i);
+
+            if (dest) {
+                if (left < run)
+                    return EFI_BUFFER_TOO_SMALL;
+
+                widen_ascii(out, &in[i], run);
+                out += run;
+                left -= run;
+            }
+
+            needed += run * sizeof(uint16_t);
+            i += run - 1;
+            continue;
+        } else if ((in[i] & 0xe0) == 0xc0) {
             if (i == src_len - 1 || (in[i+1] & 0xc0) != 0x80) {
                 cp = 0xfffd;
                 Status = EFI_INVALID_PARAMETER;
@@ -443,7 +686,27 @@ EFI_STATUS utf16_to_utf8(char* dest, unsigned int dest_max, unsigned int* dest_l
     unsigned int needed = 0, left = dest_max;
 
     for (unsigned int i = 0; i < in_len; i++) {
-        uint32_t cp = *in;
+        uint32_t cp;
+
+        if (*in < 0x80) {
+            unsigned int run = ascii_run_16(in, in_len - i);
+
+            if (dest) {
+                if (left < run)
+                    return EFI_BUFFER_TOO_SMALL;
+
+                narrow_ascii(out, in, run);
+                out += run;
+                left -= run;
+            }
+
+            in += run;
+            needed += run;
+            i += run - 1;
+            continue;
+        }
+
+        cp = *in;
         in++;
 
         if ((cp & 0xfc00) == 0xd800) {
@@ -809,11 +1072,32 @@ int strncmp(const char* s1, const char* s2, size_t n) {
 }
 
 void memmove(void* dest, const void* src, size_t n) {
+    // Copying forwards is fine unless dest overlaps the end of src - memcpy
+    // always reads a block before writing it.
+    if ((uint8_t*)dest <= (uint8_t*)src || (uint8_t*)dest >= (uint8_t*)src + n) {
+        memcpy(dest, src, n);
+        return;
+    }
+
+    // otherwise copy backwards
+
+    dest = (uint8_t*)dest + n;
+    src = (uint8_t*)src + n;
+
+    while (n >= sizeof(size_t)) {
+        dest = (size_t*)dest - 1;
+        src = (size_t*)src - 1;
+
+        *(size_t*)dest = *(size_t*)src;
+
+        n -= sizeof(size_t);
+    }
+
     while (n > 0) {
-        *(uint8_t*)dest = *(uint8_t*)src;
+        dest = (uint8_t*)dest - 1;
+        src = (uint8_t*)src - 1;
 
-        dest = (uint8_t*)dest + 1;
-        src = (uint8_t*)src + 1;
+        *(uint8_t*)dest = *(uint8_t*)src;
 
         n--;
     }
@@ -23,25 +23,53 @@
 #include "quibble.h"
 #include "tinymt32.h"
 #include "print.h"
+#include "sha256.h"
+
+#ifdef IMAGE_STATS
+#include <intrin.h>
+#endif
+
+#define EXPORT_HASH_THRESHOLD 64 // lookups against an image before we build a hash table of its exports
+#define HEADER_READ_SIZE EFI_PAGE_SIZE // initial read, which should be enough for the PE headers
+#define READ_GAP_MAX 0x10000 // largest gap we'll read through to merge two sections into one read
+#define STREAM_CHUNK_SIZE 0x10000 // size of reads when hashing files
 
 typedef struct {
     EFI_PE_IMAGE public;
     void* va;
     uint32_t size;
     uint32_t pages;
+    uint32_t* export_hash; // index + 1 of each export name, or 0 if slot empty
+    uint32_t export_hash_size;
+    uint32_t export_lookups;
+    bool reloc_pending; // relocations left for Prepare, so still relative to ImageBase
+    bool file_hashed;
+    uint8_t file_hash[SHA256_HASH_SIZE];
+    uint32_t file_checksum;
 } pe_image;
 
 static EFI_HANDLE pe_handle = NULL;
 static EFI_PE_LOADER_PROTOCOL proto;
 static EFI_BOOT_SERVICES* bs;
 static tinymt32_t mt;
+static bool defer_relocations = false;
+static bool hash_files = false;
 
 static EFI_STATUS EFIAPI Load(EFI_FILE_HANDLE File, void* VirtualAddress, EFI_PE_IMAGE** Image);
+static EFI_STATUS EFIAPI LoadAt(EFI_FILE_HANDLE File, void* VirtualAddress, EFI_PE_LOADER_ALLOCATE_PAGES AllocatePages,
+                                EFI_PE_IMAGE** Image);
+static EFI_STATUS EFIAPI LoadFromMemory(void* Data, UINTN Pages, void* VirtualAddress, EFI_PE_IMAGE** Image);
+static void EFIAPI DeferRelocations(BOOLEAN Defer);
+static void EFIAPI HashFiles(BOOLEAN Hash);
 
 EFI_STATUS pe_register(EFI_BOOT_SERVICES* BootServices, uint32_t seed) {
     EFI_GUID pe_guid = PE_LOADER_PROTOCOL;
 
     proto.Load = Load;
+    proto.LoadAt = LoadAt;
+    proto.LoadFromMemory = LoadFromMemory;
+    proto.DeferRelocations = DeferRelocations;
+    proto.HashFiles = HashFiles;
 
     tinymt32_init(&mt, seed);
 
@@ -70,9 +98,12 @@ static bool check_header(uint8_t* data, size_t size, IMAGE_NT_HEADERS** nth) {
         return false;
     }
 
-    nt_header = (IMAGE_NT_HEADERS*)(data + dos_header->e_lfanew);
+    if ((uint64_t)dos_header->e_lfanew + sizeof(IMAGE_NT_HEADERS) > size) {
+        print_string("PE header was beyond end of image.\n");
+        return false;
+    }
 
-    // FIXME - check no overflow
+    nt_header = (IMAGE_NT_HEADERS*)(data + dos_header->e_lfanew);
 
     if (nt_header->Signature != IMAGE_NT_SIGNATURE) {
         print_string("Incorrect PE signature.\n");
@@ -114,6 +145,9 @@ static EFI_STATUS EFIAPI free_image(EFI_PE_IMAGE* This) {
     if (img->public.Data)
         bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)img->public.Data, img->pages);
 
+    if (img->export_hash)
+        bs->FreePool(img->export_hash);
+
     bs->FreePool(img);
 
     return EFI_SUCCESS;
@@ -299,6 +333,106 @@ static UINT16 EFIAPI get_dll_characteristics(EFI_PE_IMAGE* This) {
         return nt_header->OptionalHeader32.DllCharacteristics;
 }
 
+static uint32_t export_name_hash(const char* name) {
+    uint32_t hash = 0x811c9dc5;
+
+    // FNV-1a
+
+    while (*name != 0) {
+        hash ^= (uint8_t)*name;
+        hash *= 0x01000193;
+        name++;
+    }
+
+    return hash;
+}
+
+static void build_export_hash(pe_image* img, IMAGE_EXPORT_DIRECTORY* export_dir) {
+    EFI_STATUS Status;
+    uint32_t* name_table = (uint32_t*)((uint8_t*)img->public.Data + export_dir->AddressOfNames);
+    uint32_t size = 1;
+
+    while (size < export_dir->NumberOfNames * 2) {
+        size <<= 1;
+    }
+
+    Status = bs->AllocatePool(EfiLoaderData, size * sizeof(uint32_t), (void**)&img->export_hash);
+    if (EFI_ERROR(Status)) { // not fatal, we'll carry on using binary searches
+        img->export_hash = NULL;
+        return;
+    }
+
+    memset(img->export_hash, 0, size * sizeof(uint32_t));
+    img->export_hash_size = size;
+
+    for (uint32_t i = 0; i < export_dir->NumberOfNames; i++) {
+        uint32_t slot = export_name_hash((char*)((uint8_t*)img->public.Data + name_table[i])) & (size - 1);
+
+        while (img->export_hash[slot] != 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+
+        img->export_hash[slot] = i + 1;
+    }
+}
+
+// Finds the index of an exported name. We try the import's hint first, which is usually
+// right if the image was linked against this build. After that we use the hash table, if
+// this image is imported from enough to have one, or otherwise a binary search, as the
+// names are sorted. If the binary search fails, check every name in case they weren't.
+static bool find_export_index(pe_image* img, IMAGE_EXPORT_DIRECTORY* export_dir, const char* name, uint32_t hint,
+                              uint32_t* index) {
+    uint32_t* name_table = (uint32_t*)((uint8_t*)img->public.Data + export_dir->AddressOfNames);
+    uint32_t start = 0, end = export_dir->NumberOfNames;
+
+    if (hint < export_dir->NumberOfNames && !strcmp((char*)((uint8_t*)img->public.Data + name_table[hint]), name)) {
+        *index = hint;
+        return true;
+    }
+
+    if (!img->export_hash && export_dir->NumberOfNames > 0 && ++img->export_lookups >= EXPORT_HASH_THRESHOLD)
+        build_export_hash(img, export_dir);
+
+    if (img->export_hash) {
+        uint32_t slot = export_name_hash(name) & (img->export_hash_size - 1);
+
+        while (img->export_hash[slot] != 0) {
+            uint32_t i = img->export_hash[slot] - 1;
+
+            if (!strcmp((char*)((uint8_t*)img->public.Data + name_table[i]), name)) {
+                *index = i;
+                return true;
+            }
+
+            slot = (slot + 1) & (img->export_hash_size - 1);
+        }
+
+        return false;
+    }
+
+    while (start < end) {
+        uint32_t mid = (start + end) / 2;
+        int cmp = strcmp((char*)((uint8_t*)img->public.Data + name_table[mid]), name);
+
+        if (cmp == 0) {
+            *index = mid;
+            return true;
+        } else if (cmp < 0)
+            start = mid + 1;
+        else
+            end = mid;
+    }
+
+    for (uint32_t i = 0; i < export_dir->NumberOfNames; i++) {
+        if (!strcmp((char*)((uint8_t*)img->public.Data + name_table[i]), name)) {
+            *index = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static EFI_STATUS resolve_imports2_64(pe_image* img, pe_image* img2, IMAGE_EXPORT_DIRECTORY* export_dir,
                                    uint64_t* orig_thunk_table, uint64_t* thunk_table,
                                    EFI_PE_IMAGE_RESOLVE_FORWARD ResolveForward) {
@@ -306,11 +440,8 @@ static EFI_STATUS resolve_imports2_64(pe_image* img, pe_image* img2, IMAGE_EXPOR
     IMAGE_DOS_HEADER* dos_header2 = (IMAGE_DOS_HEADER*)img2->public.Data;
     IMAGE_NT_HEADERS* nt_header2 = (IMAGE_NT_HEADERS*)((uint8_t*)img2->public.Data + dos_header2->e_lfanew);
     uint16_t* ordinal_table = (uint16_t*)((uint8_t*)img2->public.Data + export_dir->AddressOfNameOrdinals);
-    uint32_t* name_table = (uint32_t*)((uint8_t*)img2->public.Data + export_dir->AddressOfNames);
     uint32_t* function_table = (uint32_t*)((uint8_t*)img2->public.Data + export_dir->AddressOfFunctions);
 
-    // FIXME - use hints?
-
     // loop through import names
 
     while (*orig_thunk_table) {
@@ -318,22 +449,13 @@ static EFI_STATUS resolve_imports2_64(pe_image* img, pe_image* img2, IMAGE_EXPOR
         uint32_t index;
         uint16_t ordinal;
         void* func;
-        bool found = false;
 
         if (*orig_thunk_table & 0x8000000000000000)
             ordinal = (*orig_thunk_table & ~0x8000000000000000) - 1; // FIXME - make sure not out of bounds
         else {
-            for (unsigned int i = 0; i < export_dir->NumberOfNames; i++) {
-                char* export_name = (char*)((uint8_t*)img2->public.Data + name_table[i]);
-
-                if (!strcmp(export_name, name)) {
-                    index = i;
-                    found = true;
-                    break;
-                }
-            }
+            uint16_t hint = *(uint16_t*)((uint8_t*)img->public.Data + *orig_thunk_table);
 
-            if (!found) {
+            if (!find_export_index(img2, export_dir, name, hint, &index)) {
                 char s[255], *p;
 
                 p = stpcpy(s, "Unable to resolve function ");
@@ -381,11 +503,8 @@ static EFI_STATUS resolve_imports2_32(pe_image* img, pe_image* img2, IMAGE_EXPOR
     IMAGE_DOS_HEADER* dos_header2 = (IMAGE_DOS_HEADER*)img2->public.Data;
     IMAGE_NT_HEADERS* nt_header2 = (IMAGE_NT_HEADERS*)((uint8_t*)img2->public.Data + dos_header2->e_lfanew);
     uint16_t* ordinal_table = (uint16_t*)((uint8_t*)img2->public.Data + export_dir->AddressOfNameOrdinals);
-    uint32_t* name_table = (uint32_t*)((uint8_t*)img2->public.Data + export_dir->AddressOfNames);
     uint32_t* function_table = (uint32_t*)((uint8_t*)img2->public.Data + export_dir->AddressOfFunctions);
 
-    // FIXME - use hints?
-
     // loop through import names
 
     while (*orig_thunk_table) {
@@ -393,22 +512,13 @@ static EFI_STATUS resolve_imports2_32(pe_image* img, pe_image* img2, IMAGE_EXPOR
         uint32_t index;
         uint16_t ordinal;
         void* func;
-        bool found = false;
 
         if (*orig_thunk_table & 0x80000000)
             ordinal = (*orig_thunk_table & ~0x80000000) - 1; // FIXME - make sure not out of bounds
         else {
-            for (unsigned int i = 0; i < export_dir->NumberOfNames; i++) {
-                char* export_name = (char*)((uint8_t*)img2->public.Data + name_table[i]);
-
-                if (!strcmp(export_name, name)) {
-                    index = i;
-                    found = true;
-                    break;
-                }
-            }
+            uint16_t hint = *(uint16_t*)((uint8_t*)img->public.Data + *orig_thunk_table);
 
-            if (!found) {
+            if (!find_export_index(img2, export_dir, name, hint, &index)) {
                 char s[255], *p;
 
                 p = stpcpy(s, "Unable to resolve function ");
@@ -546,93 +656,117 @@ static EFI_STATUS EFIAPI resolve_imports(EFI_PE_IMAGE* This, char* LibraryName,
     return EFI_SUCCESS;
 }
 
-static void do_relocations(pe_image* img, IMAGE_NT_HEADERS* nt_header) {
+// This can be called from Prepare on an AP, so mustn't print anything or use boot services.
+static EFI_STATUS do_relocations(pe_image* img, IMAGE_NT_HEADERS* nt_header, unsigned int* done) {
     IMAGE_BASE_RELOCATION* reloc;
-    uint32_t size, count;
+    uint32_t size, count, dir_va;
     uint16_t* addr;
-    uint64_t base;
+    uint64_t base, delta;
+
+    *done = 0;
 
     if (nt_header->OptionalHeader32.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
         if (nt_header->OptionalHeader64.NumberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_BASERELOC ||
             nt_header->OptionalHeader64.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress == 0 ||
             nt_header->OptionalHeader64.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].Size < sizeof(IMAGE_BASE_RELOCATION)) {
-            return;
+            return EFI_SUCCESS;
         }
 
         size = nt_header->OptionalHeader64.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].Size;
-
-        reloc = (IMAGE_BASE_RELOCATION*)((uint8_t*)img->public.Data + nt_header->OptionalHeader64.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress);
+        dir_va = nt_header->OptionalHeader64.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress;
 
         base = nt_header->OptionalHeader64.ImageBase;
     } else {
         if (nt_header->OptionalHeader32.NumberOfRvaAndSizes <= IMAGE_DIRECTORY_ENTRY_BASERELOC ||
             nt_header->OptionalHeader32.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress == 0 ||
             nt_header->OptionalHeader32.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].Size < sizeof(IMAGE_BASE_RELOCATION)) {
-            return;
+            return EFI_SUCCESS;
         }
 
         size = nt_header->OptionalHeader32.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].Size;
-
-        reloc = (IMAGE_BASE_RELOCATION*)((uint8_t*)img->public.Data + nt_header->OptionalHeader32.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress);
+        dir_va = nt_header->OptionalHeader32.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress;
 
         base = nt_header->OptionalHeader32.ImageBase;
     }
 
+    // Everything's relative to the preferred base, so if we're loading it there there's nothing to do.
+    // Adding the delta is the same as subtracting the base and adding the VA, as it all wraps around.
+
+    delta = (uintptr_t)img->va - base;
+
+    if (delta == 0)
+        return EFI_SUCCESS;
+
+    if ((uint64_t)dir_va + size > img->size)
+        return EFI_VOLUME_CORRUPTED;
+
+    reloc = (IMAGE_BASE_RELOCATION*)((uint8_t*)img->public.Data + dir_va);
+
     do {
-        uint32_t* ptr;
+        uint8_t* ptr;
+        uint32_t avail;
+        unsigned int i;
 
-        if (size < reloc->SizeOfBlock)
-            return;
+        if (size < reloc->SizeOfBlock || reloc->SizeOfBlock < sizeof(IMAGE_BASE_RELOCATION))
+            return EFI_SUCCESS;
 
-        // FIXME - check not out of bounds
-        ptr = (uint32_t*)((uint8_t*)img->public.Data + reloc->VirtualAddress);
+        if (reloc->VirtualAddress >= img->size)
+            return EFI_VOLUME_CORRUPTED;
+
+        ptr = (uint8_t*)img->public.Data + reloc->VirtualAddress;
+
+        // the number of bytes between the start of the block's page and the end of the image
+
+        avail = img->size - reloc->VirtualAddress;
 
         addr = (uint16_t*)((uint8_t*)reloc + sizeof(IMAGE_BASE_RELOCATION));
         count = (reloc->SizeOfBlock - sizeof(IMAGE_BASE_RELOCATION)) / sizeof(uint16_t);
 
-        for (unsigned int i = 0; i < count; i++) {
-            uint16_t offset = addr[i] & 0xfff;
+        // Blocks are nearly always all DIR64 or all HIGHLOW, bar an ABSOLUTE on the end for padding,
+        // so go through runs of the same type without going back through the switch each time.
+
+        i = 0;
+
+        while (i < count) {
             uint16_t type = addr[i] >> 12;
 
             switch (type) {
                 case IMAGE_REL_BASED_ABSOLUTE:
                     // nop
+                    i++;
                 break;
 
                 case IMAGE_REL_BASED_HIGHLOW:
-                {
-                    uint32_t* ptr2 = (uint32_t*)((uint8_t*)ptr + offset);
-
-                    *ptr2 = *ptr2 - base + (uintptr_t)img->va;
-                    break;
-                }
+                    do {
+                        if ((addr[i] & 0xfff) + sizeof(uint32_t) > avail)
+                            return EFI_VOLUME_CORRUPTED;
+
+                        *(uint32_t*)(ptr + (addr[i] & 0xfff)) += (uint32_t)delta;
+                        i++;
+                        (*done)++;
+                    } while (i < count && (addr[i] >> 12) == IMAGE_REL_BASED_HIGHLOW);
+                break;
 
                 case IMAGE_REL_BASED_DIR64:
-                {
-                    uint64_t* ptr2 = (uint64_t*)((uint8_t*)ptr + offset);
-
-                    *ptr2 = *ptr2 - base + (uintptr_t)img->va;
-                    break;
-                }
-
-                default: {
-                    char s[255], *p;
-
-                    p = stpcpy(s, "Unsupported relocation type ");
-                    p = hex_to_str(p, type);
-                    p = stpcpy(p, ".\n");
-
-                    print_string(s);
+                    do {
+                        if ((addr[i] & 0xfff) + sizeof(uint64_t) > avail)
+                            return EFI_VOLUME_CORRUPTED;
+
+                        *(uint64_t*)(ptr + (addr[i] & 0xfff)) += delta;
+                        i++;
+                        (*done)++;
+                    } while (i < count && (addr[i] >> 12) == IMAGE_REL_BASED_DIR64);
+                break;
 
-                    return;
-                }
+                default:
+                    return EFI_UNSUPPORTED;
             }
         }
 
         size -= reloc->SizeOfBlock;
 
         if (size < sizeof(IMAGE_BASE_RELOCATION))
-            return;
+            return EFI_SUCCESS;
 
         reloc = (IMAGE_BASE_RELOCATION*)((uint8_t*)reloc + reloc->SizeOfBlock);
     } while (true);
@@ -664,7 +798,10 @@ static void randomize_security_cookie(pe_image* img, IMAGE_NT_HEADERS* nt_header
         if (config->SecurityCookie == 0)
             return;
 
-        cookie = (uint64_t*)((uint8_t*)img->public.Data + config->SecurityCookie - (uint8_t*)img->va);
+        if (img->reloc_pending)
+            cookie = (uint64_t*)((uint8_t*)img->public.Data + config->SecurityCookie - nt_header->OptionalHeader64.ImageBase);
+        else
+            cookie = (uint64_t*)((uint8_t*)img->public.Data + config->SecurityCookie - (uint8_t*)img->va);
 
         *(uint32_t*)cookie = tinymt32_generate_uint32(&mt);
         *((uint32_t*)cookie + 1) = tinymt32_generate_uint32(&mt);
@@ -694,7 +831,10 @@ static void randomize_security_cookie(pe_image* img, IMAGE_NT_HEADERS* nt_header
         if (config->SecurityCookie == 0)
             return;
 
-        cookie = (uint32_t*)((uint8_t*)img->public.Data + config->SecurityCookie - (uint8_t*)img->va);
+        if (img->reloc_pending)
+            cookie = (uint32_t*)((uint8_t*)img->public.Data + config->SecurityCookie - nt_header->OptionalHeader32.ImageBase);
+        else
+            cookie = (uint32_t*)((uint8_t*)img->public.Data + config->SecurityCookie - (uint8_t*)img->va);
         *cookie = tinymt32_generate_uint32(&mt);
     }
 }
@@ -913,9 +1053,7 @@ static EFI_STATUS EFIAPI find_export(EFI_PE_IMAGE* This, char* Function, UINT64*
     IMAGE_NT_HEADERS* nt_header = (IMAGE_NT_HEADERS*)((uint8_t*)img->public.Data + dos_header->e_lfanew);
     IMAGE_EXPORT_DIRECTORY* export_dir;
     uint16_t* ordinal_table;
-    uint32_t* name_table;
     uint32_t* function_table;
-    bool found = false;
     uint32_t index, ordinal;
 
     if (nt_header->OptionalHeader32.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
@@ -939,20 +1077,9 @@ static EFI_STATUS EFIAPI find_export(EFI_PE_IMAGE* This, char* Function, UINT64*
     }
 
     ordinal_table = (uint16_t*)((uint8_t*)img->public.Data + export_dir->AddressOfNameOrdinals);
-    name_table = (uint32_t*)((uint8_t*)img->public.Data + export_dir->AddressOfNames);
     function_table = (uint32_t*)((uint8_t*)img->public.Data + export_dir->AddressOfFunctions);
 
-    for (unsigned int i = 0; i < export_dir->NumberOfNames; i++) {
-        char* export_name = (char*)((uint8_t*)img->public.Data + name_table[i]);
-
-        if (!strcmp(export_name, Function)) {
-            index = i;
-            found = true;
-            break;
-        }
-    }
-
-    if (!found) {
+    if (!find_export_index(img, export_dir, Function, 0xffffffff, &index)) {
         char s[255], *p;
 
         p = stpcpy(s, "Unable to resolve function ");
@@ -1016,9 +1143,17 @@ static EFI_STATUS EFIAPI get_sections(EFI_PE_IMAGE* This, IMAGE_SECTION_HEADER**
 
 static EFI_STATUS relocate(EFI_PE_IMAGE* This, EFI_VIRTUAL_ADDRESS Address) {
     pe_image* img = _CR(This, pe_image, public);
+    EFI_STATUS Status;
     IMAGE_DOS_HEADER* dos_header;
     IMAGE_NT_HEADERS* nt_header;
     uint64_t old_va, base;
+    unsigned int relocs;
+
+    // not relocated yet, so Prepare can go straight to the new address
+    if (img->reloc_pending) {
+        img->va = (void*)(uintptr_t)Address;
+        return EFI_SUCCESS;
+    }
 
     dos_header = (IMAGE_DOS_HEADER*)img->public.Data;
     nt_header = (IMAGE_NT_HEADERS*)((uint8_t*)img->public.Data + dos_header->e_lfanew);
@@ -1031,22 +1166,251 @@ static EFI_STATUS relocate(EFI_PE_IMAGE* This, EFI_VIRTUAL_ADDRESS Address) {
         base = nt_header->OptionalHeader32.ImageBase;
 
     img->va = (void*)(uintptr_t)(Address - old_va + base); // because do_relocations works on offsets
-    do_relocations(img, nt_header);
+
+    Status = do_relocations(img, nt_header, &relocs);
+    if (EFI_ERROR(Status))
+        print_error("do_relocations", Status); // non-fatal
 
     img->va = (void*)(uintptr_t)Address;
 
     return EFI_SUCCESS;
 }
 
-static EFI_STATUS EFIAPI Load(EFI_FILE_HANDLE File, void* VirtualAddress, EFI_PE_IMAGE** Image) {
+// Applies the relocations that LoadAt left when DeferRelocations was set. Images are independent of
+// each other once loaded, so this can be run on an AP - it doesn't print anything or use boot services.
+static EFI_STATUS EFIAPI prepare(EFI_PE_IMAGE* This) {
+    pe_image* img = _CR(This, pe_image, public);
+    IMAGE_DOS_HEADER* dos_header;
+    IMAGE_NT_HEADERS* nt_header;
+    unsigned int relocs;
+
+    if (!img->reloc_pending)
+        return EFI_SUCCESS;
+
+    dos_header = (IMAGE_DOS_HEADER*)img->public.Data;
+    nt_header = (IMAGE_NT_HEADERS*)((uint8_t*)img->public.Data + dos_header->e_lfanew);
+
+    img->reloc_pending = false;
+
+    return do_relocations(img, nt_header, &relocs);
+}
+
+// Only available if the image was loaded while HashFiles was set.
+static EFI_STATUS EFIAPI get_file_hash(EFI_PE_IMAGE* This, UINT8* Hash, UINT32* CheckSum) {
+    pe_image* img = _CR(This, pe_image, public);
+
+    if (!img->file_hashed)
+        return EFI_NOT_FOUND;
+
+    memcpy(Hash, img->file_hash, SHA256_HASH_SIZE);
+    *CheckSum = img->file_checksum;
+
+    return EFI_SUCCESS;
+}
+
+static void init_image_functions(pe_image* img) {
+    img->public.Free = free_image;
+    img->public.GetEntryPoint = get_entry_point;
+    img->public.ListImports = list_imports;
+    img->public.GetAddress = get_address;
+    img->public.GetSize = get_size;
+    img->public.ResolveImports = resolve_imports;
+    img->public.GetCheckSum = get_checksum;
+    img->public.GetDllCharacteristics = get_dll_characteristics;
+    img->public.MoveAddress = move_address;
+    img->public.GetVersion = get_version;
+    img->public.FindExport = find_export;
+    img->public.GetCharacteristics = get_characteristics;
+    img->public.GetSections = get_sections;
+    img->public.Relocate = relocate;
+    img->public.Prepare = prepare;
+    img->public.GetFileHash = get_file_hash;
+}
+
+// Returns how much of a section is backed by data in the file.
+static uint32_t section_raw_size(IMAGE_SECTION_HEADER* section) {
+    if (section->PointerToRawData == 0)
+        return 0;
+
+    return section->SizeOfRawData < section->VirtualSize ? section->SizeOfRawData : section->VirtualSize;
+}
+
+static EFI_STATUS read_at(EFI_FILE_HANDLE File, uint64_t offset, size_t size, void* buf) {
+    EFI_STATUS Status;
+    UINTN read_size = size;
+
+    Status = File->SetPosition(File, offset);
+    if (EFI_ERROR(Status)) {
+        print_error("File->SetPosition", Status);
+        return Status;
+    }
+
+    Status = File->Read(File, &read_size, buf);
+    if (EFI_ERROR(Status)) {
+        print_error("File->Read", Status);
+        return Status;
+    }
+
+    if (read_size != size) {
+        print_string("Short read from file.\n");
+        return EFI_VOLUME_CORRUPTED;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Adds bytes at the given file offset to a PE checksum. Only the total modulo 0xffff matters,
+// so we can add 32 bits at a time - the high word counts the same as if it had been added by itself.
+static uint64_t checksum_add(uint64_t sum, const uint8_t* buf, size_t len, uint64_t offset) {
+    while (len > 0 && (offset & 3)) {
+        sum += (uint64_t)*buf << ((offset & 1) * 8);
+        buf++;
+        len--;
+        offset++;
+    }
+
+    while (len >= sizeof(uint32_t)) {
+        sum += *(uint32_t*)buf;
+        buf += sizeof(uint32_t);
+        len -= sizeof(uint32_t);
+    }
+
+    offset = 0;
+
+    while (len > 0) {
+        sum += (uint64_t)*buf << ((offset & 1) * 8);
+        buf++;
+        len--;
+        offset++;
+    }
+
+    return sum;
+}
+
+// Copies whatever parts of the sections lie in the file range [offset, offset + len) into the image.
+static void copy_to_sections(pe_image* img, IMAGE_SECTION_HEADER* sections, unsigned int num_sections,
+                             const uint8_t* buf, uint64_t offset, size_t len) {
+    for (unsigned int i = 0; i < num_sections; i++) {
+        uint32_t raw_size = section_raw_size(&sections[i]);
+        uint64_t start, end;
+
+        if (raw_size == 0)
+            continue;
+
+        start = sections[i].PointerToRawData > offset ? sections[i].PointerToRawData : offset;
+        end = (uint64_t)sections[i].PointerToRawData + raw_size;
+
+        if (end > offset + len)
+            end = offset + len;
+
+        if (start >= end)
+            continue;
+
+        memcpy((uint8_t*)img->public.Data + sections[i].VirtualAddress + (start - sections[i].PointerToRawData),
+               buf + (start - offset), end - start);
+    }
+}
+
+// Used instead of reading each section separately when HashFiles is set. We read the whole file in
+// order, through a bounce buffer, and work out its SHA-256 hash and PE checksum while each chunk is
+// still in the cache. The headers have already been read into the image by this point.
+static EFI_STATUS stream_file(pe_image* img, EFI_FILE_HANDLE File, size_t file_size, size_t header_size,
+                              IMAGE_NT_HEADERS* nt_header, IMAGE_SECTION_HEADER* sections,
+                              unsigned int num_sections) {
+    EFI_STATUS Status;
+    sha256_ctx ctx;
+    uint64_t sum, checksum_offset;
+    uint8_t* buf;
+    size_t pos;
+
+    sha256_init(&ctx);
+
+    sha256_update(&ctx, img->public.Data, header_size);
+    sum = checksum_add(0, img->public.Data, header_size, 0);
+
+    // the checksum doesn't include itself
+
+    checksum_offset = (uint8_t*)&nt_header->OptionalHeader32.CheckSum - (uint8_t*)img->public.Data;
+
+    for (unsigned int i = 0; i < sizeof(uint32_t); i++) {
+        sum += 0xffff - ((uint64_t)((uint8_t*)img->public.Data)[checksum_offset + i] << (((checksum_offset + i) & 1) * 8));
+    }
+
+    // sections whose data is inside the headers, which isn't going to be read again
+    copy_to_sections(img, sections, num_sections, img->public.Data, 0, header_size);
+
+    pos = header_size;
+
+    if (pos < file_size) {
+        Status = bs->AllocatePool(EfiLoaderData, STREAM_CHUNK_SIZE, (void**)&buf);
+        if (EFI_ERROR(Status)) {
+            print_error("AllocatePool", Status);
+            return Status;
+        }
+
+        Status = File->SetPosition(File, pos);
+        if (EFI_ERROR(Status)) {
+            print_error("File->SetPosition", Status);
+            bs->FreePool(buf);
+            return Status;
+        }
+
+        while (pos < file_size) {
+            size_t size = file_size - pos < STREAM_CHUNK_SIZE ? file_size - pos : STREAM_CHUNK_SIZE;
+            UINTN read_size = size;
+
+            Status = File->Read(File, &read_size, buf);
+            if (EFI_ERROR(Status)) {
+                print_error("File->Read", Status);
+                bs->FreePool(buf);
+                return Status;
+            }
+
+            if (read_size != size) {
+                print_string("Short read from file.\n");
+                bs->FreePool(buf);
+                return EFI_VOLUME_CORRUPTED;
+            }
+
+            sha256_update(&ctx, buf, size);
+            sum = checksum_add(sum, buf, size, pos);
+            copy_to_sections(img, sections, num_sections, buf, pos, size);
+
+            pos += size;
+        }
+
+        bs->FreePool(buf);
+    }
+
+    sha256_final(&ctx, img->file_hash);
+
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    img->file_checksum = (uint32_t)sum + (uint32_t)file_size;
+    img->file_hashed = true;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI LoadAt(EFI_FILE_HANDLE File, void* VirtualAddress, EFI_PE_LOADER_ALLOCATE_PAGES AllocatePages,
+                                EFI_PE_IMAGE** Image) {
     EFI_STATUS Status;
     EFI_FILE_INFO file_info;
     pe_image* img;
-    size_t file_size, pages;
+    size_t file_size, header_size, read_size;
     EFI_PHYSICAL_ADDRESS addr;
-    uint8_t* data;
+    uint8_t* data = NULL;
+    uint32_t nt_offset;
     IMAGE_NT_HEADERS* nt_header;
     IMAGE_SECTION_HEADER* sections;
+    unsigned int num_sections;
+    bool ordered;
+#ifdef IMAGE_STATS
+    uint64_t start_cycles = __rdtsc(), reloc_cycles;
+#endif
+    unsigned int relocs;
 
     Status = bs->AllocatePool(EfiLoaderData, sizeof(pe_image), (void**)&img);
     if (EFI_ERROR(Status)) {
@@ -1055,6 +1419,11 @@ static EFI_STATUS EFIAPI Load(EFI_FILE_HANDLE File, void* VirtualAddress, EFI_PE
     }
 
     img->public.Data = NULL;
+    img->export_hash = NULL;
+    img->export_hash_size = 0;
+    img->export_lookups = 0;
+    img->reloc_pending = false;
+    img->file_hashed = false;
 
     {
         EFI_GUID guid = EFI_FILE_INFO_ID;
@@ -1091,47 +1460,43 @@ static EFI_STATUS EFIAPI Load(EFI_FILE_HANDLE File, void* VirtualAddress, EFI_PE
             file_size = file_info.FileSize;
     }
 
-    pages = file_size / EFI_PAGE_SIZE;
-    if (file_size % EFI_PAGE_SIZE != 0)
-        pages++;
-
-    if (pages == 0) {
+    if (file_size == 0) {
         bs->FreePool(img);
         return EFI_INVALID_PARAMETER;
     }
 
-    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &addr);
+    // read the first page of the file, so we know how big the image is going to be
+
+    read_size = file_size < HEADER_READ_SIZE ? file_size : HEADER_READ_SIZE;
+
+    Status = bs->AllocatePool(EfiLoaderData, read_size, (void**)&data);
     if (EFI_ERROR(Status)) {
-        print_error("AllocatePages", Status);
+        print_error("AllocatePool", Status);
         bs->FreePool(img);
         return Status;
     }
 
-    data = (uint8_t*)(uintptr_t)addr;
-
-    {
-        UINTN read_size = pages * EFI_PAGE_SIZE;
+    Status = read_at(File, 0, read_size, data);
+    if (EFI_ERROR(Status))
+        goto end;
 
-        Status = File->Read(File, &read_size, data);
-        if (EFI_ERROR(Status)) {
-            print_error("File->Read", Status);
-            bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, pages);
-            bs->FreePool(img);
-            return Status;
-        }
-    }
-
-    if (!check_header(data, file_size, &nt_header)) {
+    if (!check_header(data, read_size, &nt_header)) {
         print_string("Header check failed.\n");
-        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, pages);
-        bs->FreePool(img);
-        return EFI_INVALID_PARAMETER;
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
     }
 
-    if (nt_header->OptionalHeader32.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+    nt_offset = (uint32_t)((uint8_t*)nt_header - data);
+
+    if (nt_header->OptionalHeader32.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
         img->size = nt_header->OptionalHeader64.SizeOfImage;
-    else
+        header_size = nt_header->OptionalHeader64.SizeOfHeaders;
+    } else {
         img->size = nt_header->OptionalHeader32.SizeOfImage;
+        header_size = nt_header->OptionalHeader32.SizeOfHeaders;
+    }
+
+    num_sections = nt_header->FileHeader.NumberOfSections;
 
     img->pages = img->size / EFI_PAGE_SIZE;
     if ((img->size % EFI_PAGE_SIZE) != 0)
@@ -1139,17 +1504,26 @@ static EFI_STATUS EFIAPI Load(EFI_FILE_HANDLE File, void* VirtualAddress, EFI_PE
 
     if (img->pages == 0) {
         print_string("Image size was 0.\n");
-        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, pages);
-        bs->FreePool(img);
-        return EFI_INVALID_PARAMETER;
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
     }
 
-    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, img->pages, &addr);
+    if (header_size > file_size || header_size > img->size ||
+        nt_offset + offsetof(IMAGE_NT_HEADERS, OptionalHeader32) + nt_header->FileHeader.SizeOfOptionalHeader +
+        (num_sections * sizeof(IMAGE_SECTION_HEADER)) > header_size) {
+        print_string("Invalid header size.\n");
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
+    }
+
+    if (AllocatePages)
+        Status = AllocatePages(img->pages, &addr);
+    else
+        Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, img->pages, &addr);
+
     if (EFI_ERROR(Status)) {
         print_error("AllocatePages", Status);
-        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, pages);
-        bs->FreePool(img);
-        return Status;
+        goto end;
     }
 
     img->public.Data = (uint8_t*)(uintptr_t)addr;
@@ -1159,57 +1533,209 @@ static EFI_STATUS EFIAPI Load(EFI_FILE_HANDLE File, void* VirtualAddress, EFI_PE
     else // if VirtualAddress not set, use physical address
         img->va = (void*)(uintptr_t)addr;
 
-    if (nt_header->OptionalHeader32.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC) {
-        sections = (IMAGE_SECTION_HEADER*)((uint8_t*)&nt_header->OptionalHeader64 + nt_header->FileHeader.SizeOfOptionalHeader);
+    // copy header, reading the rest of it if it didn't fit in the first page
+
+    if (header_size > read_size) {
+        memcpy(img->public.Data, data, read_size);
+
+        Status = read_at(File, read_size, header_size - read_size, (uint8_t*)img->public.Data + read_size);
+        if (EFI_ERROR(Status))
+            goto end;
+    } else
+        memcpy(img->public.Data, data, header_size);
+
+    bs->FreePool(data);
+    data = NULL;
+
+    nt_header = (IMAGE_NT_HEADERS*)((uint8_t*)img->public.Data + nt_offset);
+    sections = (IMAGE_SECTION_HEADER*)((uint8_t*)&nt_header->OptionalHeader32 + nt_header->FileHeader.SizeOfOptionalHeader);
+
+    ordered = true;
+
+    for (unsigned int i = 0; i < num_sections; i++) {
+        uint32_t raw_size = section_raw_size(&sections[i]);
+
+        if ((uint64_t)sections[i].VirtualAddress + sections[i].VirtualSize > (uint64_t)img->pages * EFI_PAGE_SIZE) {
+            print_string("Section extends beyond end of image.\n");
+            Status = EFI_INVALID_PARAMETER;
+            goto end;
+        }
+
+        if (raw_size > 0 && (uint64_t)sections[i].PointerToRawData + raw_size > file_size) {
+            print_string("Section extends beyond end of file.\n");
+            Status = EFI_INVALID_PARAMETER;
+            goto end;
+        }
+
+        if (i > 0 && sections[i].VirtualAddress < sections[i - 1].VirtualAddress + sections[i - 1].VirtualSize)
+            ordered = false;
+    }
+
+    // Unless we're hashing the file, read each section straight into place. If the sections are
+    // in order, and the gap between two of them is the same on disk as in memory, we read them in
+    // one go - this is the usual case when FileAlignment and SectionAlignment are the same.
 
-        // copy header
-        memcpy(img->public.Data, data, nt_header->OptionalHeader64.SizeOfHeaders);
+    if (hash_files) {
+        Status = stream_file(img, File, file_size, header_size, nt_header, sections, num_sections);
+        if (EFI_ERROR(Status))
+            goto end;
     } else {
-        sections = (IMAGE_SECTION_HEADER*)((uint8_t*)&nt_header->OptionalHeader32 + nt_header->FileHeader.SizeOfOptionalHeader);
+        uint32_t run_offset = 0, run_va = 0, run_size = 0;
 
-        // copy header
-        memcpy(img->public.Data, data, nt_header->OptionalHeader32.SizeOfHeaders);
+        for (unsigned int i = 0; i < num_sections; i++) {
+            uint32_t raw_size = section_raw_size(&sections[i]);
+
+            if (raw_size == 0)
+                continue;
+
+            if (run_size > 0 && ordered && sections[i].PointerToRawData >= run_offset + run_size &&
+                sections[i].PointerToRawData - run_offset == sections[i].VirtualAddress - run_va &&
+                sections[i].PointerToRawData - run_offset - run_size <= READ_GAP_MAX) {
+                run_size = sections[i].PointerToRawData + raw_size - run_offset;
+                continue;
+            }
+
+            if (run_size > 0) {
+                Status = read_at(File, run_offset, run_size, (uint8_t*)img->public.Data + run_va);
+                if (EFI_ERROR(Status))
+                    goto end;
+            }
+
+            run_offset = sections[i].PointerToRawData;
+            run_va = sections[i].VirtualAddress;
+            run_size = raw_size;
+        }
+
+        if (run_size > 0) {
+            Status = read_at(File, run_offset, run_size, (uint8_t*)img->public.Data + run_va);
+            if (EFI_ERROR(Status))
+                goto end;
+        }
     }
 
-    for (unsigned int i = 0; i < nt_header->FileHeader.NumberOfSections; i++) {
-        uint32_t section_size;
+    // zero the parts of sections not backed by the file - this has to come after
+    // all the reads, as a merged read will have written over the gaps
 
-        // FIXME - check no overruns
+    for (unsigned int i = 0; i < num_sections; i++) {
+        uint32_t raw_size = section_raw_size(&sections[i]);
 
-        section_size = sections[i].VirtualSize;
+        if (raw_size < sections[i].VirtualSize)
+            memset((uint8_t*)img->public.Data + sections[i].VirtualAddress + raw_size, 0, sections[i].VirtualSize - raw_size);
+    }
 
-        if (sections[i].SizeOfRawData < section_size)
-            section_size = sections[i].SizeOfRawData;
+#ifdef IMAGE_STATS
+    reloc_cycles = __rdtsc();
+#endif
 
-        if (section_size > 0 && sections[i].PointerToRawData != 0)
-            memcpy((uint8_t*)img->public.Data + sections[i].VirtualAddress, data + sections[i].PointerToRawData, section_size);
+    relocs = 0;
 
-        if (section_size < sections[i].VirtualSize) // if short, pad with zeroes
-            memset((uint8_t*)img->public.Data + sections[i].VirtualAddress + section_size, 0, sections[i].VirtualSize - section_size);
+    if (defer_relocations)
+        img->reloc_pending = true;
+    else {
+        Status = do_relocations(img, nt_header, &relocs);
+        if (EFI_ERROR(Status))
+            print_error("do_relocations", Status); // non-fatal
     }
 
-    do_relocations(img, nt_header);
+#ifdef IMAGE_STATS
+    {
+        char s[255], *p;
+        uint64_t end_cycles = __rdtsc();
+
+        p = stpcpy(s, "pe: read ");
+        p = dec_to_str(p, file_size);
+        p = stpcpy(p, " bytes in ");
+        p = dec_to_str(p, reloc_cycles - start_cycles);
+        p = stpcpy(p, " cycles, relocated ");
+        p = dec_to_str(p, relocs);
+        p = stpcpy(p, " addresses in ");
+        p = dec_to_str(p, end_cycles - reloc_cycles);
+        p = stpcpy(p, " cycles\n");
+
+        print_string(s);
+    }
+#endif
 
     randomize_security_cookie(img, nt_header);
 
-    bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, pages);
+    init_image_functions(img);
 
-    img->public.Free = free_image;
-    img->public.GetEntryPoint = get_entry_point;
-    img->public.ListImports = list_imports;
-    img->public.GetAddress = get_address;
-    img->public.GetSize = get_size;
-    img->public.ResolveImports = resolve_imports;
-    img->public.GetCheckSum = get_checksum;
-    img->public.GetDllCharacteristics = get_dll_characteristics;
-    img->public.MoveAddress = move_address;
-    img->public.GetVersion = get_version;
-    img->public.FindExport = find_export;
-    img->public.GetCharacteristics = get_characteristics;
-    img->public.GetSections = get_sections;
-    img->public.Relocate = relocate;
+    *Image = &img->public;
+
+    Status = EFI_SUCCESS;
+
+end:
+    if (data)
+        bs->FreePool(data);
+
+    if (EFI_ERROR(Status)) {
+        if (img->public.Data)
+            bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)img->public.Data, img->pages);
+
+        bs->FreePool(img);
+    }
+
+    return Status;
+}
+
+static EFI_STATUS EFIAPI Load(EFI_FILE_HANDLE File, void* VirtualAddress, EFI_PE_IMAGE** Image) {
+    return LoadAt(File, VirtualAddress, NULL, Image);
+}
+
+static EFI_STATUS EFIAPI LoadFromMemory(void* Data, UINTN Pages, void* VirtualAddress, EFI_PE_IMAGE** Image) {
+    EFI_STATUS Status;
+    pe_image* img;
+    IMAGE_NT_HEADERS* nt_header;
+
+    if (!check_header(Data, Pages * EFI_PAGE_SIZE, &nt_header)) {
+        print_string("Header check failed.\n");
+        return EFI_INVALID_PARAMETER;
+    }
+
+    Status = bs->AllocatePool(EfiLoaderData, sizeof(pe_image), (void**)&img);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        return Status;
+    }
+
+    if (nt_header->OptionalHeader32.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+        img->size = nt_header->OptionalHeader64.SizeOfImage;
+    else
+        img->size = nt_header->OptionalHeader32.SizeOfImage;
+
+    img->pages = img->size / EFI_PAGE_SIZE;
+    if ((img->size % EFI_PAGE_SIZE) != 0)
+        img->pages++;
+
+    if (img->pages != Pages) {
+        print_string("Image size did not match.\n");
+        bs->FreePool(img);
+        return EFI_INVALID_PARAMETER;
+    }
+
+    img->public.Data = Data;
+    img->va = VirtualAddress;
+    img->export_hash = NULL;
+    img->export_hash_size = 0;
+    img->export_lookups = 0;
+    img->reloc_pending = false;
+    img->file_hashed = false;
+
+    // already relocated, but the cookie shouldn't be the same as last time
+
+    randomize_security_cookie(img, nt_header);
+
+    init_image_functions(img);
 
     *Image = &img->public;
 
     return EFI_SUCCESS;
 }
+
+static void EFIAPI DeferRelocations(BOOLEAN Defer) {
+    defer_relocations = Defer;
+}
+
+static void EFIAPI HashFiles(BOOLEAN Hash) {
+    hash_files = Hash;
+}
@@ -15,6 +15,7 @@ static FT_Face face = NULL;
 static void* font_data = NULL;
 static size_t font_size;
 bool gop_console = false;
+bool print_quiet = false;
 
 unsigned int font_height = 0;
 
@@ -309,6 +310,9 @@ void init_gop_console() {
 }
 
 void print_string(const char* s) {
+    if (print_quiet)
+        return;
+
     if (face)
         draw_text_ft(s, &console_pos, 0x000000, 0xffffff);
     else {
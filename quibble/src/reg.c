@@ -22,11 +22,67 @@
 #include "winreg.h"
 #include "print.h"
 
+#ifdef REG_STATS
+#include <intrin.h>
+#endif
+
+#define KEY_CACHE_SIZE 64 // must be a power of two
+#define KEY_CACHE_NAME_LEN 32
+
+typedef struct {
+    HKEY parent;
+    HKEY child;
+    uint16_t name_len;
+    WCHAR name[KEY_CACHE_NAME_LEN]; // upper-cased
+} key_cache_entry;
+
+typedef struct {
+    uint32_t old_cell;
+    uint32_t new_cell;
+} sk_map_entry;
+
+typedef struct {
+    uint32_t cell; // subkey list in the old hive
+    uint32_t fixup; // offset in the new hive of where to put its new cell
+    uint32_t parent; // new cell of the key it belongs to
+    bool root_allowed;
+} compact_item;
+
+typedef struct {
+    uint8_t* data;
+    uint32_t size; // space available for bins
+    uint32_t pos;
+    uint32_t bin_end;
+    sk_map_entry* sk; // sorted by old_cell
+    unsigned int sk_count;
+    compact_item* stack; // subkey lists still to copy
+    unsigned int stack_count;
+    unsigned int stack_alloc;
+} compact_ctx;
+
+#ifdef REG_STATS
+typedef struct {
+    uint64_t open_cycles;
+    uint64_t find_key_calls;
+    uint64_t components;
+    uint64_t cache_hits;
+    uint64_t key_nodes;
+    uint64_t value_queries;
+    uint64_t value_nodes;
+} reg_stats;
+#endif
+
 typedef struct {
     EFI_REGISTRY_HIVE public;
     size_t size;
     UINTN pages;
     void* data;
+    uint32_t* bin_end; // for each page, the offset of the end of its bin, or 0 if not in one
+    uint32_t bin_pages;
+    key_cache_entry key_cache[KEY_CACHE_SIZE];
+#ifdef REG_STATS
+    reg_stats stats;
+#endif
 } hive;
 
 static EFI_HANDLE reg_handle = NULL;
@@ -51,9 +107,23 @@ EFI_STATUS reg_unregister() {
     return bs->UninstallProtocolInterface(&reg_handle, &reg_guid, EFI_NATIVE_INTERFACE);
 }
 
+static uint32_t calc_checksum(void* data) {
+    uint32_t csum = 0;
+
+    for (unsigned int i = 0; i < 127; i++) {
+        csum ^= ((uint32_t*)data)[i];
+    }
+
+    if (csum == 0xffffffff)
+        csum = 0xfffffffe;
+    else if (csum == 0)
+        csum = 1;
+
+    return csum;
+}
+
 static bool check_header(hive* h) {
     HBASE_BLOCK* base_block = (HBASE_BLOCK*)h->data;
-    uint32_t csum;
 
     if (base_block->Signature != HV_HBLOCK_SIGNATURE) {
         print_string("Invalid signature.\n");
@@ -92,20 +162,7 @@ static bool check_header(hive* h) {
         return false;
     }
 
-    // check checksum
-
-    csum = 0;
-
-    for (unsigned int i = 0; i < 127; i++) {
-        csum ^= ((uint32_t*)h->data)[i];
-    }
-
-    if (csum == 0xffffffff)
-        csum = 0xfffffffe;
-    else if (csum == 0)
-        csum = 1;
-
-    if (csum != base_block->CheckSum) {
+    if (calc_checksum(h->data) != base_block->CheckSum) {
         print_string("Invalid checksum.\n");
         return false;
     }
@@ -113,12 +170,47 @@ static bool check_header(hive* h) {
     return true;
 }
 
+#ifdef REG_STATS
+static void print_stats(hive* h) {
+    char s[255], *p;
+
+    p = stpcpy(s, "reg: opened in ");
+    p = dec_to_str(p, h->stats.open_cycles);
+    p = stpcpy(p, " cycles, ");
+    p = dec_to_str(p, h->stats.find_key_calls);
+    p = stpcpy(p, " FindKey calls (");
+    p = dec_to_str(p, h->stats.components);
+    p = stpcpy(p, " components, ");
+    p = dec_to_str(p, h->stats.cache_hits);
+    p = stpcpy(p, " cached), ");
+    p = dec_to_str(p, h->stats.key_nodes);
+    p = stpcpy(p, " key nodes read\n");
+
+    print_string(s);
+
+    p = stpcpy(s, "reg: ");
+    p = dec_to_str(p, h->stats.value_queries);
+    p = stpcpy(p, " value queries, ");
+    p = dec_to_str(p, h->stats.value_nodes);
+    p = stpcpy(p, " value nodes read\n");
+
+    print_string(s);
+}
+#endif
+
 static EFI_STATUS EFIAPI close_hive(EFI_REGISTRY_HIVE* This) {
     hive* h = _CR(This, hive, public);
 
+#ifdef REG_STATS
+    print_stats(h);
+#endif
+
     if (h->data)
         bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)h->data, h->pages);
 
+    if (h->bin_end)
+        bs->FreePool(h->bin_end);
+
     bs->FreePool(h);
 
     return EFI_SUCCESS;
@@ -133,84 +225,267 @@ static EFI_STATUS EFIAPI find_root(EFI_REGISTRY_HIVE* This, HKEY* Key) {
     return EFI_SUCCESS;
 }
 
-static EFI_STATUS EFIAPI enum_keys(EFI_REGISTRY_HIVE* This, HKEY Key, UINT32 Index, WCHAR* Name, UINT32 NameLength) {
-    hive* h = _CR(This, hive, public);
-    int32_t size;
-    CM_KEY_NODE* nk;
-    CM_KEY_FAST_INDEX* lh;
-    CM_KEY_NODE* nk2;
-    bool overflow = false;
+// Returns the contents of the cell at offset cell, or NULL if it is free or doesn't lie
+// within a bin's cells.
+static void* get_cell(hive* h, uint32_t cell, uint32_t* size) {
+    uint32_t page = cell / EFI_PAGE_SIZE;
+    uint32_t end;
+    int32_t cell_size;
 
-    // FIXME - make sure no buffer overruns (here and elsewhere)
+    if (page >= h->bin_pages || h->bin_end[page] == 0)
+        return NULL;
 
-    // find parent key node
+    end = h->bin_end[page];
 
-    size = -*(int32_t*)((uint8_t*)h->data + Key);
+    // Bins are page-aligned, so this is the bin's first page if the page before it belongs
+    // to a different bin. If so, reject offsets that point into the bin header.
 
-    if (size < 0)
-        return EFI_NOT_FOUND;
+    if ((page == 0 || h->bin_end[page - 1] != end) && cell % EFI_PAGE_SIZE < sizeof(HBIN))
+        return NULL;
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]))
-        return EFI_INVALID_PARAMETER;
+    if (end - cell < sizeof(int32_t))
+        return NULL;
+
+    cell_size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + cell);
+
+    if (cell_size < (int32_t)sizeof(int32_t) || (uint32_t)cell_size > end - cell)
+        return NULL;
+
+    *size = cell_size - sizeof(int32_t);
+
+    return (uint8_t*)h->data + 0x1000 + cell + sizeof(int32_t);
+}
+
+static CM_KEY_NODE* get_key_node(hive* h, uint32_t cell) {
+    CM_KEY_NODE* nk;
+    uint32_t size;
+
+#ifdef REG_STATS
+    h->stats.key_nodes++;
+#endif
 
-    nk = (CM_KEY_NODE*)((uint8_t*)h->data + Key + sizeof(int32_t));
+    nk = (CM_KEY_NODE*)get_cell(h, cell, &size);
+
+    if (!nk || size < offsetof(CM_KEY_NODE, Name[0]))
+        return NULL;
 
     if (nk->Signature != CM_KEY_NODE_SIGNATURE)
-        return EFI_INVALID_PARAMETER;
+        return NULL;
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]) + nk->NameLength)
-        return EFI_INVALID_PARAMETER;
+    if (size < offsetof(CM_KEY_NODE, Name[0]) + nk->NameLength)
+        return NULL;
 
-    // FIXME - volatile keys?
+    return nk;
+}
 
-    if (Index >= nk->SubKeyCount || nk->SubKeyList == 0xffffffff)
-        return EFI_NOT_FOUND;
+// Returns a subkey list - ri, li, lf, or lh - checking that it's big enough for its entries.
+static void* get_key_index(hive* h, uint32_t cell, uint16_t* sig, uint16_t* count) {
+    void* index;
+    uint32_t size, entry_size;
 
-    // go to key index
+    index = get_cell(h, cell, &size);
 
-    size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + nk->SubKeyList);
+    if (!index || size < offsetof(CM_KEY_INDEX, List[0]))
+        return NULL;
 
-    if (size < 0)
-        return EFI_NOT_FOUND;
+    *sig = ((CM_KEY_INDEX*)index)->Signature;
+    *count = ((CM_KEY_INDEX*)index)->Count;
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_FAST_INDEX, List[0]))
-        return EFI_INVALID_PARAMETER;
+    if (*sig == CM_KEY_HASH_LEAF || *sig == CM_KEY_FAST_LEAF)
+        entry_size = sizeof(CM_INDEX);
+    else if (*sig == CM_KEY_INDEX_LEAF || *sig == CM_KEY_INDEX_ROOT)
+        entry_size = sizeof(uint32_t);
+    else
+        return NULL;
 
-    lh = (CM_KEY_FAST_INDEX*)((uint8_t*)h->data + 0x1000 + nk->SubKeyList + sizeof(int32_t));
+    if (size < offsetof(CM_KEY_INDEX, List[0]) + (*count * entry_size))
+        return NULL;
 
-    if (lh->Signature != CM_KEY_HASH_LEAF)
-        return EFI_INVALID_PARAMETER;
+    return index;
+}
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_FAST_INDEX, List[0]) + (lh->Count * sizeof(CM_INDEX)))
-        return EFI_INVALID_PARAMETER;
+static uint32_t key_index_entry(void* index, uint16_t sig, unsigned int i) {
+    if (sig == CM_KEY_HASH_LEAF || sig == CM_KEY_FAST_LEAF)
+        return ((CM_KEY_FAST_INDEX*)index)->List[i].Cell;
+    else
+        return ((CM_KEY_INDEX*)index)->List[i];
+}
 
-    if (Index >= lh->Count)
-        return EFI_INVALID_PARAMETER;
+// The hash stored in lh lists, which is name[0] * 37^(n-1) + ... + name[n-1] on the
+// upper-cased name. We only know how to upper-case ASCII, so if there's anything else
+// in the name we clear ascii and the caller shouldn't trust the hash or the sort order.
+static uint32_t key_name_hash(const WCHAR* name, UINTN len, bool* ascii) {
+    uint32_t hash = 0;
 
-    // find child key node
+    *ascii = true;
 
-    size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + lh->List[Index].Cell);
+    for (UINTN i = 0; i < len; i++) {
+        WCHAR c = name[i];
 
-    if (size < 0)
-        return EFI_NOT_FOUND;
+        if (c >= 'a' && c <= 'z')
+            c = c - 'a' + 'A';
+        else if (c >= 0x80)
+            *ascii = false;
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]))
-        return EFI_INVALID_PARAMETER;
+        hash = (hash * 37) + c;
+    }
+
+    return hash;
+}
 
-    nk2 = (CM_KEY_NODE*)((uint8_t*)h->data + 0x1000 + lh->List[Index].Cell + sizeof(int32_t));
+// Compares a key's name against name in the order Windows sorts subkey lists, i.e. on the
+// upper-cased names.
+static int compare_key_name(CM_KEY_NODE* nk, const WCHAR* name, UINTN len) {
+    UINTN nklen = nk->Flags & KEY_COMP_NAME ? nk->NameLength : nk->NameLength / sizeof(WCHAR);
 
-    if (nk2->Signature != CM_KEY_NODE_SIGNATURE)
-        return EFI_INVALID_PARAMETER;
+    // FIXME - use string protocol here to do comparison properly?
+
+    for (UINTN i = 0; i < nklen && i < len; i++) {
+        WCHAR c1 = nk->Flags & KEY_COMP_NAME ? ((uint8_t*)nk->Name)[i] : nk->Name[i];
+        WCHAR c2 = name[i];
+
+        if (c1 >= 'a' && c1 <= 'z')
+            c1 = c1 - 'a' + 'A';
+
+        if (c2 >= 'a' && c2 <= 'z')
+            c2 = c2 - 'a' + 'A';
+
+        if (c1 != c2)
+            return c1 < c2 ? -1 : 1;
+    }
+
+    if (nklen == len)
+        return 0;
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]) + nk2->NameLength)
+    return nklen < len ? -1 : 1;
+}
+
+static EFI_STATUS find_in_leaf(hive* h, uint32_t cell, const WCHAR* name, UINTN len, uint32_t hash, bool ascii,
+                               HKEY* key) {
+    void* index;
+    uint16_t sig, count;
+
+    index = get_key_index(h, cell, &sig, &count);
+
+    if (!index || sig == CM_KEY_INDEX_ROOT)
         return EFI_INVALID_PARAMETER;
 
-    if (nk2->Flags & KEY_COMP_NAME) {
+    if (sig == CM_KEY_HASH_LEAF) {
+        CM_KEY_FAST_INDEX* lh = (CM_KEY_FAST_INDEX*)index;
+
+        for (unsigned int i = 0; i < count; i++) {
+            CM_KEY_NODE* nk;
+
+            if (ascii && lh->List[i].HashKey != hash)
+                continue;
+
+            nk = get_key_node(h, lh->List[i].Cell);
+
+            if (nk && compare_key_name(nk, name, len) == 0) {
+                *key = 0x1000 + lh->List[i].Cell;
+                return EFI_SUCCESS;
+            }
+        }
+    } else if (ascii) { // lf and li lists are sorted by name
+        unsigned int lo = 0, hi = count;
+
+        while (lo < hi) {
+            unsigned int mid = (lo + hi) / 2;
+            CM_KEY_NODE* nk = get_key_node(h, key_index_entry(index, sig, mid));
+            int cmp;
+
+            if (!nk)
+                return EFI_INVALID_PARAMETER;
+
+            cmp = compare_key_name(nk, name, len);
+
+            if (cmp == 0) {
+                *key = 0x1000 + key_index_entry(index, sig, mid);
+                return EFI_SUCCESS;
+            } else if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+    } else {
+        for (unsigned int i = 0; i < count; i++) {
+            CM_KEY_NODE* nk = get_key_node(h, key_index_entry(index, sig, i));
+
+            if (nk && compare_key_name(nk, name, len) == 0) {
+                *key = 0x1000 + key_index_entry(index, sig, i);
+                return EFI_SUCCESS;
+            }
+        }
+    }
+
+    return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS find_in_root(hive* h, CM_KEY_INDEX* ri, const WCHAR* name, UINTN len, uint32_t hash, bool ascii,
+                               HKEY* key) {
+    EFI_STATUS Status;
+
+    if (ascii) {
+        unsigned int lo = 0, hi = ri->Count;
+
+        // The leaves are in order, so find the first whose last key isn't before ours.
+
+        while (lo < hi) {
+            unsigned int mid = (lo + hi) / 2;
+            void* leaf;
+            uint16_t sig, count;
+            CM_KEY_NODE* nk;
+
+            leaf = get_key_index(h, ri->List[mid], &sig, &count);
+
+            if (!leaf || sig == CM_KEY_INDEX_ROOT)
+                return EFI_INVALID_PARAMETER;
+
+            if (count == 0) {
+                lo = mid + 1;
+                continue;
+            }
+
+            nk = get_key_node(h, key_index_entry(leaf, sig, count - 1));
+
+            if (!nk)
+                return EFI_INVALID_PARAMETER;
+
+            if (compare_key_name(nk, name, len) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (lo == ri->Count)
+            return EFI_NOT_FOUND;
+
+        return find_in_leaf(h, ri->List[lo], name, len, hash, ascii, key);
+    }
+
+    for (unsigned int i = 0; i < ri->Count; i++) {
+        Status = find_in_leaf(h, ri->List[i], name, len, hash, ascii, key);
+        if (Status != EFI_NOT_FOUND)
+            return Status;
+    }
+
+    return EFI_NOT_FOUND;
+}
+
+static EFI_STATUS copy_key_name(CM_KEY_NODE* nk, WCHAR* Name, UINT32 NameLength) {
+    bool overflow = false;
+
+    // NameLength includes the terminating null
+
+    if (NameLength == 0)
+        return EFI_BUFFER_TOO_SMALL;
+
+    if (nk->Flags & KEY_COMP_NAME) {
         unsigned int i = 0;
-        char* nkname = (char*)nk2->Name;
+        uint8_t* nkname = (uint8_t*)nk->Name;
 
-        for (i = 0; i < nk2->NameLength; i++) {
-            if (i >= NameLength) {
+        for (i = 0; i < nk->NameLength; i++) {
+            if (i + 1 >= NameLength) {
                 overflow = true;
                 break;
             }
@@ -222,13 +497,13 @@ static EFI_STATUS EFIAPI enum_keys(EFI_REGISTRY_HIVE* This, HKEY Key, UINT32 Ind
     } else {
         unsigned int i = 0;
 
-        for (i = 0; i < nk2->NameLength / sizeof(WCHAR); i++) {
-            if (i >= NameLength) {
+        for (i = 0; i < nk->NameLength / sizeof(WCHAR); i++) {
+            if (i + 1 >= NameLength) {
                 overflow = true;
                 break;
             }
 
-            Name[i] = nk2->Name[i];
+            Name[i] = nk->Name[i];
         }
 
         Name[i] = 0;
@@ -237,130 +512,211 @@ static EFI_STATUS EFIAPI enum_keys(EFI_REGISTRY_HIVE* This, HKEY Key, UINT32 Ind
     return overflow ? EFI_BUFFER_TOO_SMALL : EFI_SUCCESS;
 }
 
-static EFI_STATUS find_child_key(hive* h, HKEY parent, const WCHAR* namebit, UINTN nblen, HKEY* key) {
-    int32_t size;
+static EFI_STATUS EFIAPI enum_keys(EFI_REGISTRY_HIVE* This, HKEY Key, UINT32 Index, WCHAR* Name, UINT32 NameLength) {
+    hive* h = _CR(This, hive, public);
     CM_KEY_NODE* nk;
-    CM_KEY_FAST_INDEX* lh;
+    void* index;
+    uint16_t sig, count;
+    uint32_t cell;
+    CM_KEY_NODE* nk2;
 
     // find parent key node
 
-    size = -*(int32_t*)((uint8_t*)h->data + parent);
+    nk = get_key_node(h, Key - 0x1000);
+
+    if (!nk)
+        return EFI_INVALID_PARAMETER;
+
+    // FIXME - volatile keys?
 
-    if (size < 0)
+    if (Index >= nk->SubKeyCount || nk->SubKeyList == 0xffffffff)
         return EFI_NOT_FOUND;
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]))
+    // go to key index
+
+    index = get_key_index(h, nk->SubKeyList, &sig, &count);
+
+    if (!index)
         return EFI_INVALID_PARAMETER;
 
-    nk = (CM_KEY_NODE*)((uint8_t*)h->data + parent + sizeof(int32_t));
+    if (sig == CM_KEY_INDEX_ROOT) {
+        CM_KEY_INDEX* ri = (CM_KEY_INDEX*)index;
+        unsigned int i;
 
-    if (nk->Signature != CM_KEY_NODE_SIGNATURE)
+        for (i = 0; i < ri->Count; i++) {
+            index = get_key_index(h, ri->List[i], &sig, &count);
+
+            if (!index || sig == CM_KEY_INDEX_ROOT)
+                return EFI_INVALID_PARAMETER;
+
+            if (Index < count)
+                break;
+
+            Index -= count;
+        }
+
+        if (i == ri->Count)
+            return EFI_INVALID_PARAMETER;
+    } else if (Index >= count)
+        return EFI_INVALID_PARAMETER;
+
+    cell = key_index_entry(index, sig, Index);
+
+    // find child key node
+
+    nk2 = get_key_node(h, cell);
+
+    if (!nk2)
         return EFI_INVALID_PARAMETER;
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]) + nk->NameLength)
+    return copy_key_name(nk2, Name, NameLength);
+}
+
+// Like enum_keys, but also returns the subkey itself. Position is zero on the first call, and
+// afterwards holds the leaf number in its top half and the next entry in its bottom half, so
+// that we don't have to walk an ri list from the start each time.
+static EFI_STATUS EFIAPI next_key(EFI_REGISTRY_HIVE* This, HKEY Key, UINT32* Position, HKEY* SubKey, WCHAR* Name,
+                                  UINT32 NameLength) {
+    hive* h = _CR(This, hive, public);
+    CM_KEY_NODE* nk;
+    CM_KEY_NODE* nk2;
+    void* index;
+    uint16_t sig, count;
+    uint32_t leaf_num = *Position >> 16;
+    uint32_t entry = *Position & 0xffff;
+    uint32_t cell;
+
+    nk = get_key_node(h, Key - 0x1000);
+
+    if (!nk)
         return EFI_INVALID_PARAMETER;
 
     if (nk->SubKeyCount == 0 || nk->SubKeyList == 0xffffffff)
         return EFI_NOT_FOUND;
 
-    // go to key index
+    index = get_key_index(h, nk->SubKeyList, &sig, &count);
 
-    size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + nk->SubKeyList);
+    if (!index)
+        return EFI_INVALID_PARAMETER;
 
-    if (size < 0)
-        return EFI_NOT_FOUND;
+    if (sig == CM_KEY_INDEX_ROOT) {
+        CM_KEY_INDEX* ri = (CM_KEY_INDEX*)index;
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_FAST_INDEX, List[0]))
-        return EFI_INVALID_PARAMETER;
+        while (true) {
+            if (leaf_num >= ri->Count)
+                return EFI_NOT_FOUND;
 
-    lh = (CM_KEY_FAST_INDEX*)((uint8_t*)h->data + 0x1000 + nk->SubKeyList + sizeof(int32_t));
+            index = get_key_index(h, ri->List[leaf_num], &sig, &count);
 
-    if (lh->Signature != CM_KEY_HASH_LEAF)
-        return EFI_INVALID_PARAMETER;
+            if (!index || sig == CM_KEY_INDEX_ROOT)
+                return EFI_INVALID_PARAMETER;
+
+            if (entry < count)
+                break;
+
+            leaf_num++;
+            entry = 0;
+        }
+    } else if (leaf_num != 0 || entry >= count)
+        return EFI_NOT_FOUND;
+
+    cell = key_index_entry(index, sig, entry);
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_FAST_INDEX, List[0]) + (lh->Count * sizeof(CM_INDEX)))
+    nk2 = get_key_node(h, cell);
+
+    if (!nk2)
         return EFI_INVALID_PARAMETER;
 
-    // FIXME - check against hashes
+    *SubKey = 0x1000 + cell;
+    *Position = (leaf_num << 16) | (entry + 1);
 
-    for (unsigned int i = 0; i < lh->Count; i++) {
-        CM_KEY_NODE* nk2;
+    return copy_key_name(nk2, Name, NameLength);
+}
 
-        size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + lh->List[i].Cell);
+static EFI_STATUS find_child_key(hive* h, HKEY parent, const WCHAR* namebit, UINTN nblen, HKEY* key) {
+    EFI_STATUS Status;
+    key_cache_entry* ce = NULL;
+    CM_KEY_NODE* nk;
+    void* index;
+    uint16_t sig, count;
+    uint32_t hash;
+    bool ascii;
 
-        if (size < 0)
-            continue;
+    // find parent key node
 
-        if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]))
-            continue;
+    nk = get_key_node(h, parent - 0x1000);
 
-        nk2 = (CM_KEY_NODE*)((uint8_t*)h->data + 0x1000 + lh->List[i].Cell + sizeof(int32_t));
+    if (!nk)
+        return EFI_INVALID_PARAMETER;
 
-        if (nk2->Signature != CM_KEY_NODE_SIGNATURE)
-            continue;
+    if (nk->SubKeyCount == 0 || nk->SubKeyList == 0xffffffff)
+        return EFI_NOT_FOUND;
 
-        if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]) + nk2->NameLength)
-            continue;
+    hash = key_name_hash(namebit, nblen, &ascii);
 
-        // FIXME - use string protocol here to do comparison properly?
+#ifdef REG_STATS
+    h->stats.components++;
+#endif
 
-        if (nk2->Flags & KEY_COMP_NAME) {
-            unsigned int j;
-            char* name = (char*)nk2->Name;
+    // check cache
 
-            if (nk2->NameLength != nblen)
-                continue;
+    if (ascii && nblen <= KEY_CACHE_NAME_LEN) {
+        ce = &h->key_cache[(hash ^ parent) & (KEY_CACHE_SIZE - 1)];
 
-            for (j = 0; j < nk2->NameLength; j++) {
-                WCHAR c1 = name[j];
-                WCHAR c2 = namebit[j];
+        if (ce->parent == parent && ce->name_len == nblen) {
+            UINTN i;
 
-                if (c1 >= 'A' && c1 <= 'Z')
-                    c1 = c1 - 'A' + 'a';
+            for (i = 0; i < nblen; i++) {
+                WCHAR c = namebit[i];
 
-                if (c2 >= 'A' && c2 <= 'Z')
-                    c2 = c2 - 'A' + 'a';
+                if (c >= 'a' && c <= 'z')
+                    c = c - 'a' + 'A';
 
-                if (c1 != c2)
+                if (c != ce->name[i])
                     break;
             }
 
-            if (j != nk2->NameLength)
-                continue;
+            if (i == nblen) {
+#ifdef REG_STATS
+                h->stats.cache_hits++;
+#endif
+                *key = ce->child;
+                return EFI_SUCCESS;
+            }
+        }
+    }
 
-            *key = 0x1000 + lh->List[i].Cell;
+    // go to key index
 
-            return EFI_SUCCESS;
-        } else {
-            unsigned int j;
+    index = get_key_index(h, nk->SubKeyList, &sig, &count);
 
-            if (nk2->NameLength / sizeof(WCHAR) != nblen)
-                continue;
+    if (!index)
+        return EFI_INVALID_PARAMETER;
 
-            for (j = 0; j < nk2->NameLength / sizeof(WCHAR); j++) {
-                WCHAR c1 = nk2->Name[j];
-                WCHAR c2 = namebit[j];
+    if (sig == CM_KEY_INDEX_ROOT)
+        Status = find_in_root(h, (CM_KEY_INDEX*)index, namebit, nblen, hash, ascii, key);
+    else
+        Status = find_in_leaf(h, nk->SubKeyList, namebit, nblen, hash, ascii, key);
 
-                if (c1 >= 'A' && c1 <= 'Z')
-                    c1 = c1 - 'A' + 'a';
+    if (EFI_ERROR(Status) || !ce)
+        return Status;
 
-                if (c2 >= 'A' && c2 <= 'Z')
-                    c2 = c2 - 'A' + 'a';
+    // add to cache
 
-                if (c1 != c2)
-                    break;
-            }
+    ce->parent = parent;
+    ce->child = *key;
+    ce->name_len = (uint16_t)nblen;
 
-            if (j != nk2->NameLength / sizeof(WCHAR))
-                continue;
+    for (UINTN i = 0; i < nblen; i++) {
+        WCHAR c = namebit[i];
 
-            *key = 0x1000 + lh->List[i].Cell;
+        if (c >= 'a' && c <= 'z')
+            c = c - 'a' + 'A';
 
-            return EFI_SUCCESS;
-        }
+        ce->name[i] = c;
     }
 
-    return EFI_NOT_FOUND;
+    return EFI_SUCCESS;
 }
 
 static EFI_STATUS EFIAPI find_key(EFI_REGISTRY_HIVE* This, HKEY Parent, const WCHAR* Path, HKEY* Key) {
@@ -369,6 +725,10 @@ static EFI_STATUS EFIAPI find_key(EFI_REGISTRY_HIVE* This, HKEY Parent, const WC
     UINTN nblen;
     HKEY k;
 
+#ifdef REG_STATS
+    h->stats.find_key_calls++;
+#endif
+
     do {
         nblen = 0;
         while (Path[nblen] != '\\' && Path[nblen] != 0) {
@@ -389,9 +749,31 @@ static EFI_STATUS EFIAPI find_key(EFI_REGISTRY_HIVE* This, HKEY Parent, const WC
     } while (true);
 }
 
+static CM_KEY_VALUE* get_value_node(hive* h, uint32_t cell) {
+    uint32_t size;
+    CM_KEY_VALUE* vk;
+
+#ifdef REG_STATS
+    h->stats.value_nodes++;
+#endif
+
+    vk = (CM_KEY_VALUE*)get_cell(h, cell, &size);
+
+    if (!vk || size < offsetof(CM_KEY_VALUE, Name[0]))
+        return NULL;
+
+    if (vk->Signature != CM_KEY_VALUE_SIGNATURE)
+        return NULL;
+
+    if (size < offsetof(CM_KEY_VALUE, Name[0]) + vk->NameLength)
+        return NULL;
+
+    return vk;
+}
+
 static EFI_STATUS EFIAPI enum_values(EFI_REGISTRY_HIVE* This, HKEY Key, UINT32 Index, WCHAR* Name, UINT32 NameLength, UINT32* Type) {
     hive* h = _CR(This, hive, public);
-    int32_t size;
+    uint32_t size;
     CM_KEY_NODE* nk;
     uint32_t* list;
     CM_KEY_VALUE* vk;
@@ -399,20 +781,9 @@ static EFI_STATUS EFIAPI enum_values(EFI_REGISTRY_HIVE* This, HKEY Key, UINT32 I
 
     // find key node
 
-    size = -*(int32_t*)((uint8_t*)h->data + Key);
+    nk = get_key_node(h, Key - 0x1000);
 
-    if (size < 0)
-        return EFI_NOT_FOUND;
-
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]))
-        return EFI_INVALID_PARAMETER;
-
-    nk = (CM_KEY_NODE*)((uint8_t*)h->data + Key + sizeof(int32_t));
-
-    if (nk->Signature != CM_KEY_NODE_SIGNATURE)
-        return EFI_INVALID_PARAMETER;
-
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]) + nk->NameLength)
+    if (!nk)
         return EFI_INVALID_PARAMETER;
 
     if (Index >= nk->ValuesCount || nk->Values == 0xffffffff)
@@ -420,37 +791,24 @@ static EFI_STATUS EFIAPI enum_values(EFI_REGISTRY_HIVE* This, HKEY Key, UINT32 I
 
     // go to key index
 
-    size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + nk->Values);
+    list = (uint32_t*)get_cell(h, nk->Values, &size);
 
-    if (size < 0)
+    if (!list)
         return EFI_NOT_FOUND;
 
-    if ((uint32_t)size < sizeof(int32_t) + (sizeof(uint32_t) * nk->ValuesCount))
+    if (size < sizeof(uint32_t) * nk->ValuesCount)
         return EFI_INVALID_PARAMETER;
 
-    list = (uint32_t*)((uint8_t*)h->data + 0x1000 + nk->Values + sizeof(int32_t));
-
     // find value node
 
-    size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + list[Index]);
-
-    if (size < 0)
-        return EFI_NOT_FOUND;
-
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_VALUE, Name[0]))
-        return EFI_INVALID_PARAMETER;
-
-    vk = (CM_KEY_VALUE*)((uint8_t*)h->data + 0x1000 + list[Index] + sizeof(int32_t));
-
-    if (vk->Signature != CM_KEY_VALUE_SIGNATURE)
-        return EFI_INVALID_PARAMETER;
+    vk = get_value_node(h, list[Index]);
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_VALUE, Name[0]) + vk->NameLength)
+    if (!vk)
         return EFI_INVALID_PARAMETER;
 
     if (vk->Flags & VALUE_COMP_NAME) {
         unsigned int i = 0;
-        char* nkname = (char*)vk->Name;
+        uint8_t* nkname = (uint8_t*)vk->Name;
 
         for (i = 0; i < vk->NameLength; i++) {
             if (i >= NameLength) {
@@ -482,141 +840,148 @@ static EFI_STATUS EFIAPI enum_values(EFI_REGISTRY_HIVE* This, HKEY Key, UINT32 I
     return overflow ? EFI_BUFFER_TOO_SMALL : EFI_SUCCESS;
 }
 
-static EFI_STATUS EFIAPI query_value_no_copy(EFI_REGISTRY_HIVE* This, HKEY Key, const WCHAR* Name, void** Data,
-                                             UINT32* DataLength, UINT32* Type) {
-    hive* h = _CR(This, hive, public);
-    int32_t size;
+// Returns the list of value cells for key, or NULL if it has none.
+static uint32_t* get_value_list(hive* h, HKEY Key, uint32_t* count, EFI_STATUS* Status) {
+    uint32_t size;
     CM_KEY_NODE* nk;
     uint32_t* list;
-    unsigned int namelen = wcslen(Name);
 
     // find key node
 
-    size = -*(int32_t*)((uint8_t*)h->data + Key);
+    nk = get_key_node(h, Key - 0x1000);
 
-    if (size < 0)
-        return EFI_NOT_FOUND;
+    if (!nk) {
+        *Status = EFI_INVALID_PARAMETER;
+        return NULL;
+    }
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]))
-        return EFI_INVALID_PARAMETER;
+    if (nk->ValuesCount == 0 || nk->Values == 0xffffffff) {
+        *Status = EFI_NOT_FOUND;
+        return NULL;
+    }
 
-    nk = (CM_KEY_NODE*)((uint8_t*)h->data + Key + sizeof(int32_t));
+    // go to key index
 
-    if (nk->Signature != CM_KEY_NODE_SIGNATURE)
-        return EFI_INVALID_PARAMETER;
+    list = (uint32_t*)get_cell(h, nk->Values, &size);
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]) + nk->NameLength)
-        return EFI_INVALID_PARAMETER;
+    if (!list) {
+        *Status = EFI_NOT_FOUND;
+        return NULL;
+    }
 
-    if (nk->ValuesCount == 0 || nk->Values == 0xffffffff)
-        return EFI_NOT_FOUND;
+    if (size < sizeof(uint32_t) * nk->ValuesCount) {
+        *Status = EFI_INVALID_PARAMETER;
+        return NULL;
+    }
 
-    // go to key index
-
-    size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + nk->Values);
-
-    if (size < 0)
-        return EFI_NOT_FOUND;
+    *count = nk->ValuesCount;
+    *Status = EFI_SUCCESS;
 
-    if ((uint32_t)size < sizeof(int32_t) + (sizeof(uint32_t) * nk->ValuesCount))
-        return EFI_INVALID_PARAMETER;
+    return list;
+}
 
-    list = (uint32_t*)((uint8_t*)h->data + 0x1000 + nk->Values + sizeof(int32_t));
+static bool value_name_matches(CM_KEY_VALUE* vk, const WCHAR* Name, unsigned int namelen) {
+    if (vk->Flags & VALUE_COMP_NAME) {
+        unsigned int j;
+        uint8_t* valname = (uint8_t*)vk->Name;
 
-    // find value node
+        if (vk->NameLength != namelen)
+            return false;
 
-    for (unsigned int i = 0; i < nk->ValuesCount; i++) {
-        CM_KEY_VALUE* vk;
+        for (j = 0; j < vk->NameLength; j++) {
+            WCHAR c1 = valname[j];
+            WCHAR c2 = Name[j];
 
-        size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + list[i]);
+            if (c1 >= 'A' && c1 <= 'Z')
+                c1 = c1 - 'A' + 'a';
 
-        if (size < 0)
-            continue;
+            if (c2 >= 'A' && c2 <= 'Z')
+                c2 = c2 - 'A' + 'a';
 
-        if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_VALUE, Name[0]))
-            continue;
+            if (c1 != c2)
+                return false;
+        }
+    } else {
+        unsigned int j;
 
-        vk = (CM_KEY_VALUE*)((uint8_t*)h->data + 0x1000 + list[i] + sizeof(int32_t));
+        if (vk->NameLength / sizeof(WCHAR) != namelen)
+            return false;
 
-        if (vk->Signature != CM_KEY_VALUE_SIGNATURE)
-            continue;
+        for (j = 0; j < vk->NameLength / sizeof(WCHAR); j++) {
+            WCHAR c1 = vk->Name[j];
+            WCHAR c2 = Name[j];
 
-        if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_VALUE, Name[0]) + vk->NameLength)
-            continue;
+            if (c1 >= 'A' && c1 <= 'Z')
+                c1 = c1 - 'A' + 'a';
 
-        if (vk->Flags & VALUE_COMP_NAME) {
-            unsigned int j;
-            char* valname = (char*)vk->Name;
+            if (c2 >= 'A' && c2 <= 'Z')
+                c2 = c2 - 'A' + 'a';
 
-            if (vk->NameLength != namelen)
-                continue;
+            if (c1 != c2)
+                return false;
+        }
+    }
 
-            for (j = 0; j < vk->NameLength; j++) {
-                WCHAR c1 = valname[j];
-                WCHAR c2 = Name[j];
+    return true;
+}
 
-                if (c1 >= 'A' && c1 <= 'Z')
-                    c1 = c1 - 'A' + 'a';
+static EFI_STATUS get_value_data(hive* h, CM_KEY_VALUE* vk, void** Data, UINT32* DataLength) {
+    if (vk->DataLength & CM_KEY_VALUE_SPECIAL_SIZE) { // data stored as data offset
+        size_t datalen = vk->DataLength & ~CM_KEY_VALUE_SPECIAL_SIZE;
+        uint8_t* ptr = (uint8_t*)&vk->Data;
 
-                if (c2 >= 'A' && c2 <= 'Z')
-                    c2 = c2 - 'A' + 'a';
+        if (datalen == 2)
+            ptr = (uint8_t*)&vk->Data + 2;
+        else if (datalen == 1)
+            ptr = (uint8_t*)&vk->Data + 3;
+        else if (datalen != 0 && datalen != 4)
+            return EFI_INVALID_PARAMETER;
 
-                if (c1 != c2)
-                    break;
-            }
+        *Data = ptr;
+    } else {
+        uint32_t size;
 
-            if (j != vk->NameLength)
-                continue;
-        } else {
-            unsigned int j;
+        *Data = get_cell(h, vk->Data, &size);
 
-            if (vk->NameLength / sizeof(WCHAR) != namelen)
-                continue;
+        if (!*Data || size < vk->DataLength)
+            return EFI_INVALID_PARAMETER;
+    }
 
-            for (j = 0; j < vk->NameLength / sizeof(WCHAR); j++) {
-                WCHAR c1 = vk->Name[j];
-                WCHAR c2 = Name[j];
+    // FIXME - handle long "data block" values
 
-                if (c1 >= 'A' && c1 <= 'Z')
-                    c1 = c1 - 'A' + 'a';
+    *DataLength = vk->DataLength & ~CM_KEY_VALUE_SPECIAL_SIZE;
 
-                if (c2 >= 'A' && c2 <= 'Z')
-                    c2 = c2 - 'A' + 'a';
+    return EFI_SUCCESS;
+}
 
-                if (c1 != c2)
-                    break;
-            }
+static EFI_STATUS EFIAPI query_value_no_copy(EFI_REGISTRY_HIVE* This, HKEY Key, const WCHAR* Name, void** Data,
+                                             UINT32* DataLength, UINT32* Type) {
+    EFI_STATUS Status;
+    hive* h = _CR(This, hive, public);
+    uint32_t* list;
+    uint32_t count;
+    unsigned int namelen = wcslen(Name);
 
-            if (j != vk->NameLength / sizeof(WCHAR))
-                continue;
-        }
+#ifdef REG_STATS
+    h->stats.value_queries++;
+#endif
 
-        if (vk->DataLength & CM_KEY_VALUE_SPECIAL_SIZE) { // data stored as data offset
-            size_t datalen = vk->DataLength & ~CM_KEY_VALUE_SPECIAL_SIZE;
-            uint8_t* ptr;
-
-            if (datalen == 4)
-                ptr = (uint8_t*)&vk->Data;
-            else if (datalen == 2)
-                ptr = (uint8_t*)&vk->Data + 2;
-            else if (datalen == 1)
-                ptr = (uint8_t*)&vk->Data + 3;
-            else if (datalen != 0)
-                return EFI_INVALID_PARAMETER;
+    list = get_value_list(h, Key, &count, &Status);
+    if (!list)
+        return Status;
 
-            *Data = ptr;
-        } else {
-            size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + vk->Data);
+    // find value node
 
-            if ((uint32_t)size < vk->DataLength)
-                return EFI_INVALID_PARAMETER;
+    for (unsigned int i = 0; i < count; i++) {
+        CM_KEY_VALUE* vk = get_value_node(h, list[i]);
 
-            *Data = (uint8_t*)h->data + 0x1000 + vk->Data + sizeof(int32_t);
-        }
+        if (!vk || !value_name_matches(vk, Name, namelen))
+            continue;
 
-        // FIXME - handle long "data block" values
+        Status = get_value_data(h, vk, Data, DataLength);
+        if (EFI_ERROR(Status))
+            return Status;
 
-        *DataLength = vk->DataLength & ~CM_KEY_VALUE_SPECIAL_SIZE;
         *Type = vk->Type;
 
         return EFI_SUCCESS;
@@ -625,6 +990,69 @@ static EFI_STATUS EFIAPI query_value_no_copy(EFI_REGISTRY_HIVE* This, HKEY Key,
     return EFI_NOT_FOUND;
 }
 
+// Looks up several values of the same key in one pass over its value list. Each query's
+// Status is set to EFI_NOT_FOUND if the value isn't there.
+static EFI_STATUS EFIAPI query_values(EFI_REGISTRY_HIVE* This, HKEY Key, EFI_REGISTRY_VALUE_QUERY* Values, UINT32 Count) {
+    EFI_STATUS Status;
+    hive* h = _CR(This, hive, public);
+    uint32_t* list;
+    uint32_t count;
+    unsigned int left = Count;
+
+#ifdef REG_STATS
+    h->stats.value_queries += Count;
+#endif
+
+    for (unsigned int j = 0; j < Count; j++) {
+        Values[j].Status = EFI_NOT_FOUND;
+        Values[j].Data = NULL;
+        Values[j].DataLength = wcslen(Values[j].Name); // used as the name length until we find it
+        Values[j].Type = REG_NONE;
+    }
+
+    list = get_value_list(h, Key, &count, &Status);
+    if (!list) {
+        for (unsigned int j = 0; j < Count; j++) {
+            Values[j].DataLength = 0;
+        }
+
+        return Status == EFI_NOT_FOUND ? EFI_SUCCESS : Status;
+    }
+
+    for (unsigned int i = 0; i < count && left > 0; i++) {
+        CM_KEY_VALUE* vk = get_value_node(h, list[i]);
+        unsigned int vklen;
+
+        if (!vk)
+            continue;
+
+        vklen = vk->Flags & VALUE_COMP_NAME ? vk->NameLength : vk->NameLength / sizeof(WCHAR);
+
+        for (unsigned int j = 0; j < Count; j++) {
+            if (Values[j].Status != EFI_NOT_FOUND || Values[j].DataLength != vklen)
+                continue;
+
+            if (!value_name_matches(vk, Values[j].Name, vklen))
+                continue;
+
+            Values[j].Status = get_value_data(h, vk, &Values[j].Data, &Values[j].DataLength);
+
+            if (!EFI_ERROR(Values[j].Status))
+                Values[j].Type = vk->Type;
+
+            left--;
+            break;
+        }
+    }
+
+    for (unsigned int j = 0; j < Count; j++) {
+        if (Values[j].Status == EFI_NOT_FOUND)
+            Values[j].DataLength = 0;
+    }
+
+    return EFI_SUCCESS;
+}
+
 static EFI_STATUS EFIAPI query_value(EFI_REGISTRY_HIVE* This, HKEY Key, const WCHAR* Name, void* Data,
                                      UINT32* DataLength, UINT32* Type) {
     EFI_STATUS Status;
@@ -656,58 +1084,536 @@ static EFI_STATUS steal_data(EFI_REGISTRY_HIVE* This, void** Data, UINT32* Size)
     h->data = NULL;
     h->size = 0;
 
+    if (h->bin_end) {
+        bs->FreePool(h->bin_end);
+        h->bin_end = NULL;
+    }
+
+    h->bin_pages = 0;
+
+    memset(h->key_cache, 0, sizeof(h->key_cache));
+
     return EFI_SUCCESS;
 }
 
-static void clear_volatile(hive* h, HKEY key) {
-    int32_t size;
-    CM_KEY_NODE* nk;
-    uint16_t sig;
+// Walks the bins in address order, recording where each one ends so that get_cell can
+// check offsets in constant time, and clearing the volatile subkeys of every key node.
+static EFI_STATUS scan_bins(hive* h) {
+    EFI_STATUS Status;
+    HBASE_BLOCK* base_block = (HBASE_BLOCK*)h->data;
+    uint32_t length, off;
 
-    size = -*(int32_t*)((uint8_t*)h->data + key);
+    h->bin_end = NULL;
+    h->bin_pages = 0;
 
-    if (size < 0)
-        return;
+    if (h->size < 0x1000)
+        return EFI_INVALID_PARAMETER;
 
-    if ((uint32_t)size < sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0]))
-        return;
+    length = base_block->Length;
 
-    nk = (CM_KEY_NODE*)((uint8_t*)h->data + key + sizeof(int32_t));
+    if (length > h->size - 0x1000)
+        length = (uint32_t)(h->size - 0x1000);
 
-    if (nk->Signature != CM_KEY_NODE_SIGNATURE)
-        return;
+    if (length < EFI_PAGE_SIZE) {
+        print_string("Hive has no bins.\n");
+        return EFI_INVALID_PARAMETER;
+    }
 
-    nk->VolatileSubKeyList = 0xbaadf00d;
-    nk->VolatileSubKeyCount = 0;
+    h->bin_pages = length / EFI_PAGE_SIZE;
 
-    if (nk->SubKeyCount == 0 || nk->SubKeyList == 0xffffffff)
-        return;
+    Status = bs->AllocatePool(EfiLoaderData, h->bin_pages * sizeof(uint32_t), (void**)&h->bin_end);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        h->bin_end = NULL;
+        h->bin_pages = 0;
+        return Status;
+    }
 
-    size = -*(int32_t*)((uint8_t*)h->data + 0x1000 + nk->SubKeyList);
+    memset(h->bin_end, 0, h->bin_pages * sizeof(uint32_t));
 
-    sig = *(uint16_t*)((uint8_t*)h->data + 0x1000 + nk->SubKeyList + sizeof(int32_t));
+    off = 0;
 
-    if (sig == CM_KEY_HASH_LEAF) {
-        CM_KEY_FAST_INDEX* lh = (CM_KEY_FAST_INDEX*)((uint8_t*)h->data + 0x1000 + nk->SubKeyList + sizeof(int32_t));
+    while (off < h->bin_pages * EFI_PAGE_SIZE) {
+        HBIN* bin = (HBIN*)((uint8_t*)h->data + 0x1000 + off);
+        uint32_t end, cell;
+
+        if (bin->Signature != HV_HBIN_SIGNATURE || bin->FileOffset != off || bin->Size == 0 ||
+            bin->Size % EFI_PAGE_SIZE != 0 || bin->Size > (h->bin_pages * EFI_PAGE_SIZE) - off) {
+            char s[255], *p;
+
+            p = stpcpy(s, "Invalid bin at offset ");
+            p = hex_to_str(p, off);
+            p = stpcpy(p, ".\n");
 
-        for (unsigned int i = 0; i < lh->Count; i++) {
-            clear_volatile(h, 0x1000 + lh->List[i].Cell);
+            print_string(s);
+            break;
         }
-    } else if (sig == CM_KEY_INDEX_ROOT) {
-        CM_KEY_INDEX* ri = (CM_KEY_INDEX*)((uint8_t*)h->data + 0x1000 + nk->SubKeyList + sizeof(int32_t));
 
-        for (unsigned int i = 0; i < ri->Count; i++) {
-            clear_volatile(h, 0x1000 + ri->List[i]);
+        end = off + bin->Size;
+
+        for (unsigned int i = off / EFI_PAGE_SIZE; i < end / EFI_PAGE_SIZE; i++) {
+            h->bin_end[i] = end;
         }
-    } else {
-        char s[255], *p;
 
-        p = stpcpy(s, "Unhandled registry signature ");
-        p = hex_to_str(p, sig);
-        p = stpcpy(p, ".\n");
+        cell = off + sizeof(HBIN);
+
+        while (end - cell >= sizeof(int32_t)) {
+            int32_t cell_size = *(int32_t*)((uint8_t*)h->data + 0x1000 + cell);
+            uint32_t abs_size = cell_size < 0 ? 0 - (uint32_t)cell_size : (uint32_t)cell_size;
+
+            if (abs_size < sizeof(int32_t) || abs_size > end - cell)
+                break;
+
+            if (cell_size < 0 && abs_size >= sizeof(int32_t) + offsetof(CM_KEY_NODE, Name[0])) {
+                CM_KEY_NODE* nk = (CM_KEY_NODE*)((uint8_t*)h->data + 0x1000 + cell + sizeof(int32_t));
+
+                if (nk->Signature == CM_KEY_NODE_SIGNATURE) {
+                    nk->VolatileSubKeyList = 0xbaadf00d;
+                    nk->VolatileSubKeyCount = 0;
+                }
+            }
+
+            cell += abs_size;
+        }
+
+        off = end;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Allocates a cell in the compacted hive, starting a new bin if it won't fit in the
+// current one.
+static EFI_STATUS compact_alloc(compact_ctx* ctx, uint32_t size, uint32_t* cell) {
+    uint32_t cell_size = (size + sizeof(int32_t) + 7) & ~7;
+
+    if (cell_size > ctx->bin_end - ctx->pos) {
+        uint32_t bin_size = (cell_size + sizeof(HBIN) + EFI_PAGE_SIZE - 1) & ~(EFI_PAGE_SIZE - 1);
+        HBIN* bin;
+
+        if (bin_size > ctx->size - ctx->bin_end)
+            return EFI_BUFFER_TOO_SMALL;
 
-        print_string(s);
+        // mark the rest of the old bin as free
+
+        if (ctx->bin_end > ctx->pos)
+            *(int32_t*)(ctx->data + 0x1000 + ctx->pos) = ctx->bin_end - ctx->pos;
+
+        bin = (HBIN*)(ctx->data + 0x1000 + ctx->bin_end);
+
+        memset(bin, 0, sizeof(HBIN));
+        bin->Signature = HV_HBIN_SIGNATURE;
+        bin->FileOffset = ctx->bin_end;
+        bin->Size = bin_size;
+
+        ctx->pos = ctx->bin_end + sizeof(HBIN);
+        ctx->bin_end += bin_size;
     }
+
+    *(int32_t*)(ctx->data + 0x1000 + ctx->pos) = -(int32_t)cell_size;
+    *cell = ctx->pos;
+    ctx->pos += cell_size;
+
+    return EFI_SUCCESS;
+}
+
+// Copies a cell as it is into the compacted hive - the caller is responsible for fixing up
+// any offsets it contains.
+static EFI_STATUS compact_copy_cell(hive* h, compact_ctx* ctx, uint32_t cell, uint32_t* new_cell, void** new_data,
+                                    uint32_t* new_size) {
+    EFI_STATUS Status;
+    void* data;
+    uint32_t size;
+
+    data = get_cell(h, cell, &size);
+    if (!data)
+        return EFI_INVALID_PARAMETER;
+
+    Status = compact_alloc(ctx, size, new_cell);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    memcpy(ctx->data + 0x1000 + *new_cell + sizeof(int32_t), data, size);
+
+    if (new_data)
+        *new_data = ctx->data + 0x1000 + *new_cell + sizeof(int32_t);
+
+    if (new_size)
+        *new_size = size;
+
+    return EFI_SUCCESS;
+}
+
+static uint32_t compact_find_sk(compact_ctx* ctx, uint32_t cell) {
+    unsigned int start = 0, end = ctx->sk_count;
+
+    while (start < end) {
+        unsigned int mid = (start + end) / 2;
+
+        if (ctx->sk[mid].old_cell == cell)
+            return ctx->sk[mid].new_cell;
+        else if (ctx->sk[mid].old_cell < cell)
+            start = mid + 1;
+        else
+            end = mid;
+    }
+
+    return 0xffffffff;
+}
+
+// All the security descriptors in a hive are on one circular list, so copy them up front
+// rather than as we come across them.
+static EFI_STATUS compact_security(hive* h, compact_ctx* ctx, uint32_t first) {
+    EFI_STATUS Status;
+    CM_KEY_SECURITY* sk;
+    uint32_t cell, size;
+    unsigned int count = 0;
+
+    cell = first;
+
+    do {
+        sk = (CM_KEY_SECURITY*)get_cell(h, cell, &size);
+
+        if (!sk || size < offsetof(CM_KEY_SECURITY, Descriptor[0]) || sk->Signature != CM_KEY_SECURITY_SIGNATURE)
+            return EFI_INVALID_PARAMETER;
+
+        count++;
+
+        // cells are at least 8 bytes, so any more than this means the list is broken
+        if (count > h->bin_pages * (EFI_PAGE_SIZE / 8))
+            return EFI_INVALID_PARAMETER;
+
+        cell = sk->Flink;
+    } while (cell != first);
+
+    Status = bs->AllocatePool(EfiLoaderData, count * sizeof(sk_map_entry), (void**)&ctx->sk);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePool", Status);
+        ctx->sk = NULL;
+        return Status;
+    }
+
+    ctx->sk_count = 0;
+
+    do {
+        unsigned int i;
+        uint32_t new_cell;
+
+        sk = (CM_KEY_SECURITY*)get_cell(h, cell, &size);
+
+        Status = compact_copy_cell(h, ctx, cell, &new_cell, NULL, NULL);
+        if (EFI_ERROR(Status))
+            return Status;
+
+        i = ctx->sk_count;
+
+        while (i > 0 && ctx->sk[i - 1].old_cell > cell) {
+            ctx->sk[i] = ctx->sk[i - 1];
+            i--;
+        }
+
+        ctx->sk[i].old_cell = cell;
+        ctx->sk[i].new_cell = new_cell;
+        ctx->sk_count++;
+
+        cell = sk->Flink;
+    } while (cell != first);
+
+    // fix up the list pointers
+
+    for (unsigned int i = 0; i < ctx->sk_count; i++) {
+        CM_KEY_SECURITY* old_sk = (CM_KEY_SECURITY*)get_cell(h, ctx->sk[i].old_cell, &size);
+
+        sk = (CM_KEY_SECURITY*)(ctx->data + 0x1000 + ctx->sk[i].new_cell + sizeof(int32_t));
+
+        sk->Flink = compact_find_sk(ctx, old_sk->Flink);
+        sk->Blink = compact_find_sk(ctx, old_sk->Blink);
+
+        if (sk->Blink == 0xffffffff)
+            return EFI_INVALID_PARAMETER;
+    }
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS compact_value(hive* h, compact_ctx* ctx, uint32_t cell, uint32_t* new_cell) {
+    EFI_STATUS Status;
+    CM_KEY_VALUE* vk;
+    CM_BIG_DATA* db;
+    uint32_t* list;
+    uint32_t size;
+
+    if (!get_value_node(h, cell))
+        return EFI_INVALID_PARAMETER;
+
+    Status = compact_copy_cell(h, ctx, cell, new_cell, (void**)&vk, NULL);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    if (vk->DataLength & CM_KEY_VALUE_SPECIAL_SIZE || vk->DataLength == 0) // data stored in value node
+        return EFI_SUCCESS;
+
+    Status = compact_copy_cell(h, ctx, vk->Data, &vk->Data, (void**)&db, &size);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    if (((HBASE_BLOCK*)h->data)->Minor < 4 || vk->DataLength <= CM_KEY_VALUE_BIG || size < sizeof(CM_BIG_DATA) ||
+        db->Signature != CM_BIG_DATA_SIGNATURE) {
+        return EFI_SUCCESS;
+    }
+
+    // long value split into segments
+
+    Status = compact_copy_cell(h, ctx, db->List, &db->List, (void**)&list, &size);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    if (size < db->Count * sizeof(uint32_t))
+        return EFI_INVALID_PARAMETER;
+
+    for (unsigned int i = 0; i < db->Count; i++) {
+        Status = compact_copy_cell(h, ctx, list[i], &list[i], NULL, NULL);
+        if (EFI_ERROR(Status))
+            return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS compact_push(compact_ctx* ctx, uint32_t cell, uint32_t* fixup, uint32_t parent, bool root_allowed) {
+    EFI_STATUS Status;
+    compact_item* item;
+
+    if (ctx->stack_count == ctx->stack_alloc) {
+        unsigned int new_alloc = ctx->stack_alloc == 0 ? 64 : ctx->stack_alloc * 2;
+        compact_item* new_stack;
+
+        Status = bs->AllocatePool(EfiLoaderData, new_alloc * sizeof(compact_item), (void**)&new_stack);
+        if (EFI_ERROR(Status)) {
+            print_error("AllocatePool", Status);
+            return Status;
+        }
+
+        if (ctx->stack) {
+            memcpy(new_stack, ctx->stack, ctx->stack_count * sizeof(compact_item));
+            bs->FreePool(ctx->stack);
+        }
+
+        ctx->stack = new_stack;
+        ctx->stack_alloc = new_alloc;
+    }
+
+    item = &ctx->stack[ctx->stack_count];
+
+    item->cell = cell;
+    item->fixup = (uint32_t)((uint8_t*)fixup - ctx->data);
+    item->parent = parent;
+    item->root_allowed = root_allowed;
+
+    ctx->stack_count++;
+
+    return EFI_SUCCESS;
+}
+
+// Copies a key node into the compacted hive, along with its class and values. Its subkey
+// list is left on the stack for compact_keys to get to.
+static EFI_STATUS compact_key(hive* h, compact_ctx* ctx, uint32_t cell, uint32_t parent, uint32_t* new_cell) {
+    EFI_STATUS Status;
+    CM_KEY_NODE* nk;
+
+    if (!get_key_node(h, cell))
+        return EFI_INVALID_PARAMETER;
+
+    Status = compact_copy_cell(h, ctx, cell, new_cell, (void**)&nk, NULL);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    nk->Parent = parent;
+
+    if (nk->Security != 0xffffffff) {
+        nk->Security = compact_find_sk(ctx, nk->Security);
+
+        if (nk->Security == 0xffffffff)
+            return EFI_INVALID_PARAMETER;
+    }
+
+    if (nk->Class != 0xffffffff) {
+        Status = compact_copy_cell(h, ctx, nk->Class, &nk->Class, NULL, NULL);
+        if (EFI_ERROR(Status))
+            return Status;
+    }
+
+    if (nk->ValuesCount != 0 && nk->Values != 0xffffffff) {
+        uint32_t* list;
+        uint32_t size;
+
+        Status = compact_copy_cell(h, ctx, nk->Values, &nk->Values, (void**)&list, &size);
+        if (EFI_ERROR(Status))
+            return Status;
+
+        if (size < nk->ValuesCount * sizeof(uint32_t))
+            return EFI_INVALID_PARAMETER;
+
+        for (unsigned int i = 0; i < nk->ValuesCount; i++) {
+            Status = compact_value(h, ctx, list[i], &list[i]);
+            if (EFI_ERROR(Status))
+                return Status;
+        }
+    }
+
+    if (nk->SubKeyCount != 0 && nk->SubKeyList != 0xffffffff) {
+        Status = compact_push(ctx, nk->SubKeyList, &nk->SubKeyList, *new_cell, true);
+        if (EFI_ERROR(Status))
+            return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS compact_subkeys(hive* h, compact_ctx* ctx, const compact_item* item) {
+    EFI_STATUS Status;
+    void* index;
+    uint16_t sig, count;
+    uint32_t parent = item->parent;
+
+    if (!get_key_index(h, item->cell, &sig, &count))
+        return EFI_INVALID_PARAMETER;
+
+    if (sig == CM_KEY_INDEX_ROOT && !item->root_allowed)
+        return EFI_INVALID_PARAMETER;
+
+    Status = compact_copy_cell(h, ctx, item->cell, (uint32_t*)(ctx->data + item->fixup), &index, NULL);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (sig == CM_KEY_INDEX_ROOT) {
+            CM_KEY_INDEX* ri = (CM_KEY_INDEX*)index;
+
+            Status = compact_push(ctx, ri->List[i], &ri->List[i], parent, false);
+        } else if (sig == CM_KEY_INDEX_LEAF) {
+            CM_KEY_INDEX* li = (CM_KEY_INDEX*)index;
+
+            Status = compact_key(h, ctx, li->List[i], parent, &li->List[i]);
+        } else {
+            CM_KEY_FAST_INDEX* lh = (CM_KEY_FAST_INDEX*)index;
+
+            Status = compact_key(h, ctx, lh->List[i].Cell, parent, &lh->List[i].Cell);
+        }
+
+        if (EFI_ERROR(Status))
+            return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Copies the whole tree under cell. This uses an explicit stack rather than recursing, as
+// a deep or hostile hive could otherwise overflow the firmware's stack. Every item on it
+// is a cell that's already been copied, so a loop in the tree runs the new hive out of
+// space rather than going on forever.
+static EFI_STATUS compact_keys(hive* h, compact_ctx* ctx, uint32_t cell, uint32_t parent, uint32_t* new_cell) {
+    EFI_STATUS Status;
+
+    Status = compact_key(h, ctx, cell, parent, new_cell);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    while (ctx->stack_count > 0) {
+        compact_item item = ctx->stack[ctx->stack_count - 1];
+
+        ctx->stack_count--;
+
+        Status = compact_subkeys(h, ctx, &item);
+        if (EFI_ERROR(Status))
+            return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// Rebuilds the hive with only the cells reachable from the root key, so that we don't
+// hand the kernel - and have to map - all the free space of a long-lived hive.
+static EFI_STATUS EFIAPI compact_hive(EFI_REGISTRY_HIVE* This) {
+    hive* h = _CR(This, hive, public);
+    EFI_STATUS Status;
+    HBASE_BLOCK* base_block;
+    CM_KEY_NODE* nk;
+    EFI_PHYSICAL_ADDRESS addr;
+    compact_ctx ctx;
+    uint32_t root;
+    UINTN pages;
+
+    if (!h->data)
+        return EFI_INVALID_PARAMETER;
+
+    base_block = (HBASE_BLOCK*)h->data;
+
+    nk = get_key_node(h, base_block->RootCell);
+    if (!nk)
+        return EFI_INVALID_PARAMETER;
+
+    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, h->pages, &addr);
+    if (EFI_ERROR(Status)) {
+        print_error("AllocatePages", Status);
+        return Status;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.data = (uint8_t*)(uintptr_t)addr;
+    ctx.size = (uint32_t)((h->pages - 1) * EFI_PAGE_SIZE);
+
+    memcpy(ctx.data, h->data, 0x1000);
+
+    if (nk->Security != 0xffffffff) {
+        Status = compact_security(h, &ctx, nk->Security);
+        if (EFI_ERROR(Status))
+            goto end;
+    }
+
+    Status = compact_keys(h, &ctx, base_block->RootCell, nk->Parent, &root);
+    if (EFI_ERROR(Status))
+        goto end;
+
+    if (ctx.bin_end > ctx.pos)
+        *(int32_t*)(ctx.data + 0x1000 + ctx.pos) = ctx.bin_end - ctx.pos;
+
+    base_block = (HBASE_BLOCK*)ctx.data;
+    base_block->RootCell = root;
+    base_block->Length = ctx.bin_end;
+    base_block->CheckSum = calc_checksum(ctx.data);
+
+    // give back the pages we didn't need
+
+    pages = 1 + (ctx.bin_end / EFI_PAGE_SIZE);
+
+    if (pages < h->pages)
+        bs->FreePages(addr + (pages * EFI_PAGE_SIZE), h->pages - pages);
+
+    bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)h->data, h->pages);
+
+    if (h->bin_end)
+        bs->FreePool(h->bin_end);
+
+    h->data = ctx.data;
+    h->pages = pages;
+    h->size = pages * EFI_PAGE_SIZE;
+
+    memset(h->key_cache, 0, sizeof(h->key_cache));
+
+    Status = scan_bins(h);
+
+end:
+    if (ctx.sk)
+        bs->FreePool(ctx.sk);
+
+    if (ctx.stack)
+        bs->FreePool(ctx.stack);
+
+    if (EFI_ERROR(Status) && ctx.data != h->data)
+        bs->FreePages(addr, h->pages);
+
+    return Status;
 }
 
 static EFI_STATUS EFIAPI OpenHive(EFI_FILE_HANDLE File, EFI_REGISTRY_HIVE** Hive) {
@@ -715,6 +1621,9 @@ static EFI_STATUS EFIAPI OpenHive(EFI_FILE_HANDLE File, EFI_REGISTRY_HIVE** Hive
     EFI_FILE_INFO file_info;
     hive* h;
     EFI_PHYSICAL_ADDRESS addr;
+#ifdef REG_STATS
+    uint64_t start_cycles = __rdtsc();
+#endif
 
     Status = bs->AllocatePool(EfiLoaderData, sizeof(hive), (void**)&h);
     if (EFI_ERROR(Status)) {
@@ -789,7 +1698,19 @@ static EFI_STATUS EFIAPI OpenHive(EFI_FILE_HANDLE File, EFI_REGISTRY_HIVE** Hive
         return EFI_INVALID_PARAMETER;
     }
 
-    clear_volatile(h, 0x1000 + ((HBASE_BLOCK*)h->data)->RootCell);
+    Status = scan_bins(h);
+    if (EFI_ERROR(Status)) {
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)h->data, h->pages);
+        bs->FreePool(h);
+        return Status;
+    }
+
+    memset(h->key_cache, 0, sizeof(h->key_cache));
+
+#ifdef REG_STATS
+    memset(&h->stats, 0, sizeof(h->stats));
+    h->stats.open_cycles = __rdtsc() - start_cycles;
+#endif
 
     h->public.Close = close_hive;
     h->public.FindRoot = find_root;
@@ -799,6 +1720,9 @@ static EFI_STATUS EFIAPI OpenHive(EFI_FILE_HANDLE File, EFI_REGISTRY_HIVE** Hive
     h->public.QueryValue = query_value;
     h->public.StealData = steal_data;
     h->public.QueryValueNoCopy = query_value_no_copy;
+    h->public.NextKey = next_key;
+    h->public.QueryValues = query_values;
+    h->public.Compact = compact_hive;
 
     *Hive = &h->public;
 
@@ -0,0 +1,254 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include "sha256.h"
+#include "misc.h"
+#include <stdbool.h>
+#include <string.h>
+#include <intrin.h>
+
+#if defined(__x86_64__) && (defined(_MSC_VER) || (defined(__SHA__) && defined(__SSE4_1__)))
+#include <immintrin.h>
+#define USE_SHA_NI
+#endif
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_c(uint32_t* state, const uint8_t* data, size_t blocks) {
+    while (blocks > 0) {
+        uint32_t w[64];
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (unsigned int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[(i * 4) + 1] << 16) |
+                   ((uint32_t)data[(i * 4) + 2] << 8) | data[(i * 4) + 3];
+        }
+
+        for (unsigned int i = 16; i < 64; i++) {
+            uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        for (unsigned int i = 0; i < 64; i++) {
+            uint32_t s1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + k[i] + w[i];
+            uint32_t s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+
+        data += 64;
+        blocks--;
+    }
+}
+
+#ifdef USE_SHA_NI
+static void sha256_blocks_sha_ni(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, tmp;
+
+    // The instructions want the state as ABEF and CDGH, rather than ABCD and EFGH.
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*)&state[0]), 0xb1); // CDAB
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((__m128i*)&state[4]), 0x1b); // EFGH
+    state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0); // CDGH
+
+    while (blocks > 0) {
+        __m128i abef = state0, cdgh = state1;
+        __m128i msg[4];
+
+        // each time round does four rounds, with the message schedule kept in a ring of four
+
+        for (unsigned int i = 0; i < 16; i++) {
+            __m128i m;
+
+            if (i < 4)
+                msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*)(data + (i * 16))), mask);
+            else {
+                m = _mm_sha256msg1_epu32(msg[i % 4], msg[(i + 1) % 4]);
+                m = _mm_add_epi32(m, _mm_alignr_epi8(msg[(i + 3) % 4], msg[(i + 2) % 4], 4));
+                msg[i % 4] = _mm_sha256msg2_epu32(m, msg[(i + 3) % 4]);
+            }
+
+            m = _mm_add_epi32(msg[i % 4], _mm_loadu_si128((__m128i*)&k[i * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(m, 0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+
+        data += 64;
+        blocks--;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b); // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1); // DCHG
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xf0)); // DCBA
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+
+static bool have_sha_ni() {
+    static int cached = -1;
+    int cpu_info[4];
+
+    if (cached != -1)
+        return cached;
+
+    cached = 0;
+
+    __cpuid(cpu_info, 0);
+
+    if (cpu_info[0] >= 7) {
+        bool ssse3_sse41;
+
+        __cpuid(cpu_info, 1);
+
+        ssse3_sse41 = (cpu_info[2] & 0x200) && (cpu_info[2] & 0x80000);
+
+        __cpuidex(cpu_info, 7, 0);
+
+        if (ssse3_sse41 && cpu_info[1] & 0x20000000)
+            cached = 1;
+    }
+
+    return cached;
+}
+#endif
+
+static void sha256_blocks(uint32_t* state, const uint8_t* data, size_t blocks) {
+#ifdef USE_SHA_NI
+    if (have_sha_ni()) {
+        sha256_blocks_sha_ni(state, data, blocks);
+        return;
+    }
+#endif
+
+    sha256_blocks_c(state, data, blocks);
+}
+
+void sha256_init(sha256_ctx* ctx) {
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->length = 0;
+    ctx->buf_len = 0;
+}
+
+void sha256_update(sha256_ctx* ctx, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+
+    ctx->length += len;
+
+    if (ctx->buf_len > 0) {
+        size_t n = sizeof(ctx->buf) - ctx->buf_len;
+
+        if (n > len)
+            n = len;
+
+        memcpy(&ctx->buf[ctx->buf_len], p, n);
+        ctx->buf_len += n;
+        p += n;
+        len -= n;
+
+        if (ctx->buf_len < sizeof(ctx->buf))
+            return;
+
+        sha256_blocks(ctx->state, ctx->buf, 1);
+        ctx->buf_len = 0;
+    }
+
+    // whole blocks get hashed straight from the caller's buffer
+
+    if (len >= sizeof(ctx->buf)) {
+        sha256_blocks(ctx->state, p, len / sizeof(ctx->buf));
+        p += len & ~(sizeof(ctx->buf) - 1);
+        len &= sizeof(ctx->buf) - 1;
+    }
+
+    if (len > 0) {
+        memcpy(ctx->buf, p, len);
+        ctx->buf_len = len;
+    }
+}
+
+void sha256_final(sha256_ctx* ctx, uint8_t* hash) {
+    uint64_t bits = ctx->length * 8;
+
+    ctx->buf[ctx->buf_len] = 0x80;
+    ctx->buf_len++;
+
+    if (ctx->buf_len > sizeof(ctx->buf) - sizeof(uint64_t)) {
+        memset(&ctx->buf[ctx->buf_len], 0, sizeof(ctx->buf) - ctx->buf_len);
+        sha256_blocks(ctx->state, ctx->buf, 1);
+        ctx->buf_len = 0;
+    }
+
+    memset(&ctx->buf[ctx->buf_len], 0, sizeof(ctx->buf) - sizeof(uint64_t) - ctx->buf_len);
+
+    for (unsigned int i = 0; i < sizeof(uint64_t); i++) {
+        ctx->buf[sizeof(ctx->buf) - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+
+    sha256_blocks(ctx->state, ctx->buf, 1);
+
+    for (unsigned int i = 0; i < 8; i++) {
+        hash[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        hash[(i * 4) + 1] = (uint8_t)(ctx->state[i] >> 16);
+        hash[(i * 4) + 2] = (uint8_t)(ctx->state[i] >> 8);
+        hash[(i * 4) + 3] = (uint8_t)ctx->state[i];
+    }
+}
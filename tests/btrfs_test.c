@@ -0,0 +1,1345 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Tests and benchmarks for the Btrfs driver, run on a block device backed by an image file.
+// The images are made by btrfsgen.c from a generated Windows directory, once with each kind
+// of compression, and the workload is what a boot reads: the SYSTEM hive, the NLS files and
+// the images, the last by the same replay as pe_test.
+//
+//   btrfs_test check              check every file reads back the same as it was written,
+//                                 including from odd positions and from copies preloaded into
+//                                 memory, and that a boot loads the same images from the
+//                                 filesystem as from the directory it came from
+//   btrfs_test bench [image...]   time the boot's reads, and count the ReadBlocks calls and
+//                                 allocations they take, from each generated image, with and
+//                                 without a prefetch manifest, or from raw images of real
+//                                 Btrfs filesystems with a Windows directory at the top
+//
+// The driver is built with BTRFS_STATS, so it prints its own counts once the last of its file
+// handles is closed.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "host.h"
+#include "btrfsgen.h"
+#include "hivegen.h"
+#include "pegen.h"
+#include "replay.h"
+#include "quibble.h"
+#include "quibbleproto.h"
+#include "peload.h"
+#include "reg.h"
+#include "misc.h"
+#include "print.h"
+
+#define MAX_FAILURES 20
+#define BENCH_RUNS 5
+#define BLOCK_SIZE 512
+#define MAX_POSITION_FILES 40
+
+EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE* SystemTable); // btrfs.c
+
+static EFI_BOOT_SERVICES* bs = &host_bs;
+static EFI_PE_LOADER_PROTOCOL* pe;
+static EFI_REGISTRY_PROTOCOL* reg;
+static EFI_DRIVER_BINDING_PROTOCOL* drvbind;
+static unsigned int failures;
+static unsigned int stats_lines; // from the driver's BTRFS_STATS
+static bool show_driver_messages = true;
+
+static const load_mode mode = { "relocate on load", false, false };
+
+typedef struct {
+    EFI_BLOCK_IO_PROTOCOL block;
+    EFI_DISK_IO_PROTOCOL disk_io;
+    EFI_BLOCK_IO_MEDIA media;
+    EFI_HANDLE handle;
+    int fd;
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t discontiguous; // reads not starting where the last one ended
+    uint64_t next_offset;
+} disk;
+
+typedef struct {
+    const char* label;
+    uint8_t compression;
+} compression_type;
+
+static const compression_type compression_types[] = {
+    { "uncompressed", BTRFS_COMPRESSION_NONE },
+    { "zlib", BTRFS_COMPRESSION_ZLIB },
+    { "lzo", BTRFS_COMPRESSION_LZO },
+    { "zstd", BTRFS_COMPRESSION_ZSTD },
+};
+
+// what a boot reads besides the hive and the images, relative to the Windows directory
+static const WCHAR* const boot_files[] = {
+    L"System32\\c_1252.nls",
+    L"System32\\c_437.nls",
+    L"System32\\l_intl.nls",
+    L"inf\\biosinfo.inf",
+    L"AppPatch\\drvmain.sdb",
+};
+
+typedef struct {
+    uint16_t version;
+    boot_driver* drivers; // if NULL, they come from the hive
+    unsigned int num_drivers;
+    bool optional_files; // for real Windows directories, which won't have all of boot_files
+} workload;
+
+typedef struct {
+    const char* label;
+    pegen_params pe;
+    unsigned int filler_dirs;
+} gen_scenario;
+
+static const gen_scenario check_scenario = {
+    "Windows 10", { _WIN32_WINNT_WIN10, 40, 4, 2000, 40, 1 }, 40
+};
+
+static const gen_scenario bench_scenario = {
+    "Windows 10, 150 boot drivers", { _WIN32_WINNT_WIN10, 150, 8, 3000, 80, 1 }, 200
+};
+
+static void fail(const char* fmt, ...) {
+    va_list ap;
+
+    failures++;
+
+    if (failures > MAX_FAILURES)
+        return;
+
+    va_start(ap, fmt);
+    printf("FAIL: ");
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+
+    if (failures == MAX_FAILURES)
+        printf("(not showing any more failures)\n");
+}
+
+static void widen(const char* s, WCHAR* w) {
+    while (*s) {
+        *w = *s == '/' ? '\\' : (uint8_t)*s;
+        w++;
+        s++;
+    }
+
+    *w = 0;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+
+    return remove(path);
+}
+
+static void remove_tree(const char* path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static double ms(uint64_t ns) {
+    return (double)ns / 1000000.0;
+}
+
+static double mb(uint64_t bytes) {
+    return (double)bytes / (1024.0 * 1024.0);
+}
+
+// the driver's output
+
+static void EFIAPI info_print(const char* s) {
+    if (!strncmp(s, "btrfs: ", 7))
+        stats_lines++;
+
+    if (show_driver_messages)
+        printf("  %s", s);
+}
+
+static EFI_QUIBBLE_INFO_PROTOCOL info_proto = { info_print };
+
+// a disk backed by an image file
+
+static EFI_STATUS EFIAPI disk_read_blocks(EFI_BLOCK_IO_PROTOCOL* This, UINT32 MediaId, EFI_LBA LBA,
+                                          UINTN BufferSize, VOID* Buffer) {
+    disk* d = _CR(This, disk, block);
+    uint64_t offset = LBA * d->media.BlockSize;
+
+    if (MediaId != d->media.MediaId)
+        return EFI_MEDIA_CHANGED;
+
+    if (BufferSize % d->media.BlockSize != 0)
+        return EFI_BAD_BUFFER_SIZE;
+
+    if (LBA > d->media.LastBlock || (BufferSize / d->media.BlockSize) > d->media.LastBlock + 1 - LBA)
+        return EFI_INVALID_PARAMETER;
+
+    if (pread(d->fd, Buffer, BufferSize, offset) != (ssize_t)BufferSize)
+        return EFI_DEVICE_ERROR;
+
+    d->reads++;
+    d->read_bytes += BufferSize;
+
+    if (offset != d->next_offset)
+        d->discontiguous++;
+
+    d->next_offset = offset + BufferSize;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI disk_read_disk(EFI_DISK_IO_PROTOCOL* This, UINT32 MediaId, UINT64 Offset,
+                                        UINTN BufferSize, VOID* Buffer) {
+    disk* d = _CR(This, disk, disk_io);
+
+    if (MediaId != d->media.MediaId)
+        return EFI_MEDIA_CHANGED;
+
+    if (pread(d->fd, Buffer, BufferSize, Offset) != (ssize_t)BufferSize)
+        return EFI_DEVICE_ERROR;
+
+    d->reads++;
+    d->read_bytes += BufferSize;
+
+    if (Offset != d->next_offset)
+        d->discontiguous++;
+
+    d->next_offset = Offset + BufferSize;
+
+    return EFI_SUCCESS;
+}
+
+static void reset_disk_counters(disk* d) {
+    d->reads = 0;
+    d->read_bytes = 0;
+    d->discontiguous = 0;
+}
+
+// Attaches the image as a new disk, starts the driver on it, and opens the root directory.
+static bool mount(const char* image, disk* d, EFI_FILE_HANDLE* root) {
+    EFI_GUID block_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    EFI_GUID disk_guid = EFI_DISK_IO_PROTOCOL_GUID;
+    EFI_GUID fs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs;
+    EFI_STATUS Status;
+    struct stat st;
+
+    memset(d, 0, sizeof(disk));
+
+    d->fd = open(image, O_RDONLY);
+    if (d->fd < 0) {
+        perror(image);
+        return false;
+    }
+
+    if (fstat(d->fd, &st) != 0 || st.st_size < BLOCK_SIZE) {
+        printf("%s is too small.\n", image);
+        close(d->fd);
+        return false;
+    }
+
+    d->media.MediaId = 1;
+    d->media.MediaPresent = TRUE;
+    d->media.LogicalPartition = TRUE;
+    d->media.ReadOnly = TRUE;
+    d->media.BlockSize = BLOCK_SIZE;
+    d->media.LastBlock = (st.st_size / BLOCK_SIZE) - 1;
+
+    d->block.Revision = 0x00010000;
+    d->block.Media = &d->media;
+    d->block.ReadBlocks = disk_read_blocks;
+
+    d->disk_io.Revision = 0x00010000;
+    d->disk_io.ReadDisk = disk_read_disk;
+
+    Status = bs->InstallMultipleProtocolInterfaces(&d->handle, &block_guid, &d->block, &disk_guid, &d->disk_io,
+                                                   NULL);
+    if (EFI_ERROR(Status)) {
+        printf("InstallMultipleProtocolInterfaces returned %s.\n", error_string(Status));
+        close(d->fd);
+        return false;
+    }
+
+    Status = drvbind->Supported(drvbind, d->handle, NULL);
+    if (EFI_ERROR(Status)) {
+        printf("Supported returned %s.\n", error_string(Status));
+        goto fail;
+    }
+
+    Status = drvbind->Start(drvbind, d->handle, NULL);
+    if (EFI_ERROR(Status)) {
+        printf("Start returned %s for %s.\n", error_string(Status), image);
+        goto fail;
+    }
+
+    Status = bs->HandleProtocol(d->handle, &fs_guid, (void**)&fs);
+    if (EFI_ERROR(Status)) {
+        printf("HandleProtocol returned %s.\n", error_string(Status));
+        goto fail;
+    }
+
+    Status = fs->OpenVolume(fs, root);
+    if (EFI_ERROR(Status)) {
+        printf("OpenVolume returned %s.\n", error_string(Status));
+        goto fail;
+    }
+
+    return true;
+
+fail:
+    bs->UninstallProtocolInterface(d->handle, &block_guid, &d->block);
+    bs->UninstallProtocolInterface(d->handle, &disk_guid, &d->disk_io);
+    close(d->fd);
+
+    return false;
+}
+
+// The driver doesn't free its volumes on Stop, so the disk has to outlive this.
+static void unmount(disk* d, EFI_FILE_HANDLE root) {
+    EFI_GUID block_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    EFI_GUID disk_guid = EFI_DISK_IO_PROTOCOL_GUID;
+
+    root->Close(root);
+
+    drvbind->Stop(drvbind, d->handle, 0, NULL);
+
+    bs->UninstallProtocolInterface(d->handle, &block_guid, &d->block);
+    bs->UninstallProtocolInterface(d->handle, &disk_guid, &d->disk_io);
+
+    close(d->fd);
+    d->fd = -1;
+}
+
+static EFI_QUIBBLE_PREFETCH_PROTOCOL* get_prefetch(disk* d) {
+    EFI_GUID prefetch_guid = EFI_QUIBBLE_PREFETCH_PROTOCOL_GUID;
+    EFI_QUIBBLE_PREFETCH_PROTOCOL* prefetch;
+
+    if (EFI_ERROR(bs->HandleProtocol(d->handle, &prefetch_guid, (void**)&prefetch)))
+        return NULL;
+
+    return prefetch;
+}
+
+// the workload
+
+// what read_file allocated
+static void free_file(void* data, size_t size) {
+    bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, (size + EFI_PAGE_SIZE - 1) / EFI_PAGE_SIZE);
+}
+
+// Reads what a boot would from the Windows directory under root, and loads the images.
+static bool run_workload(EFI_FILE_HANDLE root, const workload* w, const char* label, load_result* res) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE windir, file;
+    EFI_REGISTRY_HIVE* hive;
+    LIST_ENTRY images;
+    boot_driver* drivers = w->drivers;
+    unsigned int num_drivers = w->num_drivers;
+    bool ret = false;
+
+    Status = open_file(root, &windir, L"Windows");
+    if (EFI_ERROR(Status)) {
+        fail("%s: opening Windows returned %s", label, error_string(Status));
+        return false;
+    }
+
+    Status = open_file(windir, &file, L"System32\\config\\SYSTEM");
+    if (EFI_ERROR(Status)) {
+        fail("%s: opening the SYSTEM hive returned %s", label, error_string(Status));
+        goto end;
+    }
+
+    Status = reg->OpenHive(file, &hive);
+    file->Close(file);
+
+    if (EFI_ERROR(Status)) {
+        fail("%s: OpenHive returned %s", label, error_string(Status));
+        goto end;
+    }
+
+    hive->Close(hive);
+
+    for (unsigned int i = 0; i < sizeof(boot_files) / sizeof(boot_files[0]); i++) {
+        void* data;
+        size_t size;
+
+        Status = read_file(bs, windir, boot_files[i], &data, &size);
+        if (Status == EFI_NOT_FOUND && w->optional_files)
+            continue;
+        else if (EFI_ERROR(Status)) {
+            fail("%s: reading file %u returned %s", label, i, error_string(Status));
+            goto end;
+        }
+
+        free_file(data, size);
+    }
+
+    if (!drivers && !get_boot_drivers(reg, windir, &drivers, &num_drivers)) {
+        fail("%s: could not get the boot drivers", label);
+        goto end;
+    }
+
+    Status = replay_load(pe, windir, w->version, drivers, num_drivers, &mode, &images, res);
+
+    free_images(&images, res->version);
+
+    if (EFI_ERROR(Status))
+        fail("%s: loading returned %s", label, error_string(Status));
+    else
+        ret = true;
+
+end:
+    if (drivers != w->drivers)
+        free(drivers);
+
+    windir->Close(windir);
+
+    return ret;
+}
+
+// generating the Windows directory
+
+static bool make_dir(const char* base, const char* sub) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/%s", base, sub);
+
+    if (mkdir(path, 0755) != 0 && access(path, F_OK) != 0) {
+        perror(path);
+        return false;
+    }
+
+    return true;
+}
+
+static uint32_t next_random(uint32_t* state) {
+    // xorshift32
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+
+    return *state;
+}
+
+// Fills the buffer with words, which compress about as well as the text and code in a real
+// Windows directory, or with noise, which doesn't compress at all.
+static void fill(uint8_t* data, size_t size, bool noise, uint32_t* state) {
+    static const char* const words[] = {
+        "amd64", "assembly", "boot", "culture", "driver", "export", "identity", "import", "kernel",
+        "manifest", "Microsoft", "neutral", "processor", "public", "registry", "section", "service",
+        "token", "version", "Windows", "x86", "\r\n", "=", "<", ">", "\"", "0", "1", "10.0.19041.1",
+    };
+    size_t pos = 0;
+
+    if (noise) {
+        for (pos = 0; pos < size; pos++) {
+            data[pos] = (uint8_t)next_random(state);
+        }
+
+        return;
+    }
+
+    while (pos < size) {
+        const char* word = words[next_random(state) % (sizeof(words) / sizeof(words[0]))];
+        size_t len = strlen(word);
+
+        if (len > size - pos)
+            len = size - pos;
+
+        memcpy(&data[pos], word, len);
+        pos += len;
+
+        if (pos < size) {
+            data[pos] = ' ';
+            pos++;
+        }
+    }
+}
+
+static bool write_file(const char* base, const char* name, size_t size, bool noise, uint32_t* state) {
+    char path[4096];
+    uint8_t* data;
+    FILE* f;
+    bool ret;
+
+    snprintf(path, sizeof(path), "%s/%s", base, name);
+
+    data = malloc(size + 1);
+    if (!data)
+        return false;
+
+    fill(data, size, noise, state);
+
+    f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        free(data);
+        return false;
+    }
+
+    ret = size == 0 || fwrite(data, size, 1, f) == 1;
+
+    if (fclose(f) != 0)
+        ret = false;
+
+    free(data);
+
+    return ret;
+}
+
+// Lots of small files in lots of directories, as in WinSxS, so that the FS tree is as deep as
+// a real one. Most sizes are small enough to be inline, and a few are big enough to need
+// several compressed extents.
+static bool write_filler(const char* windir, unsigned int dirs, uint32_t* state) {
+    if (!make_dir(windir, "WinSxS"))
+        return false;
+
+    for (unsigned int i = 0; i < dirs; i++) {
+        char name[256];
+        unsigned int files = 4 + (next_random(state) % 12);
+
+        snprintf(name, sizeof(name), "WinSxS/amd64_component-%u_31bf3856ad364e35_10.0.19041.%u_none_%08x", i,
+                 next_random(state) % 1000, next_random(state));
+
+        if (!make_dir(windir, name))
+            return false;
+
+        for (unsigned int j = 0; j < files; j++) {
+            char file[512];
+            uint32_t r = next_random(state) % 100;
+            size_t size;
+
+            if (r < 55)
+                size = next_random(state) % 3000;
+            else if (r < 95)
+                size = 3000 + (next_random(state) % 60000);
+            else
+                size = 64000 + (next_random(state) % 600000);
+
+            snprintf(file, sizeof(file), "%s/file%u.%s", name, j, j % 3 == 0 ? "dll" : "manifest");
+
+            if (!write_file(windir, file, size, j % 7 == 6, state))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static bool generate(const char* tmp, const gen_scenario* sc, pegen_result* gen, workload* w) {
+    char windir[4096], system32[4096], path[4096];
+    hive_params params;
+    gen_key* root;
+    uint32_t hive_size, state = sc->pe.seed | 1;
+    bool ret;
+
+    snprintf(path, sizeof(path), "%s/src", tmp);
+    snprintf(windir, sizeof(windir), "%s/src/Windows", tmp);
+    snprintf(system32, sizeof(system32), "%s/System32", windir);
+
+    if (mkdir(path, 0755) != 0 || mkdir(windir, 0755) != 0) {
+        perror(windir);
+        return false;
+    }
+
+    if (!pegen_write(system32, &sc->pe, gen)) {
+        fail("%s: could not write images", sc->label);
+        return false;
+    }
+
+    // the same sizes as on Windows 10
+    if (!make_dir(windir, "System32/config") || !make_dir(windir, "inf") || !make_dir(windir, "AppPatch") ||
+        !write_file(windir, "System32/c_1252.nls", 66082, false, &state) ||
+        !write_file(windir, "System32/c_437.nls", 66082, false, &state) ||
+        !write_file(windir, "System32/l_intl.nls", 7796, false, &state) ||
+        !write_file(windir, "inf/biosinfo.inf", 9394, false, &state) ||
+        !write_file(windir, "AppPatch/drvmain.sdb", 561416, false, &state) ||
+        !write_filler(windir, sc->filler_dirs, &state)) {
+        pegen_free(gen);
+        return false;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.services = 600;
+    params.boot_drivers = sc->pe.drivers;
+    params.leaf_size = 511;
+    params.seed = sc->pe.seed;
+
+    root = gen_system_hive(&params, NULL);
+
+    snprintf(path, sizeof(path), "%s/System32/config/SYSTEM", windir);
+    ret = gen_write_hive(root, &params, path, &hive_size);
+
+    gen_free_key(root);
+
+    if (!ret) {
+        perror(path);
+        pegen_free(gen);
+        return false;
+    }
+
+    // the images come from pegen rather than the hive, whose services it doesn't know about
+
+    memset(w, 0, sizeof(workload));
+    w->version = sc->pe.version;
+    w->num_drivers = gen->num_drivers;
+    w->drivers = calloc(gen->num_drivers + 1, sizeof(boot_driver));
+
+    for (unsigned int i = 0; i < gen->num_drivers; i++) {
+        widen("System32\\drivers", w->drivers[i].dir);
+        widen(gen->driver_files[i], w->drivers[i].file);
+    }
+
+    return true;
+}
+
+static bool make_image(const char* tmp, const compression_type* ct, char* image, size_t image_size,
+                       btrfsgen_result* res) {
+    char src[4096];
+    btrfsgen_params params;
+
+    snprintf(src, sizeof(src), "%s/src", tmp);
+    snprintf(image, image_size, "%s/%s.img", tmp, ct->label);
+
+    params.compression = ct->compression;
+    params.seed = 1;
+
+    if (!btrfsgen_write(src, image, &params, res)) {
+        fail("%s: could not write image", ct->label);
+        return false;
+    }
+
+    return true;
+}
+
+// checks
+
+typedef struct {
+    char* path; // relative to the root
+    uint64_t size;
+    struct timespec mtime;
+} tree_file;
+
+static tree_file* tree_files;
+static unsigned int num_tree_files, alloc_tree_files;
+static size_t tree_root_len;
+
+static int add_tree_file(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)ftw;
+
+    if (type != FTW_F)
+        return 0;
+
+    if (num_tree_files == alloc_tree_files) {
+        alloc_tree_files = alloc_tree_files == 0 ? 1024 : alloc_tree_files * 2;
+        tree_files = realloc(tree_files, alloc_tree_files * sizeof(tree_file));
+    }
+
+    tree_files[num_tree_files].path = malloc(strlen(path + tree_root_len + 1) + 1);
+    strcpy(tree_files[num_tree_files].path, path + tree_root_len + 1);
+    tree_files[num_tree_files].size = st->st_size;
+    tree_files[num_tree_files].mtime = st->st_mtim;
+    num_tree_files++;
+
+    return 0;
+}
+
+static void free_tree_files(void) {
+    for (unsigned int i = 0; i < num_tree_files; i++) {
+        free(tree_files[i].path);
+    }
+
+    free(tree_files);
+    tree_files = NULL;
+    num_tree_files = alloc_tree_files = 0;
+}
+
+static uint8_t* read_host_file(const char* src, const char* name, uint64_t size) {
+    char path[4096];
+    uint8_t* data = malloc(size + 1);
+    FILE* f;
+
+    snprintf(path, sizeof(path), "%s/%s", src, name);
+
+    f = fopen(path, "rb");
+    if (!f) {
+        free(data);
+        return NULL;
+    }
+
+    if (size != 0 && fread(data, size, 1, f) != 1) {
+        fclose(f);
+        free(data);
+        return NULL;
+    }
+
+    fclose(f);
+
+    return data;
+}
+
+// Reads every file whole, as read_file does, and compares it with the original.
+static void check_files(EFI_FILE_HANDLE root, const char* src, const char* label) {
+    for (unsigned int i = 0; i < num_tree_files; i++) {
+        WCHAR name[MAX_PATH];
+        uint8_t* expected;
+        void* data;
+        size_t size;
+        EFI_STATUS Status;
+
+        widen(tree_files[i].path, name);
+
+        // read_file won't read empty files, so check they come back empty
+        if (tree_files[i].size == 0) {
+            EFI_FILE_HANDLE file;
+            uint8_t buf[16];
+            UINTN read = sizeof(buf);
+
+            Status = open_file(root, &file, name);
+            if (EFI_ERROR(Status)) {
+                fail("%s: opening %s returned %s", label, tree_files[i].path, error_string(Status));
+                continue;
+            }
+
+            Status = file->Read(file, &read, buf);
+            if (EFI_ERROR(Status) || read != 0)
+                fail("%s: reading empty file %s returned %s, %zu bytes", label, tree_files[i].path,
+                     error_string(Status), (size_t)read);
+
+            file->Close(file);
+            continue;
+        }
+
+        Status = read_file(bs, root, name, &data, &size);
+        if (EFI_ERROR(Status)) {
+            fail("%s: reading %s returned %s", label, tree_files[i].path, error_string(Status));
+            continue;
+        }
+
+        expected = read_host_file(src, tree_files[i].path, tree_files[i].size);
+
+        if (!expected)
+            fail("%s: could not read %s from the host", label, tree_files[i].path);
+        else if (size != tree_files[i].size)
+            fail("%s: %s was %zu bytes, not %" PRIu64, label, tree_files[i].path, size, tree_files[i].size);
+        else if (memcmp(data, expected, size))
+            fail("%s: %s didn't match", label, tree_files[i].path);
+
+        free(expected);
+        free_file(data, size);
+    }
+}
+
+// Checks that GetInfo gives the same modification times as the host, which the kernel cache relies on.
+static void check_times(EFI_FILE_HANDLE root, const char* label) {
+    EFI_GUID guid = EFI_FILE_INFO_ID;
+
+    for (unsigned int i = 0; i < num_tree_files; i++) {
+        WCHAR name[MAX_PATH];
+        EFI_FILE_HANDLE file;
+        WCHAR buf[(sizeof(EFI_FILE_INFO) / sizeof(WCHAR)) + MAX_PATH];
+        UINTN size = sizeof(buf);
+        EFI_TIME* t = &((EFI_FILE_INFO*)buf)->ModificationTime;
+        EFI_STATUS Status;
+        struct tm tm;
+
+        widen(tree_files[i].path, name);
+
+        Status = open_file(root, &file, name);
+        if (EFI_ERROR(Status)) {
+            fail("%s: opening %s returned %s", label, tree_files[i].path, error_string(Status));
+            continue;
+        }
+
+        Status = file->GetInfo(file, &guid, &size, buf);
+
+        file->Close(file);
+
+        if (EFI_ERROR(Status)) {
+            fail("%s: GetInfo on %s returned %s", label, tree_files[i].path, error_string(Status));
+            continue;
+        }
+
+        gmtime_r(&tree_files[i].mtime.tv_sec, &tm);
+
+        if (t->Year != tm.tm_year + 1900 || t->Month != tm.tm_mon + 1 || t->Day != tm.tm_mday ||
+            t->Hour != tm.tm_hour || t->Minute != tm.tm_min || t->Second != tm.tm_sec ||
+            t->Nanosecond != (UINT32)tree_files[i].mtime.tv_nsec) {
+            fail("%s: %s has time %04u-%02u-%02u %02u:%02u:%02u.%09u, not %04u-%02u-%02u %02u:%02u:%02u.%09lu", label,
+                 tree_files[i].path, t->Year, t->Month, t->Day, t->Hour, t->Minute, t->Second, t->Nanosecond,
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                 (unsigned long)tree_files[i].mtime.tv_nsec);
+        }
+    }
+}
+
+// Reads pieces of the bigger files from odd positions: either side of sector and extent
+// boundaries, and over the end of the file. Each piece is followed by another read, to check
+// the position moved on by the right amount.
+static void check_positions(EFI_FILE_HANDLE root, const char* src, const char* label) {
+    static const uint64_t lengths[] = { 1, 100, 4096, 5000, 70000, 200000 };
+    unsigned int files = 0;
+    uint8_t* buf = malloc(0x40000);
+
+    for (unsigned int i = 0; i < num_tree_files && files < MAX_POSITION_FILES; i++) {
+        uint64_t size = tree_files[i].size;
+        uint64_t offsets[] = { 0, 1, 4095, 4097, 0x20000 - 7, size / 2 + 3, size - 1000, size - 1 };
+        WCHAR name[MAX_PATH];
+        EFI_FILE_HANDLE file;
+        uint8_t* expected;
+        EFI_STATUS Status;
+
+        if (size < 8192)
+            continue;
+
+        files++;
+
+        widen(tree_files[i].path, name);
+
+        Status = open_file(root, &file, name);
+        if (EFI_ERROR(Status)) {
+            fail("%s: opening %s returned %s", label, tree_files[i].path, error_string(Status));
+            continue;
+        }
+
+        expected = read_host_file(src, tree_files[i].path, size);
+        if (!expected) {
+            file->Close(file);
+            continue;
+        }
+
+        for (unsigned int j = 0; j < sizeof(offsets) / sizeof(offsets[0]); j++) {
+            uint64_t off = offsets[j], len = lengths[(i + j) % (sizeof(lengths) / sizeof(lengths[0]))];
+
+            if (off >= size)
+                continue;
+
+            Status = file->SetPosition(file, off);
+            if (EFI_ERROR(Status)) {
+                fail("%s: SetPosition returned %s", label, error_string(Status));
+                break;
+            }
+
+            for (unsigned int k = 0; k < 2; k++) {
+                uint64_t want = len < size - off ? len : size - off;
+                UINTN read = len;
+
+                Status = file->Read(file, &read, buf);
+                if (EFI_ERROR(Status)) {
+                    fail("%s: reading %" PRIu64 " bytes of %s at %" PRIx64 " returned %s", label, len,
+                         tree_files[i].path, off, error_string(Status));
+                    break;
+                }
+
+                if (read != want)
+                    fail("%s: read %zu bytes of %s at %" PRIx64 ", not %" PRIu64, label, (size_t)read,
+                         tree_files[i].path, off, want);
+                else if (memcmp(buf, expected + off, read))
+                    fail("%s: %" PRIu64 " bytes of %s at %" PRIx64 " didn't match", label, len, tree_files[i].path,
+                         off);
+
+                off += read;
+                len = 333;
+            }
+        }
+
+        free(expected);
+        file->Close(file);
+    }
+
+    free(buf);
+}
+
+// The same again, from copies that preload_file has read into memory, which shouldn't need the disk.
+static void check_preload(EFI_FILE_HANDLE root, disk* d, const char* src, const char* label) {
+    unsigned int files = 0;
+
+    for (unsigned int i = 0; i < num_tree_files && files < MAX_POSITION_FILES; i++) {
+        WCHAR name[MAX_PATH];
+        EFI_STATUS Status;
+
+        if (tree_files[i].size < 8192)
+            continue;
+
+        files++;
+
+        widen(tree_files[i].path, name);
+
+        Status = preload_file(bs, root, L"", name);
+        if (EFI_ERROR(Status))
+            fail("%s: preloading %s returned %s", label, tree_files[i].path, error_string(Status));
+    }
+
+    add_preload_dir(root, L"");
+
+    reset_disk_counters(d);
+
+    check_positions(root, src, label);
+
+    if (d->reads != 0)
+        fail("%s: %" PRIu64 " reads from preloaded files", label, d->reads);
+
+    free_preloaded_files(bs);
+}
+
+static void check_image(const char* tmp, const compression_type* ct, const workload* w, uint64_t checksum) {
+    char image[4096], src[4096];
+    btrfsgen_result gen;
+    disk d, d2;
+    EFI_FILE_HANDLE root;
+    EFI_QUIBBLE_PREFETCH_PROTOCOL* prefetch;
+    load_result res;
+    host_stats before;
+    unsigned int stats_before = stats_lines;
+    void* manifest = NULL;
+    UINTN manifest_size = 0;
+
+    snprintf(src, sizeof(src), "%s/src", tmp);
+
+    if (!make_image(tmp, ct, image, sizeof(image), &gen))
+        return;
+
+    if (ct->compression != BTRFS_COMPRESSION_NONE && gen.compressed_extents == 0)
+        fail("%s: nothing was compressed", ct->label);
+
+    if (!mount(image, &d, &root)) {
+        fail("%s: could not mount image", ct->label);
+        return;
+    }
+
+    // record on a fresh mount, so the manifest covers everything a boot reads
+
+    prefetch = get_prefetch(&d);
+
+    if (prefetch)
+        prefetch->Record(prefetch, TRUE);
+
+    if (run_workload(root, w, ct->label, &res) && res.checksum != checksum)
+        fail("%s: checksum %016" PRIx64 ", not %016" PRIx64 " as from the directory", ct->label, res.checksum,
+             checksum);
+
+    if (prefetch) {
+        prefetch->Record(prefetch, FALSE);
+
+        if (prefetch->GetManifest(prefetch, NULL, &manifest_size) == EFI_BUFFER_TOO_SMALL) {
+            manifest = malloc(manifest_size);
+
+            if (EFI_ERROR(prefetch->GetManifest(prefetch, manifest, &manifest_size))) {
+                free(manifest);
+                manifest = NULL;
+            }
+        }
+    }
+
+    check_files(root, src, ct->label);
+    check_times(root, ct->label);
+    check_positions(root, src, ct->label);
+    check_preload(root, &d, src, ct->label);
+
+    // Once everything the driver needs is cached, a boot shouldn't leave anything allocated.
+    // Only the driver's handles are still open here, so the stats shouldn't have been printed.
+
+    before = host_counters;
+
+    if (run_workload(root, w, ct->label, &res) &&
+        host_counters.pool_allocs - before.pool_allocs != host_counters.pool_frees - before.pool_frees) {
+        fail("%s: %" PRId64 " pool allocations not freed", ct->label,
+             (int64_t)((host_counters.pool_allocs - before.pool_allocs) - (host_counters.pool_frees - before.pool_frees)));
+    }
+
+    if (stats_lines != stats_before)
+        fail("%s: stats printed while files were still open", ct->label);
+
+    unmount(&d, root);
+
+    // from here on only once in the whole run, when the first volume's last handle is closed
+
+    if (stats_lines != 1)
+        fail("%s: stats printed %u times", ct->label, stats_lines);
+
+    // the same again, with what was read the first time prefetched
+
+    if (!manifest)
+        fail("%s: no prefetch manifest", ct->label);
+    else if (mount(image, &d2, &root)) {
+        prefetch = get_prefetch(&d2);
+
+        // A manifest with one damaged entry should be dropped as a whole, without
+        // anything being cached. The header is 24 bytes, and each entry is 24 bytes
+        // with the size at offset 16.
+
+        if (prefetch && manifest_size >= 48) {
+            uint8_t* damaged = malloc(manifest_size);
+            uint32_t odd_size = 1;
+
+            memcpy(damaged, manifest, manifest_size);
+            memcpy(damaged + manifest_size - 8, &odd_size, sizeof(uint32_t));
+
+            if (prefetch->Replay(prefetch, damaged, manifest_size) != EFI_INVALID_PARAMETER)
+                fail("%s: damaged prefetch manifest not rejected", ct->label);
+
+            free(damaged);
+        }
+
+        if (!prefetch || EFI_ERROR(prefetch->Replay(prefetch, manifest, manifest_size)))
+            fail("%s: prefetch replay failed", ct->label);
+
+        reset_disk_counters(&d2);
+
+        if (run_workload(root, w, ct->label, &res) && res.checksum != checksum)
+            fail("%s, prefetched: checksum %016" PRIx64 ", not %016" PRIx64, ct->label, res.checksum, checksum);
+
+        if (d2.reads != 0)
+            fail("%s: %" PRIu64 " reads after prefetching", ct->label, d2.reads);
+
+        unmount(&d2, root);
+    }
+
+    free(manifest);
+
+    printf("%s: %" PRIu64 " files, %u compressed extents, FS tree level %u, checksum %016" PRIx64 "\n", ct->label,
+           gen.files, gen.compressed_extents, gen.fs_tree_level, res.checksum);
+
+    unlink(image);
+}
+
+static int do_check(void) {
+    char tmp[] = "/tmp/btrfs_test.XXXXXX";
+    char src[4096], windir[4096];
+    pegen_result gen;
+    workload w;
+    EFI_FILE_HANDLE dir;
+    load_result res;
+
+    if (!mkdtemp(tmp)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    if (!generate(tmp, &check_scenario, &gen, &w)) {
+        remove_tree(tmp);
+        return 1;
+    }
+
+    snprintf(src, sizeof(src), "%s/src", tmp);
+    snprintf(windir, sizeof(windir), "%s/src/Windows", tmp);
+
+    tree_root_len = strlen(src);
+    nftw(src, add_tree_file, 16, FTW_PHYS);
+
+    print_quiet = true;
+
+    // what a boot loads straight from the directory, for comparison
+
+    if (EFI_ERROR(host_open_dir(src, &dir)))
+        fail("could not open %s", src);
+    else {
+        if (run_workload(dir, &w, "directory", &res)) {
+            for (unsigned int i = 0; i < sizeof(compression_types) / sizeof(compression_types[0]); i++) {
+                if (compression_types[i].compression == BTRFS_COMPRESSION_ZSTD && !btrfsgen_zstd_available()) {
+                    printf("%s: skipped, as libzstd.so.1 isn't available\n", compression_types[i].label);
+                    continue;
+                }
+
+                check_image(tmp, &compression_types[i], &w, res.checksum);
+            }
+        }
+
+        dir->Close(dir);
+    }
+
+    print_quiet = false;
+
+    free_tree_files();
+    free(w.drivers);
+    pegen_free(&gen);
+    remove_tree(tmp);
+
+    if (failures > 0) {
+        printf("%u failures.\n", failures);
+        return 1;
+    }
+
+    printf("All tests passed.\n");
+
+    return 0;
+}
+
+// benchmarks
+
+typedef struct {
+    uint64_t ns;
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t discontiguous;
+    host_stats counters;
+} bench_result;
+
+static void print_bench(const char* label, const bench_result* r) {
+    printf("  %s: %.2f ms, %" PRIu64 " reads (%.1f MB, %" PRIu64 " discontiguous)\n", label, ms(r->ns), r->reads,
+           mb(r->read_bytes), r->discontiguous);
+    printf("    %" PRIu64 " pool allocations (%.1f MB, %" PRIu64 " frees), %" PRIu64 " page allocations\n",
+           r->counters.pool_allocs, mb(r->counters.pool_bytes), r->counters.pool_frees, r->counters.page_allocs);
+}
+
+// Times the workload on a fresh mount, then again with everything the driver keeps already
+// loaded, and then on another fresh mount with what the first run read prefetched.
+static void bench_image(const char* image, const char* label, const workload* w) {
+    disk d, d2;
+    EFI_FILE_HANDLE root;
+    EFI_QUIBBLE_PREFETCH_PROTOCOL* prefetch;
+    bench_result cold, warm, prefetched;
+    load_result res;
+    void* manifest = NULL;
+    UINTN manifest_size = 0;
+    uint64_t start;
+
+    if (!mount(image, &d, &root)) {
+        failures++;
+        return;
+    }
+
+    prefetch = get_prefetch(&d);
+
+    if (prefetch)
+        prefetch->Record(prefetch, TRUE);
+
+    reset_disk_counters(&d);
+    host_reset_counters();
+    print_quiet = true;
+
+    start = host_ns();
+
+    if (!run_workload(root, w, label, &res)) {
+        print_quiet = false;
+        unmount(&d, root);
+        return;
+    }
+
+    cold.ns = host_ns() - start;
+    cold.reads = d.reads;
+    cold.read_bytes = d.read_bytes;
+    cold.discontiguous = d.discontiguous;
+    cold.counters = host_counters;
+
+    if (prefetch) {
+        prefetch->Record(prefetch, FALSE);
+
+        if (prefetch->GetManifest(prefetch, NULL, &manifest_size) == EFI_BUFFER_TOO_SMALL) {
+            manifest = malloc(manifest_size);
+
+            if (EFI_ERROR(prefetch->GetManifest(prefetch, manifest, &manifest_size))) {
+                free(manifest);
+                manifest = NULL;
+            }
+        }
+    }
+
+    memset(&warm, 0, sizeof(warm));
+
+    for (unsigned int run = 0; run < BENCH_RUNS; run++) {
+        bench_result r;
+
+        reset_disk_counters(&d);
+        host_reset_counters();
+
+        start = host_ns();
+
+        if (!run_workload(root, w, label, &res))
+            break;
+
+        r.ns = host_ns() - start;
+        r.reads = d.reads;
+        r.read_bytes = d.read_bytes;
+        r.discontiguous = d.discontiguous;
+        r.counters = host_counters;
+
+        if (run == 0 || r.ns < warm.ns)
+            warm = r;
+    }
+
+    print_quiet = false;
+
+    printf("%s: %u images, checksum %016" PRIx64 "\n", label, res.num_images, res.checksum);
+    print_bench("first boot", &cold);
+    print_bench("remounted", &warm);
+
+    unmount(&d, root);
+
+    if (manifest && mount(image, &d2, &root)) {
+        prefetch = get_prefetch(&d2);
+
+        reset_disk_counters(&d2);
+        host_reset_counters();
+        print_quiet = true;
+
+        start = host_ns();
+
+        if (prefetch)
+            prefetch->Replay(prefetch, manifest, manifest_size);
+
+        if (run_workload(root, w, label, &res)) {
+            prefetched.ns = host_ns() - start;
+            prefetched.reads = d2.reads;
+            prefetched.read_bytes = d2.read_bytes;
+            prefetched.discontiguous = d2.discontiguous;
+            prefetched.counters = host_counters;
+
+            print_quiet = false;
+            print_bench("prefetched", &prefetched);
+        }
+
+        print_quiet = false;
+
+        unmount(&d2, root);
+    }
+
+    free(manifest);
+}
+
+static int do_bench(int argc, char** argv) {
+    char tmp[] = "/tmp/btrfs_test.XXXXXX";
+    pegen_result gen;
+    workload w;
+
+    if (argc > 0) {
+        memset(&w, 0, sizeof(w));
+        w.optional_files = true;
+
+        for (int i = 0; i < argc; i++) {
+            bench_image(argv[i], argv[i], &w);
+        }
+
+        return failures > 0 ? 1 : 0;
+    }
+
+    if (!mkdtemp(tmp)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    if (!generate(tmp, &bench_scenario, &gen, &w)) {
+        remove_tree(tmp);
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < sizeof(compression_types) / sizeof(compression_types[0]); i++) {
+        const compression_type* ct = &compression_types[i];
+        char image[4096], label[256];
+        btrfsgen_result res;
+
+        if (ct->compression == BTRFS_COMPRESSION_ZSTD && !btrfsgen_zstd_available()) {
+            printf("%s: skipped, as libzstd.so.1 isn't available\n", ct->label);
+            continue;
+        }
+
+        if (!make_image(tmp, ct, image, sizeof(image), &res))
+            continue;
+
+        snprintf(label, sizeof(label), "%s, %s", bench_scenario.label, ct->label);
+
+        printf("%s: %" PRIu64 " files (%.1f MB), image %.1f MB, data %.1f MB, metadata %.1f MB, FS tree level %u\n",
+               ct->label, res.files, mb(res.file_bytes), mb(res.image_size), mb(res.data_bytes),
+               mb(res.metadata_bytes), res.fs_tree_level);
+
+        bench_image(image, label, &w);
+
+        unlink(image);
+    }
+
+    free(w.drivers);
+    pegen_free(&gen);
+    remove_tree(tmp);
+
+    return failures > 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    EFI_GUID pe_guid = PE_LOADER_PROTOCOL;
+    EFI_GUID reg_guid = WINDOWS_REGISTRY_PROTOCOL;
+    EFI_GUID info_guid = EFI_QUIBBLE_INFO_PROTOCOL_GUID;
+    EFI_GUID drvbind_guid = EFI_DRIVER_BINDING_PROTOCOL_GUID;
+    EFI_HANDLE info_handle = NULL;
+    EFI_STATUS Status;
+
+    host_init();
+
+    Status = pe_register(bs, 0x12345678);
+    if (EFI_ERROR(Status)) {
+        printf("pe_register returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    Status = bs->LocateProtocol(&pe_guid, NULL, (void**)&pe);
+    if (EFI_ERROR(Status)) {
+        printf("LocateProtocol returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    Status = reg_register(bs);
+    if (EFI_ERROR(Status)) {
+        printf("reg_register returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    Status = bs->LocateProtocol(&reg_guid, NULL, (void**)&reg);
+    if (EFI_ERROR(Status)) {
+        printf("LocateProtocol returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    // as Quibble does before loading its drivers, so that they can print
+    Status = bs->InstallProtocolInterface(&info_handle, &info_guid, EFI_NATIVE_INTERFACE, &info_proto);
+    if (EFI_ERROR(Status)) {
+        printf("InstallProtocolInterface returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    Status = efi_main(host_image_handle, &host_systable);
+    if (EFI_ERROR(Status)) {
+        printf("efi_main returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    Status = bs->HandleProtocol(host_image_handle, &drvbind_guid, (void**)&drvbind);
+    if (EFI_ERROR(Status)) {
+        printf("HandleProtocol returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    if (argc >= 2 && !strcmp(argv[1], "bench"))
+        return do_bench(argc - 2, argv + 2);
+    else if (argc == 1 || !strcmp(argv[1], "check"))
+        return do_check();
+
+    printf("Usage: btrfs_test [check | bench [image...]]\n");
+
+    return 1;
+}
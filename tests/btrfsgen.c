@@ -0,0 +1,1063 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "btrfsgen.h"
+
+#define Z_SOLO
+#include "zlib/zlib.h"
+
+#define SECTOR_SIZE 0x1000
+#define NODE_SIZE 0x4000
+#define GENERATION 1
+#define MAX_INLINE 2048 // as Linux's max_inline
+#define MAX_COMPRESSED_EXTENT 0x20000 // 128 KB, as Linux
+#define MAX_EXTENT 0x8000000 // 128 MB
+#define LZO_SEGMENT 0x1000
+#define LZO_HASH_BITS 12
+#define CHUNK_ALIGN 0x100000
+
+// Logical addresses deliberately don't match physical ones, so that the driver has to map them.
+#define SYS_CHUNK_ADDR 0x1500000
+#define SYS_CHUNK_PHYS 0x100000
+#define SYS_CHUNK_SIZE 0x400000
+#define META_CHUNK_ADDR 0x2000000
+#define DATA_CHUNK_ADDR 0x40000000
+
+#define INODE_MODE_DIR 040755
+#define INODE_MODE_FILE 0100644
+
+_Static_assert(sizeof(superblock) == 0x1000, "superblock is the wrong size");
+
+uint32_t calc_crc32c(uint32_t seed, uint8_t* msg, unsigned int msglen); // crc32c.c
+
+typedef struct {
+    uint8_t* data;
+    uint64_t size;
+    uint64_t alloc;
+} buffer;
+
+typedef struct {
+    KEY key;
+    uint8_t* data;
+    uint32_t size;
+} gen_item;
+
+typedef struct {
+    gen_item* items;
+    unsigned int num;
+    unsigned int alloc;
+} item_list;
+
+typedef struct {
+    KEY key;
+    uint64_t address;
+} node_ptr;
+
+typedef struct {
+    const btrfsgen_params* params;
+    btrfsgen_result* res;
+    item_list fs;
+    buffer data;
+    uint64_t next_inode;
+    BTRFS_UUID fs_uuid;
+    BTRFS_UUID chunk_uuid;
+    BTRFS_UUID dev_uuid;
+    BTRFS_UUID subvol_uuid;
+    uint8_t* comp; // compression output, big enough for anything we'd keep
+} gen_ctx;
+
+typedef size_t (*zstd_compress_func)(void* dst, size_t dst_capacity, const void* src, size_t src_size, int level);
+typedef unsigned int (*zstd_is_error_func)(size_t code);
+
+static zstd_compress_func zstd_compress;
+static zstd_is_error_func zstd_is_error;
+
+static void* xalloc(size_t size) {
+    void* p = calloc(1, size);
+
+    if (!p) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    return p;
+}
+
+static uint64_t align_up(uint64_t v, uint64_t align) {
+    return (v + align - 1) & ~(align - 1);
+}
+
+// Appends size bytes, zeroes if data is NULL, and returns where they went.
+static uint64_t buf_add(buffer* b, const void* data, uint64_t size) {
+    uint64_t off = b->size;
+
+    if (b->size + size > b->alloc) {
+        uint64_t new_alloc = b->alloc == 0 ? 0x10000 : b->alloc;
+
+        while (new_alloc < b->size + size) {
+            new_alloc *= 2;
+        }
+
+        b->data = realloc(b->data, new_alloc);
+        if (!b->data) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+
+        b->alloc = new_alloc;
+    }
+
+    if (data)
+        memcpy(b->data + off, data, size);
+    else
+        memset(b->data + off, 0, size);
+
+    b->size += size;
+
+    return off;
+}
+
+static void add_item(item_list* l, uint64_t obj_id, uint8_t obj_type, uint64_t offset, const void* data,
+                     uint32_t size) {
+    gen_item* it;
+
+    if (l->num == l->alloc) {
+        l->alloc = l->alloc == 0 ? 1024 : l->alloc * 2;
+        l->items = realloc(l->items, l->alloc * sizeof(gen_item));
+        if (!l->items) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    it = &l->items[l->num];
+
+    it->key.obj_id = obj_id;
+    it->key.obj_type = obj_type;
+    it->key.offset = offset;
+    it->data = xalloc(size == 0 ? 1 : size);
+    it->size = size;
+
+    memcpy(it->data, data, size);
+
+    l->num++;
+}
+
+static void free_items(item_list* l) {
+    for (unsigned int i = 0; i < l->num; i++) {
+        free(l->items[i].data);
+    }
+
+    free(l->items);
+}
+
+static int keycmp(const KEY* key1, const KEY* key2) {
+    if (key1->obj_id != key2->obj_id)
+        return key1->obj_id < key2->obj_id ? -1 : 1;
+
+    if (key1->obj_type != key2->obj_type)
+        return key1->obj_type < key2->obj_type ? -1 : 1;
+
+    if (key1->offset != key2->offset)
+        return key1->offset < key2->offset ? -1 : 1;
+
+    return 0;
+}
+
+static int item_cmp(const void* a, const void* b) {
+    return keycmp(&((const gen_item*)a)->key, &((const gen_item*)b)->key);
+}
+
+// Sorts the items, and merges DIR_ITEMs whose names have the same hash into one item, as Btrfs does.
+static void sort_items(item_list* l) {
+    unsigned int n = 0;
+
+    qsort(l->items, l->num, sizeof(gen_item), item_cmp);
+
+    for (unsigned int i = 0; i < l->num; i++) {
+        if (n > 0 && !keycmp(&l->items[n - 1].key, &l->items[i].key)) {
+            gen_item* it = &l->items[n - 1];
+
+            it->data = realloc(it->data, it->size + l->items[i].size);
+            if (!it->data) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+
+            memcpy(it->data + it->size, l->items[i].data, l->items[i].size);
+            it->size += l->items[i].size;
+
+            free(l->items[i].data);
+            continue;
+        }
+
+        l->items[n] = l->items[i];
+        n++;
+    }
+
+    l->num = n;
+}
+
+static void set_csum(uint8_t* data, uint32_t size) {
+    uint32_t crc = ~calc_crc32c(0xffffffff, data + 32, size - 32);
+
+    memset(data, 0, 32);
+    memcpy(data, &crc, sizeof(uint32_t));
+}
+
+static void make_uuid(BTRFS_UUID* uuid, uint32_t* state) {
+    for (unsigned int i = 0; i < sizeof(uuid->uuid); i++) {
+        // xorshift32
+        *state ^= *state << 13;
+        *state ^= *state >> 17;
+        *state ^= *state << 5;
+
+        uuid->uuid[i] = (uint8_t)*state;
+    }
+}
+
+// compression
+
+static void* gen_zalloc(void* opaque, unsigned int items, unsigned int size) {
+    (void)opaque;
+
+    return calloc(items, size);
+}
+
+static void gen_zfree(void* opaque, void* ptr) {
+    (void)opaque;
+
+    free(ptr);
+}
+
+static uint32_t compress_zlib(const uint8_t* in, uint32_t len, uint8_t* out, uint32_t outlen) {
+    z_stream c_stream;
+    int ret;
+
+    memset(&c_stream, 0, sizeof(c_stream));
+    c_stream.zalloc = gen_zalloc;
+    c_stream.zfree = gen_zfree;
+
+    if (deflateInit(&c_stream, 3) != Z_OK) // Linux's default level
+        return 0;
+
+    c_stream.next_in = (uint8_t*)in;
+    c_stream.avail_in = len;
+    c_stream.next_out = out;
+    c_stream.avail_out = outlen;
+
+    ret = deflate(&c_stream, Z_FINISH);
+
+    deflateEnd(&c_stream);
+
+    if (ret != Z_STREAM_END)
+        return 0;
+
+    return outlen - c_stream.avail_out;
+}
+
+static uint32_t lzo_hash(const uint8_t* p) {
+    uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+
+    return (v * 2654435761u) >> (32 - LZO_HASH_BITS);
+}
+
+static uint8_t* lzo_put_length(uint8_t* op, uint32_t n) {
+    while (n > 255) {
+        *op = 0;
+        op++;
+        n -= 255;
+    }
+
+    *op = (uint8_t)n;
+    op++;
+
+    return op;
+}
+
+// Compresses one segment of up to 4 KB as LZO1X, using only the forms lzo.c's decoder accepts:
+// one to three literals go in the bottom bits of the match before them, and anything longer is
+// a literal run, which must come straight after a match with no trailing literals and be
+// followed by another match. Matches are found greedily, and are never further back than the
+// segment, so M4 is never needed. Returns the compressed length, followed by an end marker.
+static uint32_t lzo_segment(const uint8_t* in, uint32_t len, uint8_t* out) {
+    uint16_t table[1 << LZO_HASH_BITS];
+    uint32_t ip = 0, lit_start = 0;
+    uint8_t* op = out;
+    uint8_t* trail = NULL; // the byte of the last match holding its trailing literal count
+
+    memset(table, 0xff, sizeof(table));
+
+    while (true) {
+        uint32_t cand = 0xffff, mlen = 0, lits;
+        bool at_end = ip + 3 > len;
+
+        if (!at_end) {
+            uint32_t h = lzo_hash(&in[ip]);
+
+            cand = table[h];
+            table[h] = (uint16_t)ip;
+
+            if (cand != 0xffff && !memcmp(&in[cand], &in[ip], 3)) {
+                mlen = 3;
+
+                while (ip + mlen < len && in[cand + mlen] == in[ip + mlen]) {
+                    mlen++;
+                }
+            }
+
+            if (mlen == 0) {
+                ip++;
+                continue;
+            }
+        }
+
+        if (at_end)
+            ip = len;
+
+        lits = ip - lit_start;
+
+        if (lits > 0) {
+            if (op == out && lits <= 238) { // first literals of the segment
+                *op = (uint8_t)(17 + lits);
+                op++;
+            } else if (trail && lits <= 3)
+                *trail |= (uint8_t)lits;
+            else if (lits - 3 <= 15) {
+                *op = (uint8_t)(lits - 3);
+                op++;
+            } else {
+                *op = 0;
+                op++;
+                op = lzo_put_length(op, lits - 3 - 15);
+            }
+
+            memcpy(op, &in[lit_start], lits);
+            op += lits;
+        }
+
+        if (at_end)
+            break;
+
+        {
+            uint32_t d = ip - cand - 1;
+
+            if (mlen <= 8 && d < 2048) { // M2
+                *op = (uint8_t)(((mlen - 1) << 5) | ((d & 7) << 2));
+                trail = op;
+                op++;
+                *op = (uint8_t)(d >> 3);
+                op++;
+            } else { // M3
+                if (mlen - 2 <= 31) {
+                    *op = (uint8_t)(32 | (mlen - 2));
+                    op++;
+                } else {
+                    *op = 32;
+                    op++;
+                    op = lzo_put_length(op, mlen - 2 - 31);
+                }
+
+                *op = (uint8_t)((d & 63) << 2);
+                trail = op;
+                op++;
+                *op = (uint8_t)(d >> 6);
+                op++;
+            }
+        }
+
+        for (uint32_t i = ip + 1; i < ip + mlen && i + 3 <= len; i++) {
+            table[lzo_hash(&in[i])] = (uint16_t)i;
+        }
+
+        ip += mlen;
+        lit_start = ip;
+    }
+
+    // end marker
+    op[0] = 0x11;
+    op[1] = 0;
+    op[2] = 0;
+    op += 3;
+
+    return (uint32_t)(op - out);
+}
+
+// Btrfs's LZO format: the total length, then each 4 KB segment preceded by its length. A
+// length never straddles a 4 KB boundary - if it would, it's moved to the next one.
+static uint32_t compress_lzo(const uint8_t* in, uint32_t len, uint8_t* out, uint32_t outlen) {
+    uint32_t op = sizeof(uint32_t);
+
+    for (uint32_t pos = 0; pos < len; pos += LZO_SEGMENT) {
+        uint32_t seg = len - pos < LZO_SEGMENT ? len - pos : LZO_SEGMENT;
+        uint32_t n;
+
+        if (LZO_SEGMENT - (op % LZO_SEGMENT) < sizeof(uint32_t)) {
+            memset(&out[op], 0, LZO_SEGMENT - (op % LZO_SEGMENT));
+            op += LZO_SEGMENT - (op % LZO_SEGMENT);
+        }
+
+        // worst case for a segment of literals
+        if (op + sizeof(uint32_t) + seg + (seg / 255) + 16 > outlen)
+            return 0;
+
+        n = lzo_segment(&in[pos], seg, &out[op + sizeof(uint32_t)]);
+
+        memcpy(&out[op], &n, sizeof(uint32_t));
+        op += sizeof(uint32_t) + n;
+    }
+
+    memcpy(out, &op, sizeof(uint32_t));
+
+    return op;
+}
+
+static bool load_zstd(void) {
+    static bool tried = false;
+
+    if (!tried) {
+        void* lib = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+
+        tried = true;
+
+        if (lib) {
+            zstd_compress = (zstd_compress_func)dlsym(lib, "ZSTD_compress");
+            zstd_is_error = (zstd_is_error_func)dlsym(lib, "ZSTD_isError");
+
+            if (!zstd_compress || !zstd_is_error)
+                zstd_compress = NULL;
+        }
+    }
+
+    return zstd_compress != NULL;
+}
+
+bool btrfsgen_zstd_available(void) {
+    return load_zstd();
+}
+
+static uint32_t compress_zstd(const uint8_t* in, uint32_t len, uint8_t* out, uint32_t outlen) {
+    size_t ret;
+
+    if (!load_zstd())
+        return 0;
+
+    ret = zstd_compress(out, outlen, in, len, 3); // Linux's default level
+
+    if (zstd_is_error(ret))
+        return 0;
+
+    return (uint32_t)ret;
+}
+
+// Returns the compressed length, or 0 if it wouldn't save anything.
+static uint32_t compress_data(uint8_t type, const uint8_t* in, uint32_t len, uint8_t* out) {
+    uint32_t outlen = len + LZO_SEGMENT, ret;
+
+    switch (type) {
+        case BTRFS_COMPRESSION_ZLIB:
+            ret = compress_zlib(in, len, out, outlen);
+            break;
+
+        case BTRFS_COMPRESSION_LZO:
+            ret = compress_lzo(in, len, out, outlen);
+            break;
+
+        case BTRFS_COMPRESSION_ZSTD:
+            ret = compress_zstd(in, len, out, outlen);
+            break;
+
+        default:
+            return 0;
+    }
+
+    return ret < len ? ret : 0;
+}
+
+// the FS tree
+
+static void add_inode_item(gen_ctx* ctx, uint64_t inode, uint32_t mode, uint64_t size, uint64_t blocks,
+                           const struct stat* st) {
+    INODE_ITEM ii;
+
+    memset(&ii, 0, sizeof(ii));
+
+    ii.generation = GENERATION;
+    ii.transid = GENERATION;
+    ii.st_size = size;
+    ii.st_blocks = blocks;
+    ii.st_nlink = 1;
+    ii.st_mode = mode;
+    ii.sequence = 1;
+    ii.st_atime.seconds = ii.st_ctime.seconds = ii.st_mtime.seconds = ii.otime.seconds = st->st_mtim.tv_sec;
+    ii.st_atime.nanoseconds = ii.st_ctime.nanoseconds = ii.st_mtime.nanoseconds = ii.otime.nanoseconds = st->st_mtim.tv_nsec;
+
+    add_item(&ctx->fs, inode, TYPE_INODE_ITEM, 0, &ii, sizeof(ii));
+}
+
+static void add_inode_ref(gen_ctx* ctx, uint64_t inode, uint64_t parent, uint64_t index, const char* name) {
+    uint16_t n = (uint16_t)strlen(name);
+    INODE_REF* ir = xalloc(offsetof(INODE_REF, name[0]) + n);
+
+    ir->index = index;
+    ir->n = n;
+    memcpy(ir->name, name, n);
+
+    add_item(&ctx->fs, inode, TYPE_INODE_REF, parent, ir, offsetof(INODE_REF, name[0]) + n);
+
+    free(ir);
+}
+
+static void add_dir_entry(item_list* l, uint64_t dir, const KEY* location, uint8_t type, uint64_t index,
+                          const char* name) {
+    uint16_t n = (uint16_t)strlen(name);
+    DIR_ITEM* di = xalloc(offsetof(DIR_ITEM, name[0]) + n);
+
+    di->key = *location;
+    di->transid = GENERATION;
+    di->m = 0;
+    di->n = n;
+    di->type = type;
+    memcpy(di->name, name, n);
+
+    add_item(l, dir, TYPE_DIR_ITEM, calc_crc32c(0xfffffffe, (uint8_t*)name, n), di, offsetof(DIR_ITEM, name[0]) + n);
+
+    if (index != 0)
+        add_item(l, dir, TYPE_DIR_INDEX, index, di, offsetof(DIR_ITEM, name[0]) + n);
+
+    free(di);
+}
+
+static void add_extent(gen_ctx* ctx, uint64_t inode, uint64_t offset, uint8_t compression, const uint8_t* data,
+                       uint32_t disk_size, uint32_t decoded_size) {
+    uint8_t buf[offsetof(EXTENT_DATA, data[0]) + sizeof(EXTENT_DATA2)];
+    EXTENT_DATA* ed = (EXTENT_DATA*)buf;
+    EXTENT_DATA2* ed2 = (EXTENT_DATA2*)ed->data;
+    uint64_t off;
+
+    off = buf_add(&ctx->data, data, disk_size);
+    buf_add(&ctx->data, NULL, align_up(disk_size, SECTOR_SIZE) - disk_size);
+
+    memset(buf, 0, sizeof(buf));
+
+    ed->generation = GENERATION;
+    ed->decoded_size = decoded_size;
+    ed->compression = compression;
+    ed->type = EXTENT_TYPE_REGULAR;
+
+    ed2->address = DATA_CHUNK_ADDR + off;
+    ed2->size = align_up(disk_size, SECTOR_SIZE);
+    ed2->offset = 0;
+    ed2->num_bytes = decoded_size;
+
+    add_item(&ctx->fs, inode, TYPE_EXTENT_DATA, offset, buf, sizeof(buf));
+
+    if (compression != BTRFS_COMPRESSION_NONE)
+        ctx->res->compressed_extents++;
+}
+
+static bool add_file(gen_ctx* ctx, const char* path, uint64_t inode, const struct stat* st) {
+    FILE* f;
+    uint64_t size = st->st_size, blocks = 0;
+    uint8_t* data;
+    uint8_t compression = ctx->params->compression;
+
+    data = xalloc(align_up(size, MAX_COMPRESSED_EXTENT) + 1);
+
+    f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        free(data);
+        return false;
+    }
+
+    if (fread(data, 1, size, f) != size) {
+        fprintf(stderr, "Could not read %s.\n", path);
+        fclose(f);
+        free(data);
+        return false;
+    }
+
+    fclose(f);
+
+    if (size == 0) {
+        // no extents
+    } else if (size <= MAX_INLINE) {
+        uint8_t buf[offsetof(EXTENT_DATA, data[0]) + MAX_INLINE];
+        EXTENT_DATA* ed = (EXTENT_DATA*)buf;
+        uint32_t len = 0;
+
+        memset(buf, 0, offsetof(EXTENT_DATA, data[0]));
+
+        if (compression != BTRFS_COMPRESSION_NONE)
+            len = compress_data(compression, data, (uint32_t)size, ctx->comp);
+
+        ed->generation = GENERATION;
+        ed->decoded_size = size;
+        ed->type = EXTENT_TYPE_INLINE;
+
+        if (len != 0) {
+            ed->compression = compression;
+            memcpy(ed->data, ctx->comp, len);
+            ctx->res->compressed_extents++;
+        } else {
+            len = (uint32_t)size;
+            memcpy(ed->data, data, len);
+        }
+
+        add_item(&ctx->fs, inode, TYPE_EXTENT_DATA, 0, buf, offsetof(EXTENT_DATA, data[0]) + len);
+
+        blocks = size;
+        ctx->res->data_bytes += len;
+    } else {
+        uint64_t pos = 0;
+
+        while (pos < size) {
+            uint32_t len, aligned, comp_len = 0;
+
+            if (compression != BTRFS_COMPRESSION_NONE) {
+                // compress sector-aligned pieces, with the end of the last sector zeroed
+                len = size - pos < MAX_COMPRESSED_EXTENT ? (uint32_t)(size - pos) : MAX_COMPRESSED_EXTENT;
+                aligned = (uint32_t)align_up(len, SECTOR_SIZE);
+
+                comp_len = compress_data(compression, &data[pos], aligned, ctx->comp);
+
+                if (align_up(comp_len, SECTOR_SIZE) >= aligned)
+                    comp_len = 0;
+            } else {
+                len = size - pos < MAX_EXTENT ? (uint32_t)(size - pos) : MAX_EXTENT;
+                aligned = (uint32_t)align_up(len, SECTOR_SIZE);
+            }
+
+            if (comp_len != 0) {
+                add_extent(ctx, inode, pos, compression, ctx->comp, comp_len, aligned);
+                ctx->res->data_bytes += align_up(comp_len, SECTOR_SIZE);
+            } else {
+                add_extent(ctx, inode, pos, BTRFS_COMPRESSION_NONE, &data[pos], len, aligned);
+                ctx->res->data_bytes += aligned;
+            }
+
+            blocks += aligned;
+            pos += len;
+        }
+    }
+
+    add_inode_item(ctx, inode, INODE_MODE_FILE, size, blocks, st);
+
+    ctx->res->files++;
+    ctx->res->file_bytes += size;
+
+    free(data);
+
+    return true;
+}
+
+static int filter_entry(const struct dirent* de) {
+    return strcmp(de->d_name, ".") && strcmp(de->d_name, "..");
+}
+
+static bool add_dir(gen_ctx* ctx, const char* path, uint64_t inode, const struct stat* st) {
+    struct dirent** list;
+    int n;
+    uint64_t index = 2, size = 0;
+    bool ret = true;
+
+    n = scandir(path, &list, filter_entry, alphasort);
+    if (n < 0) {
+        fprintf(stderr, "Could not read directory %s.\n", path);
+        return false;
+    }
+
+    for (int i = 0; i < n; i++) {
+        char* child_path;
+        struct stat st2;
+        KEY location;
+        uint64_t child = ctx->next_inode;
+
+        if (asprintf(&child_path, "%s/%s", path, list[i]->d_name) < 0) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+
+        if (lstat(child_path, &st2) != 0 || (!S_ISDIR(st2.st_mode) && !S_ISREG(st2.st_mode))) {
+            free(child_path);
+            continue;
+        }
+
+        ctx->next_inode++;
+
+        location.obj_id = child;
+        location.obj_type = TYPE_INODE_ITEM;
+        location.offset = 0;
+
+        add_dir_entry(&ctx->fs, inode, &location, S_ISDIR(st2.st_mode) ? BTRFS_TYPE_DIRECTORY : BTRFS_TYPE_FILE,
+                      index, list[i]->d_name);
+        add_inode_ref(ctx, child, inode, index, list[i]->d_name);
+
+        index++;
+        size += 2 * strlen(list[i]->d_name);
+
+        if (S_ISDIR(st2.st_mode))
+            ret = add_dir(ctx, child_path, child, &st2);
+        else
+            ret = add_file(ctx, child_path, child, &st2);
+
+        free(child_path);
+
+        if (!ret)
+            break;
+    }
+
+    for (int i = 0; i < n; i++) {
+        free(list[i]);
+    }
+
+    free(list);
+
+    add_inode_item(ctx, inode, INODE_MODE_DIR, size, 0, st);
+
+    ctx->res->dirs++;
+
+    return ret;
+}
+
+// Writes out a tree, filling each node before starting the next, as a freshly balanced tree
+// would be. Returns the address and level of the top node.
+static void write_tree(gen_ctx* ctx, buffer* b, uint64_t base, uint64_t tree_id, const gen_item* items,
+                       unsigned int num, uint64_t* root_addr, uint8_t* root_level) {
+    node_ptr* ptrs = xalloc((num + 1) * sizeof(node_ptr));
+    unsigned int num_ptrs = 0, i = 0;
+    uint8_t level = 0;
+
+    do {
+        uint64_t off = buf_add(b, NULL, NODE_SIZE);
+        uint8_t* node = b->data + off;
+        tree_header* th = (tree_header*)node;
+        leaf_node* ln = (leaf_node*)(node + sizeof(tree_header));
+        uint32_t data_end = NODE_SIZE - sizeof(tree_header), n = 0;
+
+        while (i < num && (n + 1) * sizeof(leaf_node) + items[i].size <= data_end) {
+            data_end -= items[i].size;
+
+            ln[n].key = items[i].key;
+            ln[n].offset = data_end;
+            ln[n].size = items[i].size;
+            memcpy(node + sizeof(tree_header) + data_end, items[i].data, items[i].size);
+
+            n++;
+            i++;
+        }
+
+        th->fs_uuid = ctx->fs_uuid;
+        th->address = base + off;
+        th->flags = HEADER_FLAG_WRITTEN | HEADER_FLAG_MIXED_BACKREF;
+        th->chunk_tree_uuid = ctx->chunk_uuid;
+        th->generation = GENERATION;
+        th->tree_id = tree_id;
+        th->num_items = n;
+        th->level = 0;
+
+        set_csum(node, NODE_SIZE);
+
+        if (n > 0)
+            ptrs[num_ptrs].key = ln[0].key;
+
+        ptrs[num_ptrs].address = base + off;
+        num_ptrs++;
+    } while (i < num);
+
+    while (num_ptrs > 1) {
+        unsigned int max = (NODE_SIZE - sizeof(tree_header)) / sizeof(internal_node), num_ptrs2 = 0;
+
+        level++;
+
+        for (i = 0; i < num_ptrs; i += max) {
+            uint64_t off = buf_add(b, NULL, NODE_SIZE);
+            uint8_t* node = b->data + off;
+            tree_header* th = (tree_header*)node;
+            internal_node* in = (internal_node*)(node + sizeof(tree_header));
+            unsigned int n = num_ptrs - i < max ? num_ptrs - i : max;
+
+            for (unsigned int j = 0; j < n; j++) {
+                in[j].key = ptrs[i + j].key;
+                in[j].address = ptrs[i + j].address;
+                in[j].generation = GENERATION;
+            }
+
+            th->fs_uuid = ctx->fs_uuid;
+            th->address = base + off;
+            th->flags = HEADER_FLAG_WRITTEN | HEADER_FLAG_MIXED_BACKREF;
+            th->chunk_tree_uuid = ctx->chunk_uuid;
+            th->generation = GENERATION;
+            th->tree_id = tree_id;
+            th->num_items = n;
+            th->level = level;
+
+            set_csum(node, NODE_SIZE);
+
+            // fine to overwrite in place, as we've finished with the entries before i
+            ptrs[num_ptrs2].key = ptrs[i].key;
+            ptrs[num_ptrs2].address = base + off;
+            num_ptrs2++;
+        }
+
+        num_ptrs = num_ptrs2;
+    }
+
+    *root_addr = ptrs[0].address;
+    *root_level = level;
+
+    free(ptrs);
+}
+
+static void add_chunk_item(item_list* l, gen_ctx* ctx, uint64_t address, uint64_t phys, uint64_t size,
+                           uint64_t type, uint8_t* copy) {
+    uint8_t buf[sizeof(CHUNK_ITEM) + sizeof(CHUNK_ITEM_STRIPE)];
+    CHUNK_ITEM* ci = (CHUNK_ITEM*)buf;
+    CHUNK_ITEM_STRIPE* cis = (CHUNK_ITEM_STRIPE*)&ci[1];
+
+    memset(buf, 0, sizeof(buf));
+
+    ci->size = size;
+    ci->root_id = BTRFS_ROOT_EXTENT;
+    ci->stripe_length = 0x10000;
+    ci->type = type;
+    ci->opt_io_alignment = SECTOR_SIZE;
+    ci->opt_io_width = SECTOR_SIZE;
+    ci->sector_size = SECTOR_SIZE;
+    ci->num_stripes = 1;
+    ci->sub_stripes = 1;
+
+    cis->dev_id = 1;
+    cis->offset = phys;
+    cis->dev_uuid = ctx->dev_uuid;
+
+    add_item(l, 0x100, TYPE_CHUNK_ITEM, address, buf, sizeof(buf));
+
+    if (copy)
+        memcpy(copy, buf, sizeof(buf));
+}
+
+bool btrfsgen_write(const char* dir, const char* image, const btrfsgen_params* params, btrfsgen_result* res) {
+    gen_ctx ctx;
+    struct stat st;
+    buffer meta, sys;
+    item_list root_items, chunk_items;
+    uint64_t fs_root, root_root, chunk_root, meta_phys, meta_size, data_phys, data_size;
+    uint8_t fs_level, root_level, chunk_level;
+    uint32_t seed = params->seed | 1;
+    superblock* sb;
+    bool ret = false;
+    int fd;
+
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&meta, 0, sizeof(meta));
+    memset(&sys, 0, sizeof(sys));
+    memset(&root_items, 0, sizeof(root_items));
+    memset(&chunk_items, 0, sizeof(chunk_items));
+    memset(res, 0, sizeof(btrfsgen_result));
+
+    if (params->compression == BTRFS_COMPRESSION_ZSTD && !load_zstd()) {
+        fprintf(stderr, "libzstd.so.1 not found.\n");
+        return false;
+    }
+
+    ctx.params = params;
+    ctx.res = res;
+    ctx.next_inode = SUBVOL_ROOT_INODE + 1;
+    ctx.comp = xalloc(MAX_COMPRESSED_EXTENT + LZO_SEGMENT);
+
+    make_uuid(&ctx.fs_uuid, &seed);
+    make_uuid(&ctx.chunk_uuid, &seed);
+    make_uuid(&ctx.dev_uuid, &seed);
+    make_uuid(&ctx.subvol_uuid, &seed);
+
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s is not a directory.\n", dir);
+        goto end;
+    }
+
+    // the subvolume's root directory is its own parent
+    add_inode_ref(&ctx, SUBVOL_ROOT_INODE, SUBVOL_ROOT_INODE, 0, "..");
+
+    if (!add_dir(&ctx, dir, SUBVOL_ROOT_INODE, &st))
+        goto end;
+
+    sort_items(&ctx.fs);
+
+    write_tree(&ctx, &meta, META_CHUNK_ADDR, BTRFS_ROOT_FSTREE, ctx.fs.items, ctx.fs.num, &fs_root, &fs_level);
+
+    res->fs_tree_level = fs_level;
+
+    // root tree: the FS tree, and the "default" entry pointing to it
+
+    {
+        ROOT_ITEM ri;
+        KEY location;
+
+        memset(&ri, 0, sizeof(ri));
+
+        ri.inode.generation = GENERATION;
+        ri.inode.st_size = 3;
+        ri.inode.st_blocks = NODE_SIZE;
+        ri.inode.st_nlink = 1;
+        ri.inode.st_mode = INODE_MODE_DIR;
+        ri.generation = GENERATION;
+        ri.objid = SUBVOL_ROOT_INODE;
+        ri.block_number = fs_root;
+        ri.bytes_used = meta.size;
+        ri.num_references = 1;
+        ri.root_level = fs_level;
+        ri.generation2 = GENERATION;
+        ri.uuid = ctx.subvol_uuid;
+        ri.ctransid = GENERATION;
+        ri.otransid = GENERATION;
+
+        add_item(&root_items, BTRFS_ROOT_FSTREE, TYPE_ROOT_ITEM, 0, &ri, sizeof(ri));
+
+        location.obj_id = BTRFS_ROOT_FSTREE;
+        location.obj_type = TYPE_ROOT_ITEM;
+        location.offset = 0xffffffffffffffff;
+
+        add_dir_entry(&root_items, BTRFS_ROOT_TREEDIR, &location, BTRFS_TYPE_DIRECTORY, 0, "default");
+
+        sort_items(&root_items);
+
+        write_tree(&ctx, &meta, META_CHUNK_ADDR, BTRFS_ROOT_ROOT, root_items.items, root_items.num, &root_root,
+                   &root_level);
+    }
+
+    // layout: superblock, system chunk, metadata chunk, data chunk
+
+    meta_phys = SYS_CHUNK_PHYS + SYS_CHUNK_SIZE;
+    meta_size = align_up(meta.size, CHUNK_ALIGN);
+    data_phys = meta_phys + meta_size;
+    data_size = align_up(ctx.data.size == 0 ? 1 : ctx.data.size, CHUNK_ALIGN);
+
+    res->image_size = data_phys + data_size;
+    res->metadata_bytes = meta.size;
+
+    sb = xalloc(sizeof(superblock));
+
+    // chunk tree
+
+    {
+        DEV_ITEM* di = &sb->dev_item;
+        KEY* key = (KEY*)sb->sys_chunk_array;
+
+        di->dev_id = 1;
+        di->num_bytes = res->image_size;
+        di->bytes_used = SYS_CHUNK_SIZE + meta_size + data_size;
+        di->optimal_io_align = SECTOR_SIZE;
+        di->optimal_io_width = SECTOR_SIZE;
+        di->minimal_io_size = SECTOR_SIZE;
+        di->device_uuid = ctx.dev_uuid;
+        di->fs_uuid = ctx.fs_uuid;
+
+        add_item(&chunk_items, 1, TYPE_DEV_ITEM, 1, di, sizeof(DEV_ITEM));
+
+        key->obj_id = 0x100;
+        key->obj_type = TYPE_CHUNK_ITEM;
+        key->offset = SYS_CHUNK_ADDR;
+
+        add_chunk_item(&chunk_items, &ctx, SYS_CHUNK_ADDR, SYS_CHUNK_PHYS, SYS_CHUNK_SIZE, BLOCK_FLAG_SYSTEM,
+                       sb->sys_chunk_array + sizeof(KEY));
+        add_chunk_item(&chunk_items, &ctx, META_CHUNK_ADDR, meta_phys, meta_size, BLOCK_FLAG_METADATA, NULL);
+        add_chunk_item(&chunk_items, &ctx, DATA_CHUNK_ADDR, data_phys, data_size, BLOCK_FLAG_DATA, NULL);
+
+        sb->n = sizeof(KEY) + sizeof(CHUNK_ITEM) + sizeof(CHUNK_ITEM_STRIPE);
+
+        sort_items(&chunk_items);
+
+        write_tree(&ctx, &sys, SYS_CHUNK_ADDR, BTRFS_ROOT_CHUNK, chunk_items.items, chunk_items.num, &chunk_root,
+                   &chunk_level);
+    }
+
+    sb->uuid = ctx.fs_uuid;
+    sb->sb_phys_addr = superblock_addrs[0];
+    sb->flags = 1;
+    sb->magic = BTRFS_MAGIC;
+    sb->generation = GENERATION;
+    sb->root_tree_addr = root_root;
+    sb->chunk_tree_addr = chunk_root;
+    sb->total_bytes = res->image_size;
+    sb->bytes_used = meta.size + sys.size + ctx.data.size;
+    sb->root_dir_objectid = BTRFS_ROOT_TREEDIR;
+    sb->num_devices = 1;
+    sb->sector_size = SECTOR_SIZE;
+    sb->node_size = NODE_SIZE;
+    sb->leaf_size = NODE_SIZE;
+    sb->stripe_size = SECTOR_SIZE;
+    sb->chunk_root_generation = GENERATION;
+    sb->incompat_flags = BTRFS_INCOMPAT_FLAGS_MIXED_BACKREF | BTRFS_INCOMPAT_FLAGS_DEFAULT_SUBVOL |
+                         BTRFS_INCOMPAT_FLAGS_BIG_METADATA | BTRFS_INCOMPAT_FLAGS_EXTENDED_IREF |
+                         BTRFS_INCOMPAT_FLAGS_SKINNY_METADATA | BTRFS_INCOMPAT_FLAGS_NO_HOLES;
+    sb->root_level = root_level;
+    sb->chunk_root_level = chunk_level;
+    strcpy(sb->label, "quibble-test");
+
+    if (params->compression == BTRFS_COMPRESSION_LZO)
+        sb->incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_LZO;
+    else if (params->compression == BTRFS_COMPRESSION_ZSTD)
+        sb->incompat_flags |= BTRFS_INCOMPAT_FLAGS_COMPRESS_ZSTD;
+
+    set_csum((uint8_t*)sb, sizeof(superblock));
+
+    fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create %s.\n", image);
+        free(sb);
+        goto end;
+    }
+
+    if (ftruncate(fd, res->image_size) != 0 ||
+        pwrite(fd, sb, sizeof(superblock), superblock_addrs[0]) != sizeof(superblock) ||
+        pwrite(fd, sys.data, sys.size, SYS_CHUNK_PHYS) != (ssize_t)sys.size ||
+        pwrite(fd, meta.data, meta.size, meta_phys) != (ssize_t)meta.size ||
+        (ctx.data.size != 0 && pwrite(fd, ctx.data.data, ctx.data.size, data_phys) != (ssize_t)ctx.data.size)) {
+        fprintf(stderr, "Could not write %s.\n", image);
+        close(fd);
+        free(sb);
+        goto end;
+    }
+
+    close(fd);
+    free(sb);
+
+    ret = true;
+
+end:
+    free_items(&ctx.fs);
+    free_items(&root_items);
+    free_items(&chunk_items);
+    free(ctx.data.data);
+    free(meta.data);
+    free(sys.data);
+    free(ctx.comp);
+
+    return ret;
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Generates Btrfs images from directories on the host, as mkfs.btrfs --rootdir does: one
+// device with single profiles, a chunk tree, a root tree, and an FS tree as the default
+// subvolume, with file data compressed as Linux would with compress=zlib, lzo or zstd.
+// There's no extent, checksum or device tree, as the driver never looks at them.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// glibc's struct stat has these as macros, which would clash with INODE_ITEM
+#undef st_atime
+#undef st_ctime
+#undef st_mtime
+
+#include "btrfs.h"
+
+typedef struct {
+    uint8_t compression; // BTRFS_COMPRESSION_*
+    uint32_t seed; // for the UUIDs
+} btrfsgen_params;
+
+typedef struct {
+    uint64_t image_size;
+    uint64_t file_bytes; // the contents of the files
+    uint64_t data_bytes; // what they take up on disk, once compressed
+    uint64_t metadata_bytes;
+    unsigned int files;
+    unsigned int dirs;
+    unsigned int compressed_extents;
+    uint8_t fs_tree_level;
+} btrfsgen_result;
+
+bool btrfsgen_write(const char* dir, const char* image, const btrfsgen_params* params, btrfsgen_result* res);
+bool btrfsgen_zstd_available(void); // zstd comes from the host's libzstd, if there is one
@@ -0,0 +1,568 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Just enough of the gnu-efi headers to build parts of Quibble as ordinary programs,
+// so they can be tested and timed on the host. The gnu-efi header names in this
+// directory all include this file.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef uint8_t UINT8;
+typedef int8_t INT8;
+typedef uint16_t UINT16;
+typedef int16_t INT16;
+typedef uint32_t UINT32;
+typedef int32_t INT32;
+typedef uint64_t UINT64;
+typedef int64_t INT64;
+typedef uintptr_t UINTN;
+typedef intptr_t INTN;
+typedef uint16_t CHAR16;
+typedef char CHAR8;
+typedef uint16_t WCHAR;
+typedef uint8_t BOOLEAN;
+typedef void VOID;
+
+typedef UINTN EFI_STATUS;
+typedef void* EFI_HANDLE;
+typedef void* EFI_EVENT;
+typedef UINTN EFI_TPL;
+typedef UINT64 EFI_LBA;
+typedef UINT64 EFI_PHYSICAL_ADDRESS;
+typedef UINT64 EFI_VIRTUAL_ADDRESS;
+
+typedef struct {
+    UINT32 Data1;
+    UINT16 Data2;
+    UINT16 Data3;
+    UINT8 Data4[8];
+} EFI_GUID;
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define CONST const
+#define EFIAPI
+#define TRUE 1
+#define FALSE 0
+
+#ifndef _MSC_VER
+#define __int64 long long
+#define __stdcall
+#define __cdecl
+#define __fastcall
+#endif
+
+#define EFIERR(a) (((UINTN)1 << ((sizeof(UINTN) * 8) - 1)) | (a))
+#define EFI_ERROR(a) (((INTN)(a)) < 0)
+
+#define EFI_SUCCESS 0
+#define EFI_LOAD_ERROR EFIERR(1)
+#define EFI_INVALID_PARAMETER EFIERR(2)
+#define EFI_UNSUPPORTED EFIERR(3)
+#define EFI_BAD_BUFFER_SIZE EFIERR(4)
+#define EFI_BUFFER_TOO_SMALL EFIERR(5)
+#define EFI_NOT_READY EFIERR(6)
+#define EFI_DEVICE_ERROR EFIERR(7)
+#define EFI_WRITE_PROTECTED EFIERR(8)
+#define EFI_OUT_OF_RESOURCES EFIERR(9)
+#define EFI_VOLUME_CORRUPTED EFIERR(10)
+#define EFI_VOLUME_FULL EFIERR(11)
+#define EFI_NO_MEDIA EFIERR(12)
+#define EFI_MEDIA_CHANGED EFIERR(13)
+#define EFI_NOT_FOUND EFIERR(14)
+#define EFI_ACCESS_DENIED EFIERR(15)
+#define EFI_NO_RESPONSE EFIERR(16)
+#define EFI_NO_MAPPING EFIERR(17)
+#define EFI_TIMEOUT EFIERR(18)
+#define EFI_NOT_STARTED EFIERR(19)
+#define EFI_ALREADY_STARTED EFIERR(20)
+#define EFI_ABORTED EFIERR(21)
+#define EFI_ICMP_ERROR EFIERR(22)
+#define EFI_TFTP_ERROR EFIERR(23)
+#define EFI_PROTOCOL_ERROR EFIERR(24)
+#define EFI_INCOMPATIBLE_VERSION EFIERR(25)
+#define EFI_SECURITY_VIOLATION EFIERR(26)
+#define EFI_CRC_ERROR EFIERR(27)
+#define EFI_END_OF_MEDIA EFIERR(28)
+#define EFI_END_OF_FILE EFIERR(31)
+#define EFI_INVALID_LANGUAGE EFIERR(32)
+#define EFI_COMPROMISED_DATA EFIERR(33)
+
+#define EFI_PAGE_SIZE 4096
+#define EFI_PAGE_SHIFT 12
+#define EFI_PAGE_MASK 0xfff
+#define EFI_SIZE_TO_PAGES(a) (((a) >> EFI_PAGE_SHIFT) + (((a) & EFI_PAGE_MASK) ? 1 : 0))
+
+#define _CR(Record, TYPE, Field) ((TYPE*)((CHAR8*)(Record) - (CHAR8*)&(((TYPE*)0)->Field)))
+#define CR(Record, TYPE, Field, Signature) _CR(Record, TYPE, Field)
+
+// efilink.h
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY;
+
+#define InitializeListHead(ListHead) \
+    (ListHead)->Flink = ListHead; \
+    (ListHead)->Blink = ListHead;
+
+#define IsListEmpty(ListHead) ((ListHead)->Flink == (ListHead))
+
+#define _RemoveEntryList(Entry) { \
+        LIST_ENTRY *_Blink, *_Flink; \
+        _Flink = (Entry)->Flink; \
+        _Blink = (Entry)->Blink; \
+        _Blink->Flink = _Flink; \
+        _Flink->Blink = _Blink; \
+    }
+
+#define RemoveEntryList(Entry) \
+    _RemoveEntryList(Entry); \
+    (Entry)->Flink = (LIST_ENTRY*)0; \
+    (Entry)->Blink = (LIST_ENTRY*)0;
+
+#define InsertTailList(ListHead, Entry) { \
+        LIST_ENTRY *_ListHead, *_Blink; \
+        _ListHead = (ListHead); \
+        _Blink = _ListHead->Blink; \
+        (Entry)->Flink = _ListHead; \
+        (Entry)->Blink = _Blink; \
+        _Blink->Flink = (Entry); \
+        _ListHead->Blink = (Entry); \
+    }
+
+#define InsertHeadList(ListHead, Entry) { \
+        LIST_ENTRY *_ListHead, *_Flink; \
+        _ListHead = (ListHead); \
+        _Flink = _ListHead->Flink; \
+        (Entry)->Flink = _Flink; \
+        (Entry)->Blink = _ListHead; \
+        _Flink->Blink = (Entry); \
+        _ListHead->Flink = (Entry); \
+    }
+
+// efidef.h
+
+typedef enum {
+    AllocateAnyPages,
+    AllocateMaxAddress,
+    AllocateAddress,
+    MaxAllocateType
+} EFI_ALLOCATE_TYPE;
+
+typedef enum {
+    EfiReservedMemoryType,
+    EfiLoaderCode,
+    EfiLoaderData,
+    EfiBootServicesCode,
+    EfiBootServicesData,
+    EfiRuntimeServicesCode,
+    EfiRuntimeServicesData,
+    EfiConventionalMemory,
+    EfiUnusableMemory,
+    EfiACPIReclaimMemory,
+    EfiACPIMemoryNVS,
+    EfiMemoryMappedIO,
+    EfiMemoryMappedIOPortSpace,
+    EfiPalCode,
+    EfiPersistentMemory,
+    EfiMaxMemoryType
+} EFI_MEMORY_TYPE;
+
+typedef struct {
+    UINT32 Type;
+    UINT32 Pad;
+    EFI_PHYSICAL_ADDRESS PhysicalStart;
+    EFI_VIRTUAL_ADDRESS VirtualStart;
+    UINT64 NumberOfPages;
+    UINT64 Attribute;
+} EFI_MEMORY_DESCRIPTOR;
+
+#define EFI_MEMORY_DESCRIPTOR_VERSION 1
+
+typedef struct {
+    UINT16 Year;
+    UINT8 Month;
+    UINT8 Day;
+    UINT8 Hour;
+    UINT8 Minute;
+    UINT8 Second;
+    UINT8 Pad1;
+    UINT32 Nanosecond;
+    INT16 TimeZone;
+    UINT8 Daylight;
+    UINT8 Pad2;
+} EFI_TIME;
+
+typedef struct {
+    UINT64 Signature;
+    UINT32 Revision;
+    UINT32 HeaderSize;
+    UINT32 CRC32;
+    UINT32 Reserved;
+} EFI_TABLE_HEADER;
+
+// efidevp.h
+
+typedef struct _EFI_DEVICE_PATH_PROTOCOL {
+    UINT8 Type;
+    UINT8 SubType;
+    UINT8 Length[2];
+} EFI_DEVICE_PATH_PROTOCOL, EFI_DEVICE_PATH;
+
+#define EFI_DEVICE_PATH_PROTOCOL_GUID { 0x09576e91, 0x6d3f, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b} }
+#define DEVICE_PATH_PROTOCOL EFI_DEVICE_PATH_PROTOCOL_GUID
+
+#define HARDWARE_DEVICE_PATH 0x01
+#define ACPI_DEVICE_PATH 0x02
+#define MEDIA_DEVICE_PATH 0x04
+#define END_DEVICE_PATH_TYPE 0x7f
+#define END_ENTIRE_DEVICE_PATH_SUBTYPE 0xff
+#define HW_PCI_DP 0x01
+#define ACPI_DP 0x01
+#define MEDIA_HARDDRIVE_DP 0x01
+#define MEDIA_FILEPATH_DP 0x04
+
+typedef struct {
+    EFI_DEVICE_PATH_PROTOCOL Header;
+    UINT32 PartitionNumber;
+    UINT64 PartitionStart;
+    UINT64 PartitionSize;
+    UINT8 Signature[16];
+    UINT8 MBRType;
+    UINT8 SignatureType;
+} HARDDRIVE_DEVICE_PATH;
+
+typedef struct {
+    EFI_DEVICE_PATH_PROTOCOL Header;
+    CHAR16 PathName[1];
+} FILEPATH_DEVICE_PATH;
+
+// efiapi.h
+
+typedef enum {
+    EFI_NATIVE_INTERFACE
+} EFI_INTERFACE_TYPE;
+
+typedef enum {
+    AllHandles,
+    ByRegisterNotify,
+    ByProtocol
+} EFI_LOCATE_SEARCH_TYPE;
+
+typedef enum {
+    TimerCancel,
+    TimerPeriodic,
+    TimerRelative
+} EFI_TIMER_DELAY;
+
+#define EVT_TIMER 0x80000000
+#define EVT_NOTIFY_WAIT 0x00000100
+#define EVT_NOTIFY_SIGNAL 0x00000200
+
+#define TPL_APPLICATION 4
+#define TPL_CALLBACK 8
+#define TPL_NOTIFY 16
+#define TPL_HIGH_LEVEL 31
+
+#define EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL 0x00000001
+#define EFI_OPEN_PROTOCOL_GET_PROTOCOL 0x00000002
+#define EFI_OPEN_PROTOCOL_TEST_PROTOCOL 0x00000004
+#define EFI_OPEN_PROTOCOL_BY_CHILD_CONTROLLER 0x00000008
+#define EFI_OPEN_PROTOCOL_BY_DRIVER 0x00000010
+#define EFI_OPEN_PROTOCOL_EXCLUSIVE 0x00000020
+
+typedef void (EFIAPI* EFI_EVENT_NOTIFY)(EFI_EVENT Event, VOID* Context);
+
+// Services nothing here calls are left untyped.
+typedef EFI_STATUS (EFIAPI* EFI_UNUSED_SERVICE)();
+
+typedef struct _EFI_BOOT_SERVICES {
+    EFI_TABLE_HEADER Hdr;
+    EFI_TPL (EFIAPI* RaiseTPL)(EFI_TPL NewTpl);
+    VOID (EFIAPI* RestoreTPL)(EFI_TPL OldTpl);
+    EFI_STATUS (EFIAPI* AllocatePages)(EFI_ALLOCATE_TYPE Type, EFI_MEMORY_TYPE MemoryType, UINTN NoPages,
+                                       EFI_PHYSICAL_ADDRESS* Memory);
+    EFI_STATUS (EFIAPI* FreePages)(EFI_PHYSICAL_ADDRESS Memory, UINTN NoPages);
+    EFI_STATUS (EFIAPI* GetMemoryMap)(UINTN* MemoryMapSize, EFI_MEMORY_DESCRIPTOR* MemoryMap, UINTN* MapKey,
+                                      UINTN* DescriptorSize, UINT32* DescriptorVersion);
+    EFI_STATUS (EFIAPI* AllocatePool)(EFI_MEMORY_TYPE PoolType, UINTN Size, VOID** Buffer);
+    EFI_STATUS (EFIAPI* FreePool)(VOID* Buffer);
+    EFI_STATUS (EFIAPI* CreateEvent)(UINT32 Type, EFI_TPL NotifyTpl, EFI_EVENT_NOTIFY NotifyFunction,
+                                     VOID* NotifyContext, EFI_EVENT* Event);
+    EFI_STATUS (EFIAPI* SetTimer)(EFI_EVENT Event, EFI_TIMER_DELAY Type, UINT64 TriggerTime);
+    EFI_STATUS (EFIAPI* WaitForEvent)(UINTN NumberOfEvents, EFI_EVENT* Event, UINTN* Index);
+    EFI_STATUS (EFIAPI* SignalEvent)(EFI_EVENT Event);
+    EFI_STATUS (EFIAPI* CloseEvent)(EFI_EVENT Event);
+    EFI_STATUS (EFIAPI* CheckEvent)(EFI_EVENT Event);
+    EFI_STATUS (EFIAPI* InstallProtocolInterface)(EFI_HANDLE* Handle, EFI_GUID* Protocol,
+                                                  EFI_INTERFACE_TYPE InterfaceType, VOID* Interface);
+    EFI_UNUSED_SERVICE ReinstallProtocolInterface;
+    EFI_STATUS (EFIAPI* UninstallProtocolInterface)(EFI_HANDLE Handle, EFI_GUID* Protocol, VOID* Interface);
+    EFI_STATUS (EFIAPI* HandleProtocol)(EFI_HANDLE Handle, EFI_GUID* Protocol, VOID** Interface);
+    VOID* Reserved;
+    EFI_UNUSED_SERVICE RegisterProtocolNotify;
+    EFI_UNUSED_SERVICE LocateHandle;
+    EFI_UNUSED_SERVICE LocateDevicePath;
+    EFI_UNUSED_SERVICE InstallConfigurationTable;
+    EFI_UNUSED_SERVICE LoadImage;
+    EFI_UNUSED_SERVICE StartImage;
+    EFI_UNUSED_SERVICE Exit;
+    EFI_UNUSED_SERVICE UnloadImage;
+    EFI_STATUS (EFIAPI* ExitBootServices)(EFI_HANDLE ImageHandle, UINTN MapKey);
+    EFI_UNUSED_SERVICE GetNextMonotonicCount;
+    EFI_STATUS (EFIAPI* Stall)(UINTN Microseconds);
+    EFI_STATUS (EFIAPI* SetWatchdogTimer)(UINTN Timeout, UINT64 WatchdogCode, UINTN DataSize, CHAR16* WatchdogData);
+    EFI_UNUSED_SERVICE ConnectController;
+    EFI_UNUSED_SERVICE DisconnectController;
+    EFI_STATUS (EFIAPI* OpenProtocol)(EFI_HANDLE Handle, EFI_GUID* Protocol, VOID** Interface, EFI_HANDLE AgentHandle,
+                                      EFI_HANDLE ControllerHandle, UINT32 Attributes);
+    EFI_STATUS (EFIAPI* CloseProtocol)(EFI_HANDLE Handle, EFI_GUID* Protocol, EFI_HANDLE AgentHandle,
+                                       EFI_HANDLE ControllerHandle);
+    EFI_UNUSED_SERVICE OpenProtocolInformation;
+    EFI_UNUSED_SERVICE ProtocolsPerHandle;
+    EFI_STATUS (EFIAPI* LocateHandleBuffer)(EFI_LOCATE_SEARCH_TYPE SearchType, EFI_GUID* Protocol, VOID* SearchKey,
+                                            UINTN* NoHandles, EFI_HANDLE** Buffer);
+    EFI_STATUS (EFIAPI* LocateProtocol)(EFI_GUID* Protocol, VOID* Registration, VOID** Interface);
+    EFI_STATUS (EFIAPI* InstallMultipleProtocolInterfaces)(EFI_HANDLE* Handle, ...);
+    EFI_UNUSED_SERVICE UninstallMultipleProtocolInterfaces;
+    EFI_UNUSED_SERVICE CalculateCrc32;
+    EFI_UNUSED_SERVICE CopyMem;
+    EFI_UNUSED_SERVICE SetMem;
+    EFI_UNUSED_SERVICE CreateEventEx;
+} EFI_BOOT_SERVICES;
+
+typedef EFI_STATUS (EFIAPI* EFI_ALLOCATE_POOL)(EFI_MEMORY_TYPE PoolType, UINTN Size, VOID** Buffer);
+typedef EFI_STATUS (EFIAPI* EFI_FREE_POOL)(VOID* Buffer);
+
+// eficon.h
+
+typedef struct {
+    UINT16 ScanCode;
+    CHAR16 UnicodeChar;
+} EFI_INPUT_KEY;
+
+typedef struct _SIMPLE_INPUT_INTERFACE {
+    EFI_UNUSED_SERVICE Reset;
+    EFI_STATUS (EFIAPI* ReadKeyStroke)(struct _SIMPLE_INPUT_INTERFACE* This, EFI_INPUT_KEY* Key);
+    EFI_EVENT WaitForKey;
+} SIMPLE_INPUT_INTERFACE, EFI_SIMPLE_TEXT_IN_PROTOCOL;
+
+typedef struct {
+    INT32 MaxMode;
+    INT32 Mode;
+    INT32 Attribute;
+    INT32 CursorColumn;
+    INT32 CursorRow;
+    BOOLEAN CursorVisible;
+} SIMPLE_TEXT_OUTPUT_MODE;
+
+typedef struct _SIMPLE_TEXT_OUTPUT_INTERFACE {
+    EFI_UNUSED_SERVICE Reset;
+    EFI_STATUS (EFIAPI* OutputString)(struct _SIMPLE_TEXT_OUTPUT_INTERFACE* This, CHAR16* String);
+    EFI_UNUSED_SERVICE TestString;
+    EFI_STATUS (EFIAPI* QueryMode)(struct _SIMPLE_TEXT_OUTPUT_INTERFACE* This, UINTN ModeNumber, UINTN* Columns,
+                                   UINTN* Rows);
+    EFI_STATUS (EFIAPI* SetMode)(struct _SIMPLE_TEXT_OUTPUT_INTERFACE* This, UINTN ModeNumber);
+    EFI_STATUS (EFIAPI* SetAttribute)(struct _SIMPLE_TEXT_OUTPUT_INTERFACE* This, UINTN Attribute);
+    EFI_STATUS (EFIAPI* ClearScreen)(struct _SIMPLE_TEXT_OUTPUT_INTERFACE* This);
+    EFI_STATUS (EFIAPI* SetCursorPosition)(struct _SIMPLE_TEXT_OUTPUT_INTERFACE* This, UINTN Column, UINTN Row);
+    EFI_STATUS (EFIAPI* EnableCursor)(struct _SIMPLE_TEXT_OUTPUT_INTERFACE* This, BOOLEAN Enable);
+    SIMPLE_TEXT_OUTPUT_MODE* Mode;
+} SIMPLE_TEXT_OUTPUT_INTERFACE, EFI_SIMPLE_TEXT_OUT_PROTOCOL;
+
+typedef struct {
+    EFI_TABLE_HEADER Hdr;
+    EFI_UNUSED_SERVICE GetTime;
+    EFI_UNUSED_SERVICE SetTime;
+    EFI_UNUSED_SERVICE GetWakeupTime;
+    EFI_UNUSED_SERVICE SetWakeupTime;
+    EFI_UNUSED_SERVICE SetVirtualAddressMap;
+    EFI_UNUSED_SERVICE ConvertPointer;
+    EFI_UNUSED_SERVICE GetVariable;
+    EFI_UNUSED_SERVICE GetNextVariableName;
+    EFI_UNUSED_SERVICE SetVariable;
+    EFI_UNUSED_SERVICE GetNextHighMonotonicCount;
+    EFI_UNUSED_SERVICE ResetSystem;
+} EFI_RUNTIME_SERVICES;
+
+typedef struct {
+    EFI_GUID VendorGuid;
+    VOID* VendorTable;
+} EFI_CONFIGURATION_TABLE;
+
+typedef struct _EFI_SYSTEM_TABLE {
+    EFI_TABLE_HEADER Hdr;
+    CHAR16* FirmwareVendor;
+    UINT32 FirmwareRevision;
+    EFI_HANDLE ConsoleInHandle;
+    SIMPLE_INPUT_INTERFACE* ConIn;
+    EFI_HANDLE ConsoleOutHandle;
+    SIMPLE_TEXT_OUTPUT_INTERFACE* ConOut;
+    EFI_HANDLE StandardErrorHandle;
+    SIMPLE_TEXT_OUTPUT_INTERFACE* StdErr;
+    EFI_RUNTIME_SERVICES* RuntimeServices;
+    EFI_BOOT_SERVICES* BootServices;
+    UINTN NumberOfTableEntries;
+    EFI_CONFIGURATION_TABLE* ConfigurationTable;
+} EFI_SYSTEM_TABLE;
+
+// efiprot.h
+
+typedef struct {
+    UINT32 Revision;
+    EFI_HANDLE ParentHandle;
+    EFI_SYSTEM_TABLE* SystemTable;
+    EFI_HANDLE DeviceHandle;
+    EFI_DEVICE_PATH* FilePath;
+    VOID* Reserved;
+    UINT32 LoadOptionsSize;
+    VOID* LoadOptions;
+    VOID* ImageBase;
+    UINT64 ImageSize;
+    EFI_MEMORY_TYPE ImageCodeType;
+    EFI_MEMORY_TYPE ImageDataType;
+    EFI_UNUSED_SERVICE Unload;
+} EFI_LOADED_IMAGE, EFI_LOADED_IMAGE_PROTOCOL;
+
+#define EFI_LOADED_IMAGE_PROTOCOL_GUID { 0x5b1b31a1, 0x9562, 0x11d2, {0x8e, 0x3f, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b} }
+#define LOADED_IMAGE_PROTOCOL EFI_LOADED_IMAGE_PROTOCOL_GUID
+
+typedef struct _EFI_FILE_HANDLE* EFI_FILE_HANDLE;
+
+typedef struct _EFI_FILE_HANDLE {
+    UINT64 Revision;
+    EFI_STATUS (EFIAPI* Open)(struct _EFI_FILE_HANDLE* File, struct _EFI_FILE_HANDLE** NewHandle, CHAR16* FileName,
+                              UINT64 OpenMode, UINT64 Attributes);
+    EFI_STATUS (EFIAPI* Close)(struct _EFI_FILE_HANDLE* File);
+    EFI_STATUS (EFIAPI* Delete)(struct _EFI_FILE_HANDLE* File);
+    EFI_STATUS (EFIAPI* Read)(struct _EFI_FILE_HANDLE* File, UINTN* BufferSize, VOID* Buffer);
+    EFI_STATUS (EFIAPI* Write)(struct _EFI_FILE_HANDLE* File, UINTN* BufferSize, VOID* Buffer);
+    EFI_STATUS (EFIAPI* GetPosition)(struct _EFI_FILE_HANDLE* File, UINT64* Position);
+    EFI_STATUS (EFIAPI* SetPosition)(struct _EFI_FILE_HANDLE* File, UINT64 Position);
+    EFI_STATUS (EFIAPI* GetInfo)(struct _EFI_FILE_HANDLE* File, EFI_GUID* InformationType, UINTN* BufferSize,
+                                 VOID* Buffer);
+    EFI_STATUS (EFIAPI* SetInfo)(struct _EFI_FILE_HANDLE* File, EFI_GUID* InformationType, UINTN BufferSize,
+                                 VOID* Buffer);
+    EFI_STATUS (EFIAPI* Flush)(struct _EFI_FILE_HANDLE* File);
+    EFI_UNUSED_SERVICE OpenEx;
+    EFI_UNUSED_SERVICE ReadEx;
+    EFI_UNUSED_SERVICE WriteEx;
+    EFI_UNUSED_SERVICE FlushEx;
+} EFI_FILE_PROTOCOL, EFI_FILE;
+
+#define EFI_FILE_PROTOCOL_REVISION 0x00010000
+#define EFI_FILE_HANDLE_REVISION EFI_FILE_PROTOCOL_REVISION
+
+#define EFI_FILE_MODE_READ 0x0000000000000001ULL
+#define EFI_FILE_MODE_WRITE 0x0000000000000002ULL
+#define EFI_FILE_MODE_CREATE 0x8000000000000000ULL
+
+#define EFI_FILE_READ_ONLY 0x01
+#define EFI_FILE_HIDDEN 0x02
+#define EFI_FILE_SYSTEM 0x04
+#define EFI_FILE_RESERVED 0x08
+#define EFI_FILE_DIRECTORY 0x10
+#define EFI_FILE_ARCHIVE 0x20
+
+typedef struct {
+    UINT64 Size;
+    UINT64 FileSize;
+    UINT64 PhysicalSize;
+    EFI_TIME CreateTime;
+    EFI_TIME LastAccessTime;
+    EFI_TIME ModificationTime;
+    UINT64 Attribute;
+    CHAR16 FileName[1];
+} EFI_FILE_INFO;
+
+#define EFI_FILE_INFO_ID { 0x09576e92, 0x6d3f, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b} }
+
+typedef struct {
+    UINT64 Size;
+    BOOLEAN ReadOnly;
+    UINT64 VolumeSize;
+    UINT64 FreeSpace;
+    UINT32 BlockSize;
+    CHAR16 VolumeLabel[1];
+} EFI_FILE_SYSTEM_INFO;
+
+#define EFI_FILE_SYSTEM_INFO_ID { 0x09576e93, 0x6d3f, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b} }
+
+typedef struct _EFI_FILE_IO_INTERFACE {
+    UINT64 Revision;
+    EFI_STATUS (EFIAPI* OpenVolume)(struct _EFI_FILE_IO_INTERFACE* This, EFI_FILE_HANDLE* Root);
+} EFI_FILE_IO_INTERFACE, EFI_SIMPLE_FILE_SYSTEM_PROTOCOL;
+
+#define EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID { 0x964e5b22, 0x6459, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b} }
+#define SIMPLE_FILE_SYSTEM_PROTOCOL EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID
+#define EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_REVISION 0x00010000
+
+typedef struct {
+    UINT32 MediaId;
+    BOOLEAN RemovableMedia;
+    BOOLEAN MediaPresent;
+    BOOLEAN LogicalPartition;
+    BOOLEAN ReadOnly;
+    BOOLEAN WriteCaching;
+    UINT32 BlockSize;
+    UINT32 IoAlign;
+    EFI_LBA LastBlock;
+} EFI_BLOCK_IO_MEDIA;
+
+typedef struct _EFI_BLOCK_IO {
+    UINT64 Revision;
+    EFI_BLOCK_IO_MEDIA* Media;
+    EFI_UNUSED_SERVICE Reset;
+    EFI_STATUS (EFIAPI* ReadBlocks)(struct _EFI_BLOCK_IO* This, UINT32 MediaId, EFI_LBA LBA, UINTN BufferSize,
+                                    VOID* Buffer);
+    EFI_UNUSED_SERVICE WriteBlocks;
+    EFI_UNUSED_SERVICE FlushBlocks;
+} EFI_BLOCK_IO, EFI_BLOCK_IO_PROTOCOL;
+
+#define EFI_BLOCK_IO_PROTOCOL_GUID { 0x964e5b21, 0x6459, 0x11d2, {0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b} }
+#define BLOCK_IO_PROTOCOL EFI_BLOCK_IO_PROTOCOL_GUID
+
+typedef struct _EFI_DISK_IO {
+    UINT64 Revision;
+    EFI_STATUS (EFIAPI* ReadDisk)(struct _EFI_DISK_IO* This, UINT32 MediaId, UINT64 Offset, UINTN BufferSize,
+                                  VOID* Buffer);
+    EFI_UNUSED_SERVICE WriteDisk;
+} EFI_DISK_IO, EFI_DISK_IO_PROTOCOL;
+
+#define EFI_DISK_IO_PROTOCOL_GUID { 0xce345171, 0xba0b, 0x11d2, {0x8e, 0x4f, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b} }
+#define DISK_IO_PROTOCOL EFI_DISK_IO_PROTOCOL_GUID
+
+typedef struct _EFI_DRIVER_BINDING_PROTOCOL {
+    EFI_STATUS (EFIAPI* Supported)(struct _EFI_DRIVER_BINDING_PROTOCOL* This, EFI_HANDLE ControllerHandle,
+                                   EFI_DEVICE_PATH_PROTOCOL* RemainingDevicePath);
+    EFI_STATUS (EFIAPI* Start)(struct _EFI_DRIVER_BINDING_PROTOCOL* This, EFI_HANDLE ControllerHandle,
+                               EFI_DEVICE_PATH_PROTOCOL* RemainingDevicePath);
+    EFI_STATUS (EFIAPI* Stop)(struct _EFI_DRIVER_BINDING_PROTOCOL* This, EFI_HANDLE ControllerHandle,
+                              UINTN NumberOfChildren, EFI_HANDLE* ChildHandleBuffer);
+    UINT32 Version;
+    EFI_HANDLE ImageHandle;
+    EFI_HANDLE DriverBindingHandle;
+} EFI_DRIVER_BINDING_PROTOCOL, EFI_DRIVER_BINDING;
+
+#define EFI_DRIVER_BINDING_PROTOCOL_GUID { 0x18a031ab, 0xb443, 0x4d1a, {0xa5, 0xc0, 0x0c, 0x09, 0x26, 0x1e, 0x9f, 0x71} }
@@ -0,0 +1,43 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// The MSVC intrinsics used by the parts of Quibble built for the host.
+
+#pragma once
+
+#include <stddef.h>
+#include <cpuid.h>
+#include <x86intrin.h>
+
+#undef __cpuid // cpuid.h's version takes its outputs separately
+#define __cpuidex host_cpuidex // newer versions of cpuid.h have this, older ones don't
+
+static inline void __cpuid(int cpu_info[4], int function_id) {
+    __cpuid_count(function_id, 0, cpu_info[0], cpu_info[1], cpu_info[2], cpu_info[3]);
+}
+
+static inline void __cpuidex(int cpu_info[4], int function_id, int subfunction_id) {
+    __cpuid_count(function_id, subfunction_id, cpu_info[0], cpu_info[1], cpu_info[2], cpu_info[3]);
+}
+
+static inline void __movsb(unsigned char* dest, const unsigned char* src, size_t count) {
+    __asm__ __volatile__("rep movsb" : "+D" (dest), "+S" (src), "+c" (count) : : "memory");
+}
+
+static inline void __stosb(unsigned char* dest, unsigned char data, size_t count) {
+    __asm__ __volatile__("rep stosb" : "+D" (dest), "+c" (count) : "a" (data) : "memory");
+}
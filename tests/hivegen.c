@@ -0,0 +1,997 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hivegen.h"
+#include "winreg.h"
+#include "reg.h"
+
+#define NUM_SECURITY 4
+#define BIN_SIZE 4096
+
+typedef struct {
+    uint8_t* data; // the bins, without the base block
+    uint32_t alloc;
+    uint32_t pos;
+    uint32_t bin_end;
+    uint32_t sk[NUM_SECURITY];
+    unsigned int garbage;
+    unsigned int keys_written;
+} builder;
+
+static uint32_t rng_state;
+
+static uint32_t rng(void) {
+    // xorshift32
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+
+    return rng_state;
+}
+
+static void* xalloc(size_t size) {
+    void* p = calloc(1, size);
+
+    if (!p) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    return p;
+}
+
+static WCHAR* widen(const char* s, uint16_t* len) {
+    size_t n = strlen(s);
+    WCHAR* w = xalloc((n + 1) * sizeof(WCHAR));
+
+    // Latin-1
+    for (size_t i = 0; i < n; i++) {
+        w[i] = (uint8_t)s[i];
+    }
+
+    *len = (uint16_t)n;
+
+    return w;
+}
+
+static gen_key* new_key(gen_key* parent, const char* name) {
+    gen_key* key = xalloc(sizeof(gen_key));
+
+    key->name = widen(name, &key->name_len);
+
+    if (parent) {
+        if (parent->num_children == parent->alloc_children) {
+            parent->alloc_children = parent->alloc_children == 0 ? 4 : parent->alloc_children * 2;
+            parent->children = realloc(parent->children, parent->alloc_children * sizeof(gen_key*));
+
+            if (!parent->children) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+        }
+
+        parent->children[parent->num_children] = key;
+        parent->num_children++;
+    }
+
+    return key;
+}
+
+static void add_value(gen_key* key, const char* name, uint32_t type, const void* data, uint32_t size) {
+    gen_value* v;
+
+    if (key->num_values == key->alloc_values) {
+        key->alloc_values = key->alloc_values == 0 ? 4 : key->alloc_values * 2;
+        key->values = realloc(key->values, key->alloc_values * sizeof(gen_value));
+
+        if (!key->values) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+
+    v = &key->values[key->num_values];
+    key->num_values++;
+
+    v->name = widen(name, &v->name_len);
+    v->type = type;
+    v->size = size;
+    v->data = xalloc(size == 0 ? 1 : size);
+    memcpy(v->data, data, size);
+}
+
+static void add_dword(gen_key* key, const char* name, uint32_t val) {
+    add_value(key, name, REG_DWORD, &val, sizeof(uint32_t));
+}
+
+static void add_string(gen_key* key, const char* name, uint32_t type, const char* s) {
+    uint16_t len;
+    WCHAR* w = widen(s, &len);
+
+    add_value(key, name, type, w, (len + 1) * sizeof(WCHAR));
+
+    free(w);
+}
+
+// strings is a list of null-terminated strings, ending with an empty one
+static void add_multi_sz(gen_key* key, const char* name, const char* strings) {
+    const char* s = strings;
+    WCHAR* w;
+    size_t len = 0;
+
+    while (s[len] != 0 || s[len + 1] != 0) {
+        len++;
+    }
+
+    len += 2;
+
+    w = xalloc(len * sizeof(WCHAR));
+
+    for (size_t i = 0; i < len; i++) {
+        w[i] = (uint8_t)s[i];
+    }
+
+    add_value(key, name, REG_MULTI_SZ, w, (uint32_t)(len * sizeof(WCHAR)));
+
+    free(w);
+}
+
+static void add_random_binary(gen_key* key, const char* name, uint32_t size) {
+    uint8_t* data = xalloc(size);
+
+    for (uint32_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)rng();
+    }
+
+    add_value(key, name, REG_BINARY, data, size);
+
+    free(data);
+}
+
+void gen_free_key(gen_key* key) {
+    for (unsigned int i = 0; i < key->num_children; i++) {
+        gen_free_key(key->children[i]);
+    }
+
+    for (unsigned int i = 0; i < key->num_values; i++) {
+        free(key->values[i].name);
+        free(key->values[i].data);
+    }
+
+    free(key->children);
+    free(key->values);
+    free(key->class_name);
+    free(key->name);
+    free(key);
+}
+
+static WCHAR upcase(WCHAR c) {
+    return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+// The order Windows keeps subkey lists in, as far as reg.c is concerned - see compare_key_name.
+int gen_compare_names(const WCHAR* name1, unsigned int len1, const WCHAR* name2, unsigned int len2) {
+    for (unsigned int i = 0; i < len1 && i < len2; i++) {
+        WCHAR c1 = upcase(name1[i]);
+        WCHAR c2 = upcase(name2[i]);
+
+        if (c1 != c2)
+            return c1 < c2 ? -1 : 1;
+    }
+
+    if (len1 == len2)
+        return 0;
+
+    return len1 < len2 ? -1 : 1;
+}
+
+gen_key* gen_find_child(const gen_key* key, const WCHAR* name) {
+    unsigned int len = 0;
+
+    while (name[len] != 0) {
+        len++;
+    }
+
+    for (unsigned int i = 0; i < key->num_children; i++) {
+        if (!gen_compare_names(key->children[i]->name, key->children[i]->name_len, name, len))
+            return key->children[i];
+    }
+
+    return NULL;
+}
+
+static const char* groups[] = {
+    "System Reservation", "EMS", "WdfLoadGroup", "Boot Bus Extender", "System Bus Extender", "SCSI miniport",
+    "Port", "Primary Disk", "SCSI Class", "SCSI CDROM Class", "FSFilter Infrastructure", "FSFilter System",
+    "FSFilter Bottom", "FSFilter Copy Protection", "FSFilter Security Enhancer", "FSFilter Open File",
+    "FSFilter Physical Quota Management", "FSFilter Encryption", "FSFilter Compression", "FSFilter HSM",
+    "FSFilter Cluster File System", "FSFilter System Recovery", "FSFilter Quota Management",
+    "FSFilter Content Screener", "FSFilter Continuous Backup", "FSFilter Replication", "FSFilter Anti-Virus",
+    "FSFilter Undelete", "FSFilter Activity Monitor", "FSFilter Top", "Filter", "Boot File System", "Base",
+    "Pointer Port", "Keyboard Port", "Pointer Class", "Keyboard Class", "Video Init", "Video", "Video Save",
+    "File System", "Streams Drivers", "NDIS Wrapper", "COM Infrastructure", "Event Log", "AudioGroup",
+    "Network", "PNP_TDI", "NetBIOSGroup", "PlugPlay", "Parallel arbitrator", "Extended Base", "NetworkProvider",
+    "Core", "Boot Platform", "Early-Launch"
+};
+
+#define NUM_GROUPS (sizeof(groups) / sizeof(groups[0]))
+
+static const char* syllables[] = {
+    "ac", "al", "an", "ar", "ba", "bi", "bu", "ca", "ce", "ci", "da", "de", "di", "do", "el", "en", "er", "fa",
+    "fi", "ga", "hd", "id", "in", "is", "ka", "la", "le", "li", "lo", "ma", "me", "mi", "mo", "na", "ne", "ni",
+    "no", "nt", "on", "or"
+};
+
+#define NUM_SYLLABLES (sizeof(syllables) / sizeof(syllables[0]))
+
+static const char* suffixes[] = { "", "", "", "svc", "flt", "port", "bus", "", "32", "mp", "", "Filter" };
+
+static void service_name(unsigned int i, char* s) {
+    // 40^3 is 64000, and 7919 is coprime to it, so each i up to that gets a different name
+    unsigned int n = (i * 7919) % (NUM_SYLLABLES * NUM_SYLLABLES * NUM_SYLLABLES);
+    unsigned int style = (i * 2654435761u) >> 24;
+
+    s[0] = 0;
+
+    for (unsigned int j = 0; j < 3; j++) {
+        strcat(s, syllables[n % NUM_SYLLABLES]);
+        n /= NUM_SYLLABLES;
+    }
+
+    strcat(s, suffixes[style % (sizeof(suffixes) / sizeof(suffixes[0]))]);
+
+    if (style & 0x10)
+        s[0] = s[0] - 'a' + 'A';
+
+    if (style & 0x20)
+        s[3] = s[3] >= 'a' ? s[3] - 'a' + 'A' : s[3];
+}
+
+static void add_service(gen_key* services, const char* name, unsigned int i, bool boot, bool fs,
+                        unsigned int* group_tags) {
+    gen_key* svc = new_key(services, name);
+    char s[512];
+
+    if (boot) {
+        unsigned int group = fs ? 31 : rng() % NUM_GROUPS; // "Boot File System"
+
+        add_dword(svc, "Type", fs ? 2 : 1);
+        add_dword(svc, "Start", 0);
+        add_dword(svc, "ErrorControl", 3);
+
+        // a few boot drivers aren't in any group
+        if (!fs && rng() % 8 == 0)
+            group = NUM_GROUPS;
+        else
+            add_string(svc, "Group", REG_SZ, groups[group]);
+
+        if (group != NUM_GROUPS && rng() % 4 != 0) {
+            group_tags[group]++;
+            add_dword(svc, "Tag", group_tags[group]);
+        }
+
+        switch (i % 3) {
+            case 0:
+                snprintf(s, sizeof(s), "\\SystemRoot\\System32\\drivers\\%s.sys", name);
+                add_string(svc, "ImagePath", REG_EXPAND_SZ, s);
+                break;
+
+            case 1:
+                snprintf(s, sizeof(s), "System32\\drivers\\%s.sys", name);
+                add_string(svc, "ImagePath", REG_EXPAND_SZ, s);
+                break;
+
+            default:
+                break; // no ImagePath, so it's system32\drivers\<name>.sys
+        }
+    } else {
+        static const uint32_t types[] = { 1, 1, 2, 0x10, 0x20, 0x20, 0x110 };
+        uint32_t type = types[rng() % (sizeof(types) / sizeof(types[0]))];
+
+        add_dword(svc, "Type", type);
+        add_dword(svc, "Start", 1 + (rng() % 4));
+        add_dword(svc, "ErrorControl", 1);
+
+        if (type >= 0x10)
+            snprintf(s, sizeof(s), "%%SystemRoot%%\\System32\\svchost.exe -k %sGroup -p", name);
+        else
+            snprintf(s, sizeof(s), "\\SystemRoot\\System32\\drivers\\%s.sys", name);
+
+        add_string(svc, "ImagePath", REG_EXPAND_SZ, s);
+
+        if (rng() % 3 == 0)
+            add_string(svc, "Group", REG_SZ, groups[rng() % NUM_GROUPS]);
+    }
+
+    snprintf(s, sizeof(s), "@%%SystemRoot%%\\System32\\drivers\\%s.sys,-%u;%s Service", name, 100 + (i % 900),
+             name);
+    add_string(svc, "DisplayName", REG_SZ, s);
+
+    snprintf(s, sizeof(s), "@%%SystemRoot%%\\System32\\drivers\\%s.sys,-%u;Provides support for the %s "
+             "device, and for everything which depends on it being present when the system starts.", name,
+             101 + (i % 900), name);
+    add_string(svc, "Description", REG_SZ, s);
+
+    if (rng() % 2 == 0)
+        add_random_binary(svc, "FailureActions", 20 + (rng() % 4) * 8);
+
+    // the occasional long value, up to the largest that fits in one cell
+    if (rng() % 50 == 0)
+        add_random_binary(svc, "Blob", 2048 + (rng() % (CM_KEY_VALUE_BIG - 2048)));
+
+    if (rng() % 2 == 0) {
+        gen_key* sec = new_key(svc, "Security");
+
+        add_random_binary(sec, "Security", 100 + (rng() % 100));
+    }
+
+    if (rng() % 3 == 0) {
+        gen_key* params = new_key(svc, "Parameters");
+
+        add_dword(params, "ServiceDllUnloadOnStop", 1);
+        snprintf(s, sizeof(s), "%%SystemRoot%%\\System32\\%s.dll", name);
+        add_string(params, "ServiceDll", REG_EXPAND_SZ, s);
+    }
+
+    if (rng() % 5 == 0) {
+        gen_key* en = new_key(svc, "Enum");
+
+        snprintf(s, sizeof(s), "ROOT\\LEGACY_%s\\0000", name);
+        add_string(en, "0", REG_SZ, s);
+        add_dword(en, "Count", 1);
+        add_dword(en, "NextInstance", 1);
+    }
+
+    if (boot && rng() % 4 == 0) {
+        gen_key* so = new_key(svc, "StartOverride");
+
+        add_dword(so, "0", rng() % 2 == 0 ? 0 : 3);
+    }
+}
+
+static void add_nls(gen_key* control) {
+    gen_key* nls = new_key(control, "Nls");
+    gen_key* cp = new_key(nls, "CodePage");
+    gen_key* lang = new_key(nls, "Language");
+    gen_key* locale = new_key(nls, "Locale");
+    char s[32], t[32];
+
+    static const unsigned int codepages[] = {
+        37, 437, 500, 708, 720, 737, 775, 850, 852, 855, 857, 858, 860, 861, 862, 863, 864, 865, 866, 869, 870,
+        874, 875, 932, 936, 949, 950, 1026, 1047, 1140, 1141, 1142, 1143, 1144, 1145, 1146, 1147, 1148, 1149,
+        1250, 1251, 1252, 1253, 1254, 1255, 1256, 1257, 1258, 1361, 10000, 10001, 10002, 10003, 10004, 10005,
+        10006, 10007, 10008, 10010, 10017, 10021, 10029, 10079, 10081, 10082, 20000, 20001, 20002, 20003, 20004,
+        20005, 20105, 20106, 20107, 20108, 20127, 20261, 20269, 20273, 20277, 20278, 20280, 20284, 20285, 20290,
+        20297, 20420, 20423, 20424, 20833, 20838, 20866, 20871, 20880, 20905, 20924, 20932, 20936, 20949, 21025,
+        21027, 21866, 28591, 28592, 28593, 28594, 28595, 28596, 28597, 28598, 28599, 28603, 28605
+    };
+
+    add_string(cp, "ACP", REG_SZ, "1252");
+    add_string(cp, "OEMCP", REG_SZ, "437");
+    add_string(cp, "MACCP", REG_SZ, "10000");
+    add_string(cp, "OEMHAL", REG_SZ, "vgaoem.fon");
+
+    for (unsigned int i = 0; i < sizeof(codepages) / sizeof(codepages[0]); i++) {
+        snprintf(s, sizeof(s), "%u", codepages[i]);
+        snprintf(t, sizeof(t), "c_%u.nls", codepages[i]);
+        add_string(cp, s, REG_SZ, i % 5 == 4 ? "" : t);
+    }
+
+    add_string(lang, "Default", REG_SZ, "0409");
+    add_string(lang, "InstallLanguage", REG_SZ, "0409");
+
+    for (unsigned int i = 0x401; i < 0x4a0; i++) {
+        snprintf(s, sizeof(s), "%04x", i);
+        add_string(lang, s, REG_SZ, "l_intl.nls");
+    }
+
+    add_string(locale, "(Default)", REG_SZ, "00000409");
+
+    for (unsigned int i = 0x401; i < 0x4a0; i++) {
+        snprintf(s, sizeof(s), "%08x", i);
+        snprintf(t, sizeof(t), "%u", 1 + (i % 16));
+        add_string(locale, s, REG_SZ, t);
+    }
+}
+
+static void add_filler(gen_key* parent, const char* name, unsigned int count, unsigned int depth) {
+    gen_key* key = new_key(parent, name);
+    char s[64];
+
+    for (unsigned int i = 0; i < 4; i++) {
+        snprintf(s, sizeof(s), "Value%u", i);
+        add_dword(key, s, rng());
+    }
+
+    if (depth == 0)
+        return;
+
+    for (unsigned int i = 0; i < count; i++) {
+        snprintf(s, sizeof(s), "%04u", i);
+        add_filler(key, s, count / 2, depth - 1);
+    }
+}
+
+static unsigned int count_keys(const gen_key* key) {
+    unsigned int count = 1;
+
+    for (unsigned int i = 0; i < key->num_children; i++) {
+        count += count_keys(key->children[i]);
+    }
+
+    return count;
+}
+
+gen_key* gen_system_hive(const hive_params* params, unsigned int* num_keys) {
+    gen_key *root, *select, *hwconfig, *ccs, *control, *services, *sgo, *gol, *key;
+    unsigned int group_tags[NUM_GROUPS];
+    char s[1024];
+
+    rng_state = params->seed ? params->seed : 1;
+
+    memset(group_tags, 0, sizeof(group_tags));
+
+    root = new_key(NULL, "ROOT");
+
+    select = new_key(root, "Select");
+    add_dword(select, "Current", 1);
+    add_dword(select, "Default", 1);
+    add_dword(select, "Failed", 0);
+    add_dword(select, "LastKnownGood", 1);
+
+    hwconfig = new_key(root, "HardwareConfig");
+    add_dword(hwconfig, "LastId", 0);
+    add_string(hwconfig, "LastConfig", REG_SZ, "{a8b6c2e0-7a43-4c7c-95c1-5d7f8b2e1c3d}");
+
+    key = new_key(hwconfig, "{a8b6c2e0-7a43-4c7c-95c1-5d7f8b2e1c3d}");
+    add_dword(key, "Id", 0);
+    add_string(key, "BIOSVendor", REG_SZ, "Quibble Test Firmware");
+
+    key = new_key(root, "MountedDevices");
+
+    for (unsigned int i = 0; i < 26; i++) {
+        snprintf(s, sizeof(s), "\\DosDevices\\%c:", 'A' + i);
+        add_random_binary(key, s, 12 + (i % 3) * 12);
+    }
+
+    key = new_key(root, "Setup");
+    add_dword(key, "SetupType", 0);
+    add_dword(key, "SystemSetupInProgress", 0);
+    add_string(key, "CmdLine", REG_SZ, "setup -newsetup");
+
+    ccs = new_key(root, "ControlSet001");
+    control = new_key(ccs, "Control");
+
+    add_string(control, "SystemBootDevice", REG_SZ, "multi(0)disk(0)rdisk(0)partition(1)");
+    add_string(control, "SystemStartOptions", REG_SZ, " NOEXECUTE=OPTIN");
+
+    add_nls(control);
+
+    key = new_key(control, "Errata");
+    add_string(key, "InfName", REG_SZ, "biosinfo.inf");
+
+    key = new_key(control, "BiosInfo");
+    add_string(key, "InfName", REG_SZ, "biosinfo.inf");
+
+    {
+        size_t pos = 0;
+
+        for (unsigned int i = 0; i < NUM_GROUPS; i++) {
+            strcpy(s + pos, groups[i]);
+            pos += strlen(groups[i]) + 1;
+        }
+
+        s[pos] = 0;
+        s[pos + 1] = 0;
+    }
+
+    sgo = new_key(control, "ServiceGroupOrder");
+    add_multi_sz(sgo, "List", s);
+
+    // Class has a subkey for every device class, each with one for every device
+
+    add_filler(control, "Class", 40, 2);
+    add_filler(control, "DeviceClasses", 30, 2);
+    add_filler(control, "Session Manager", 10, 2);
+
+    ccs->children[0]->class_name = widen("ControlClass", &ccs->children[0]->class_len);
+
+    services = new_key(ccs, "Services");
+
+    {
+        static const char* boot_names[] = { "ACPI", "disk", "volmgr", "partmgr", "pci", "CNG", "ksecdd",
+                                            "Wdf01000", "storahci", "volsnap" };
+        unsigned int boot_left = params->boot_drivers;
+        unsigned int n = params->services;
+
+        // the filesystem driver Quibble is told about
+        add_service(services, "btrfs", 0, true, true, group_tags);
+
+        for (unsigned int i = 0; i < sizeof(boot_names) / sizeof(boot_names[0]) && i + 1 < n; i++) {
+            add_service(services, boot_names[i], i + 1, boot_left > 0, false, group_tags);
+
+            if (boot_left > 0)
+                boot_left--;
+        }
+
+        for (unsigned int i = sizeof(boot_names) / sizeof(boot_names[0]) + 1; i < n; i++) {
+            bool boot = boot_left > 0 && rng() % (n - i) < boot_left;
+
+            service_name(i, s);
+
+            // a few names outside ASCII, which reg.c can't use its hashes or binary search for
+
+            if (i % 97 == 0)
+                strcat(s, "\xe9"); // Latin-1, so still stored compressed
+
+            add_service(services, s, i, boot, false, group_tags);
+
+            if (boot)
+                boot_left--;
+
+            if (i % 211 == 0) {
+                gen_key* last = services->children[services->num_children - 1];
+
+                // a name which can't be stored in one byte per character
+                last->name[last->name_len - 1] = 0x3a9;
+            }
+        }
+
+        // a name longer than the 255 characters load_drivers allows for, which it skips
+
+        memset(s, 'x', 300);
+        s[300] = 0;
+        add_service(services, s, n, false, false, group_tags);
+    }
+
+    gol = new_key(control, "GroupOrderList");
+
+    for (unsigned int i = 0; i < NUM_GROUPS; i++) {
+        uint32_t list[257];
+        unsigned int count = group_tags[i] > 256 ? 256 : group_tags[i];
+
+        if (count == 0)
+            continue;
+
+        list[0] = count;
+
+        for (unsigned int j = 0; j < count; j++) {
+            list[1 + j] = count - j; // reverse order of tag, so it does actually reorder things
+        }
+
+        add_value(gol, groups[i], REG_BINARY, list, (count + 1) * sizeof(uint32_t));
+    }
+
+    add_filler(ccs, "Enum", 50, 2);
+    add_filler(ccs, "Hardware Profiles", 2, 1);
+    add_filler(root, "DriverDatabase", 60, 2);
+
+    if (params->depth > 0) {
+        key = new_key(root, "Deep");
+
+        for (unsigned int i = 0; i < params->depth; i++) {
+            key = new_key(key, i % 2 == 0 ? "Deeper" : "deeper");
+            add_dword(key, "Level", i);
+        }
+    }
+
+    if (num_keys)
+        *num_keys = count_keys(root);
+
+    return root;
+}
+
+// writing
+
+static uint8_t* cell_data(builder* b, uint32_t cell) {
+    return b->data + cell + sizeof(int32_t);
+}
+
+static uint32_t alloc_cell_raw(builder* b, uint32_t size) {
+    uint32_t cell_size = (size + sizeof(int32_t) + 7) & ~7;
+    uint32_t cell;
+
+    if (cell_size > b->bin_end - b->pos) {
+        uint32_t bin_size = (cell_size + sizeof(HBIN) + BIN_SIZE - 1) & ~(BIN_SIZE - 1);
+        HBIN* bin;
+
+        if (b->bin_end + bin_size > b->alloc) {
+            uint32_t new_alloc = b->alloc == 0 ? 0x100000 : b->alloc * 2;
+
+            while (new_alloc < b->bin_end + bin_size) {
+                new_alloc *= 2;
+            }
+
+            b->data = realloc(b->data, new_alloc);
+
+            if (!b->data) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+
+            b->alloc = new_alloc;
+        }
+
+        // the rest of the old bin is free
+        if (b->bin_end > b->pos)
+            *(int32_t*)(b->data + b->pos) = b->bin_end - b->pos;
+
+        bin = (HBIN*)(b->data + b->bin_end);
+        memset(bin, 0, sizeof(HBIN));
+        bin->Signature = HV_HBIN_SIGNATURE;
+        bin->FileOffset = b->bin_end;
+        bin->Size = bin_size;
+
+        b->pos = b->bin_end + sizeof(HBIN);
+        b->bin_end += bin_size;
+    }
+
+    cell = b->pos;
+    *(int32_t*)(b->data + cell) = -(int32_t)cell_size;
+    memset(b->data + cell + sizeof(int32_t), 0, cell_size - sizeof(int32_t));
+    b->pos += cell_size;
+
+    return cell;
+}
+
+// Allocates a cell, sometimes leaving a free one after it - full of stale data, like the
+// space a deleted key leaves behind.
+static uint32_t alloc_cell(builder* b, uint32_t size) {
+    uint32_t cell = alloc_cell_raw(b, size);
+
+    if (b->garbage != 0 && rng() % 100 < b->garbage) {
+        uint32_t junk = alloc_cell_raw(b, 8 + (rng() % 256));
+        int32_t junk_size = -*(int32_t*)(b->data + junk);
+
+        for (uint32_t i = sizeof(int32_t); i < (uint32_t)junk_size; i++) {
+            b->data[junk + i] = (uint8_t)rng();
+        }
+
+        ((CM_KEY_NODE*)cell_data(b, junk))->Signature = CM_KEY_NODE_SIGNATURE;
+        *(int32_t*)(b->data + junk) = junk_size;
+    }
+
+    return cell;
+}
+
+static bool is_latin1(const WCHAR* name, unsigned int len) {
+    for (unsigned int i = 0; i < len; i++) {
+        if (name[i] > 0xff)
+            return false;
+    }
+
+    return true;
+}
+
+static uint32_t name_hash(const WCHAR* name, unsigned int len) {
+    uint32_t hash = 0;
+
+    for (unsigned int i = 0; i < len; i++) {
+        hash = (hash * 37) + upcase(name[i]);
+    }
+
+    return hash;
+}
+
+static uint32_t write_value(builder* b, const gen_value* v) {
+    bool comp = is_latin1(v->name, v->name_len);
+    uint32_t name_size = comp ? v->name_len : v->name_len * sizeof(WCHAR);
+    uint32_t cell = alloc_cell(b, offsetof(CM_KEY_VALUE, Name[0]) + name_size);
+    CM_KEY_VALUE* vk;
+
+    vk = (CM_KEY_VALUE*)cell_data(b, cell);
+    vk->Signature = CM_KEY_VALUE_SIGNATURE;
+    vk->NameLength = (uint16_t)name_size;
+    vk->Type = v->type;
+    vk->Flags = comp ? VALUE_COMP_NAME : 0;
+
+    if (comp) {
+        for (unsigned int i = 0; i < v->name_len; i++) {
+            ((uint8_t*)vk->Name)[i] = (uint8_t)v->name[i];
+        }
+    } else
+        memcpy(vk->Name, v->name, name_size);
+
+    // Values of up to four bytes can be stored in the Data field itself, but reg.c doesn't
+    // read the shorter ones from there the way Windows writes them, so they get a cell.
+
+    if (v->size == 0 || v->size == sizeof(uint32_t)) {
+        uint32_t data = 0;
+
+        memcpy(&data, v->data, v->size);
+
+        vk->DataLength = v->size | CM_KEY_VALUE_SPECIAL_SIZE;
+        vk->Data = data;
+    } else {
+        uint32_t data_cell = alloc_cell(b, v->size);
+
+        vk = (CM_KEY_VALUE*)cell_data(b, cell); // b->data may have moved
+        vk->DataLength = v->size;
+        vk->Data = data_cell;
+
+        memcpy(cell_data(b, data_cell), v->data, v->size);
+    }
+
+    return cell;
+}
+
+static int compare_children(const void* a, const void* b) {
+    const gen_key* k1 = *(const gen_key**)a;
+    const gen_key* k2 = *(const gen_key**)b;
+
+    return gen_compare_names(k1->name, k1->name_len, k2->name, k2->name_len);
+}
+
+// Writes a leaf of the subkey list - lh usually, as in current versions of Windows, but
+// sometimes li or lf, as in older ones.
+static uint32_t write_leaf(builder* b, gen_key** children, const uint32_t* cells, unsigned int count,
+                           uint16_t sig) {
+    uint32_t cell;
+
+    if (sig == CM_KEY_INDEX_LEAF) {
+        CM_KEY_INDEX* li;
+
+        cell = alloc_cell(b, offsetof(CM_KEY_INDEX, List[0]) + (count * sizeof(uint32_t)));
+        li = (CM_KEY_INDEX*)cell_data(b, cell);
+        li->Signature = sig;
+        li->Count = (uint16_t)count;
+
+        for (unsigned int i = 0; i < count; i++) {
+            li->List[i] = cells[i];
+        }
+    } else {
+        CM_KEY_FAST_INDEX* lh;
+
+        cell = alloc_cell(b, offsetof(CM_KEY_FAST_INDEX, List[0]) + (count * sizeof(CM_INDEX)));
+        lh = (CM_KEY_FAST_INDEX*)cell_data(b, cell);
+        lh->Signature = sig;
+        lh->Count = (uint16_t)count;
+
+        for (unsigned int i = 0; i < count; i++) {
+            lh->List[i].Cell = cells[i];
+
+            if (sig == CM_KEY_HASH_LEAF)
+                lh->List[i].HashKey = name_hash(children[i]->name, children[i]->name_len);
+            else { // lf - the first four characters of the name
+                lh->List[i].HashKey = 0;
+
+                for (unsigned int j = 0; j < children[i]->name_len && j < 4; j++) {
+                    ((uint8_t*)&lh->List[i].HashKey)[j] = (uint8_t)children[i]->name[j];
+                }
+            }
+        }
+    }
+
+    return cell;
+}
+
+static uint32_t write_key(builder* b, gen_key* key, uint32_t parent, unsigned int leaf_size, unsigned int sk) {
+    bool comp = is_latin1(key->name, key->name_len);
+    uint32_t name_size = comp ? key->name_len : key->name_len * sizeof(WCHAR);
+    uint32_t cell, values = 0xffffffff, subkeys = 0xffffffff, class_cell = 0xffffffff;
+    uint32_t max_name = 0, max_value_name = 0, max_data = 0;
+    unsigned int key_num = b->keys_written;
+    CM_KEY_NODE* nk;
+
+    b->keys_written++;
+
+    cell = alloc_cell(b, offsetof(CM_KEY_NODE, Name[0]) + name_size);
+
+    if (key->class_name) {
+        class_cell = alloc_cell(b, key->class_len * sizeof(WCHAR));
+        memcpy(cell_data(b, class_cell), key->class_name, key->class_len * sizeof(WCHAR));
+    }
+
+    if (key->num_values > 0) {
+        uint32_t* list = xalloc(key->num_values * sizeof(uint32_t));
+
+        for (unsigned int i = 0; i < key->num_values; i++) {
+            list[i] = write_value(b, &key->values[i]);
+
+            if (key->values[i].name_len * sizeof(WCHAR) > max_value_name)
+                max_value_name = key->values[i].name_len * sizeof(WCHAR);
+
+            if (key->values[i].size > max_data)
+                max_data = key->values[i].size;
+        }
+
+        values = alloc_cell(b, key->num_values * sizeof(uint32_t));
+        memcpy(cell_data(b, values), list, key->num_values * sizeof(uint32_t));
+
+        free(list);
+    }
+
+    if (key->num_children > 0) {
+        uint32_t* cells = xalloc(key->num_children * sizeof(uint32_t));
+        gen_key** sorted = xalloc(key->num_children * sizeof(gen_key*));
+        uint16_t sig = key_num % 7 == 3 ? CM_KEY_INDEX_LEAF : (key_num % 11 == 5 ? CM_KEY_FAST_LEAF : CM_KEY_HASH_LEAF);
+
+        // The children are written in the order they were created, as they would be in a
+        // real hive, but the lists have to be in name order.
+
+        memcpy(sorted, key->children, key->num_children * sizeof(gen_key*));
+        qsort(sorted, key->num_children, sizeof(gen_key*), compare_children);
+
+        for (unsigned int i = 0; i < key->num_children; i++) {
+            gen_key* child = key->children[i];
+            unsigned int j;
+
+            for (j = 0; sorted[j] != child; j++) {
+            }
+
+            cells[j] = write_key(b, child, cell, leaf_size, (sk + i) % NUM_SECURITY);
+
+            if (child->name_len * sizeof(WCHAR) > max_name)
+                max_name = child->name_len * sizeof(WCHAR);
+        }
+
+        if (key->num_children <= leaf_size)
+            subkeys = write_leaf(b, sorted, cells, key->num_children, sig);
+        else {
+            unsigned int leaves = (key->num_children + leaf_size - 1) / leaf_size;
+            uint32_t* leaf_cells = xalloc(leaves * sizeof(uint32_t));
+            CM_KEY_INDEX* ri;
+
+            // Windows splits full leaves in half, so they're not all the same size
+            for (unsigned int i = 0; i < leaves; i++) {
+                unsigned int start = (unsigned int)(((uint64_t)key->num_children * i) / leaves);
+                unsigned int end = (unsigned int)(((uint64_t)key->num_children * (i + 1)) / leaves);
+
+                leaf_cells[i] = write_leaf(b, &sorted[start], &cells[start], end - start,
+                                           sig == CM_KEY_FAST_LEAF ? CM_KEY_HASH_LEAF : sig);
+            }
+
+            subkeys = alloc_cell(b, offsetof(CM_KEY_INDEX, List[0]) + (leaves * sizeof(uint32_t)));
+            ri = (CM_KEY_INDEX*)cell_data(b, subkeys);
+            ri->Signature = CM_KEY_INDEX_ROOT;
+            ri->Count = (uint16_t)leaves;
+            memcpy(ri->List, leaf_cells, leaves * sizeof(uint32_t));
+
+            free(leaf_cells);
+        }
+
+        free(sorted);
+        free(cells);
+    }
+
+    nk = (CM_KEY_NODE*)cell_data(b, cell);
+    nk->Signature = CM_KEY_NODE_SIGNATURE;
+    nk->Flags = (comp ? KEY_COMP_NAME : 0) | (parent == 0xffffffff ? KEY_HIVE_ENTRY | KEY_NO_DELETE : 0);
+    nk->LastWriteTime = 0x1d5a0b3c4e5f6070 + key_num;
+    nk->Parent = parent;
+    nk->SubKeyCount = key->num_children;
+    nk->SubKeyList = subkeys;
+    nk->ValuesCount = key->num_values;
+    nk->Values = values;
+    nk->Security = b->sk[sk];
+    nk->Class = class_cell;
+    nk->ClassLength = key->class_name ? key->class_len * sizeof(WCHAR) : 0;
+    nk->MaxNameLen = max_name;
+    nk->MaxValueNameLen = max_value_name;
+    nk->MaxValueDataLen = max_data;
+    nk->NameLength = (uint16_t)name_size;
+
+    // stale volatile subkeys, which reg.c has to clear
+    if (key_num % 13 == 0) {
+        nk->VolatileSubKeyCount = 1 + (key_num % 5);
+        nk->VolatileSubKeyList = 0x12345678;
+    } else
+        nk->VolatileSubKeyList = 0xffffffff;
+
+    if (comp) {
+        for (unsigned int i = 0; i < key->name_len; i++) {
+            ((uint8_t*)nk->Name)[i] = (uint8_t)key->name[i];
+        }
+    } else
+        memcpy(nk->Name, key->name, name_size);
+
+    return cell;
+}
+
+static void write_security(builder* b) {
+    for (unsigned int i = 0; i < NUM_SECURITY; i++) {
+        uint32_t len = 80 + (i * 24);
+        CM_KEY_SECURITY* sk;
+
+        b->sk[i] = alloc_cell(b, offsetof(CM_KEY_SECURITY, Descriptor[0]) + len);
+
+        sk = (CM_KEY_SECURITY*)cell_data(b, b->sk[i]);
+        sk->Signature = CM_KEY_SECURITY_SIGNATURE;
+        sk->ReferenceCount = 1;
+        sk->DescriptorLength = len;
+
+        for (uint32_t j = 0; j < len; j++) {
+            sk->Descriptor[j] = (uint8_t)rng();
+        }
+    }
+
+    for (unsigned int i = 0; i < NUM_SECURITY; i++) {
+        CM_KEY_SECURITY* sk = (CM_KEY_SECURITY*)cell_data(b, b->sk[i]);
+
+        sk->Flink = b->sk[(i + 1) % NUM_SECURITY];
+        sk->Blink = b->sk[(i + NUM_SECURITY - 1) % NUM_SECURITY];
+    }
+}
+
+bool gen_write_hive(const gen_key* root, const hive_params* params, const char* path, uint32_t* size) {
+    builder b;
+    HBASE_BLOCK base;
+    uint32_t root_cell, csum;
+    FILE* f;
+    bool ret;
+
+    memset(&b, 0, sizeof(b));
+    b.garbage = params->garbage;
+
+    rng_state = (params->seed ? params->seed : 1) ^ 0x5bd1e995;
+
+    write_security(&b);
+
+    root_cell = write_key(&b, (gen_key*)root, 0xffffffff, params->leaf_size ? params->leaf_size : 511, 0);
+
+    if (b.bin_end > b.pos)
+        *(int32_t*)(b.data + b.pos) = b.bin_end - b.pos;
+
+    memset(&base, 0, sizeof(base));
+    base.Signature = HV_HBLOCK_SIGNATURE;
+    base.Sequence1 = base.Sequence2 = 1;
+    base.Major = HSYS_MAJOR;
+    base.Minor = 5;
+    base.Type = HFILE_TYPE_PRIMARY;
+    base.Format = HBASE_FORMAT_MEMORY;
+    base.RootCell = root_cell;
+    base.Length = b.bin_end;
+    base.Cluster = 1;
+
+    for (unsigned int i = 0; i < 6; i++) {
+        base.FileName[i] = "SYSTEM"[i];
+    }
+
+    csum = 0;
+
+    for (unsigned int i = 0; i < 127; i++) {
+        csum ^= ((uint32_t*)&base)[i];
+    }
+
+    if (csum == 0xffffffff)
+        csum = 0xfffffffe;
+    else if (csum == 0)
+        csum = 1;
+
+    base.CheckSum = csum;
+
+    f = fopen(path, "wb");
+    if (!f) {
+        free(b.data);
+        return false;
+    }
+
+    ret = fwrite(&base, sizeof(base), 1, f) == 1 && fwrite(b.data, b.bin_end, 1, f) == 1;
+
+    if (fclose(f) != 0)
+        ret = false;
+
+    free(b.data);
+
+    if (size)
+        *size = sizeof(base) + b.bin_end;
+
+    return ret;
+}
@@ -0,0 +1,63 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Generates synthetic SYSTEM hives, laid out like a real one as far as Quibble cares:
+// Select, HardwareConfig, and a control set with Nls, ServiceGroupOrder, GroupOrderList,
+// and as many services as asked for. The tree is kept in memory too, so that what reg.c
+// reads back can be checked against it.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "efi/efihost.h"
+
+typedef struct {
+    unsigned int services;
+    unsigned int boot_drivers; // how many services are boot-start kernel drivers
+    unsigned int leaf_size; // the most subkeys in one list, before an ri list is used
+    unsigned int garbage; // percentage of cells followed by a free cell, as in a long-lived hive
+    unsigned int depth; // if not 0, a chain of this many nested keys under the root's Deep key
+    uint32_t seed;
+} hive_params;
+
+typedef struct {
+    WCHAR* name;
+    uint16_t name_len; // in characters
+    uint32_t type;
+    uint8_t* data;
+    uint32_t size;
+} gen_value;
+
+typedef struct _gen_key {
+    WCHAR* name;
+    uint16_t name_len; // in characters
+    WCHAR* class_name;
+    uint16_t class_len;
+    struct _gen_key** children;
+    unsigned int num_children;
+    unsigned int alloc_children;
+    gen_value* values;
+    unsigned int num_values;
+    unsigned int alloc_values;
+} gen_key;
+
+gen_key* gen_system_hive(const hive_params* params, unsigned int* num_keys);
+bool gen_write_hive(const gen_key* root, const hive_params* params, const char* path, uint32_t* size);
+void gen_free_key(gen_key* key);
+gen_key* gen_find_child(const gen_key* key, const WCHAR* name);
+int gen_compare_names(const WCHAR* name1, unsigned int len1, const WCHAR* name2, unsigned int len2);
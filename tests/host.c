@@ -0,0 +1,875 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "host.h"
+#include "misc.h"
+#include "print.h"
+
+#define MAX_PROTOCOLS 256
+
+typedef struct {
+    EFI_HANDLE handle;
+    EFI_GUID guid;
+    void* interface;
+} protocol_entry;
+
+typedef struct {
+    EFI_FILE_PROTOCOL proto;
+    int fd;
+    DIR* dir; // for reading directory entries
+    char* root;
+    char* path;
+    bool is_dir;
+    uint64_t pos;
+} host_file;
+
+host_stats host_counters;
+EFI_BOOT_SERVICES host_bs;
+EFI_SYSTEM_TABLE host_systable;
+EFI_HANDLE host_image_handle;
+bool gop_console = false;
+bool print_quiet = false;
+
+static protocol_entry protocols[MAX_PROTOCOLS];
+static unsigned int num_protocols = 0;
+static SIMPLE_TEXT_OUTPUT_INTERFACE con_out;
+static SIMPLE_TEXT_OUTPUT_MODE con_out_mode;
+static uint8_t handles[MAX_PROTOCOLS]; // handles are just the addresses of these
+static unsigned int num_handles = 0;
+
+static EFI_STATUS open_path(const char* root, const char* path, bool write, EFI_FILE_HANDLE* file);
+
+// Quibble's print.c draws on the screen, so we have our own.
+
+void print_string(const char* s) {
+    if (print_quiet)
+        return;
+
+    fputs(s, stdout);
+}
+
+void print_error(const char* func, EFI_STATUS Status) {
+    fprintf(stdout, "%s returned %s\n", func, error_string(Status));
+}
+
+static EFI_STATUS EFIAPI output_string(SIMPLE_TEXT_OUTPUT_INTERFACE* This, CHAR16* String) {
+    char s[1024];
+    unsigned int len = 0, out_len;
+
+    (void)This;
+
+    if (print_quiet)
+        return EFI_SUCCESS;
+
+    while (String[len] != 0) {
+        len++;
+    }
+
+    if (EFI_ERROR(utf16_to_utf8(s, sizeof(s) - 1, &out_len, String, len * sizeof(CHAR16))))
+        return EFI_SUCCESS;
+
+    s[out_len] = 0;
+
+    // the firmware wants \r\n, the host doesn't
+
+    for (unsigned int i = 0; i < out_len; i++) {
+        if (s[i] != '\r')
+            putchar(s[i]);
+    }
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI unsupported() {
+    return EFI_UNSUPPORTED;
+}
+
+static EFI_TPL EFIAPI raise_tpl(EFI_TPL NewTpl) {
+    (void)NewTpl;
+
+    return TPL_APPLICATION;
+}
+
+static VOID EFIAPI restore_tpl(EFI_TPL OldTpl) {
+    (void)OldTpl;
+}
+
+static EFI_STATUS EFIAPI allocate_pool(EFI_MEMORY_TYPE PoolType, UINTN Size, VOID** Buffer) {
+    (void)PoolType;
+
+    *Buffer = malloc(Size == 0 ? 1 : Size);
+
+    if (!*Buffer)
+        return EFI_OUT_OF_RESOURCES;
+
+    host_counters.pool_allocs++;
+    host_counters.pool_bytes += Size;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI free_pool(VOID* Buffer) {
+    free(Buffer);
+
+    host_counters.pool_frees++;
+
+    return EFI_SUCCESS;
+}
+
+// Pages come from mmap, as Quibble sometimes gives back the end of an allocation.
+
+static EFI_STATUS EFIAPI allocate_pages(EFI_ALLOCATE_TYPE Type, EFI_MEMORY_TYPE MemoryType, UINTN NoPages,
+                                        EFI_PHYSICAL_ADDRESS* Memory) {
+    void* addr;
+
+    (void)MemoryType;
+
+    if (Type != AllocateAnyPages)
+        return EFI_UNSUPPORTED;
+
+    addr = mmap(NULL, NoPages * EFI_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (addr == MAP_FAILED)
+        return EFI_OUT_OF_RESOURCES;
+
+    *Memory = (EFI_PHYSICAL_ADDRESS)(uintptr_t)addr;
+
+    host_counters.page_allocs++;
+    host_counters.pages += NoPages;
+    host_counters.pages_in_use += NoPages;
+
+    if (host_counters.pages_in_use > host_counters.peak_pages)
+        host_counters.peak_pages = host_counters.pages_in_use;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI free_pages(EFI_PHYSICAL_ADDRESS Memory, UINTN NoPages) {
+    if (munmap((void*)(uintptr_t)Memory, NoPages * EFI_PAGE_SIZE) != 0)
+        return EFI_INVALID_PARAMETER;
+
+    host_counters.page_frees++;
+    host_counters.pages_in_use -= NoPages;
+
+    return EFI_SUCCESS;
+}
+
+static protocol_entry* find_protocol(EFI_HANDLE handle, const EFI_GUID* guid) {
+    for (unsigned int i = 0; i < num_protocols; i++) {
+        if ((!handle || protocols[i].handle == handle) && !memcmp(&protocols[i].guid, guid, sizeof(EFI_GUID)))
+            return &protocols[i];
+    }
+
+    return NULL;
+}
+
+static EFI_STATUS EFIAPI install_protocol_interface(EFI_HANDLE* Handle, EFI_GUID* Protocol,
+                                                    EFI_INTERFACE_TYPE InterfaceType, VOID* Interface) {
+    (void)InterfaceType;
+
+    if (!*Handle) {
+        if (num_handles == MAX_PROTOCOLS)
+            return EFI_OUT_OF_RESOURCES;
+
+        *Handle = &handles[num_handles];
+        num_handles++;
+    } else if (find_protocol(*Handle, Protocol))
+        return EFI_INVALID_PARAMETER;
+
+    if (num_protocols == MAX_PROTOCOLS)
+        return EFI_OUT_OF_RESOURCES;
+
+    protocols[num_protocols].handle = *Handle;
+    protocols[num_protocols].guid = *Protocol;
+    protocols[num_protocols].interface = Interface;
+    num_protocols++;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI uninstall_protocol_interface(EFI_HANDLE Handle, EFI_GUID* Protocol, VOID* Interface) {
+    protocol_entry* pe = find_protocol(Handle, Protocol);
+
+    if (!pe || pe->interface != Interface)
+        return EFI_NOT_FOUND;
+
+    num_protocols--;
+    memmove(pe, pe + 1, (&protocols[num_protocols] - pe) * sizeof(protocol_entry));
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI handle_protocol(EFI_HANDLE Handle, EFI_GUID* Protocol, VOID** Interface) {
+    protocol_entry* pe = find_protocol(Handle, Protocol);
+
+    if (!Handle || !pe)
+        return EFI_UNSUPPORTED;
+
+    *Interface = pe->interface;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI open_protocol(EFI_HANDLE Handle, EFI_GUID* Protocol, VOID** Interface,
+                                       EFI_HANDLE AgentHandle, EFI_HANDLE ControllerHandle, UINT32 Attributes) {
+    EFI_STATUS Status;
+    void* dummy;
+
+    (void)AgentHandle;
+    (void)ControllerHandle;
+
+    Status = handle_protocol(Handle, Protocol, Interface ? Interface : &dummy);
+
+    if (Status == EFI_SUCCESS && Attributes == EFI_OPEN_PROTOCOL_TEST_PROTOCOL && Interface)
+        *Interface = NULL;
+
+    return Status;
+}
+
+static EFI_STATUS EFIAPI close_protocol(EFI_HANDLE Handle, EFI_GUID* Protocol, EFI_HANDLE AgentHandle,
+                                        EFI_HANDLE ControllerHandle) {
+    (void)AgentHandle;
+    (void)ControllerHandle;
+
+    return find_protocol(Handle, Protocol) ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+static EFI_STATUS EFIAPI locate_handle_buffer(EFI_LOCATE_SEARCH_TYPE SearchType, EFI_GUID* Protocol,
+                                              VOID* SearchKey, UINTN* NoHandles, EFI_HANDLE** Buffer) {
+    EFI_STATUS Status;
+    unsigned int count = 0;
+
+    (void)SearchKey;
+
+    if (SearchType != ByProtocol)
+        return EFI_UNSUPPORTED;
+
+    for (unsigned int i = 0; i < num_protocols; i++) {
+        if (!memcmp(&protocols[i].guid, Protocol, sizeof(EFI_GUID)))
+            count++;
+    }
+
+    if (count == 0)
+        return EFI_NOT_FOUND;
+
+    Status = allocate_pool(EfiBootServicesData, count * sizeof(EFI_HANDLE), (void**)Buffer);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    count = 0;
+
+    for (unsigned int i = 0; i < num_protocols; i++) {
+        if (!memcmp(&protocols[i].guid, Protocol, sizeof(EFI_GUID))) {
+            (*Buffer)[count] = protocols[i].handle;
+            count++;
+        }
+    }
+
+    *NoHandles = count;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI locate_protocol(EFI_GUID* Protocol, VOID* Registration, VOID** Interface) {
+    protocol_entry* pe = find_protocol(NULL, Protocol);
+
+    (void)Registration;
+
+    if (!pe)
+        return EFI_NOT_FOUND;
+
+    *Interface = pe->interface;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI install_multiple_protocol_interfaces(EFI_HANDLE* Handle, ...) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    va_list ap;
+
+    va_start(ap, Handle);
+
+    while (true) {
+        EFI_GUID* guid = va_arg(ap, EFI_GUID*);
+        void* interface;
+
+        if (!guid)
+            break;
+
+        interface = va_arg(ap, void*);
+
+        Status = install_protocol_interface(Handle, guid, EFI_NATIVE_INTERFACE, interface);
+        if (EFI_ERROR(Status))
+            break;
+    }
+
+    va_end(ap);
+
+    return Status;
+}
+
+static EFI_STATUS EFIAPI stall(UINTN Microseconds) {
+    (void)Microseconds;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI set_watchdog_timer(UINTN Timeout, UINT64 WatchdogCode, UINTN DataSize,
+                                            CHAR16* WatchdogData) {
+    (void)Timeout;
+    (void)WatchdogCode;
+    (void)DataSize;
+    (void)WatchdogData;
+
+    return EFI_SUCCESS;
+}
+
+void host_init(void) {
+    EFI_UNUSED_SERVICE* services = (EFI_UNUSED_SERVICE*)&host_bs.RaiseTPL;
+
+    memset(&host_bs, 0, sizeof(host_bs));
+
+    for (unsigned int i = 0; i < (sizeof(host_bs) - offsetof(EFI_BOOT_SERVICES, RaiseTPL)) / sizeof(void*); i++) {
+        services[i] = unsupported;
+    }
+
+    host_bs.Hdr.Signature = 0x56524553544f4f42; // "BOOTSERV"
+    host_bs.RaiseTPL = raise_tpl;
+    host_bs.RestoreTPL = restore_tpl;
+    host_bs.AllocatePages = allocate_pages;
+    host_bs.FreePages = free_pages;
+    host_bs.AllocatePool = allocate_pool;
+    host_bs.FreePool = free_pool;
+    host_bs.InstallProtocolInterface = install_protocol_interface;
+    host_bs.UninstallProtocolInterface = uninstall_protocol_interface;
+    host_bs.HandleProtocol = handle_protocol;
+    host_bs.Reserved = NULL;
+    host_bs.Stall = stall;
+    host_bs.SetWatchdogTimer = set_watchdog_timer;
+    host_bs.OpenProtocol = open_protocol;
+    host_bs.CloseProtocol = close_protocol;
+    host_bs.LocateHandleBuffer = locate_handle_buffer;
+    host_bs.LocateProtocol = locate_protocol;
+    host_bs.InstallMultipleProtocolInterfaces = install_multiple_protocol_interfaces;
+
+    memset(&con_out, 0, sizeof(con_out));
+    con_out.OutputString = output_string;
+    con_out.Mode = &con_out_mode;
+
+    memset(&host_systable, 0, sizeof(host_systable));
+    host_systable.Hdr.Signature = 0x5453595320494249; // "IBI SYST"
+    host_systable.ConOut = &con_out;
+    host_systable.StdErr = &con_out;
+    host_systable.BootServices = &host_bs;
+
+    host_image_handle = NULL;
+    install_protocol_interface(&host_image_handle, &(EFI_GUID)EFI_LOADED_IMAGE_PROTOCOL_GUID, EFI_NATIVE_INTERFACE,
+                               NULL);
+}
+
+void host_reset_counters(void) {
+    uint64_t pages_in_use = host_counters.pages_in_use;
+
+    memset(&host_counters, 0, sizeof(host_counters));
+
+    host_counters.pages_in_use = pages_in_use;
+    host_counters.peak_pages = pages_in_use;
+}
+
+void host_print_counters(const char* prefix) {
+    printf("%s%" PRIu64 " pool allocations (%" PRIu64 " bytes, %" PRIu64 " frees), %" PRIu64
+           " page allocations (%" PRIu64 " pages, peak %" PRIu64 " in use)\n",
+           prefix, host_counters.pool_allocs, host_counters.pool_bytes, host_counters.pool_frees,
+           host_counters.page_allocs, host_counters.pages, host_counters.peak_pages);
+
+    if (host_counters.file_opens != 0) {
+        printf("%s%" PRIu64 " files opened, %" PRIu64 " reads (%" PRIu64 " bytes)\n", prefix,
+               host_counters.file_opens, host_counters.file_reads, host_counters.file_read_bytes);
+    }
+}
+
+// file handles
+
+static char* basename_of(host_file* f) {
+    char* s;
+
+    if (!strcmp(f->path, f->root))
+        return "";
+
+    s = strrchr(f->path, '/');
+
+    return s ? s + 1 : f->path;
+}
+
+static EFI_STATUS fill_file_info(const char* name, const struct stat* st, UINTN* BufferSize, VOID* Buffer) {
+    EFI_FILE_INFO* info = (EFI_FILE_INFO*)Buffer;
+    unsigned int name_len;
+    UINTN size;
+
+    utf8_to_utf16(NULL, 0, &name_len, name, strlen(name));
+
+    size = offsetof(EFI_FILE_INFO, FileName[0]) + name_len + sizeof(CHAR16);
+
+    if (*BufferSize < size) {
+        *BufferSize = size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    memset(info, 0, offsetof(EFI_FILE_INFO, FileName[0]));
+
+    info->Size = size;
+    info->FileSize = S_ISDIR(st->st_mode) ? 0 : st->st_size;
+    info->PhysicalSize = st->st_blocks * 512;
+    info->Attribute = S_ISDIR(st->st_mode) ? EFI_FILE_DIRECTORY : 0;
+
+    utf8_to_utf16(info->FileName, name_len, NULL, name, strlen(name));
+    info->FileName[name_len / sizeof(CHAR16)] = 0;
+
+    *BufferSize = size;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI file_open(EFI_FILE_HANDLE File, EFI_FILE_HANDLE* NewHandle, CHAR16* FileName,
+                                   UINT64 OpenMode, UINT64 Attributes) {
+    host_file* f = _CR(File, host_file, proto);
+    char name[4096], path[8192];
+    unsigned int name_len = 0, out_len;
+    char* comp;
+    char* save;
+    bool create = OpenMode & EFI_FILE_MODE_CREATE;
+
+    while (FileName[name_len] != 0) {
+        name_len++;
+    }
+
+    if (EFI_ERROR(utf16_to_utf8(name, sizeof(name) - 1, &out_len, FileName, name_len * sizeof(CHAR16))))
+        return EFI_INVALID_PARAMETER;
+
+    name[out_len] = 0;
+
+    strcpy(path, name[0] == '\\' ? f->root : f->path);
+
+    // Windows trees copied onto Linux don't always have the case Quibble asks for, so
+    // look each component up case-insensitively.
+
+    for (comp = strtok_r(name, "\\/", &save); comp; comp = strtok_r(NULL, "\\/", &save)) {
+        size_t len = strlen(path);
+        struct stat st;
+
+        if (!strcmp(comp, "."))
+            continue;
+
+        if (!strcmp(comp, "..")) {
+            if (strcmp(path, f->root))
+                *strrchr(path, '/') = 0;
+
+            continue;
+        }
+
+        if (len + 1 + strlen(comp) + 1 > sizeof(path))
+            return EFI_INVALID_PARAMETER;
+
+        path[len] = '/';
+        strcpy(path + len + 1, comp);
+
+        if (stat(path, &st) != 0) {
+            DIR* dir;
+            struct dirent* de;
+            bool found = false;
+
+            path[len] = 0;
+
+            dir = opendir(path);
+            if (!dir)
+                return EFI_NOT_FOUND;
+
+            while ((de = readdir(dir))) {
+                if (!strcasecmp(de->d_name, comp)) {
+                    path[len] = '/';
+                    strcpy(path + len + 1, de->d_name);
+                    found = true;
+                    break;
+                }
+            }
+
+            closedir(dir);
+
+            if (!found) {
+                if (!create || strtok_r(NULL, "\\/", &save))
+                    return EFI_NOT_FOUND;
+
+                path[len] = '/';
+
+                if (Attributes & EFI_FILE_DIRECTORY) {
+                    if (mkdir(path, 0755) != 0)
+                        return EFI_ACCESS_DENIED;
+                } else {
+                    int fd = open(path, O_CREAT | O_WRONLY, 0644);
+
+                    if (fd == -1)
+                        return EFI_ACCESS_DENIED;
+
+                    close(fd);
+                }
+
+                break;
+            }
+        }
+    }
+
+    return open_path(f->root, path, OpenMode & EFI_FILE_MODE_WRITE, NewHandle);
+}
+
+static EFI_STATUS EFIAPI file_close(EFI_FILE_HANDLE File) {
+    host_file* f = _CR(File, host_file, proto);
+
+    if (f->dir)
+        closedir(f->dir);
+
+    close(f->fd);
+    free(f->root);
+    free(f->path);
+    free(f);
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI file_delete(EFI_FILE_HANDLE File) {
+    host_file* f = _CR(File, host_file, proto);
+    int ret;
+
+    ret = f->is_dir ? rmdir(f->path) : unlink(f->path);
+
+    file_close(File);
+
+    return ret == 0 ? EFI_SUCCESS : EFI_ACCESS_DENIED;
+}
+
+static EFI_STATUS EFIAPI file_read(EFI_FILE_HANDLE File, UINTN* BufferSize, VOID* Buffer) {
+    host_file* f = _CR(File, host_file, proto);
+    ssize_t ret;
+
+    if (f->is_dir) {
+        struct dirent* de;
+        long loc;
+
+        if (!f->dir) {
+            f->dir = fdopendir(dup(f->fd));
+            if (!f->dir)
+                return EFI_DEVICE_ERROR;
+        }
+
+        do {
+            loc = telldir(f->dir);
+            de = readdir(f->dir);
+        } while (de && (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")));
+
+        if (!de) {
+            *BufferSize = 0;
+            return EFI_SUCCESS;
+        }
+
+        {
+            EFI_STATUS Status;
+            struct stat st;
+
+            if (fstatat(f->fd, de->d_name, &st, 0) != 0)
+                return EFI_DEVICE_ERROR;
+
+            Status = fill_file_info(de->d_name, &st, BufferSize, Buffer);
+
+            if (Status == EFI_BUFFER_TOO_SMALL)
+                seekdir(f->dir, loc);
+
+            return Status;
+        }
+    }
+
+    ret = pread(f->fd, Buffer, *BufferSize, f->pos);
+    if (ret < 0)
+        return EFI_DEVICE_ERROR;
+
+    *BufferSize = ret;
+    f->pos += ret;
+
+    host_counters.file_reads++;
+    host_counters.file_read_bytes += ret;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI file_write(EFI_FILE_HANDLE File, UINTN* BufferSize, VOID* Buffer) {
+    host_file* f = _CR(File, host_file, proto);
+    ssize_t ret;
+
+    if (f->is_dir)
+        return EFI_UNSUPPORTED;
+
+    ret = pwrite(f->fd, Buffer, *BufferSize, f->pos);
+    if (ret < 0)
+        return errno == EBADF ? EFI_ACCESS_DENIED : EFI_DEVICE_ERROR;
+
+    *BufferSize = ret;
+    f->pos += ret;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI file_get_position(EFI_FILE_HANDLE File, UINT64* Position) {
+    host_file* f = _CR(File, host_file, proto);
+
+    if (f->is_dir)
+        return EFI_UNSUPPORTED;
+
+    *Position = f->pos;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI file_set_position(EFI_FILE_HANDLE File, UINT64 Position) {
+    host_file* f = _CR(File, host_file, proto);
+
+    if (f->is_dir) {
+        if (Position != 0)
+            return EFI_UNSUPPORTED;
+
+        if (f->dir)
+            rewinddir(f->dir);
+
+        return EFI_SUCCESS;
+    }
+
+    if (Position == 0xffffffffffffffff) {
+        struct stat st;
+
+        if (fstat(f->fd, &st) != 0)
+            return EFI_DEVICE_ERROR;
+
+        Position = st.st_size;
+    }
+
+    f->pos = Position;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI file_get_info(EFI_FILE_HANDLE File, EFI_GUID* InformationType, UINTN* BufferSize,
+                                       VOID* Buffer) {
+    host_file* f = _CR(File, host_file, proto);
+    EFI_GUID file_info_guid = EFI_FILE_INFO_ID;
+    EFI_GUID fs_info_guid = EFI_FILE_SYSTEM_INFO_ID;
+
+    if (!memcmp(InformationType, &file_info_guid, sizeof(EFI_GUID))) {
+        struct stat st;
+
+        if (fstat(f->fd, &st) != 0)
+            return EFI_DEVICE_ERROR;
+
+        return fill_file_info(basename_of(f), &st, BufferSize, Buffer);
+    } else if (!memcmp(InformationType, &fs_info_guid, sizeof(EFI_GUID))) {
+        EFI_FILE_SYSTEM_INFO* info = (EFI_FILE_SYSTEM_INFO*)Buffer;
+        struct statvfs st;
+
+        if (*BufferSize < sizeof(EFI_FILE_SYSTEM_INFO)) {
+            *BufferSize = sizeof(EFI_FILE_SYSTEM_INFO);
+            return EFI_BUFFER_TOO_SMALL;
+        }
+
+        if (fstatvfs(f->fd, &st) != 0)
+            return EFI_DEVICE_ERROR;
+
+        memset(info, 0, sizeof(EFI_FILE_SYSTEM_INFO));
+
+        info->Size = sizeof(EFI_FILE_SYSTEM_INFO);
+        info->VolumeSize = (UINT64)st.f_blocks * st.f_frsize;
+        info->FreeSpace = (UINT64)st.f_bavail * st.f_frsize;
+        info->BlockSize = st.f_bsize;
+
+        *BufferSize = sizeof(EFI_FILE_SYSTEM_INFO);
+
+        return EFI_SUCCESS;
+    }
+
+    return EFI_UNSUPPORTED;
+}
+
+// Only renaming within the same directory and changing the size are supported.
+static EFI_STATUS EFIAPI file_set_info(EFI_FILE_HANDLE File, EFI_GUID* InformationType, UINTN BufferSize,
+                                       VOID* Buffer) {
+    host_file* f = _CR(File, host_file, proto);
+    EFI_GUID file_info_guid = EFI_FILE_INFO_ID;
+    EFI_FILE_INFO* info = (EFI_FILE_INFO*)Buffer;
+    char name[1024], *new_path;
+    unsigned int name_len = 0, out_len;
+    struct stat st;
+
+    if (memcmp(InformationType, &file_info_guid, sizeof(EFI_GUID)))
+        return EFI_UNSUPPORTED;
+
+    if (BufferSize < offsetof(EFI_FILE_INFO, FileName[0]) + sizeof(CHAR16))
+        return EFI_BAD_BUFFER_SIZE;
+
+    while (info->FileName[name_len] != 0) {
+        name_len++;
+    }
+
+    if (EFI_ERROR(utf16_to_utf8(name, sizeof(name) - 1, &out_len, info->FileName, name_len * sizeof(CHAR16))))
+        return EFI_INVALID_PARAMETER;
+
+    name[out_len] = 0;
+
+    if (strchr(name, '\\') || strchr(name, '/'))
+        return EFI_UNSUPPORTED;
+
+    if (fstat(f->fd, &st) != 0)
+        return EFI_DEVICE_ERROR;
+
+    if (!f->is_dir && info->FileSize != (UINT64)st.st_size && ftruncate(f->fd, info->FileSize) != 0)
+        return EFI_ACCESS_DENIED;
+
+    if (name[0] == 0 || !strcmp(name, basename_of(f)))
+        return EFI_SUCCESS;
+
+    new_path = malloc(strlen(f->path) + strlen(name) + 1);
+    if (!new_path)
+        return EFI_OUT_OF_RESOURCES;
+
+    strcpy(new_path, f->path);
+    strcpy(strrchr(new_path, '/') + 1, name);
+
+    if (rename(f->path, new_path) != 0) {
+        free(new_path);
+        return EFI_ACCESS_DENIED;
+    }
+
+    free(f->path);
+    f->path = new_path;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI file_flush(EFI_FILE_HANDLE File) {
+    (void)File;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS open_path(const char* root, const char* path, bool write, EFI_FILE_HANDLE* file) {
+    host_file* f;
+    struct stat st;
+    int fd;
+
+    if (stat(path, &st) != 0)
+        return EFI_NOT_FOUND;
+
+    if (S_ISDIR(st.st_mode))
+        fd = open(path, O_RDONLY | O_DIRECTORY);
+    else
+        fd = open(path, write ? O_RDWR : O_RDONLY);
+
+    if (fd == -1)
+        return EFI_ACCESS_DENIED;
+
+    f = calloc(1, sizeof(host_file));
+    if (!f) {
+        close(fd);
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    f->fd = fd;
+    f->root = strdup(root);
+    f->path = strdup(path);
+    f->is_dir = S_ISDIR(st.st_mode);
+
+    f->proto.Revision = EFI_FILE_PROTOCOL_REVISION;
+    f->proto.Open = file_open;
+    f->proto.Close = file_close;
+    f->proto.Delete = file_delete;
+    f->proto.Read = file_read;
+    f->proto.Write = file_write;
+    f->proto.GetPosition = file_get_position;
+    f->proto.SetPosition = file_set_position;
+    f->proto.GetInfo = file_get_info;
+    f->proto.SetInfo = file_set_info;
+    f->proto.Flush = file_flush;
+    f->proto.OpenEx = unsupported;
+    f->proto.ReadEx = unsupported;
+    f->proto.WriteEx = unsupported;
+    f->proto.FlushEx = unsupported;
+
+    host_counters.file_opens++;
+
+    *file = &f->proto;
+
+    return EFI_SUCCESS;
+}
+
+// Opens a host directory as if it were the root of a volume.
+EFI_STATUS host_open_dir(const char* path, EFI_FILE_HANDLE* dir) {
+    char* root = realpath(path, NULL);
+    EFI_STATUS Status;
+
+    if (!root)
+        return EFI_NOT_FOUND;
+
+    Status = open_path(root, root, true, dir);
+
+    free(root);
+
+    return Status;
+}
+
+// Opens a single host file, for reading.
+EFI_STATUS host_open_file(const char* path, EFI_FILE_HANDLE* file) {
+    char* full = realpath(path, NULL);
+    EFI_STATUS Status;
+    char* root;
+
+    if (!full)
+        return EFI_NOT_FOUND;
+
+    root = strdup(full);
+    *strrchr(root, '/') = 0;
+
+    Status = open_path(root[0] ? root : "/", full, false, file);
+
+    free(root);
+    free(full);
+
+    return Status;
+}
+
+void* host_get_protocol(EFI_HANDLE handle, const EFI_GUID* guid) {
+    protocol_entry* pe = find_protocol(handle, guid);
+
+    return pe ? pe->interface : NULL;
+}
@@ -0,0 +1,61 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// The pieces of firmware the host builds of Quibble run on: boot services backed by
+// malloc and mmap, and file handles backed by the host's filesystem. Everything they do
+// is counted in host_counters.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "efi/efihost.h"
+
+typedef struct {
+    uint64_t pool_allocs;
+    uint64_t pool_bytes;
+    uint64_t pool_frees;
+    uint64_t page_allocs;
+    uint64_t pages;
+    uint64_t page_frees;
+    uint64_t pages_in_use;
+    uint64_t peak_pages;
+    uint64_t file_opens;
+    uint64_t file_reads;
+    uint64_t file_read_bytes;
+} host_stats;
+
+extern host_stats host_counters;
+extern EFI_BOOT_SERVICES host_bs;
+extern EFI_SYSTEM_TABLE host_systable;
+extern EFI_HANDLE host_image_handle;
+
+void host_init(void);
+void host_reset_counters(void);
+void host_print_counters(const char* prefix);
+EFI_STATUS host_open_dir(const char* path, EFI_FILE_HANDLE* dir);
+EFI_STATUS host_open_file(const char* path, EFI_FILE_HANDLE* file);
+void* host_get_protocol(EFI_HANDLE handle, const EFI_GUID* guid);
+
+static inline uint64_t host_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
@@ -0,0 +1,42 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Force-included when building Quibble's own sources for the host. misc.c provides the
+// string functions Quibble uses, some with different prototypes from the C library's,
+// so rename them to keep them apart from the host's.
+
+#pragma once
+
+#define memcmp quibble_memcmp
+#define memcpy quibble_memcpy
+#define memmove quibble_memmove
+#define memset quibble_memset
+#define memchr quibble_memchr
+#define strlen quibble_strlen
+#define strcmp quibble_strcmp
+#define strncmp quibble_strncmp
+#define strcpy quibble_strcpy
+#define strcat quibble_strcat
+#define strstr quibble_strstr
+#define strtol quibble_strtol
+#define stpcpy quibble_stpcpy
+#define wcslen quibble_wcslen
+#define wcsncpy quibble_wcsncpy
+#define wcsncat quibble_wcsncat
+#define wcsicmp quibble_wcsicmp
+#define stricmp quibble_stricmp
+#define strnicmp quibble_strnicmp
@@ -0,0 +1,42 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// The C library as Quibble sees it - see misc.c.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+int memcmp(const void* s1, const void* s2, size_t n);
+void memcpy(void* dest, const void* src, size_t n);
+void memmove(void* dest, const void* src, size_t n);
+void* memset(void* s, int c, size_t n);
+void* memchr(const void* s, int c, size_t n);
+size_t strlen(const char* s);
+int strcmp(const char* s1, const char* s2);
+int strncmp(const char* s1, const char* s2, size_t n);
+char* strcpy(char* dest, const char* src);
+char* strcat(char* dest, const char* src);
+char* strstr(const char* haystack, const char* needle);
+long int strtol(const char* nptr, char** endptr, int base);
+size_t wcslen(const uint16_t* s);
+void wcsncpy(uint16_t* dest, const uint16_t* src, size_t n);
+void wcsncat(uint16_t* dest, const uint16_t* src, size_t n);
+int wcsicmp(const uint16_t* s1, const uint16_t* s2);
+int stricmp(const char* s1, const char* s2);
+int strnicmp(const char* s1, const char* s2, int n);
@@ -0,0 +1,342 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Exhaustive tests and a benchmark for the memcpy, memset, memcmp, and memmove in misc.c.
+// misc.c is included directly, so that each test can be run with rep movsb / rep stosb
+// turned off, used above 128 bytes as with ERMSB, and used for everything as with FSRM.
+
+#include "../quibble/src/misc.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include "host.h"
+
+#define MAX_SIZE 65536
+#define MAX_ALIGN 16
+#define GUARD 64
+#define SMALL_SIZE 1024 // every alignment is tried up to this, beyond it one per size
+#define MAX_DISTANCE 80 // for overlapping memmoves
+
+#define BUF_SIZE (GUARD + MAX_DISTANCE + MAX_ALIGN + MAX_SIZE + MAX_DISTANCE + GUARD)
+
+static const struct {
+    const char* name;
+    size_t threshold;
+} modes[] = {
+    { "no rep", (size_t)-1 },
+    { "ERMSB", 128 },
+    { "FSRM", 1 },
+};
+
+static uint8_t* src_buf;
+static uint8_t* dest_buf;
+static uint8_t* ref_buf;
+static uint8_t* poison_buf;
+static unsigned int failures;
+
+static void fail(const char* func, const char* mode, size_t size, unsigned int src_align, unsigned int dest_align,
+                 const char* what) {
+    if (failures < 20) {
+        printf("FAIL: %s (%s), size %zu, alignments %u/%u: %s\n", func, mode, size, src_align, dest_align,
+               what);
+    }
+
+    failures++;
+}
+
+static void fill_random(uint8_t* buf, size_t size, uint32_t seed) {
+    for (size_t i = 0; i < size; i++) {
+        seed = (seed * 1103515245) + 12345;
+        buf[i] = (uint8_t)(seed >> 16);
+    }
+}
+
+// The checks use the host's memcpy and memcmp, rather than the ones being tested.
+
+static void poison(uint8_t* buf, size_t size) {
+    __builtin_memcpy(buf, poison_buf, size);
+}
+
+static bool is_poisoned(const uint8_t* buf, size_t off, size_t size) {
+    return __builtin_memcmp(buf + off, poison_buf + off, size) == 0;
+}
+
+static bool same(const uint8_t* a, const uint8_t* b, size_t size) {
+    return __builtin_memcmp(a, b, size) == 0;
+}
+
+static void test_memcpy_one(const char* mode, size_t size, unsigned int src_align, unsigned int dest_align) {
+    uint8_t* src = src_buf + GUARD + src_align;
+    uint8_t* dest = dest_buf + GUARD + dest_align;
+
+    poison(dest_buf, GUARD + dest_align + size + GUARD);
+
+    memcpy(dest, src, size);
+
+    if (!same(dest, src, size))
+        fail("memcpy", mode, size, src_align, dest_align, "data wrong");
+
+    if (!is_poisoned(dest_buf, 0, GUARD + dest_align) || !is_poisoned(dest_buf, GUARD + dest_align + size, GUARD))
+        fail("memcpy", mode, size, src_align, dest_align, "wrote outside buffer");
+}
+
+static void test_memset_one(const char* mode, size_t size, unsigned int dest_align, int c) {
+    uint8_t* dest = dest_buf + GUARD + dest_align;
+
+    poison(dest_buf, GUARD + dest_align + size + GUARD);
+
+    if (memset(dest, c, size) != dest)
+        fail("memset", mode, size, 0, dest_align, "wrong return value");
+
+    // every byte is the same as the one after it, and the first is right
+    if (size > 0 && (dest[0] != (uint8_t)c || !same(dest, dest + 1, size - 1)))
+        fail("memset", mode, size, 0, dest_align, "data wrong");
+
+    if (!is_poisoned(dest_buf, 0, GUARD + dest_align) || !is_poisoned(dest_buf, GUARD + dest_align + size, GUARD))
+        fail("memset", mode, size, 0, dest_align, "wrote outside buffer");
+}
+
+static void test_memcmp_diff(const char* mode, size_t size, unsigned int src_align, unsigned int dest_align,
+                             size_t pos) {
+    uint8_t* a = src_buf + GUARD + src_align;
+    uint8_t* b = dest_buf + GUARD + dest_align;
+    uint8_t orig = b[pos];
+
+    // make sure the comparison is unsigned, and that it's the first difference which counts
+
+    a[pos] = 0x80;
+    b[pos] = 0x7f;
+
+    if (pos + 1 < size)
+        b[size - 1] ^= 0xff;
+
+    if (memcmp(a, b, size) != 1 || memcmp(b, a, size) != -1)
+        fail("memcmp", mode, size, src_align, dest_align, "wrong sign");
+
+    if (pos + 1 < size)
+        b[size - 1] ^= 0xff;
+
+    a[pos] = orig;
+    b[pos] = orig;
+}
+
+static void test_memcmp_one(const char* mode, size_t size, unsigned int src_align, unsigned int dest_align) {
+    uint8_t* a = src_buf + GUARD + src_align;
+    uint8_t* b = dest_buf + GUARD + dest_align;
+
+    __builtin_memcpy(b, a, size);
+
+    if (memcmp(a, b, size) != 0)
+        fail("memcmp", mode, size, src_align, dest_align, "equal buffers didn't compare equal");
+
+    if (size == 0)
+        return;
+
+    if (size <= 256) {
+        for (size_t pos = 0; pos < size; pos++) {
+            test_memcmp_diff(mode, size, src_align, dest_align, pos);
+        }
+    } else {
+        test_memcmp_diff(mode, size, src_align, dest_align, 0);
+        test_memcmp_diff(mode, size, src_align, dest_align, size / 2);
+        test_memcmp_diff(mode, size, src_align, dest_align, (size - 1) & ~15);
+        test_memcmp_diff(mode, size, src_align, dest_align, size - 1);
+    }
+
+    // bytes outside the range mustn't count
+
+    b[size - 1] ^= 0xff;
+
+    if (memcmp(a, b, size - 1) != 0)
+        fail("memcmp", mode, size, src_align, dest_align, "compared too much");
+
+    b[size - 1] ^= 0xff;
+}
+
+// Moves size bytes within one buffer, from offset align to offset align + distance.
+static void test_memmove_one(const char* mode, size_t size, unsigned int align, int distance) {
+    uint8_t* buf = dest_buf + GUARD + MAX_DISTANCE;
+    uint8_t* src = buf + align;
+    uint8_t* dest = src + distance;
+    size_t start = GUARD + MAX_DISTANCE + align + (distance < 0 ? distance : 0);
+    size_t span = size + (distance < 0 ? -distance : distance);
+    size_t len = GUARD + MAX_DISTANCE + MAX_ALIGN + size + MAX_DISTANCE + GUARD;
+
+    poison(dest_buf, len);
+    __builtin_memcpy(src, ref_buf + (size % 4096), size);
+
+    memmove(dest, src, size);
+
+    if (!same(dest, ref_buf + (size % 4096), size))
+        fail("memmove", mode, size, align, (unsigned int)(align + distance), "data wrong");
+
+    // anything not overwritten which wasn't part of src should still be poisoned
+
+    if (!is_poisoned(dest_buf, 0, start) || !is_poisoned(dest_buf, start + span, len - start - span))
+        fail("memmove", mode, size, align, (unsigned int)(align + distance), "wrote outside buffer");
+}
+
+static void run_tests(const char* mode) {
+    static const int fill_values[] = { 0, 0xff, 0x5a, 0x1c3 };
+
+    fill_random(src_buf, BUF_SIZE, 1);
+
+    for (size_t size = 0; size <= MAX_SIZE; size++) {
+        if (size <= SMALL_SIZE) {
+            for (unsigned int sa = 0; sa < MAX_ALIGN; sa++) {
+                for (unsigned int da = 0; da < MAX_ALIGN; da++) {
+                    test_memcpy_one(mode, size, sa, da);
+                    test_memcmp_one(mode, size, sa, da);
+                }
+
+                test_memset_one(mode, size, sa, fill_values[sa % (sizeof(fill_values) / sizeof(fill_values[0]))]);
+
+                for (int d = -MAX_DISTANCE; d <= MAX_DISTANCE; d += (size <= 128 ? 1 : 7)) {
+                    test_memmove_one(mode, size, sa, d);
+                }
+            }
+        } else {
+            unsigned int sa = size % MAX_ALIGN;
+            unsigned int da = (size / MAX_ALIGN) % MAX_ALIGN;
+            int d = (int)(size % (2 * MAX_DISTANCE + 1)) - MAX_DISTANCE;
+
+            test_memcpy_one(mode, size, sa, da);
+            test_memcmp_one(mode, size, sa, da);
+            test_memset_one(mode, size, da, fill_values[size % (sizeof(fill_values) / sizeof(fill_values[0]))]);
+            test_memmove_one(mode, size, sa, d);
+        }
+    }
+}
+
+static double bench_one(void (*func)(uint8_t* dest, uint8_t* src, size_t size), size_t size, unsigned int align) {
+    size_t iterations = (256 * 1024 * 1024) / (size < 64 ? 64 : size);
+    uint64_t start, end;
+
+    func(dest_buf + GUARD + align, src_buf + GUARD + align + (align ? 1 : 0), size); // warm up
+
+    start = host_ns();
+
+    for (size_t i = 0; i < iterations; i++) {
+        func(dest_buf + GUARD + align, src_buf + GUARD + align + (align ? 1 : 0), size);
+    }
+
+    end = host_ns();
+
+    return (double)(size * iterations) / (double)(end - start); // bytes per ns, i.e. GB/s
+}
+
+static void bench_memcpy(uint8_t* dest, uint8_t* src, size_t size) {
+    memcpy(dest, src, size);
+}
+
+static void bench_memset(uint8_t* dest, uint8_t* src, size_t size) {
+    memset(dest, src[0], size);
+}
+
+static void bench_memcmp(uint8_t* dest, uint8_t* src, size_t size) {
+    if (memcmp(dest, src, size) == 2)
+        abort();
+}
+
+static void bench_memmove(uint8_t* dest, uint8_t* src, size_t size) {
+    memmove(dest + 8, dest, size); // overlapping, so it has to go backwards
+}
+
+static void run_bench(void) {
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+    static const struct {
+        const char* name;
+        void (*func)(uint8_t* dest, uint8_t* src, size_t size);
+    } funcs[] = {
+        { "memcpy", bench_memcpy },
+        { "memset", bench_memset },
+        { "memcmp", bench_memcmp },
+        { "memmove", bench_memmove },
+    };
+
+    printf("%-8s %-7s %-9s", "", "", "");
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        printf(" %8zu", sizes[i]);
+    }
+    printf("   (GB/s)\n");
+
+    for (unsigned int f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++) {
+        for (unsigned int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            for (unsigned int align = 0; align <= 3; align += 3) {
+                rep_threshold = modes[m].threshold;
+
+                // memcmp needs equal buffers to run to the end
+                for (size_t i = 0; i < MAX_SIZE; i++) {
+                    dest_buf[GUARD + align + i] = src_buf[GUARD + align + (align ? 1 : 0) + i];
+                }
+
+                printf("%-8s %-7s %-9s", funcs[f].name, modes[m].name, align ? "unaligned" : "aligned");
+
+                for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+                    printf(" %8.2f", bench_one(funcs[f].func, sizes[i], align));
+                }
+
+                printf("\n");
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    bool bench = argc > 1 && !strcmp(argv[1], "bench");
+
+    src_buf = aligned_alloc(4096, BUF_SIZE + 4096);
+    dest_buf = aligned_alloc(4096, BUF_SIZE + 4096);
+    ref_buf = aligned_alloc(4096, BUF_SIZE + 4096);
+
+    poison_buf = aligned_alloc(4096, BUF_SIZE + 4096);
+
+    if (!src_buf || !dest_buf || !ref_buf || !poison_buf) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < BUF_SIZE; i++) {
+        poison_buf[i] = (uint8_t)(0xa5 ^ i ^ (i >> 8));
+    }
+
+    fill_random(ref_buf, BUF_SIZE, 2);
+
+    if (bench) {
+        fill_random(src_buf, BUF_SIZE, 1);
+        run_bench();
+        return 0;
+    }
+
+    for (unsigned int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        uint64_t start = host_ns();
+
+        rep_threshold = modes[m].threshold;
+
+        run_tests(modes[m].name);
+
+        printf("%s: done in %.1f s\n", modes[m].name, (double)(host_ns() - start) / 1e9);
+    }
+
+    if (failures != 0) {
+        printf("%u failures.\n", failures);
+        return 1;
+    }
+
+    printf("All tests passed.\n");
+
+    return 0;
+}
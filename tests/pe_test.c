@@ -0,0 +1,520 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Tests and benchmarks for loading images - peload.c, apiset.c, and images.c - run against
+// synthetic System32 directories from pegen.c or against copies of real Windows directories.
+//
+//   pe_test check              load generated directories, and check every import and
+//                              relocated pointer ends up where it should
+//   pe_test bench [windir...]  time each phase of loading the images of a boot, from each
+//                              Windows directory, or from generated ones
+//
+// The replay is in replay.c. The boot drivers of a real Windows directory come from its SYSTEM
+// hive, in the order they're enumerated rather than by group.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include "host.h"
+#include "pegen.h"
+#include "replay.h"
+#include "quibble.h"
+#include "peload.h"
+#include "x86.h"
+#include "reg.h"
+#include "misc.h"
+#include "print.h"
+
+#define MAX_FAILURES 20
+#define BENCH_RUNS 5
+
+static EFI_BOOT_SERVICES* bs = &host_bs;
+static EFI_PE_LOADER_PROTOCOL* pe;
+static EFI_REGISTRY_PROTOCOL* reg;
+static unsigned int failures;
+
+static const load_mode modes[] = {
+    { "relocate on load", false, false },
+    { "deferred relocations", true, false },
+    { "hashing files", true, true },
+};
+
+static void fail(const char* fmt, ...) {
+    va_list ap;
+
+    failures++;
+
+    if (failures > MAX_FAILURES)
+        return;
+
+    va_start(ap, fmt);
+    printf("FAIL: ");
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+
+    if (failures == MAX_FAILURES)
+        printf("(not showing any more failures)\n");
+}
+
+// for messages
+static const char* narrow(const WCHAR* w, char* buf, size_t size) {
+    unsigned int i;
+
+    for (i = 0; w[i] != 0 && i + 1 < size; i++) {
+        buf[i] = w[i] >= 0x20 && w[i] < 0x7f ? (char)w[i] : '?';
+    }
+
+    buf[i] = 0;
+
+    return buf;
+}
+
+static void widen(const char* s, WCHAR* w) {
+    while (*s) {
+        *w = (uint8_t)*s;
+        w++;
+        s++;
+    }
+
+    *w = 0;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+
+    return remove(path);
+}
+
+static void remove_tree(const char* path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// What file.c provides to the replay, apiset.c and images.c. The host's file handles don't
+// care about case, so open_file's first Open always works.
+
+EFI_STATUS open_file(EFI_FILE_HANDLE dir, EFI_FILE_HANDLE* h, const WCHAR* name) {
+    return dir->Open(dir, h, (WCHAR*)name, EFI_FILE_MODE_READ, 0);
+}
+
+// checks
+
+static image* find_image_at(LIST_ENTRY* images, uint64_t addr) {
+    LIST_ENTRY* le = images->Flink;
+
+    while (le != images) {
+        image* img = _CR(le, image, list_entry);
+
+        if (addr >= (uintptr_t)img->va && addr < (uintptr_t)img->va + img->img->GetSize(img->img))
+            return img;
+
+        le = le->Flink;
+    }
+
+    return NULL;
+}
+
+// Goes through the .qtest section of each generated image, checking that every import address
+// table slot and relocated pointer points to a function with the right ID.
+static void check_pointers(LIST_ENTRY* images, const char* label) {
+    LIST_ENTRY* le = images->Flink;
+    char name[MAX_PATH];
+
+    while (le != images) {
+        image* img = _CR(le, image, list_entry);
+        IMAGE_SECTION_HEADER* sections;
+        UINTN num_sections;
+
+        if (EFI_ERROR(img->img->GetSections(img->img, &sections, &num_sections))) {
+            fail("%s: GetSections failed for %s", label, narrow(img->name, name, sizeof(name)));
+            le = le->Flink;
+            continue;
+        }
+
+        for (unsigned int i = 0; i < num_sections; i++) {
+            pegen_check* checks;
+            unsigned int num_checks;
+
+            if (__builtin_memcmp(sections[i].Name, PEGEN_SECTION, sizeof(PEGEN_SECTION)))
+                continue;
+
+            checks = (pegen_check*)((uint8_t*)img->img->Data + sections[i].VirtualAddress);
+            num_checks = sections[i].VirtualSize / sizeof(pegen_check);
+
+            for (unsigned int j = 0; j < num_checks; j++) {
+                uint64_t addr = *(uint64_t*)((uint8_t*)img->img->Data + checks[j].slot);
+                image* target = find_image_at(images, addr);
+                uint64_t id;
+
+                if (!target) {
+                    fail("%s: %s+%x points to %" PRIx64 ", which isn't in any image", label,
+                         narrow(img->name, name, sizeof(name)), checks[j].slot, addr);
+                    continue;
+                }
+
+                id = *(uint64_t*)((uint8_t*)target->img->Data + (addr - (uintptr_t)target->va));
+
+                if (id != checks[j].id) {
+                    char name2[MAX_PATH];
+
+                    fail("%s: %s+%x points to %s+%" PRIx64 ", which is the wrong function", label,
+                         narrow(img->name, name, sizeof(name)), checks[j].slot,
+                         narrow(target->name, name2, sizeof(name2)), addr - (uintptr_t)target->va);
+                }
+            }
+        }
+
+        le = le->Flink;
+    }
+}
+
+// The images loaded have to be exactly those pegen.c says a boot needs, with the kernel and
+// HAL first and the rest in the order of the drivers that brought them in.
+static void check_image_list(LIST_ENTRY* images, const pegen_result* gen, const char* label) {
+    LIST_ENTRY* le;
+    unsigned int count = 0, last_order = 0;
+    bool* seen = calloc(gen->num_images, sizeof(bool));
+    char name[MAX_PATH];
+
+    le = images->Flink;
+    while (le != images) {
+        image* img = _CR(le, image, list_entry);
+        unsigned int i;
+
+        narrow(img->name, name, sizeof(name));
+
+        for (char* c = name; *c; c++) {
+            if (*c >= 'A' && *c <= 'Z')
+                *c = *c - 'A' + 'a';
+        }
+
+        if (count == 0 && strcmp(name, "ntoskrnl.exe"))
+            fail("%s: first image was %s, not ntoskrnl.exe", label, name);
+        else if (count == 1 && strcmp(name, "hal.dll"))
+            fail("%s: second image was %s, not hal.dll", label, name);
+        else if (count > 1) {
+            if (img->order < last_order)
+                fail("%s: %s (order %u) came after an image with order %u", label, name, img->order, last_order);
+
+            last_order = img->order;
+        }
+
+        for (i = 0; i < gen->num_images; i++) {
+            if (!strcmp(name, gen->images[i]))
+                break;
+        }
+
+        if (i == gen->num_images)
+            fail("%s: %s was loaded, but shouldn't have been", label, name);
+        else if (seen[i])
+            fail("%s: %s was loaded twice", label, name);
+        else
+            seen[i] = true;
+
+        count++;
+        le = le->Flink;
+    }
+
+    for (unsigned int i = 0; i < gen->num_images; i++) {
+        if (!seen[i])
+            fail("%s: %s wasn't loaded", label, gen->images[i]);
+    }
+
+    free(seen);
+}
+
+typedef struct {
+    const char* label;
+    pegen_params params;
+} gen_scenario;
+
+static const gen_scenario check_scenarios[] = {
+    { "Windows 10", { _WIN32_WINNT_WIN10, 40, 4, 2000, 40, 1 } },
+    { "Windows 7", { _WIN32_WINNT_WIN7, 20, 3, 600, 30, 2 } },
+    { "Windows 10, no libraries", { _WIN32_WINNT_WIN10, 10, 0, 300, 20, 3 } },
+};
+
+static const gen_scenario bench_scenarios[] = {
+    { "Windows 10, 150 boot drivers", { _WIN32_WINNT_WIN10, 150, 8, 3000, 80, 1 } },
+    { "Windows 10, 400 boot drivers", { _WIN32_WINNT_WIN10, 400, 16, 3000, 80, 2 } },
+};
+
+static bool generate(const char* tmp, unsigned int num, const gen_scenario* sc, char* windir, size_t windir_size,
+                     pegen_result* gen, boot_driver** drivers) {
+    char system32[4096];
+
+    snprintf(windir, windir_size, "%s/%u", tmp, num);
+    snprintf(system32, sizeof(system32), "%s/System32", windir);
+
+    mkdir(windir, 0755);
+
+    if (!pegen_write(system32, &sc->params, gen)) {
+        fail("%s: could not write images", sc->label);
+        return false;
+    }
+
+    *drivers = calloc(gen->num_drivers + 1, sizeof(boot_driver));
+
+    for (unsigned int i = 0; i < gen->num_drivers; i++) {
+        widen("System32\\drivers", (*drivers)[i].dir); // mixed case, as in real ImagePaths
+        widen(gen->driver_files[i], (*drivers)[i].file);
+    }
+
+    return true;
+}
+
+static void check_scenario(const char* tmp, unsigned int num, const gen_scenario* sc) {
+    char windir[4096], label[256];
+    pegen_result gen;
+    boot_driver* drivers;
+    EFI_FILE_HANDLE dir;
+    uint64_t checksum = 0;
+
+    if (!generate(tmp, num, sc, windir, sizeof(windir), &gen, &drivers))
+        return;
+
+    if (EFI_ERROR(host_open_dir(windir, &dir))) {
+        fail("%s: could not open %s", sc->label, windir);
+        goto end;
+    }
+
+    for (unsigned int i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        LIST_ENTRY images;
+        load_result res;
+        EFI_STATUS Status;
+
+        snprintf(label, sizeof(label), "%s, %s", sc->label, modes[i].label);
+
+        Status = replay_load(pe, dir, sc->params.version, drivers, gen.num_drivers, &modes[i], &images, &res);
+
+        if (EFI_ERROR(Status))
+            fail("%s: loading returned %s", label, error_string(Status));
+        else {
+            check_image_list(&images, &gen, label);
+            check_pointers(&images, label);
+
+            // the images have to come out the same however they're loaded
+            if (i == 0)
+                checksum = res.checksum;
+            else if (res.checksum != checksum)
+                fail("%s: checksum %016" PRIx64 ", not %016" PRIx64 " as with %s", label, res.checksum, checksum,
+                     modes[0].label);
+
+            printf("%s: %u images, checksum %016" PRIx64 "\n", label, res.num_images, res.checksum);
+        }
+
+        free_images(&images, sc->params.version);
+    }
+
+    dir->Close(dir);
+
+end:
+    free(drivers);
+    pegen_free(&gen);
+}
+
+static int do_check(void) {
+    char tmp[] = "/tmp/pe_test.XXXXXX";
+    uint64_t pages_in_use;
+
+    if (!mkdtemp(tmp)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    print_quiet = true;
+    pages_in_use = host_counters.pages_in_use;
+
+    for (unsigned int i = 0; i < sizeof(check_scenarios) / sizeof(check_scenarios[0]); i++) {
+        check_scenario(tmp, i, &check_scenarios[i]);
+    }
+
+    print_quiet = false;
+
+    if (host_counters.pages_in_use != pages_in_use)
+        fail("%" PRIu64 " pages still in use after freeing the images", host_counters.pages_in_use - pages_in_use);
+
+    remove_tree(tmp);
+
+    if (failures > 0) {
+        printf("%u failures.\n", failures);
+        return 1;
+    }
+
+    printf("All tests passed.\n");
+
+    return 0;
+}
+
+// benchmarks
+
+static double ms(uint64_t ns) {
+    return (double)ns / 1000000.0;
+}
+
+static void bench_windir(EFI_FILE_HANDLE dir, const char* label, uint16_t version, const boot_driver* drivers,
+                         unsigned int num_drivers) {
+    for (unsigned int i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        load_result best;
+        host_stats counters;
+
+        memset(&best, 0, sizeof(best));
+
+        for (unsigned int run = 0; run < BENCH_RUNS; run++) {
+            LIST_ENTRY images;
+            load_result res;
+            EFI_STATUS Status;
+
+            host_reset_counters();
+
+            print_quiet = true;
+            Status = replay_load(pe, dir, version, drivers, num_drivers, &modes[i], &images, &res);
+            print_quiet = false;
+
+            counters = host_counters;
+
+            free_images(&images, res.version);
+
+            if (EFI_ERROR(Status)) {
+                fail("%s, %s: loading returned %s", label, modes[i].label, error_string(Status));
+                return;
+            }
+
+            if (run == 0 || res.total_ns < best.total_ns)
+                best = res;
+        }
+
+        printf("%s, %s: %u images, %.1f MB, checksum %016" PRIx64 "\n", label, modes[i].label, best.num_images,
+               (double)best.image_bytes / (1024.0 * 1024.0), best.checksum);
+        printf("  load %.2f ms, import discovery %.2f ms, relocation %.2f ms%s, resolution %.2f ms, total %.2f ms\n",
+               ms(best.load_ns), ms(best.imports_ns), ms(best.reloc_ns), modes[i].defer ? "" : " (in load)",
+               ms(best.resolve_ns), ms(best.total_ns));
+
+        // the counters from before the images were freed
+        {
+            host_stats saved = host_counters;
+
+            host_counters = counters;
+            host_print_counters("  ");
+            host_counters = saved;
+        }
+    }
+}
+
+static int do_bench(int argc, char** argv) {
+    char tmp[] = "/tmp/pe_test.XXXXXX";
+
+    if (argc > 0) {
+        for (int i = 0; i < argc; i++) {
+            EFI_FILE_HANDLE dir;
+            boot_driver* drivers;
+            unsigned int num_drivers;
+
+            if (EFI_ERROR(host_open_dir(argv[i], &dir))) {
+                printf("Could not open %s.\n", argv[i]);
+                failures++;
+                continue;
+            }
+
+            if (get_boot_drivers(reg, dir, &drivers, &num_drivers)) {
+                bench_windir(dir, argv[i], 0, drivers, num_drivers);
+                free(drivers);
+            } else
+                failures++;
+
+            dir->Close(dir);
+        }
+
+        return failures > 0 ? 1 : 0;
+    }
+
+    if (!mkdtemp(tmp)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < sizeof(bench_scenarios) / sizeof(bench_scenarios[0]); i++) {
+        const gen_scenario* sc = &bench_scenarios[i];
+        char windir[4096];
+        pegen_result gen;
+        boot_driver* drivers;
+        EFI_FILE_HANDLE dir;
+
+        if (!generate(tmp, i, sc, windir, sizeof(windir), &gen, &drivers))
+            break;
+
+        if (!EFI_ERROR(host_open_dir(windir, &dir))) {
+            bench_windir(dir, sc->label, sc->params.version, drivers, gen.num_drivers);
+            dir->Close(dir);
+        }
+
+        free(drivers);
+        pegen_free(&gen);
+    }
+
+    remove_tree(tmp);
+
+    return failures > 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    EFI_GUID pe_guid = PE_LOADER_PROTOCOL;
+    EFI_GUID reg_guid = WINDOWS_REGISTRY_PROTOCOL;
+    EFI_STATUS Status;
+
+    host_init();
+
+    Status = pe_register(bs, 0x12345678);
+    if (EFI_ERROR(Status)) {
+        printf("pe_register returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    Status = bs->LocateProtocol(&pe_guid, NULL, (void**)&pe);
+    if (EFI_ERROR(Status)) {
+        printf("LocateProtocol returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    Status = reg_register(bs);
+    if (EFI_ERROR(Status)) {
+        printf("reg_register returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    Status = bs->LocateProtocol(&reg_guid, NULL, (void**)&reg);
+    if (EFI_ERROR(Status)) {
+        printf("LocateProtocol returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    if (argc >= 2 && !strcmp(argv[1], "bench"))
+        return do_bench(argc - 2, argv + 2);
+    else if (argc == 1 || !strcmp(argv[1], "check"))
+        return do_check();
+
+    printf("Usage: pe_test [check | bench [windir...]]\n");
+
+    return 1;
+}
@@ -0,0 +1,929 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "pegen.h"
+#include "win.h"
+#include "peload.h"
+#include "peloaddef.h"
+
+#define SECTION_ALIGN 0x1000
+#define FUNC_SIZE 16 // the ID, then int3s
+#define INTERNAL_FUNCS 4 // functions that aren't exported, for relocated pointers to point to
+#define FORWARD_EVERY 16 // every 16th export of a library is forwarded
+#define API_SET_FILLER 200 // schema entries besides the one the images use
+#define API_SET_NAME "ext-ms-win-qtest-l1-1-0"
+#define NUM_DIRECTORIES 16
+#define IMAGE_DIRECTORY_ENTRY_IAT 12
+
+typedef struct {
+    unsigned int module;
+    char dll_name[64]; // as it appears in the import descriptor
+    unsigned int count;
+    unsigned int* exports;
+} gen_import;
+
+typedef struct {
+    char file[32];
+    char base[32]; // lower-case, without the extension - as used in forwarders
+    bool in_drivers;
+    bool dll;
+    unsigned int num_exports;
+    int* fwd_module; // -1 if the export isn't forwarded
+    unsigned int* fwd_index;
+    bool reverse_names; // name table not in order, so binary searches fail
+    gen_import* imports;
+    unsigned int num_imports;
+    uint32_t file_align;
+    uint32_t text_pad; // bytes of filler after the functions, so images are a realistic size
+    uint64_t image_base;
+    bool loaded;
+} gen_module;
+
+typedef struct {
+    uint8_t* data;
+    uint32_t size;
+    uint32_t alloc;
+} buffer;
+
+static uint32_t rng_state;
+
+static uint32_t rng(void) {
+    // xorshift32
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+
+    return rng_state;
+}
+
+static void* xalloc(size_t size) {
+    void* p = calloc(1, size);
+
+    if (!p) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    return p;
+}
+
+static char* xstrdup(const char* s) {
+    char* t = xalloc(strlen(s) + 1);
+
+    memcpy(t, s, strlen(s) + 1);
+
+    return t;
+}
+
+static uint32_t align_up(uint32_t v, uint32_t align) {
+    return (v + align - 1) & ~(align - 1);
+}
+
+// Appends size bytes, zeroes if data is NULL, and returns where they went.
+static uint32_t buf_add(buffer* b, const void* data, uint32_t size) {
+    uint32_t off = b->size;
+
+    if (b->size + size > b->alloc) {
+        uint32_t new_alloc = b->alloc == 0 ? 0x1000 : b->alloc;
+
+        while (new_alloc < b->size + size) {
+            new_alloc *= 2;
+        }
+
+        b->data = realloc(b->data, new_alloc);
+        if (!b->data) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+
+        b->alloc = new_alloc;
+    }
+
+    if (data)
+        memcpy(b->data + off, data, size);
+    else
+        memset(b->data + off, 0, size);
+
+    b->size += size;
+
+    return off;
+}
+
+static uint32_t buf_add_string(buffer* b, const char* s) {
+    return buf_add(b, s, strlen(s) + 1);
+}
+
+static void buf_align(buffer* b, uint32_t align) {
+    buf_add(b, NULL, align_up(b->size, align) - b->size);
+}
+
+static void put16(buffer* b, uint32_t off, uint16_t v) {
+    memcpy(b->data + off, &v, sizeof(v));
+}
+
+static void put32(buffer* b, uint32_t off, uint32_t v) {
+    memcpy(b->data + off, &v, sizeof(v));
+}
+
+static void put64(buffer* b, uint32_t off, uint64_t v) {
+    memcpy(b->data + off, &v, sizeof(v));
+}
+
+static uint64_t fnv64(const char* s) {
+    uint64_t hash = 0xcbf29ce484222325;
+
+    while (*s) {
+        hash ^= (uint8_t)*s;
+        hash *= 0x100000001b3;
+        s++;
+    }
+
+    return hash;
+}
+
+// Names sort in the order of their indices, unless the module has reverse_names set.
+static void export_name(const gen_module* m, unsigned int i, char* s) {
+    static const char* prefixes[] = { "Ex", "Io", "Ke", "Mm", "Ob", "Ps", "Rtl", "Zw" };
+
+    sprintf(s, "%s%05u", prefixes[i * 8 / m->num_exports], i);
+}
+
+// position of an export in the name table, which is what the hint is
+static unsigned int name_slot(const gen_module* m, unsigned int i) {
+    return m->reverse_names ? m->num_exports - 1 - i : i;
+}
+
+static uint64_t export_id(const gen_module* modules, unsigned int mod, unsigned int i) {
+    char s[100], name[32];
+
+    while (modules[mod].fwd_module[i] != -1) {
+        unsigned int next = modules[mod].fwd_module[i];
+
+        i = modules[mod].fwd_index[i];
+        mod = next;
+    }
+
+    export_name(&modules[mod], i, name);
+    sprintf(s, "%s!%s", modules[mod].file, name);
+
+    return fnv64(s);
+}
+
+static uint64_t internal_id(const gen_module* m, unsigned int i) {
+    char s[100];
+
+    sprintf(s, "%s!#%u", m->file, i);
+
+    return fnv64(s);
+}
+
+static void init_module(gen_module* m, const char* file, bool in_drivers, bool dll, unsigned int num_exports,
+                        uint64_t image_base, uint32_t text_pad) {
+    unsigned int i;
+
+    strcpy(m->file, file);
+
+    for (i = 0; file[i] != 0 && file[i] != '.'; i++) {
+        m->base[i] = file[i] >= 'A' && file[i] <= 'Z' ? file[i] - 'A' + 'a' : file[i];
+    }
+
+    m->base[i] = 0;
+
+    m->in_drivers = in_drivers;
+    m->dll = dll;
+    m->num_exports = num_exports;
+    m->fwd_module = xalloc((num_exports + 1) * sizeof(int));
+    m->fwd_index = xalloc((num_exports + 1) * sizeof(unsigned int));
+    m->imports = xalloc(8 * sizeof(gen_import));
+    m->image_base = image_base;
+    m->text_pad = text_pad;
+    m->file_align = (rng() & 1) ? 0x200 : SECTION_ALIGN;
+
+    for (i = 0; i < num_exports; i++) {
+        m->fwd_module[i] = -1;
+    }
+}
+
+// Imports count functions from module mod, spread over its exports. If forwarded is set,
+// some of them will be exports that are forwarded elsewhere.
+static void add_import(gen_module* modules, gen_module* m, unsigned int mod, const char* dll_name, unsigned int count,
+                       bool forwarded) {
+    gen_import* imp = &m->imports[m->num_imports];
+    unsigned int n = modules[mod].num_exports;
+
+    imp->module = mod;
+    strcpy(imp->dll_name, dll_name);
+    imp->count = count;
+    imp->exports = xalloc(count * sizeof(unsigned int));
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (forwarded && i % 4 == 0)
+            imp->exports[i] = ((rng() % n) / FORWARD_EVERY) * FORWARD_EVERY;
+        else
+            imp->exports[i] = rng() % n;
+    }
+
+    m->num_imports++;
+}
+
+static bool write_file(const char* path, const void* data, size_t size) {
+    FILE* f = fopen(path, "wb");
+
+    if (!f) {
+        fprintf(stderr, "Could not create %s.\n", path);
+        return false;
+    }
+
+    if (fwrite(data, 1, size, f) != size) {
+        fprintf(stderr, "Could not write %s.\n", path);
+        fclose(f);
+        return false;
+    }
+
+    fclose(f);
+
+    return true;
+}
+
+typedef struct {
+    const char* name;
+    buffer* b;
+    uint32_t vsize;
+    uint32_t characteristics;
+} gen_section;
+
+// Lays out the sections after the headers, and writes the whole file.
+static bool write_image(const char* path, const gen_module* m, gen_section* sections, unsigned int num_sections,
+                        const IMAGE_DATA_DIRECTORY* dirs, uint32_t entry_point) {
+    buffer file = { 0 };
+    IMAGE_DOS_HEADER* dos;
+    IMAGE_NT_HEADERS* nt;
+    IMAGE_OPTIONAL_HEADER64* opt;
+    IMAGE_SECTION_HEADER* sh;
+    uint32_t nt_off = sizeof(IMAGE_DOS_HEADER), header_size, rva, image_size;
+    uint32_t opt_size = sizeof(IMAGE_OPTIONAL_HEADER64) + (NUM_DIRECTORIES * sizeof(IMAGE_DATA_DIRECTORY));
+    bool ret;
+
+    header_size = align_up(nt_off + offsetof(IMAGE_NT_HEADERS, OptionalHeader64) + opt_size +
+                           (num_sections * sizeof(IMAGE_SECTION_HEADER)), m->file_align);
+
+    buf_add(&file, NULL, header_size);
+
+    // sections are placed one after the other, both in memory and in the file
+
+    rva = SECTION_ALIGN;
+
+    for (unsigned int i = 0; i < num_sections; i++) {
+        sh = (IMAGE_SECTION_HEADER*)(file.data + nt_off + offsetof(IMAGE_NT_HEADERS, OptionalHeader64) + opt_size +
+                                     (i * sizeof(IMAGE_SECTION_HEADER)));
+
+        memcpy(sh->Name, sections[i].name, strlen(sections[i].name));
+        sh->VirtualSize = sections[i].vsize;
+        sh->VirtualAddress = rva;
+        sh->SizeOfRawData = align_up(sections[i].b->size, m->file_align);
+        sh->PointerToRawData = sh->SizeOfRawData == 0 ? 0 : file.size;
+        sh->Characteristics = sections[i].characteristics;
+
+        buf_add(&file, sections[i].b->data, sections[i].b->size);
+        buf_align(&file, m->file_align);
+
+        rva = align_up(rva + sections[i].vsize, SECTION_ALIGN);
+    }
+
+    image_size = rva;
+
+    dos = (IMAGE_DOS_HEADER*)file.data;
+    dos->e_magic = IMAGE_DOS_SIGNATURE;
+    dos->e_lfanew = nt_off;
+
+    nt = (IMAGE_NT_HEADERS*)(file.data + nt_off);
+    nt->Signature = IMAGE_NT_SIGNATURE;
+    nt->FileHeader.Machine = IMAGE_FILE_MACHINE_AMD64;
+    nt->FileHeader.NumberOfSections = num_sections;
+    nt->FileHeader.SizeOfOptionalHeader = opt_size;
+    nt->FileHeader.Characteristics = 0x0022 | (m->dll ? 0x2000 : 0); // executable, large address aware, DLL
+
+    opt = &nt->OptionalHeader64;
+    opt->Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+    opt->AddressOfEntryPoint = entry_point;
+    opt->BaseOfCode = SECTION_ALIGN;
+    opt->ImageBase = m->image_base;
+    opt->SectionAlignment = SECTION_ALIGN;
+    opt->FileAlignment = m->file_align;
+    opt->MajorOperatingSystemVersion = 10;
+    opt->MajorSubsystemVersion = 10;
+    opt->SizeOfImage = image_size;
+    opt->SizeOfHeaders = header_size;
+    opt->Subsystem = 1; // native
+    opt->NumberOfRvaAndSizes = NUM_DIRECTORIES;
+
+    memcpy(opt->DataDirectory, dirs, NUM_DIRECTORIES * sizeof(IMAGE_DATA_DIRECTORY));
+
+    ret = write_file(path, file.data, file.size);
+
+    free(file.data);
+
+    return ret;
+}
+
+static bool write_module(const char* system32, const gen_module* modules, unsigned int mod) {
+    const gen_module* m = &modules[mod];
+    buffer text = { 0 }, rdata = { 0 }, data = { 0 }, qtest = { 0 }, reloc = { 0 };
+    IMAGE_DATA_DIRECTORY dirs[NUM_DIRECTORIES];
+    unsigned int num_funcs = INTERNAL_FUNCS, num_pointers, f;
+    unsigned int* export_func;
+    uint32_t text_rva, rdata_rva, data_rva, qtest_rva, reloc_rva, desc_off = 0, ptr_off;
+    uint32_t* ilt_off = NULL;
+    uint32_t* iat_off = NULL;
+    char path[1024], name[32], s[100];
+    gen_section sections[5];
+    bool ret;
+
+    memset(dirs, 0, sizeof(dirs));
+
+    // .text - each function that isn't forwarded, and the ones that aren't exported, then filler
+
+    export_func = xalloc((m->num_exports + 1) * sizeof(unsigned int));
+
+    for (unsigned int i = 0; i < m->num_exports; i++) {
+        if (m->fwd_module[i] == -1) {
+            export_func[i] = num_funcs - INTERNAL_FUNCS;
+            num_funcs++;
+        }
+    }
+
+    f = 0;
+    for (unsigned int i = 0; i < m->num_exports; i++) {
+        if (m->fwd_module[i] == -1) {
+            uint64_t id = export_id(modules, mod, i);
+
+            buf_add(&text, &id, sizeof(id));
+            buf_add(&text, "\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc", FUNC_SIZE - sizeof(id));
+            f++;
+        }
+    }
+
+    for (unsigned int i = 0; i < INTERNAL_FUNCS; i++) {
+        uint64_t id = internal_id(m, i);
+
+        buf_add(&text, &id, sizeof(id));
+        buf_add(&text, "\xcc\xcc\xcc\xcc\xcc\xcc\xcc\xcc", FUNC_SIZE - sizeof(id));
+    }
+
+    for (uint32_t i = 0; i < m->text_pad; i += sizeof(uint32_t)) {
+        uint32_t r = rng();
+
+        buf_add(&text, &r, sizeof(r));
+    }
+
+    text_rva = SECTION_ALIGN;
+    rdata_rva = align_up(text_rva + text.size, SECTION_ALIGN);
+
+    // .rdata - the export directory, then the import descriptors and their lookup tables
+
+    if (m->num_exports > 0) {
+        uint32_t exp_off, funcs_off, names_off, ords_off, modname_off;
+        IMAGE_EXPORT_DIRECTORY ed;
+
+        exp_off = buf_add(&rdata, NULL, sizeof(IMAGE_EXPORT_DIRECTORY));
+        funcs_off = buf_add(&rdata, NULL, m->num_exports * sizeof(uint32_t));
+        names_off = buf_add(&rdata, NULL, m->num_exports * sizeof(uint32_t));
+        ords_off = buf_add(&rdata, NULL, m->num_exports * sizeof(uint16_t));
+        modname_off = buf_add_string(&rdata, m->file);
+
+        for (unsigned int i = 0; i < m->num_exports; i++) {
+            uint32_t off;
+
+            export_name(m, i, name);
+            off = buf_add_string(&rdata, name);
+
+            put32(&rdata, names_off + (name_slot(m, i) * sizeof(uint32_t)), rdata_rva + off);
+            put16(&rdata, ords_off + (name_slot(m, i) * sizeof(uint16_t)), i);
+        }
+
+        for (unsigned int i = 0; i < m->num_exports; i++) {
+            if (m->fwd_module[i] != -1) {
+                uint32_t off;
+
+                export_name(&modules[m->fwd_module[i]], m->fwd_index[i], name);
+                sprintf(s, "%s.%s", modules[m->fwd_module[i]].base, name);
+                off = buf_add_string(&rdata, s);
+
+                put32(&rdata, funcs_off + (i * sizeof(uint32_t)), rdata_rva + off);
+            } else
+                put32(&rdata, funcs_off + (i * sizeof(uint32_t)), text_rva + (export_func[i] * FUNC_SIZE));
+        }
+
+        memset(&ed, 0, sizeof(ed));
+        ed.Name = rdata_rva + modname_off;
+        ed.Base = 1;
+        ed.NumberOfFunctions = m->num_exports;
+        ed.NumberOfNames = m->num_exports;
+        ed.AddressOfFunctions = rdata_rva + funcs_off;
+        ed.AddressOfNames = rdata_rva + names_off;
+        ed.AddressOfNameOrdinals = rdata_rva + ords_off;
+        memcpy(rdata.data + exp_off, &ed, sizeof(ed));
+
+        dirs[IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress = rdata_rva + exp_off;
+        dirs[IMAGE_DIRECTORY_ENTRY_EXPORT].Size = rdata.size - exp_off;
+    }
+
+    if (m->num_imports > 0) {
+        buf_align(&rdata, 8);
+
+        desc_off = buf_add(&rdata, NULL, (m->num_imports + 1) * sizeof(IMAGE_IMPORT_DESCRIPTOR));
+
+        dirs[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress = rdata_rva + desc_off;
+        dirs[IMAGE_DIRECTORY_ENTRY_IMPORT].Size = (m->num_imports + 1) * sizeof(IMAGE_IMPORT_DESCRIPTOR);
+
+        ilt_off = xalloc(m->num_imports * sizeof(uint32_t));
+        iat_off = xalloc(m->num_imports * sizeof(uint32_t));
+
+        for (unsigned int j = 0; j < m->num_imports; j++) {
+            ilt_off[j] = buf_add(&rdata, NULL, (m->imports[j].count + 1) * sizeof(uint64_t));
+        }
+
+        for (unsigned int j = 0; j < m->num_imports; j++) {
+            const gen_import* imp = &m->imports[j];
+            const gen_module* m2 = &modules[imp->module];
+            uint32_t off;
+
+            for (unsigned int k = 0; k < imp->count; k++) {
+                unsigned int e = imp->exports[k];
+
+                if (k % 11 == 10) // by ordinal
+                    put64(&rdata, ilt_off[j] + (k * sizeof(uint64_t)), 0x8000000000000000 | (e + 1));
+                else {
+                    uint16_t hint = k % 5 == 4 ? 0 : name_slot(m2, e); // some hints are stale
+
+                    buf_align(&rdata, 2);
+                    off = buf_add(&rdata, &hint, sizeof(hint));
+                    export_name(m2, e, name);
+                    buf_add_string(&rdata, name);
+
+                    put64(&rdata, ilt_off[j] + (k * sizeof(uint64_t)), rdata_rva + off);
+                }
+            }
+
+            off = buf_add_string(&rdata, imp->dll_name);
+
+            put32(&rdata, desc_off + (j * sizeof(IMAGE_IMPORT_DESCRIPTOR)) + offsetof(IMAGE_IMPORT_DESCRIPTOR, Characteristics),
+                  rdata_rva + ilt_off[j]);
+            put32(&rdata, desc_off + (j * sizeof(IMAGE_IMPORT_DESCRIPTOR)) + offsetof(IMAGE_IMPORT_DESCRIPTOR, Name),
+                  rdata_rva + off);
+        }
+    }
+
+    buf_add(&rdata, NULL, 1); // no empty sections
+    data_rva = align_up(rdata_rva + rdata.size, SECTION_ALIGN);
+
+    // .data - the import address tables, which start off as copies of the lookup tables,
+    // then pointers to our own functions which need relocating
+
+    for (unsigned int j = 0; j < m->num_imports; j++) {
+        iat_off[j] = buf_add(&data, rdata.data + ilt_off[j], (m->imports[j].count + 1) * sizeof(uint64_t));
+
+        put32(&rdata, desc_off + (j * sizeof(IMAGE_IMPORT_DESCRIPTOR)) + offsetof(IMAGE_IMPORT_DESCRIPTOR, FirstThunk),
+              data_rva + iat_off[j]);
+    }
+
+    if (m->num_imports > 0) {
+        dirs[IMAGE_DIRECTORY_ENTRY_IAT].VirtualAddress = data_rva;
+        dirs[IMAGE_DIRECTORY_ENTRY_IAT].Size = data.size;
+    }
+
+    num_pointers = 16 + (num_funcs / 8);
+
+    ptr_off = buf_add(&data, NULL, num_pointers * sizeof(uint64_t));
+
+    for (unsigned int i = 0; i < num_pointers; i++) {
+        put64(&data, ptr_off + (i * sizeof(uint64_t)), m->image_base + text_rva + (((i * 7) % num_funcs) * FUNC_SIZE));
+    }
+
+    qtest_rva = align_up(data_rva + data.size + 0x2000, SECTION_ALIGN); // .data has 8 KB not in the file
+
+    // .qtest - what each IAT slot and pointer should end up as
+
+    for (unsigned int j = 0; j < m->num_imports; j++) {
+        for (unsigned int k = 0; k < m->imports[j].count; k++) {
+            pegen_check c;
+
+            c.slot = data_rva + iat_off[j] + (k * sizeof(uint64_t));
+            c.reserved = 0;
+            c.id = export_id(modules, m->imports[j].module, m->imports[j].exports[k]);
+
+            buf_add(&qtest, &c, sizeof(c));
+        }
+    }
+
+    for (unsigned int i = 0; i < num_pointers; i++) {
+        pegen_check c;
+        unsigned int target = (i * 7) % num_funcs;
+
+        c.slot = data_rva + ptr_off + (i * sizeof(uint64_t));
+        c.reserved = 0;
+
+        if (target < num_funcs - INTERNAL_FUNCS) {
+            uint64_t id;
+
+            memcpy(&id, text.data + (target * FUNC_SIZE), sizeof(id));
+            c.id = id;
+        } else
+            c.id = internal_id(m, target - (num_funcs - INTERNAL_FUNCS));
+
+        buf_add(&qtest, &c, sizeof(c));
+    }
+
+    reloc_rva = align_up(qtest_rva + qtest.size, SECTION_ALIGN);
+
+    // .reloc - a block for each page the pointers are on, padded with an ABSOLUTE
+
+    {
+        uint32_t i = 0;
+
+        while (i < num_pointers) {
+            uint32_t page = (data_rva + ptr_off + (i * sizeof(uint64_t))) & ~0xfff;
+            uint32_t block_off = buf_add(&reloc, NULL, sizeof(IMAGE_BASE_RELOCATION));
+
+            while (i < num_pointers && ((data_rva + ptr_off + (i * sizeof(uint64_t))) & ~0xfff) == page) {
+                uint16_t entry = (IMAGE_REL_BASED_DIR64 << 12) | ((data_rva + ptr_off + (i * sizeof(uint64_t))) & 0xfff);
+
+                buf_add(&reloc, &entry, sizeof(entry));
+                i++;
+            }
+
+            buf_align(&reloc, sizeof(uint32_t));
+
+            put32(&reloc, block_off + offsetof(IMAGE_BASE_RELOCATION, VirtualAddress), page);
+            put32(&reloc, block_off + offsetof(IMAGE_BASE_RELOCATION, SizeOfBlock), reloc.size - block_off);
+        }
+
+        dirs[IMAGE_DIRECTORY_ENTRY_BASERELOC].VirtualAddress = reloc_rva;
+        dirs[IMAGE_DIRECTORY_ENTRY_BASERELOC].Size = reloc.size;
+    }
+
+    sections[0] = (gen_section){ ".text", &text, text.size, IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_READ };
+    sections[1] = (gen_section){ ".rdata", &rdata, rdata.size, IMAGE_SCN_MEM_READ };
+    sections[2] = (gen_section){ ".data", &data, data.size + 0x2000, IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_WRITE };
+    sections[3] = (gen_section){ PEGEN_SECTION, &qtest, qtest.size, IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_DISCARDABLE };
+    sections[4] = (gen_section){ ".reloc", &reloc, reloc.size, IMAGE_SCN_MEM_READ | IMAGE_SCN_MEM_DISCARDABLE };
+
+    sprintf(path, "%s/%s%s", system32, m->in_drivers ? "drivers/" : "", m->file);
+
+    ret = write_image(path, m, sections, 5, dirs, text_rva);
+
+    free(text.data);
+    free(rdata.data);
+    free(data.data);
+    free(qtest.data);
+    free(reloc.data);
+    free(export_func);
+    free(ilt_off);
+    free(iat_off);
+
+    return ret;
+}
+
+// length of a name up to its last hyphen, which is the part that gets hashed
+static unsigned int hashed_length(const char* name) {
+    unsigned int len = strlen(name);
+
+    while (len > 0 && name[len - 1] != '-') {
+        len--;
+    }
+
+    return len == 0 ? 0 : len - 1;
+}
+
+static uint32_t api_set_hash(const char* name, unsigned int len, uint32_t multiplier) {
+    uint32_t hash = 0;
+
+    for (unsigned int i = 0; i < len; i++) {
+        hash = (hash * multiplier) + (uint8_t)name[i];
+    }
+
+    return hash;
+}
+
+static uint32_t add_utf16(buffer* b, const char* s) {
+    uint32_t off = b->size;
+
+    while (*s) {
+        uint16_t c = (uint8_t)*s;
+
+        buf_add(b, &c, sizeof(c));
+        s++;
+    }
+
+    return off;
+}
+
+typedef struct {
+    char name[64];
+    const char* host;
+    uint32_t hash;
+    unsigned int index;
+} api_set_entry;
+
+static int compare_api_set_hashes(const void* a, const void* b) {
+    const api_set_entry* e1 = a;
+    const api_set_entry* e2 = b;
+
+    return e1->hash < e2->hash ? -1 : e1->hash > e2->hash ? 1 : 0;
+}
+
+// Writes ApiSetSchema.dll with a Windows 10 (version 6) schema, mapping API_SET_NAME to host.
+static bool write_api_set_schema(const char* system32, const char* host) {
+    static const uint32_t multiplier = 0x1f;
+    api_set_entry* entries = xalloc((API_SET_FILLER + 1) * sizeof(api_set_entry));
+    unsigned int count = API_SET_FILLER + 1;
+    buffer apiset = { 0 }, empty = { 0 };
+    API_SET_NAMESPACE_HEADER_10 header;
+    IMAGE_DATA_DIRECTORY dirs[NUM_DIRECTORIES];
+    gen_module m;
+    gen_section section;
+    char path[1024];
+    bool ret;
+
+    for (unsigned int i = 0; i < count; i++) {
+        if (i == API_SET_FILLER / 2) {
+            strcpy(entries[i].name, API_SET_NAME);
+            entries[i].host = host;
+        } else {
+            sprintf(entries[i].name, "ext-ms-win-qfill%03u-l1-1-0", i);
+            entries[i].host = "ntoskrnl.exe";
+        }
+
+        entries[i].index = i;
+        entries[i].hash = api_set_hash(entries[i].name, hashed_length(entries[i].name), multiplier);
+    }
+
+    memset(&header, 0, sizeof(header));
+    buf_add(&apiset, NULL, sizeof(header));
+
+    header.Version = 6;
+    header.Count = count;
+    header.HashMultiplier = multiplier;
+    header.ArrayOffset = buf_add(&apiset, NULL, count * sizeof(API_SET_NAMESPACE_ENTRY_10));
+    header.HashOffset = buf_add(&apiset, NULL, count * sizeof(API_SET_HASH_ENTRY_10));
+
+    for (unsigned int i = 0; i < count; i++) {
+        API_SET_NAMESPACE_ENTRY_10 ent;
+        API_SET_VALUE_ENTRY_81 hosts[2];
+
+        memset(&ent, 0, sizeof(ent));
+        memset(hosts, 0, sizeof(hosts));
+
+        ent.NameOffset = add_utf16(&apiset, entries[i].name);
+        ent.NameLength = strlen(entries[i].name) * sizeof(uint16_t);
+        ent.HashedLength = hashed_length(entries[i].name) * sizeof(uint16_t);
+
+        // the first host is an empty one, which should be skipped
+        hosts[1].ValueOffset = add_utf16(&apiset, entries[i].host);
+        hosts[1].ValueLength = strlen(entries[i].host) * sizeof(uint16_t);
+
+        buf_align(&apiset, 4);
+        ent.HostsOffset = buf_add(&apiset, hosts, sizeof(hosts));
+        ent.NumberOfHosts = 2;
+
+        memcpy(apiset.data + header.ArrayOffset + (i * sizeof(ent)), &ent, sizeof(ent));
+    }
+
+    qsort(entries, count, sizeof(api_set_entry), compare_api_set_hashes);
+
+    for (unsigned int i = 0; i < count; i++) {
+        API_SET_HASH_ENTRY_10 h;
+
+        h.Hash = entries[i].hash;
+        h.Index = entries[i].index;
+
+        memcpy(apiset.data + header.HashOffset + (i * sizeof(h)), &h, sizeof(h));
+    }
+
+    header.Size = apiset.size;
+    memcpy(apiset.data, &header, sizeof(header));
+
+    memset(&m, 0, sizeof(m));
+    strcpy(m.file, "ApiSetSchema.dll");
+    m.dll = true;
+    m.file_align = 0x200;
+    m.image_base = 0x180000000;
+
+    memset(dirs, 0, sizeof(dirs));
+
+    section = (gen_section){ ".apiset", &apiset, apiset.size, IMAGE_SCN_MEM_READ };
+
+    sprintf(path, "%s/ApiSetSchema.dll", system32);
+
+    ret = write_image(path, &m, &section, 1, dirs, 0);
+
+    free(apiset.data);
+    free(empty.data);
+    free(entries);
+
+    return ret;
+}
+
+static void mark_loaded(gen_module* modules, unsigned int mod) {
+    if (modules[mod].loaded)
+        return;
+
+    modules[mod].loaded = true;
+
+    for (unsigned int j = 0; j < modules[mod].num_imports; j++) {
+        mark_loaded(modules, modules[mod].imports[j].module);
+    }
+}
+
+bool pegen_write(const char* system32, const pegen_params* params, pegen_result* res) {
+    unsigned int num_modules, lib_start, crashdmp, drv_start, kexp = params->kernel_exports, lexp;
+    bool win10 = params->version >= _WIN32_WINNT_WIN10;
+    gen_module* modules;
+    char path[1024], s[64];
+    bool ret = true;
+
+    rng_state = params->seed ? params->seed : 1;
+
+    memset(res, 0, sizeof(pegen_result));
+
+    lexp = kexp / 4 < FORWARD_EVERY * 2 ? FORWARD_EVERY * 2 : kexp / 4;
+
+    lib_start = 3;
+    crashdmp = lib_start + params->libs;
+    drv_start = crashdmp + 1;
+    num_modules = drv_start + params->drivers;
+
+    modules = xalloc(num_modules * sizeof(gen_module));
+
+    init_module(&modules[0], "ntoskrnl.exe", false, false, kexp, 0x140000000, 0x200000);
+    init_module(&modules[1], "hal.dll", false, true, lexp, 0x1c0000000, 0x40000);
+    init_module(&modules[2], "kdcom.dll", false, true, 8, 0x1c0000000, 0x4000);
+
+    for (unsigned int i = 0; i < params->libs; i++) {
+        sprintf(s, "qlib%02u.sys", i);
+        init_module(&modules[lib_start + i], s, true, true, lexp, 0x1c0000000, 0x10000);
+
+        // library 0 forwards to the kernel, and each after that to the one before, so the
+        // last part of each chain is the kernel
+        for (unsigned int j = 0; j < lexp; j += FORWARD_EVERY) {
+            modules[lib_start + i].fwd_module[j] = i == 0 ? 0 : lib_start + i - 1;
+            modules[lib_start + i].fwd_index[j] = i == 0 ? (j * 7) % kexp : j;
+        }
+    }
+
+    modules[lib_start].reverse_names = true;
+
+    init_module(&modules[crashdmp], "crashdmp.sys", true, false, 0, 0x1c0000000, 0x8000);
+
+    for (unsigned int i = 0; i < params->drivers; i++) {
+        sprintf(s, "qdrv%03u.sys", i);
+        init_module(&modules[drv_start + i], s, true, false, 0, 0x1c0000000, 0x8000);
+    }
+
+    // the HAL forwards some functions to the kernel, as the real one does
+    for (unsigned int j = 0; j < lexp; j += FORWARD_EVERY / 2) {
+        modules[1].fwd_module[j] = 0;
+        modules[1].fwd_index[j] = (j * 13) % kexp;
+    }
+
+    add_import(modules, &modules[0], 1, "hal.dll", 16, false);
+    add_import(modules, &modules[0], 2, "kdcom.dll", 8, false);
+
+    if (win10 && params->libs > 0)
+        add_import(modules, &modules[0], lib_start + params->libs - 1, API_SET_NAME ".dll", 4, true);
+
+    add_import(modules, &modules[1], 0, "ntoskrnl.exe", 32, false);
+    add_import(modules, &modules[1], 2, "kdcom.dll", 2, false);
+
+    add_import(modules, &modules[2], 0, "ntoskrnl.exe", 8, false);
+    add_import(modules, &modules[2], 1, "HAL.dll", 4, true);
+
+    for (unsigned int i = 0; i < params->libs; i++) {
+        gen_module* m = &modules[lib_start + i];
+
+        add_import(modules, m, 0, "ntoskrnl.exe", 16, false);
+        add_import(modules, m, 1, "hal.dll", 4, false);
+
+        if (i > 0) {
+            sprintf(s, "qlib%02u.sys", i - 1);
+            add_import(modules, m, lib_start + i - 1, s, 8, true);
+        }
+    }
+
+    add_import(modules, &modules[crashdmp], 0, "ntoskrnl.exe", 16, false);
+
+    for (unsigned int i = 0; i < params->drivers; i++) {
+        gen_module* m = &modules[drv_start + i];
+        unsigned int n = params->driver_imports;
+
+        // some drivers split their kernel imports over two descriptors
+        if (i % 7 == 3) {
+            add_import(modules, m, 0, "ntoskrnl.exe", n / 2, false);
+            n -= n / 2;
+        }
+
+        add_import(modules, m, 0, i % 5 == 1 ? "NTOSKRNL.EXE" : "ntoskrnl.exe", n, false);
+        add_import(modules, m, 1, "hal.dll", 8, true);
+
+        if (params->libs > 0) {
+            sprintf(s, "qlib%02u.sys", i % params->libs);
+            add_import(modules, m, lib_start + (i % params->libs), s, 16, true);
+
+            // only the last part of the version is different, which should be ignored
+            if (win10 && i % 3 == 0)
+                add_import(modules, m, lib_start + params->libs - 1, "ext-ms-win-qtest-l1-1-1.dll", 4, true);
+        }
+    }
+
+    // the images a boot loads are the kernel, HAL, boot drivers, crashdmp.sys on 8.1 and
+    // later, and whatever they import
+
+    mark_loaded(modules, 0);
+    mark_loaded(modules, 1);
+
+    if (params->version >= _WIN32_WINNT_WINBLUE)
+        mark_loaded(modules, crashdmp);
+
+    for (unsigned int i = 0; i < params->drivers; i++) {
+        mark_loaded(modules, drv_start + i);
+    }
+
+    sprintf(path, "%s/drivers", system32);
+    mkdir(system32, 0755);
+    mkdir(path, 0755);
+
+    for (unsigned int i = 0; i < num_modules && ret; i++) {
+        ret = write_module(system32, modules, i);
+    }
+
+    if (ret && win10)
+        ret = write_api_set_schema(system32, params->libs > 0 ? modules[lib_start + params->libs - 1].file : "hal.dll");
+
+    res->driver_files = xalloc((params->drivers + 1) * sizeof(char*));
+    res->num_drivers = params->drivers;
+
+    for (unsigned int i = 0; i < params->drivers; i++) {
+        res->driver_files[i] = xstrdup(modules[drv_start + i].file);
+    }
+
+    res->images = xalloc((num_modules + 1) * sizeof(char*));
+
+    for (unsigned int i = 0; i < num_modules; i++) {
+        if (modules[i].loaded) {
+            char* t = xstrdup(modules[i].file);
+
+            for (char* c = t; *c; c++) {
+                if (*c >= 'A' && *c <= 'Z')
+                    *c = *c - 'A' + 'a';
+            }
+
+            res->images[res->num_images] = t;
+            res->num_images++;
+        }
+    }
+
+    for (unsigned int i = 0; i < num_modules; i++) {
+        for (unsigned int j = 0; j < modules[i].num_imports; j++) {
+            free(modules[i].imports[j].exports);
+        }
+
+        free(modules[i].imports);
+        free(modules[i].fwd_module);
+        free(modules[i].fwd_index);
+    }
+
+    free(modules);
+
+    return ret;
+}
+
+void pegen_free(pegen_result* res) {
+    for (unsigned int i = 0; i < res->num_drivers; i++) {
+        free(res->driver_files[i]);
+    }
+
+    for (unsigned int i = 0; i < res->num_images; i++) {
+        free(res->images[i]);
+    }
+
+    free(res->driver_files);
+    free(res->images);
+}
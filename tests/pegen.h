@@ -0,0 +1,56 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Generates a synthetic System32 directory of x64 images: a kernel, HAL and kdcom.dll, some
+// libraries, boot drivers that import from all of them, and on Windows 10 an API set schema.
+// The images carry their own answers: every function starts with an ID, and a .qtest
+// section lists each import address table slot and relocated pointer with the ID of the
+// function it should end up pointing to, so checking a load needs nothing but the images.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "efi/efihost.h"
+
+#define PEGEN_SECTION ".qtest"
+
+typedef struct {
+    uint16_t version; // _WIN32_WINNT_*; Windows 10 gets an API set schema, 8.1 and later crashdmp.sys
+    unsigned int drivers; // boot drivers
+    unsigned int libs; // libraries in System32\drivers that the drivers import from
+    unsigned int kernel_exports; // the HAL and libraries export a quarter as many
+    unsigned int driver_imports; // functions each driver imports from the kernel
+    uint32_t seed;
+} pegen_params;
+
+// an entry in the .qtest section
+typedef struct {
+    uint32_t slot; // RVA of the pointer
+    uint32_t reserved;
+    uint64_t id; // what the pointer should point to
+} pegen_check;
+
+typedef struct {
+    char** driver_files; // boot drivers, all in System32\drivers
+    unsigned int num_drivers;
+    char** images; // every image a boot should load, lower-case
+    unsigned int num_images;
+} pegen_result;
+
+bool pegen_write(const char* system32, const pegen_params* params, pegen_result* res);
+void pegen_free(pegen_result* res);
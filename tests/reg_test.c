@@ -0,0 +1,2256 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// Tests and benchmarks for reg.c, run against synthetic SYSTEM hives from hivegen.c or
+// against copies of real Windows directories.
+//
+//   reg_test check                          check reg.c against generated hives
+//   reg_test gen <dir> <services> [seed]    write a Windows directory with a generated hive
+//   reg_test bench [dir...]                 time the registry code on each Windows directory,
+//                                           or on generated ones with 1k, 10k and 50k services
+//
+// The boot replay calls the registry exactly as boot.c's load_registry, load_drivers,
+// load_nls, and load_errata_inf do, so that its timings and allocation counts are those of
+// a real boot. Keep them in step with boot.c.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "host.h"
+#include "hivegen.h"
+#include "quibble.h"
+#include "x86.h"
+#include "reg.h"
+#include "misc.h"
+#include "print.h"
+
+#define NAME_BUF 1024
+#define DATA_BUF 0x10000
+#define MAX_FAILURES 20
+
+typedef struct {
+    const char* label;
+    uint16_t version;
+    uint16_t build;
+    bool compact;
+} replay_params;
+
+typedef struct {
+    void* hive_data;
+    uint32_t hive_size;
+    unsigned int num_drivers;
+    unsigned int num_core_drivers;
+    WCHAR** driver_names; // in load order
+    WCHAR** driver_groups;
+    void* boot_list;
+    size_t boot_list_size;
+    void* nls[3];
+    size_t nls_size[3];
+    void* errata;
+    size_t errata_size;
+} replay_result;
+
+typedef struct {
+    LIST_ENTRY list_entry;
+    WCHAR* name;
+    WCHAR* file;
+    WCHAR* dir;
+    WCHAR* group;
+    uint32_t tag;
+} driver;
+
+typedef struct {
+    WCHAR name1[NAME_BUF];
+    WCHAR name2[NAME_BUF];
+    char subpath[1024];
+    char s[256];
+} key_bufs;
+
+static EFI_BOOT_SERVICES* bs = &host_bs;
+static EFI_REGISTRY_PROTOCOL* reg;
+static unsigned int failures;
+static const WCHAR fs_driver[] = L"btrfs";
+
+static void fail(const char* fmt, ...) {
+    va_list ap;
+
+    failures++;
+
+    if (failures > MAX_FAILURES)
+        return;
+
+    va_start(ap, fmt);
+    printf("FAIL: ");
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+
+    if (failures == MAX_FAILURES)
+        printf("(not showing any more failures)\n");
+}
+
+// for messages
+static const char* narrow(const WCHAR* w, unsigned int len, char* buf, size_t size) {
+    unsigned int i;
+
+    for (i = 0; i < len && i + 1 < size; i++) {
+        buf[i] = w[i] >= 0x20 && w[i] < 0x7f ? (char)w[i] : '?';
+    }
+
+    buf[i] = 0;
+
+    return buf;
+}
+
+static void widen(const char* s, WCHAR* w) {
+    while (*s) {
+        *w = (uint8_t)*s;
+        w++;
+        s++;
+    }
+
+    *w = 0;
+}
+
+static WCHAR* wcsdup16(const WCHAR* s) {
+    size_t len = wcslen(s);
+    WCHAR* d = malloc((len + 1) * sizeof(WCHAR));
+
+    if (d)
+        memcpy(d, s, (len + 1) * sizeof(WCHAR));
+
+    return d;
+}
+
+static int wcscmp16(const WCHAR* s1, const WCHAR* s2) {
+    while (*s1 != 0 && *s1 == *s2) {
+        s1++;
+        s2++;
+    }
+
+    return (int)*s1 - (int)*s2;
+}
+
+static bool names_equal(const WCHAR* s1, unsigned int len1, const WCHAR* s2, unsigned int len2) {
+    if (len1 != len2)
+        return false;
+
+    for (unsigned int i = 0; i < len1; i++) {
+        if (s1[i] != s2[i])
+            return false;
+    }
+
+    return true;
+}
+
+static bool is_ascii(const WCHAR* s, unsigned int len) {
+    for (unsigned int i = 0; i < len; i++) {
+        if (s[i] >= 0x80)
+            return false;
+    }
+
+    return true;
+}
+
+// Swaps the case of every ASCII letter, as reg.c's lookups should ignore case.
+static void swap_case(const WCHAR* src, unsigned int len, WCHAR* dest) {
+    for (unsigned int i = 0; i < len; i++) {
+        WCHAR c = src[i];
+
+        if (c >= 'a' && c <= 'z')
+            c = c - 'a' + 'A';
+        else if (c >= 'A' && c <= 'Z')
+            c = c - 'A' + 'a';
+
+        dest[i] = c;
+    }
+
+    dest[len] = 0;
+}
+
+// Windows directories
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+
+    return remove(path);
+}
+
+static void remove_tree(const char* path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static bool make_dir(const char* base, const char* sub) {
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/%s", base, sub);
+
+    if (mkdir(path, 0755) != 0 && access(path, F_OK) != 0) {
+        perror(path);
+        return false;
+    }
+
+    return true;
+}
+
+static bool write_filler(const char* base, const char* name, size_t size) {
+    char path[4096];
+    uint8_t* data;
+    FILE* f;
+    bool ret;
+
+    snprintf(path, sizeof(path), "%s/%s", base, name);
+
+    data = malloc(size);
+    if (!data)
+        return false;
+
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (uint8_t)(i * 31);
+    }
+
+    f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        free(data);
+        return false;
+    }
+
+    ret = fwrite(data, size, 1, f) == 1;
+
+    if (fclose(f) != 0)
+        ret = false;
+
+    free(data);
+
+    return ret;
+}
+
+// Writes the parts of a Windows directory the registry code reads: System32\config\SYSTEM,
+// the NLS files it names, and the errata INF.
+static bool make_windir(const char* windir, const hive_params* params, gen_key** model, unsigned int* num_keys,
+                        uint32_t* hive_size) {
+    char path[4096];
+    gen_key* root;
+    bool ret;
+
+    if (!make_dir(windir, "") || !make_dir(windir, "System32") || !make_dir(windir, "System32/config") ||
+        !make_dir(windir, "inf"))
+        return false;
+
+    // the same sizes as on Windows 10
+    if (!write_filler(windir, "System32/c_1252.nls", 66082) || !write_filler(windir, "System32/c_437.nls", 66082) ||
+        !write_filler(windir, "System32/l_intl.nls", 7796) || !write_filler(windir, "inf/biosinfo.inf", 9394))
+        return false;
+
+    root = gen_system_hive(params, num_keys);
+
+    snprintf(path, sizeof(path), "%s/System32/config/SYSTEM", windir);
+
+    ret = gen_write_hive(root, params, path, hive_size);
+
+    if (!ret)
+        perror(path);
+
+    if (model && ret)
+        *model = root;
+    else
+        gen_free_key(root);
+
+    return ret;
+}
+
+// boot replay
+
+// as boot.c's get_dword_value
+static bool get_dword_value(EFI_REGISTRY_VALUE_QUERY* v, uint32_t* val) {
+    if (EFI_ERROR(v->Status) || v->Type != REG_DWORD || v->DataLength != sizeof(uint32_t))
+        return false;
+
+    *val = *(uint32_t*)v->Data;
+
+    return true;
+}
+
+// as boot.c's copy_string_value
+static EFI_STATUS copy_string_value(EFI_REGISTRY_VALUE_QUERY* v, WCHAR* buf, size_t size) {
+    if (EFI_ERROR(v->Status))
+        return v->Status;
+
+    if (v->DataLength + sizeof(WCHAR) > size)
+        return EFI_BUFFER_TOO_SMALL;
+
+    memcpy(buf, v->Data, v->DataLength);
+    buf[v->DataLength / sizeof(WCHAR)] = 0;
+
+    return EFI_SUCCESS;
+}
+
+// as boot.c's read_file - the host's file handles don't care about case, so open_file's
+// first Open always works
+static EFI_STATUS replay_read_file(EFI_FILE_HANDLE dir, const WCHAR* name, void** data, size_t* size) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE file;
+    size_t file_size, pages;
+    EFI_PHYSICAL_ADDRESS addr;
+
+    Status = dir->Open(dir, &file, (WCHAR*)name, EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    {
+        EFI_FILE_INFO file_info;
+        EFI_GUID guid = EFI_FILE_INFO_ID;
+        UINTN size = sizeof(EFI_FILE_INFO);
+
+        Status = file->GetInfo(file, &guid, &size, &file_info);
+
+        if (Status == EFI_BUFFER_TOO_SMALL) {
+            EFI_FILE_INFO* file_info2;
+
+            Status = bs->AllocatePool(EfiLoaderData, size, (void**)&file_info2);
+            if (EFI_ERROR(Status)) {
+                file->Close(file);
+                return Status;
+            }
+
+            Status = file->GetInfo(file, &guid, &size, file_info2);
+            if (EFI_ERROR(Status)) {
+                bs->FreePool(file_info2);
+                file->Close(file);
+                return Status;
+            }
+
+            file_size = file_info2->FileSize;
+
+            bs->FreePool(file_info2);
+        } else if (EFI_ERROR(Status)) {
+            file->Close(file);
+            return Status;
+        } else
+            file_size = file_info.FileSize;
+    }
+
+    pages = PAGE_COUNT(file_size);
+
+    if (pages == 0) {
+        file->Close(file);
+        return EFI_INVALID_PARAMETER;
+    }
+
+    Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, pages, &addr);
+    if (EFI_ERROR(Status)) {
+        file->Close(file);
+        return Status;
+    }
+
+    *data = (uint8_t*)(uintptr_t)addr;
+    *size = file_size;
+
+    {
+        UINTN read_size = pages * EFI_PAGE_SIZE;
+
+        Status = file->Read(file, &read_size, *data);
+        if (EFI_ERROR(Status)) {
+            bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)*data, pages);
+            file->Close(file);
+            return Status;
+        }
+    }
+
+    file->Close(file);
+
+    return EFI_SUCCESS;
+}
+
+// The registry calls of boot.c's load_drivers. Instead of passing each driver to add_image,
+// we note its name and group in res.
+static EFI_STATUS replay_load_drivers(EFI_REGISTRY_HIVE* hive, HKEY ccs, bool core, int32_t hwconfig,
+                                      replay_result* res) {
+    EFI_STATUS Status;
+    HKEY services, sgokey;
+    WCHAR name[255], group[255], *sgo;
+    UINT32 position;
+    LIST_ENTRY drivers;
+    LIST_ENTRY* le;
+    uint32_t length, reg_type;
+    size_t boot_list_size;
+    unsigned int count;
+
+    static const WCHAR reg_prefix[] = L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\";
+    static const WCHAR system_root[] = L"\\SystemRoot\\";
+
+    InitializeListHead(&drivers);
+
+    Status = hive->FindKey(hive, ccs, L"Services", &services);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->FindKey", Status);
+        return Status;
+    }
+
+    position = 0;
+
+    do {
+        HKEY key;
+        EFI_REGISTRY_VALUE_QUERY values[5];
+        uint32_t type, start, tag;
+        WCHAR image_path[MAX_PATH], dir[MAX_PATH], *image_name = NULL;
+        size_t pos;
+        driver* d;
+        bool is_fs_driver;
+
+        Status = hive->NextKey(hive, services, &position, &key, name, sizeof(name) / sizeof(WCHAR));
+
+        if (Status == EFI_NOT_FOUND)
+            break;
+        else if (EFI_ERROR(Status)) {
+            if (Status == EFI_BUFFER_TOO_SMALL)
+                continue;
+
+            print_error("hive->NextKey", Status);
+            return Status;
+        }
+
+        values[0].Name = L"Type";
+        values[1].Name = L"Start";
+        values[2].Name = L"ImagePath";
+        values[3].Name = L"Group";
+        values[4].Name = L"Tag";
+
+        Status = hive->QueryValues(hive, key, values, sizeof(values) / sizeof(values[0]));
+        if (EFI_ERROR(Status)) {
+            print_error("hive->QueryValues", Status);
+            continue;
+        }
+
+        if (!get_dword_value(&values[0], &type) || (type != SERVICE_KERNEL_DRIVER && type != SERVICE_FILE_SYSTEM_DRIVER))
+            continue;
+
+        is_fs_driver = !wcsicmp(name, fs_driver);
+
+        if (!get_dword_value(&values[1], &start) || (start != SERVICE_BOOT_START && !is_fs_driver))
+            continue;
+
+        if (hwconfig != -1 && !is_fs_driver) {
+            HKEY sokey;
+
+            Status = hive->FindKey(hive, key, L"StartOverride", &sokey);
+            if (!EFI_ERROR(Status)) {
+                WCHAR soname[12];
+                uint32_t soval;
+
+                itow(hwconfig, soname);
+
+                length = sizeof(soval);
+
+                Status = hive->QueryValue(hive, sokey, soname, &soval, &length, &reg_type);
+                if (!EFI_ERROR(Status) && reg_type == REG_DWORD) {
+                    start = soval;
+
+                    if (start != SERVICE_BOOT_START)
+                        continue;
+                }
+            }
+        }
+
+        if ((values[2].Type != REG_SZ && values[2].Type != REG_EXPAND_SZ) ||
+            EFI_ERROR(copy_string_value(&values[2], image_path, sizeof(image_path)))) {
+            wcsncpy(image_path, L"system32\\drivers\\", sizeof(image_path) / sizeof(WCHAR));
+            wcsncat(image_path, name, sizeof(image_path) / sizeof(WCHAR));
+            wcsncat(image_path, L".sys", sizeof(image_path) / sizeof(WCHAR));
+        }
+
+        if (wcslen(image_path) > (sizeof(system_root) / sizeof(WCHAR)) - 1 && !memcmp(image_path, system_root, (sizeof(system_root) / sizeof(WCHAR)) - 1))
+            memcpy(image_path, &image_path[(sizeof(system_root) / sizeof(WCHAR)) - 1], (wcslen(image_path) * sizeof(WCHAR)) - sizeof(system_root) + (2*sizeof(WCHAR)));
+
+        pos = wcslen(image_path) - 1;
+        while (true) {
+            if (image_path[pos] == '\\') {
+                image_path[pos] = 0;
+                wcsncpy(dir, image_path, sizeof(dir) / sizeof(WCHAR));
+
+                image_name = &image_path[pos + 1];
+                break;
+            }
+
+            if (pos == 0)
+                break;
+
+            pos--;
+        }
+
+        if (!image_name) {
+            fail("no directory in image path of service %s", narrow(name, wcslen(name), (char[256]){0}, 256));
+            continue;
+        }
+
+        Status = bs->AllocatePool(EfiLoaderData, sizeof(driver), (void**)&d);
+        if (EFI_ERROR(Status))
+            goto end;
+
+        Status = bs->AllocatePool(EfiLoaderData, (wcslen(name) + 1) * sizeof(WCHAR), (void**)&d->name);
+        if (EFI_ERROR(Status)) {
+            bs->FreePool(d);
+            goto end;
+        }
+
+        memcpy(d->name, name, (wcslen(name) + 1) * sizeof(WCHAR));
+
+        Status = bs->AllocatePool(EfiLoaderData, (wcslen(image_name) + 1) * sizeof(WCHAR), (void**)&d->file);
+        if (EFI_ERROR(Status)) {
+            bs->FreePool(d->name);
+            bs->FreePool(d);
+            goto end;
+        }
+
+        memcpy(d->file, image_name, (wcslen(image_name) + 1) * sizeof(WCHAR));
+
+        Status = bs->AllocatePool(EfiLoaderData, (wcslen(dir) + 1) * sizeof(WCHAR), (void**)&d->dir);
+        if (EFI_ERROR(Status)) {
+            bs->FreePool(d->file);
+            bs->FreePool(d->name);
+            bs->FreePool(d);
+            goto end;
+        }
+
+        memcpy(d->dir, dir, (wcslen(dir) + 1) * sizeof(WCHAR));
+
+        d->group = NULL;
+
+        if (values[3].Type == REG_SZ && !EFI_ERROR(copy_string_value(&values[3], group, sizeof(group)))) {
+            Status = bs->AllocatePool(EfiLoaderData, (wcslen(group) + 1) * sizeof(WCHAR), (void**)&d->group);
+            if (EFI_ERROR(Status)) {
+                bs->FreePool(d->dir);
+                bs->FreePool(d->file);
+                bs->FreePool(d->name);
+                bs->FreePool(d);
+                goto end;
+            }
+
+            memcpy(d->group, group, (wcslen(group) + 1) * sizeof(WCHAR));
+        }
+
+        if (get_dword_value(&values[4], &tag))
+            d->tag = tag;
+        else
+            d->tag = 0xffffffff;
+
+        InsertTailList(&drivers, &d->list_entry);
+    } while (true);
+
+    // order by group
+
+    Status = hive->FindKey(hive, ccs, L"Control\\ServiceGroupOrder", &sgokey);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->FindKey", Status);
+        goto end;
+    }
+
+    length = sizeof(sgo);
+
+    Status = hive->QueryValueNoCopy(hive, sgokey, L"List", (void**)&sgo, &length, &reg_type);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->QueryValue", Status);
+        goto end;
+    }
+
+    if (reg_type != REG_MULTI_SZ) {
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
+    }
+
+    {
+        LIST_ENTRY drivers2;
+        WCHAR* s = sgo;
+        HKEY golkey = 0;
+
+        Status = hive->FindKey(hive, ccs, L"Control\\GroupOrderList", &golkey);
+        if (EFI_ERROR(Status))
+            print_error("hive->FindKey", Status);
+
+        InitializeListHead(&drivers2);
+
+        while (s[0] != 0) {
+            LIST_ENTRY list;
+            uint32_t* gol;
+
+            InitializeListHead(&list);
+
+            le = drivers.Flink;
+            while (le != &drivers) {
+                LIST_ENTRY* le2 = le->Flink;
+                driver* d = _CR(le, driver, list_entry);
+
+                if (d->group && !wcsicmp(s, d->group)) {
+                    RemoveEntryList(&d->list_entry);
+                    InsertTailList(&list, &d->list_entry);
+                }
+
+                le = le2;
+            }
+
+            if (IsListEmpty(&list)) {
+                s = &s[wcslen(s) + 1];
+                continue;
+            }
+
+            if (golkey != 0) {
+                Status = hive->QueryValueNoCopy(hive, golkey, s, (void**)&gol, &length, &reg_type);
+                if (!EFI_ERROR(Status) && length > sizeof(uint32_t) && reg_type == REG_BINARY) {
+                    uint32_t arrlen = gol[0];
+
+                    if (length < (arrlen + 1) * sizeof(uint32_t))
+                        arrlen = (length / sizeof(uint32_t)) - 1;
+
+                    gol = &gol[1];
+
+                    for (uint32_t j = 0; j < arrlen; j++) {
+                        le = list.Flink;
+                        while (le != &list) {
+                            LIST_ENTRY* le2 = le->Flink;
+                            driver* d = _CR(le, driver, list_entry);
+
+                            if (d->tag == gol[j]) {
+                                RemoveEntryList(&d->list_entry);
+                                InsertTailList(&drivers2, &d->list_entry);
+                            }
+
+                            le = le2;
+                        }
+                    }
+                }
+            }
+
+            le = list.Flink;
+            while (le != &list) {
+                LIST_ENTRY* le2 = le->Flink;
+                driver* d = _CR(le, driver, list_entry);
+
+                RemoveEntryList(&d->list_entry);
+                InsertTailList(&drivers2, &d->list_entry);
+
+                le = le2;
+            }
+
+            s = &s[wcslen(s) + 1];
+        }
+
+        while (!IsListEmpty(&drivers)) {
+            driver* d = _CR(drivers.Flink, driver, list_entry);
+
+            RemoveEntryList(&d->list_entry);
+            InsertTailList(&drivers2, &d->list_entry);
+        }
+
+        if (!IsListEmpty(&drivers2)) {
+            drivers.Flink = drivers2.Flink;
+            drivers.Blink = drivers2.Blink;
+            drivers.Flink->Blink = &drivers;
+            drivers.Blink->Flink = &drivers;
+        }
+    }
+
+    // build the boot driver list, as load_drivers does
+
+    boot_list_size = 0;
+    count = 0;
+
+    le = drivers.Flink;
+
+    while (le != &drivers) {
+        driver* d = _CR(le, driver, list_entry);
+
+        boot_list_size += sizeof(BOOT_DRIVER_LIST_ENTRY);
+        boot_list_size += (wcslen(d->dir) + 1 + wcslen(d->file)) * sizeof(WCHAR);
+        boot_list_size += sizeof(reg_prefix) - sizeof(WCHAR) + (wcslen(d->name) * sizeof(WCHAR)) + sizeof(WCHAR);
+        count++;
+
+        le = le->Flink;
+    }
+
+    res->driver_names = calloc(count + 1, sizeof(WCHAR*));
+    res->driver_groups = calloc(count + 1, sizeof(WCHAR*));
+
+    {
+        EFI_PHYSICAL_ADDRESS addr;
+        void* pa;
+
+        Status = bs->AllocatePages(AllocateAnyPages, EfiLoaderData, PAGE_COUNT(boot_list_size), &addr);
+        if (EFI_ERROR(Status)) {
+            print_error("AllocatePages", Status);
+            goto end;
+        }
+
+        pa = (void*)(uintptr_t)addr;
+        res->boot_list = pa;
+        res->boot_list_size = boot_list_size;
+
+        le = drivers.Flink;
+
+        while (le != &drivers) {
+            driver* d = _CR(le, driver, list_entry);
+            BOOT_DRIVER_LIST_ENTRY* bdle = (BOOT_DRIVER_LIST_ENTRY*)pa;
+
+            memset(bdle, 0, sizeof(BOOT_DRIVER_LIST_ENTRY));
+
+            pa = (uint8_t*)pa + sizeof(BOOT_DRIVER_LIST_ENTRY);
+
+            bdle->FilePath.Length = bdle->FilePath.MaximumLength = (wcslen(d->dir) + 1 + wcslen(d->file)) * sizeof(WCHAR);
+            bdle->FilePath.Buffer = pa;
+
+            memcpy(pa, d->dir, wcslen(d->dir) * sizeof(WCHAR));
+            pa = (uint8_t*)pa + (wcslen(d->dir) * sizeof(WCHAR));
+
+            *(WCHAR*)pa = '\\';
+            pa = (uint8_t*)pa + sizeof(WCHAR);
+
+            memcpy(pa, d->file, wcslen(d->file) * sizeof(WCHAR));
+            pa = (uint8_t*)pa + (wcslen(d->file) * sizeof(WCHAR));
+
+            bdle->RegistryPath.Length = bdle->RegistryPath.MaximumLength = sizeof(reg_prefix) - sizeof(WCHAR) + (wcslen(d->name) * sizeof(WCHAR));
+            bdle->RegistryPath.Buffer = pa;
+
+            memcpy(pa, reg_prefix, sizeof(reg_prefix) - sizeof(WCHAR));
+            pa = (uint8_t*)pa + sizeof(reg_prefix) - sizeof(WCHAR);
+
+            memcpy(pa, d->name, bdle->RegistryPath.Length - sizeof(reg_prefix) + sizeof(WCHAR));
+            pa = (uint8_t*)pa + bdle->RegistryPath.Length - sizeof(reg_prefix) + sizeof(WCHAR);
+
+            *(WCHAR*)pa = 0;
+            pa = (uint8_t*)pa + sizeof(WCHAR);
+
+            if (core && d->group && !wcsicmp(d->group, L"Core"))
+                res->num_core_drivers++;
+
+            res->driver_names[res->num_drivers] = (WCHAR*)((uint8_t*)bdle->RegistryPath.Buffer + sizeof(reg_prefix) - sizeof(WCHAR));
+            res->driver_groups[res->num_drivers] = d->group ? wcsdup16(d->group) : NULL;
+            res->num_drivers++;
+
+            le = le->Flink;
+        }
+    }
+
+    Status = EFI_SUCCESS;
+
+end:
+    while (!IsListEmpty(&drivers)) {
+        driver* d = _CR(drivers.Flink, driver, list_entry);
+
+        RemoveEntryList(&d->list_entry);
+
+        bs->FreePool(d->name);
+        bs->FreePool(d->file);
+        bs->FreePool(d->dir);
+
+        if (d->group)
+            bs->FreePool(d->group);
+
+        bs->FreePool(d);
+    }
+
+    return Status;
+}
+
+// The registry calls of boot.c's load_nls, and the reads of the files it names.
+static EFI_STATUS replay_load_nls(EFI_FILE_HANDLE system32, EFI_REGISTRY_HIVE* hive, HKEY ccs, uint16_t build,
+                                  replay_result* res) {
+    EFI_STATUS Status;
+    HKEY key;
+    WCHAR s[255], acp_name[255], oemcp_name[255], acp[MAX_PATH], oemcp[MAX_PATH], lang[MAX_PATH];
+    uint32_t length, type;
+    EFI_REGISTRY_VALUE_QUERY values[2];
+
+    Status = hive->FindKey(hive, ccs, L"Control\\Nls\\CodePage", &key);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->FindKey", Status);
+        return Status;
+    }
+
+    values[0].Name = L"ACP";
+    values[1].Name = L"OEMCP";
+
+    Status = hive->QueryValues(hive, key, values, sizeof(values) / sizeof(values[0]));
+    if (EFI_ERROR(Status)) {
+        print_error("hive->QueryValues", Status);
+        return Status;
+    }
+
+    if (EFI_ERROR(values[0].Status))
+        return values[0].Status;
+
+    if (values[0].Type != REG_SZ && values[0].Type != REG_EXPAND_SZ)
+        return EFI_INVALID_PARAMETER;
+
+    Status = copy_string_value(&values[0], acp_name, sizeof(acp_name));
+    if (EFI_ERROR(Status))
+        return Status;
+
+    if (EFI_ERROR(values[1].Status))
+        return values[1].Status;
+
+    if (values[1].Type != REG_SZ && values[1].Type != REG_EXPAND_SZ)
+        return EFI_INVALID_PARAMETER;
+
+    Status = copy_string_value(&values[1], oemcp_name, sizeof(oemcp_name));
+    if (EFI_ERROR(Status))
+        return Status;
+
+    values[0].Name = acp_name;
+    values[1].Name = oemcp_name;
+
+    Status = hive->QueryValues(hive, key, values, sizeof(values) / sizeof(values[0]));
+    if (EFI_ERROR(Status)) {
+        print_error("hive->QueryValues", Status);
+        return Status;
+    }
+
+    Status = copy_string_value(&values[0], acp, sizeof(acp));
+    if (EFI_ERROR(Status)) {
+        print_error("copy_string_value", Status);
+        return Status;
+    }
+
+    Status = copy_string_value(&values[1], oemcp, sizeof(oemcp));
+    if (EFI_ERROR(Status)) {
+        print_error("copy_string_value", Status);
+        return Status;
+    }
+
+    if (build >= WIN10_BUILD_1803)
+        wcsncpy(lang, L"l_intl.nls", sizeof(lang) / sizeof(WCHAR));
+    else {
+        Status = hive->FindKey(hive, ccs, L"Control\\Nls\\Language", &key);
+        if (EFI_ERROR(Status)) {
+            print_error("hive->FindKey", Status);
+            return Status;
+        }
+
+        length = sizeof(s);
+
+        Status = hive->QueryValue(hive, key, L"Default", s, &length, &type);
+        if (EFI_ERROR(Status)) {
+            print_error("hive->QueryValue", Status);
+            return Status;
+        }
+
+        if (type != REG_SZ && type != REG_EXPAND_SZ)
+            return EFI_INVALID_PARAMETER;
+
+        length = sizeof(lang);
+
+        Status = hive->QueryValue(hive, key, s, lang, &length, &type);
+        if (EFI_ERROR(Status)) {
+            print_error("hive->QueryValue", Status);
+            return Status;
+        }
+    }
+
+    Status = replay_read_file(system32, acp, &res->nls[0], &res->nls_size[0]);
+    if (EFI_ERROR(Status)) {
+        print_error("read_file", Status);
+        return Status;
+    }
+
+    Status = replay_read_file(system32, oemcp, &res->nls[1], &res->nls_size[1]);
+    if (EFI_ERROR(Status)) {
+        print_error("read_file", Status);
+        return Status;
+    }
+
+    Status = replay_read_file(system32, lang, &res->nls[2], &res->nls_size[2]);
+    if (EFI_ERROR(Status)) {
+        print_error("read_file", Status);
+        return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+// The registry calls of boot.c's load_errata_inf, and the read of the INF.
+static EFI_STATUS replay_load_errata_inf(EFI_REGISTRY_HIVE* hive, HKEY ccs, EFI_FILE_HANDLE windir, uint16_t version,
+                                         replay_result* res) {
+    EFI_STATUS Status;
+    HKEY key;
+    WCHAR name[MAX_PATH];
+    EFI_REGISTRY_VALUE_QUERY value;
+
+    static WCHAR infdir[] = L"inf\\";
+
+    if (version >= _WIN32_WINNT_VISTA)
+        Status = hive->FindKey(hive, ccs, L"Control\\Errata", &key);
+    else
+        Status = hive->FindKey(hive, ccs, L"Control\\BiosInfo", &key);
+
+    if (EFI_ERROR(Status)) {
+        print_error("hive->FindKey", Status);
+        return Status;
+    }
+
+    memcpy(name, infdir, sizeof(infdir));
+
+    value.Name = L"InfName";
+
+    Status = hive->QueryValues(hive, key, &value, 1);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->QueryValues", Status);
+        return Status;
+    }
+
+    Status = copy_string_value(&value, &name[(sizeof(infdir) / sizeof(WCHAR)) - 1], sizeof(name) - sizeof(infdir) + sizeof(WCHAR));
+    if (EFI_ERROR(Status)) {
+        print_error("copy_string_value", Status);
+        return Status;
+    }
+
+    Status = replay_read_file(windir, name, &res->errata, &res->errata_size);
+
+    if (Status == EFI_NOT_FOUND)
+        return EFI_SUCCESS;
+    else if (EFI_ERROR(Status)) {
+        print_error("read_file", Status);
+        return Status;
+    }
+
+    return Status;
+}
+
+// The registry calls of boot.c's load_registry.
+static EFI_STATUS replay_load_registry(EFI_FILE_HANDLE system32, EFI_FILE_HANDLE windir, const replay_params* params,
+                                       replay_result* res) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE file = NULL;
+    EFI_REGISTRY_HIVE* hive;
+    uint32_t set, length, type;
+    HKEY rootkey, key, ccs;
+    WCHAR ccs_name[14];
+    int32_t hwconfig = -1;
+
+    Status = system32->Open(system32, &file, L"config\\SYSTEM", EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = reg->OpenHive(file, &hive);
+    if (EFI_ERROR(Status)) {
+        print_error("OpenHive", Status);
+        file->Close(file);
+        return Status;
+    }
+
+    Status = file->Close(file);
+    if (EFI_ERROR(Status))
+        print_error("file close", Status);
+
+    Status = hive->FindRoot(hive, &rootkey);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->FindRoot", Status);
+        goto end;
+    }
+
+    Status = hive->FindKey(hive, rootkey, L"Select", &key);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->FindKey", Status);
+        goto end;
+    }
+
+    length = sizeof(set);
+
+    Status = hive->QueryValue(hive, key, L"Default", &set, &length, &type);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->QueryValue", Status);
+        goto end;
+    }
+
+    if (type != REG_DWORD) {
+        Status = EFI_INVALID_PARAMETER;
+        goto end;
+    }
+
+    wcsncpy(ccs_name, L"ControlSet00x", sizeof(ccs_name) / sizeof(WCHAR));
+    ccs_name[12] = (set % 10) + '0';
+
+    Status = hive->FindKey(hive, rootkey, ccs_name, &ccs);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->FindKey", Status);
+        goto end;
+    }
+
+    if (params->version >= _WIN32_WINNT_WIN8) {
+        Status = hive->FindKey(hive, rootkey, L"HardwareConfig", &key);
+        if (EFI_ERROR(Status)) {
+            print_error("hive->FindKey", Status);
+            goto end;
+        }
+
+        length = sizeof(hwconfig);
+
+        Status = hive->QueryValue(hive, key, L"LastId", &hwconfig, &length, &type);
+        if (EFI_ERROR(Status)) {
+            print_error("hive->QueryValue", Status);
+            goto end;
+        }
+
+        if (type != REG_DWORD) {
+            Status = EFI_INVALID_PARAMETER;
+            goto end;
+        }
+    }
+
+    Status = replay_load_drivers(hive, ccs, params->version >= _WIN32_WINNT_WIN8, hwconfig, res);
+    if (EFI_ERROR(Status)) {
+        print_error("load_drivers", Status);
+        goto end;
+    }
+
+    Status = replay_load_nls(system32, hive, ccs, params->build, res);
+    if (EFI_ERROR(Status)) {
+        print_error("load_nls", Status);
+        goto end;
+    }
+
+    Status = replay_load_errata_inf(hive, ccs, windir, params->version, res);
+    if (EFI_ERROR(Status))
+        print_error("load_errata_inf", Status);
+
+    if (params->compact) {
+        Status = hive->Compact(hive);
+        if (EFI_ERROR(Status))
+            print_error("hive->Compact", Status);
+    }
+
+    Status = hive->StealData(hive, &res->hive_data, &res->hive_size);
+    if (EFI_ERROR(Status)) {
+        print_error("hive->StealData", Status);
+        goto end;
+    }
+
+end:
+    {
+        EFI_STATUS Status2 = hive->Close(hive);
+
+        if (EFI_ERROR(Status2))
+            print_error("hive close", Status2);
+    }
+
+    return Status;
+}
+
+// Opens the Windows directory and its System32 - boot.c has done this already by the time
+// it calls load_registry.
+static EFI_STATUS open_windir(const char* path, EFI_FILE_HANDLE* windir, EFI_FILE_HANDLE* system32) {
+    EFI_STATUS Status;
+
+    Status = host_open_dir(path, windir);
+    if (EFI_ERROR(Status)) {
+        printf("Could not open %s.\n", path);
+        return Status;
+    }
+
+    Status = (*windir)->Open(*windir, system32, L"System32", EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR(Status)) {
+        printf("Could not open %s/System32.\n", path);
+        (*windir)->Close(*windir);
+        return Status;
+    }
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS replay_boot(const char* path, const replay_params* params, replay_result* res) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE windir, system32;
+
+    memset(res, 0, sizeof(replay_result));
+
+    Status = open_windir(path, &windir, &system32);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = replay_load_registry(system32, windir, params, res);
+
+    system32->Close(system32);
+    windir->Close(windir);
+
+    return Status;
+}
+
+static void free_replay(replay_result* res) {
+    if (res->hive_data)
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)res->hive_data, PAGE_COUNT(res->hive_size));
+
+    if (res->boot_list)
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)res->boot_list, PAGE_COUNT(res->boot_list_size));
+
+    for (unsigned int i = 0; i < 3; i++) {
+        if (res->nls[i])
+            bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)res->nls[i], PAGE_COUNT(res->nls_size[i]));
+    }
+
+    if (res->errata)
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)res->errata, PAGE_COUNT(res->errata_size));
+
+    if (res->driver_groups) {
+        for (unsigned int i = 0; i < res->num_drivers; i++) {
+            free(res->driver_groups[i]);
+        }
+    }
+
+    free(res->driver_names);
+    free(res->driver_groups);
+
+    memset(res, 0, sizeof(replay_result));
+}
+
+// checks
+
+static int compare_children(const void* a, const void* b) {
+    const gen_key* k1 = *(const gen_key**)a;
+    const gen_key* k2 = *(const gen_key**)b;
+
+    return gen_compare_names(k1->name, k1->name_len, k2->name, k2->name_len);
+}
+
+static void check_values(EFI_REGISTRY_HIVE* hive, HKEY key, const gen_key* model, const char* path) {
+    EFI_STATUS Status;
+    static WCHAR name[NAME_BUF];
+    static uint8_t data[DATA_BUF];
+    static char s[256];
+    uint32_t type, length;
+
+    for (unsigned int i = 0; i < model->num_values; i++) {
+        const gen_value* v = &model->values[i];
+        void* ptr;
+
+        narrow(v->name, v->name_len, s, sizeof(s));
+
+        Status = hive->EnumValues(hive, key, i, name, NAME_BUF - 1, &type);
+        if (EFI_ERROR(Status)) {
+            fail("%s: EnumValues %u returned %s", path, i, error_string(Status));
+            continue;
+        }
+
+        if (!names_equal(name, wcslen(name), v->name, v->name_len) || type != v->type)
+            fail("%s: EnumValues %u returned the wrong value", path, i);
+
+        length = sizeof(data);
+
+        Status = hive->QueryValue(hive, key, v->name, data, &length, &type);
+        if (EFI_ERROR(Status)) {
+            fail("%s: QueryValue %s returned %s", path, s, error_string(Status));
+            continue;
+        }
+
+        if (length != v->size || type != v->type || __builtin_memcmp(data, v->data, v->size))
+            fail("%s: QueryValue %s returned the wrong data", path, s);
+
+        Status = hive->QueryValueNoCopy(hive, key, v->name, &ptr, &length, &type);
+        if (EFI_ERROR(Status) || length != v->size || type != v->type || __builtin_memcmp(ptr, v->data, v->size))
+            fail("%s: QueryValueNoCopy %s failed", path, s);
+
+        if (v->size > 0) {
+            length = v->size - 1;
+
+            Status = hive->QueryValue(hive, key, v->name, data, &length, &type);
+            if (Status != EFI_BUFFER_TOO_SMALL || length != v->size)
+                fail("%s: QueryValue %s with a short buffer returned %s", path, s, error_string(Status));
+        }
+
+        if (is_ascii(v->name, v->name_len)) {
+            swap_case(v->name, v->name_len, name);
+
+            length = sizeof(data);
+
+            Status = hive->QueryValue(hive, key, name, data, &length, &type);
+            if (EFI_ERROR(Status) || length != v->size)
+                fail("%s: QueryValue %s in the other case returned %s", path, s, error_string(Status));
+        }
+    }
+
+    Status = hive->EnumValues(hive, key, model->num_values, name, NAME_BUF - 1, &type);
+    if (Status != EFI_NOT_FOUND)
+        fail("%s: EnumValues past the end returned %s", path, error_string(Status));
+
+    // all at once, with a value that isn't there at the end
+
+    {
+        EFI_REGISTRY_VALUE_QUERY values[9];
+        unsigned int i = 0;
+
+        while (i < model->num_values || i == 0) {
+            unsigned int n = 0;
+
+            while (n < 8 && i + n < model->num_values) {
+                values[n].Name = model->values[i + n].name;
+                n++;
+            }
+
+            values[n].Name = L"NoSuchValue";
+
+            Status = hive->QueryValues(hive, key, values, n + 1);
+            if (EFI_ERROR(Status)) {
+                fail("%s: QueryValues returned %s", path, error_string(Status));
+                break;
+            }
+
+            for (unsigned int j = 0; j < n; j++) {
+                const gen_value* v = &model->values[i + j];
+
+                if (EFI_ERROR(values[j].Status) || values[j].DataLength != v->size || values[j].Type != v->type ||
+                    __builtin_memcmp(values[j].Data, v->data, v->size)) {
+                    fail("%s: QueryValues for %s failed", path, narrow(v->name, v->name_len, s, sizeof(s)));
+                }
+            }
+
+            if (values[n].Status != EFI_NOT_FOUND || values[n].DataLength != 0)
+                fail("%s: QueryValues for a missing value returned %s", path, error_string(values[n].Status));
+
+            if (n == 0)
+                break;
+
+            i += n;
+        }
+    }
+}
+
+// Checks that key, and everything beneath it, is what's in the model.
+static void check_key(EFI_REGISTRY_HIVE* hive, HKEY key, const gen_key* model, const char* path) {
+    EFI_STATUS Status;
+    gen_key** sorted = NULL;
+    key_bufs* b = malloc(sizeof(key_bufs)); // not on the stack, as this recurses for every level
+    WCHAR *name = b->name1, *name2 = b->name2;
+    char *subpath = b->subpath, *s = b->s;
+    UINT32 position = 0;
+    unsigned int i;
+
+    check_values(hive, key, model, path);
+
+    if (model->num_children > 0) {
+        sorted = malloc(model->num_children * sizeof(gen_key*));
+        memcpy(sorted, model->children, model->num_children * sizeof(gen_key*));
+        qsort(sorted, model->num_children, sizeof(gen_key*), compare_children);
+    }
+
+    for (i = 0; ; i++) {
+        HKEY sub, found;
+
+        Status = hive->NextKey(hive, key, &position, &sub, name, NAME_BUF);
+
+        if (Status == EFI_NOT_FOUND)
+            break;
+        else if (EFI_ERROR(Status)) {
+            fail("%s: NextKey returned %s", path, error_string(Status));
+            break;
+        }
+
+        if (i >= model->num_children) {
+            fail("%s: NextKey returned too many keys", path);
+            break;
+        }
+
+        narrow(sorted[i]->name, sorted[i]->name_len, s, sizeof(b->s));
+        snprintf(subpath, sizeof(b->subpath), "%s\\%s", path, s);
+
+        if (!names_equal(name, wcslen(name), sorted[i]->name, sorted[i]->name_len)) {
+            fail("%s: NextKey returned %s, expected %s", path, narrow(name, wcslen(name), (char[256]){0}, 256), s);
+            continue;
+        }
+
+        Status = hive->EnumKeys(hive, key, i, name2, NAME_BUF);
+        if (EFI_ERROR(Status) || !names_equal(name2, wcslen(name2), sorted[i]->name, sorted[i]->name_len))
+            fail("%s: EnumKeys %u didn't match NextKey", path, i);
+
+        Status = hive->FindKey(hive, key, sorted[i]->name, &found);
+        if (EFI_ERROR(Status) || found != sub)
+            fail("%s: FindKey returned %s", subpath, error_string(Status));
+
+        if (is_ascii(sorted[i]->name, sorted[i]->name_len)) {
+            swap_case(sorted[i]->name, sorted[i]->name_len, name2);
+
+            Status = hive->FindKey(hive, key, name2, &found);
+            if (EFI_ERROR(Status) || found != sub)
+                fail("%s: FindKey in the other case returned %s", subpath, error_string(Status));
+        }
+
+        // a name which sorts straight after this one, which isn't there
+        memcpy(name2, sorted[i]->name, sorted[i]->name_len * sizeof(WCHAR));
+        name2[sorted[i]->name_len] = '~';
+        name2[sorted[i]->name_len + 1] = 0;
+
+        Status = hive->FindKey(hive, key, name2, &found);
+        if (Status != EFI_NOT_FOUND)
+            fail("%s~: FindKey for a missing key returned %s", subpath, error_string(Status));
+
+        check_key(hive, sub, sorted[i], subpath);
+    }
+
+    if (i != model->num_children)
+        fail("%s: NextKey returned %u keys, expected %u", path, i, model->num_children);
+
+    Status = hive->EnumKeys(hive, key, model->num_children, name, NAME_BUF);
+    if (Status != EFI_NOT_FOUND)
+        fail("%s: EnumKeys past the end returned %s", path, error_string(Status));
+
+    free(sorted);
+    free(b);
+}
+
+// Checks that key1 in hive1 and key2 in hive2 hold the same keys and values.
+static void compare_keys(EFI_REGISTRY_HIVE* hive1, HKEY key1, EFI_REGISTRY_HIVE* hive2, HKEY key2, const char* path) {
+    EFI_STATUS Status1, Status2;
+    key_bufs* b = malloc(sizeof(key_bufs));
+    WCHAR *name1 = b->name1, *name2 = b->name2;
+    char *subpath = b->subpath, *s = b->s;
+    UINT32 pos1 = 0, pos2 = 0;
+
+    for (unsigned int i = 0; ; i++) {
+        uint32_t type1, type2, len1, len2;
+        void *data1, *data2;
+
+        Status1 = hive1->EnumValues(hive1, key1, i, name1, NAME_BUF - 1, &type1);
+        Status2 = hive2->EnumValues(hive2, key2, i, name2, NAME_BUF - 1, &type2);
+
+        if (Status1 == EFI_NOT_FOUND && Status2 == EFI_NOT_FOUND)
+            break;
+
+        if (EFI_ERROR(Status1) || EFI_ERROR(Status2) || wcscmp16(name1, name2) || type1 != type2) {
+            fail("%s: value %u differs", path, i);
+            break;
+        }
+
+        Status1 = hive1->QueryValueNoCopy(hive1, key1, name1, &data1, &len1, &type1);
+        Status2 = hive2->QueryValueNoCopy(hive2, key2, name2, &data2, &len2, &type2);
+
+        if (Status1 != Status2 || (!EFI_ERROR(Status1) && (len1 != len2 || __builtin_memcmp(data1, data2, len1))))
+            fail("%s: data of %s differs", path, narrow(name1, wcslen(name1), s, sizeof(b->s)));
+    }
+
+    while (true) {
+        HKEY sub1, sub2;
+
+        Status1 = hive1->NextKey(hive1, key1, &pos1, &sub1, name1, NAME_BUF);
+        Status2 = hive2->NextKey(hive2, key2, &pos2, &sub2, name2, NAME_BUF);
+
+        if (Status1 == EFI_NOT_FOUND && Status2 == EFI_NOT_FOUND)
+            break;
+
+        if (EFI_ERROR(Status1) || EFI_ERROR(Status2) || wcscmp16(name1, name2)) {
+            fail("%s: subkeys differ", path);
+            break;
+        }
+
+        snprintf(subpath, sizeof(b->subpath), "%s\\%s", path, narrow(name1, wcslen(name1), s, sizeof(b->s)));
+
+        compare_keys(hive1, sub1, hive2, sub2, subpath);
+    }
+
+    free(b);
+}
+
+// Compacts a copy of the hive, and checks that it holds exactly what the original and the
+// model do, in less space.
+static void check_compact(EFI_FILE_HANDLE system32, const gen_key* model, const char* label, uint32_t hive_size,
+                          bool garbage) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE file;
+    EFI_REGISTRY_HIVE *hive1, *hive2;
+    HKEY root1, root2;
+    void* data;
+    uint32_t size;
+    char s[256];
+
+    for (unsigned int i = 0; i < 2; i++) {
+        Status = system32->Open(system32, &file, L"config\\SYSTEM", EFI_FILE_MODE_READ, 0);
+        if (EFI_ERROR(Status)) {
+            fail("%s: could not open hive", label);
+            return;
+        }
+
+        Status = reg->OpenHive(file, i == 0 ? &hive1 : &hive2);
+        file->Close(file);
+
+        if (EFI_ERROR(Status)) {
+            fail("%s: OpenHive returned %s", label, error_string(Status));
+
+            if (i == 1)
+                hive1->Close(hive1);
+
+            return;
+        }
+    }
+
+    Status = hive2->Compact(hive2);
+    if (EFI_ERROR(Status)) {
+        fail("%s: Compact returned %s", label, error_string(Status));
+        goto end;
+    }
+
+    snprintf(s, sizeof(s), "%s, compacted", label);
+
+    hive1->FindRoot(hive1, &root1);
+    hive2->FindRoot(hive2, &root2);
+
+    check_key(hive2, root2, model, s);
+    compare_keys(hive1, root1, hive2, root2, s);
+
+    // compacting again should change nothing
+
+    Status = hive2->Compact(hive2);
+    if (EFI_ERROR(Status)) {
+        fail("%s: second Compact returned %s", label, error_string(Status));
+        goto end;
+    }
+
+    hive2->FindRoot(hive2, &root2);
+    compare_keys(hive1, root1, hive2, root2, s);
+
+    Status = hive2->StealData(hive2, &data, &size);
+    if (EFI_ERROR(Status)) {
+        fail("%s: StealData returned %s", label, error_string(Status));
+        goto end;
+    }
+
+    if (size > PAGE_COUNT(hive_size) * EFI_PAGE_SIZE || (garbage && size >= hive_size))
+        fail("%s: compacted hive is %u bytes, was %u", label, size, hive_size);
+
+    bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)data, PAGE_COUNT(size));
+
+end:
+    hive1->Close(hive1);
+    hive2->Close(hive2);
+}
+
+static const gen_value* model_value(const gen_key* key, const char* name) {
+    WCHAR w[64];
+
+    widen(name, w);
+
+    for (unsigned int i = 0; i < key->num_values; i++) {
+        if (names_equal(key->values[i].name, key->values[i].name_len, w, wcslen(w)))
+            return &key->values[i];
+    }
+
+    return NULL;
+}
+
+static const gen_key* model_key(const gen_key* key, const char* path) {
+    char part[256];
+
+    while (key && *path) {
+        WCHAR w[256];
+        size_t len = 0;
+
+        while (path[len] != 0 && path[len] != '\\') {
+            part[len] = path[len];
+            len++;
+        }
+
+        part[len] = 0;
+        widen(part, w);
+
+        key = gen_find_child(key, w);
+        path += len;
+
+        if (*path == '\\')
+            path++;
+    }
+
+    return key;
+}
+
+static bool model_dword(const gen_key* key, const char* name, uint32_t* val) {
+    const gen_value* v = model_value(key, name);
+
+    if (!v || v->type != REG_DWORD || v->size != sizeof(uint32_t))
+        return false;
+
+    *val = *(uint32_t*)v->data;
+
+    return true;
+}
+
+// Where a group comes in ServiceGroupOrder, or past the end if it isn't there.
+static unsigned int group_index(const gen_key* sgo, const WCHAR* group) {
+    const gen_value* list = model_value(sgo, "List");
+    const WCHAR* s = (const WCHAR*)list->data;
+    unsigned int i = 0;
+
+    if (!group)
+        return 0xffffffff;
+
+    while (s[0] != 0) {
+        if (!wcsicmp(s, group))
+            return i;
+
+        s = &s[wcslen(s) + 1];
+        i++;
+    }
+
+    return 0xffffffff;
+}
+
+// Checks that the replay found the drivers the model says are boot drivers, in group order.
+static void check_replay(const gen_key* model, const replay_params* params, const replay_result* res) {
+    const gen_key* services = model_key(model, "ControlSet001\\Services");
+    const gen_key* sgo = model_key(model, "ControlSet001\\Control\\ServiceGroupOrder");
+    unsigned int expected = 0, last_group = 0;
+    char s[256];
+
+    for (unsigned int i = 0; i < services->num_children; i++) {
+        const gen_key* svc = services->children[i];
+        uint32_t type, start;
+        bool fs = !wcsicmp(svc->name, fs_driver);
+        bool found = false;
+
+        if (svc->name_len >= 255)
+            continue;
+
+        if (!model_dword(svc, "Type", &type) || (type != SERVICE_KERNEL_DRIVER && type != SERVICE_FILE_SYSTEM_DRIVER))
+            continue;
+
+        if (!model_dword(svc, "Start", &start) || (start != SERVICE_BOOT_START && !fs))
+            continue;
+
+        if (params->version >= _WIN32_WINNT_WIN8 && !fs) {
+            const gen_key* so = model_key(svc, "StartOverride");
+
+            if (so && model_dword(so, "0", &start) && start != SERVICE_BOOT_START)
+                continue;
+        }
+
+        expected++;
+
+        for (unsigned int j = 0; j < res->num_drivers; j++) {
+            if (names_equal(res->driver_names[j], wcslen(res->driver_names[j]), svc->name, svc->name_len)) {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found)
+            fail("%s: boot driver %s not loaded", params->label, narrow(svc->name, svc->name_len, s, sizeof(s)));
+    }
+
+    if (res->num_drivers != expected)
+        fail("%s: %u boot drivers loaded, expected %u", params->label, res->num_drivers, expected);
+
+    for (unsigned int i = 0; i < res->num_drivers; i++) {
+        unsigned int group = group_index(sgo, res->driver_groups[i]);
+
+        if (group < last_group) {
+            fail("%s: boot driver %s is out of group order", params->label,
+                 narrow(res->driver_names[i], wcslen(res->driver_names[i]), s, sizeof(s)));
+        }
+
+        last_group = group;
+    }
+
+    if (res->nls_size[0] != 66082 || res->nls_size[1] != 66082 || res->nls_size[2] != 7796)
+        fail("%s: wrong NLS files read", params->label);
+
+    if (res->errata_size != 9394)
+        fail("%s: errata INF not read", params->label);
+
+    if (!res->hive_data || res->hive_size < 0x2000)
+        fail("%s: hive data not returned", params->label);
+}
+
+static const replay_params replays[] = {
+    { "Windows 10", _WIN32_WINNT_WIN10, 19041, false },
+    { "Windows 10, compacted", _WIN32_WINNT_WIN10, 19041, true },
+    { "Windows 7", _WIN32_WINNT_WIN7, 7601, false },
+    { "Windows XP", _WIN32_WINNT_WINXP, 2600, false },
+};
+
+#define NUM_REPLAYS (sizeof(replays) / sizeof(replays[0]))
+
+static bool check_windir(const char* tmp, const char* label, const hive_params* params) {
+    EFI_STATUS Status;
+    char windir[4096], path[4096];
+    gen_key* model;
+    unsigned int num_keys;
+    uint32_t hive_size;
+    EFI_FILE_HANDLE file;
+    EFI_REGISTRY_HIVE* hive;
+    HKEY root;
+    unsigned int failures_before = failures;
+
+    snprintf(windir, sizeof(windir), "%s/%s", tmp, label);
+
+    if (!make_windir(windir, params, &model, &num_keys, &hive_size))
+        return false;
+
+    printf("%s: %u services, %u keys, %u bytes\n", label, params->services, num_keys, hive_size);
+
+    snprintf(path, sizeof(path), "%s/System32/config/SYSTEM", windir);
+
+    Status = host_open_file(path, &file);
+    if (EFI_ERROR(Status)) {
+        fail("%s: could not open hive", label);
+        gen_free_key(model);
+        return false;
+    }
+
+    Status = reg->OpenHive(file, &hive);
+    file->Close(file);
+
+    if (EFI_ERROR(Status)) {
+        fail("%s: OpenHive returned %s", label, error_string(Status));
+        gen_free_key(model);
+        return false;
+    }
+
+    hive->FindRoot(hive, &root);
+
+    check_key(hive, root, model, label);
+
+    // paths of more than one component, which also go through the key cache
+
+    {
+        static const char* paths[] = {
+            "ControlSet001\\Control\\Nls\\CodePage", "controlset001\\CONTROL\\nls\\codepage\\",
+            "ControlSet001\\Services\\btrfs", "ControlSet001\\Control\\Class\\0003\\0002"
+        };
+        static const char* missing[] = {
+            "ControlSet001\\Control\\Nls\\NoSuchKey", "ControlSet002\\Control",
+            "ControlSet001\\Control\\Class\\0003\\0002\\0000"
+        };
+
+        for (unsigned int i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+            WCHAR w[256];
+            HKEY key;
+
+            widen(paths[i], w);
+
+            Status = hive->FindKey(hive, root, w, &key);
+            if (EFI_ERROR(Status))
+                fail("%s: FindKey %s returned %s", label, paths[i], error_string(Status));
+        }
+
+        for (unsigned int i = 0; i < sizeof(missing) / sizeof(missing[0]); i++) {
+            WCHAR w[256];
+            HKEY key;
+
+            widen(missing[i], w);
+
+            Status = hive->FindKey(hive, root, w, &key);
+            if (Status != EFI_NOT_FOUND)
+                fail("%s: FindKey %s returned %s", label, missing[i], error_string(Status));
+        }
+    }
+
+    hive->Close(hive);
+
+    {
+        EFI_FILE_HANDLE dir, system32;
+
+        if (!EFI_ERROR(open_windir(windir, &dir, &system32))) {
+            check_compact(system32, model, label, hive_size, params->garbage != 0);
+
+            system32->Close(system32);
+            dir->Close(dir);
+        }
+    }
+
+    for (unsigned int i = 0; i < NUM_REPLAYS; i++) {
+        replay_result res;
+        replay_params rp = replays[i];
+        char rlabel[256];
+
+        snprintf(rlabel, sizeof(rlabel), "%s, %s", label, replays[i].label);
+        rp.label = rlabel;
+
+        Status = replay_boot(windir, &rp, &res);
+        if (EFI_ERROR(Status))
+            fail("%s: replay returned %s", rlabel, error_string(Status));
+        else
+            check_replay(model, &rp, &res);
+
+        free_replay(&res);
+    }
+
+    if (host_counters.pages_in_use != 0)
+        fail("%s: %" PRIu64 " pages leaked", label, host_counters.pages_in_use);
+
+    gen_free_key(model);
+
+    printf("%s: %s\n", label, failures == failures_before ? "passed" : "FAILED");
+
+    return true;
+}
+
+static int do_check(void) {
+    char tmp[] = "/tmp/reg_test.XXXXXX";
+    hive_params params;
+
+    if (!mkdtemp(tmp)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    memset(&params, 0, sizeof(params));
+
+    params.services = 300;
+    params.boot_drivers = 60;
+    params.leaf_size = 511;
+    params.seed = 1;
+    check_windir(tmp, "small", &params);
+
+    // a clean hive, with no free cells
+
+    params.garbage = 0;
+    params.seed = 2;
+    check_windir(tmp, "clean", &params);
+
+    // small leaves, so that most lists with more than a few keys are ri lists
+
+    params.services = 2000;
+    params.boot_drivers = 150;
+    params.leaf_size = 16;
+    params.garbage = 20;
+    params.seed = 3;
+    check_windir(tmp, "ri", &params);
+
+    params.services = 6000;
+    params.boot_drivers = 200;
+    params.leaf_size = 511;
+    params.garbage = 10;
+    params.seed = 4;
+    check_windir(tmp, "medium", &params);
+
+    // a chain of keys too deep to copy by recursing on the firmware's stack
+
+    params.services = 100;
+    params.boot_drivers = 20;
+    params.depth = 5000;
+    params.seed = 5;
+    check_windir(tmp, "deep", &params);
+
+    remove_tree(tmp);
+
+    if (failures > 0) {
+        printf("%u failures.\n", failures);
+        return 1;
+    }
+
+    printf("All tests passed.\n");
+
+    return 0;
+}
+
+// benchmarks
+
+#define BENCH_NS 200000000ull // how long to spend on each measurement
+#define BENCH_MIN_RUNS 3
+
+typedef struct {
+    EFI_REGISTRY_HIVE* hive;
+    HKEY root;
+    HKEY services;
+    unsigned int count;
+    WCHAR** names;
+    WCHAR** missing; // names with ~ on the end
+    WCHAR** paths; // from the root, through the control set
+    HKEY* keys;
+} lookup_ctx;
+
+typedef void (*bench_fn)(lookup_ctx* ctx);
+
+// Returns the best time for one run of fn, in nanoseconds.
+static uint64_t best_time(bench_fn fn, lookup_ctx* ctx) {
+    uint64_t best = UINT64_MAX, total = 0;
+    unsigned int runs = 0;
+
+    while (runs < BENCH_MIN_RUNS || total < BENCH_NS) {
+        uint64_t start = host_ns(), t;
+
+        fn(ctx);
+
+        t = host_ns() - start;
+
+        if (t < best)
+            best = t;
+
+        total += t;
+        runs++;
+    }
+
+    return best;
+}
+
+static void bench_find_hits(lookup_ctx* ctx) {
+    for (unsigned int i = 0; i < ctx->count; i++) {
+        HKEY key;
+
+        if (EFI_ERROR(ctx->hive->FindKey(ctx->hive, ctx->services, ctx->names[i], &key)))
+            fail("FindKey failed");
+    }
+}
+
+static void bench_find_misses(lookup_ctx* ctx) {
+    for (unsigned int i = 0; i < ctx->count; i++) {
+        HKEY key;
+
+        if (ctx->hive->FindKey(ctx->hive, ctx->services, ctx->missing[i], &key) != EFI_NOT_FOUND)
+            fail("FindKey found a missing key");
+    }
+}
+
+static void bench_find_paths(lookup_ctx* ctx) {
+    for (unsigned int i = 0; i < ctx->count; i++) {
+        HKEY key;
+
+        if (EFI_ERROR(ctx->hive->FindKey(ctx->hive, ctx->root, ctx->paths[i], &key)))
+            fail("FindKey failed");
+    }
+}
+
+static void bench_enum_keys(lookup_ctx* ctx) {
+    WCHAR name[NAME_BUF];
+
+    for (unsigned int i = 0; i < ctx->count; i++) {
+        if (EFI_ERROR(ctx->hive->EnumKeys(ctx->hive, ctx->services, i, name, NAME_BUF)))
+            fail("EnumKeys failed");
+    }
+}
+
+static void bench_next_key(lookup_ctx* ctx) {
+    WCHAR name[NAME_BUF];
+    UINT32 position = 0;
+    HKEY key;
+
+    for (unsigned int i = 0; i < ctx->count; i++) {
+        if (EFI_ERROR(ctx->hive->NextKey(ctx->hive, ctx->services, &position, &key, name, NAME_BUF)))
+            fail("NextKey failed");
+    }
+}
+
+static void bench_query_value(lookup_ctx* ctx) {
+    for (unsigned int i = 0; i < ctx->count; i++) {
+        WCHAR data[MAX_PATH];
+        uint32_t length = sizeof(data), type;
+
+        ctx->hive->QueryValue(ctx->hive, ctx->keys[i], L"ImagePath", data, &length, &type);
+    }
+}
+
+static void bench_query_values(lookup_ctx* ctx) {
+    for (unsigned int i = 0; i < ctx->count; i++) {
+        EFI_REGISTRY_VALUE_QUERY values[5];
+
+        values[0].Name = L"Type";
+        values[1].Name = L"Start";
+        values[2].Name = L"ImagePath";
+        values[3].Name = L"Group";
+        values[4].Name = L"Tag";
+
+        ctx->hive->QueryValues(ctx->hive, ctx->keys[i], values, sizeof(values) / sizeof(values[0]));
+    }
+}
+
+static EFI_STATUS open_hive(const char* windir, EFI_REGISTRY_HIVE** hive, uint64_t* ns, uint64_t* read_ns,
+                            uint64_t* size) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE dir, system32, file;
+    uint64_t start;
+
+    Status = open_windir(windir, &dir, &system32);
+    if (EFI_ERROR(Status))
+        return Status;
+
+    Status = system32->Open(system32, &file, L"config\\SYSTEM", EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR(Status)) {
+        printf("Could not open %s/System32/config/SYSTEM.\n", windir);
+        goto end;
+    }
+
+    if (size || read_ns) {
+        EFI_GUID guid = EFI_FILE_INFO_ID;
+        uint8_t buf[sizeof(EFI_FILE_INFO) + (MAX_PATH * sizeof(WCHAR))];
+        UINTN len = sizeof(buf);
+        EFI_FILE_INFO* info = (EFI_FILE_INFO*)buf;
+
+        Status = file->GetInfo(file, &guid, &len, info);
+        if (EFI_ERROR(Status)) {
+            file->Close(file);
+            goto end;
+        }
+
+        if (size)
+            *size = info->FileSize;
+
+        // just reading the file, for comparison
+        if (read_ns) {
+            UINTN read_size = PAGE_COUNT(info->FileSize) * EFI_PAGE_SIZE;
+            void* data = malloc(read_size);
+
+            start = host_ns();
+            file->Read(file, &read_size, data);
+            *read_ns = host_ns() - start;
+
+            free(data);
+            file->SetPosition(file, 0);
+        }
+    }
+
+    start = host_ns();
+    Status = reg->OpenHive(file, hive);
+
+    if (ns)
+        *ns = host_ns() - start;
+
+    file->Close(file);
+
+end:
+    system32->Close(system32);
+    dir->Close(dir);
+
+    return Status;
+}
+
+// Finds the current control set's Services key, and the names of all the keys in it.
+static bool get_services(lookup_ctx* ctx) {
+    EFI_STATUS Status;
+    WCHAR name[NAME_BUF], ccs_name[14];
+    UINT32 position = 0;
+    uint32_t set, length = sizeof(set), type;
+    HKEY key, ccs;
+    unsigned int alloc = 0;
+    EFI_REGISTRY_HIVE* hive = ctx->hive;
+
+    hive->FindRoot(hive, &ctx->root);
+
+    if (EFI_ERROR(hive->FindKey(hive, ctx->root, L"Select", &key)) ||
+        EFI_ERROR(hive->QueryValue(hive, key, L"Default", &set, &length, &type))) {
+        printf("Could not read Select\\Default.\n");
+        return false;
+    }
+
+    wcsncpy(ccs_name, L"ControlSet00x", sizeof(ccs_name) / sizeof(WCHAR));
+    ccs_name[12] = (set % 10) + '0';
+
+    if (EFI_ERROR(hive->FindKey(hive, ctx->root, ccs_name, &ccs)) ||
+        EFI_ERROR(hive->FindKey(hive, ccs, L"Services", &ctx->services))) {
+        printf("Could not find Services key.\n");
+        return false;
+    }
+
+    ctx->count = 0;
+
+    while (true) {
+        size_t len;
+
+        Status = hive->NextKey(hive, ctx->services, &position, &key, name, NAME_BUF);
+        if (Status == EFI_NOT_FOUND)
+            break;
+        else if (EFI_ERROR(Status))
+            continue;
+
+        if (ctx->count == alloc) {
+            alloc = alloc == 0 ? 1024 : alloc * 2;
+            ctx->names = realloc(ctx->names, alloc * sizeof(WCHAR*));
+            ctx->missing = realloc(ctx->missing, alloc * sizeof(WCHAR*));
+            ctx->paths = realloc(ctx->paths, alloc * sizeof(WCHAR*));
+            ctx->keys = realloc(ctx->keys, alloc * sizeof(HKEY));
+        }
+
+        len = wcslen(name);
+
+        ctx->names[ctx->count] = wcsdup16(name);
+
+        ctx->missing[ctx->count] = malloc((len + 2) * sizeof(WCHAR));
+        memcpy(ctx->missing[ctx->count], name, len * sizeof(WCHAR));
+        ctx->missing[ctx->count][len] = '~';
+        ctx->missing[ctx->count][len + 1] = 0;
+
+        ctx->paths[ctx->count] = malloc((len + 24) * sizeof(WCHAR));
+        memcpy(ctx->paths[ctx->count], ccs_name, 13 * sizeof(WCHAR));
+        memcpy(&ctx->paths[ctx->count][13], L"\\Services\\", 10 * sizeof(WCHAR));
+        memcpy(&ctx->paths[ctx->count][23], name, (len + 1) * sizeof(WCHAR));
+
+        ctx->keys[ctx->count] = key;
+        ctx->count++;
+    }
+
+    return ctx->count > 0;
+}
+
+static void free_lookups(lookup_ctx* ctx) {
+    for (unsigned int i = 0; i < ctx->count; i++) {
+        free(ctx->names[i]);
+        free(ctx->missing[i]);
+        free(ctx->paths[i]);
+    }
+
+    free(ctx->names);
+    free(ctx->missing);
+    free(ctx->paths);
+    free(ctx->keys);
+}
+
+static void print_ns(const char* what, uint64_t ns, unsigned int calls) {
+    printf("  %-28s %10.1f ns/call\n", what, (double)ns / calls);
+}
+
+static void bench_windir(const char* windir, const char* label) {
+    EFI_STATUS Status;
+    EFI_REGISTRY_HIVE* hive;
+    uint64_t size = 0, best = UINT64_MAX, best_read = UINT64_MAX, total = 0;
+    unsigned int runs = 0;
+    lookup_ctx ctx;
+
+    // OpenHive, which includes scan_bins clearing the volatile subkeys of every key
+
+    while (runs < BENCH_MIN_RUNS || total < 5 * BENCH_NS) {
+        uint64_t ns, read_ns;
+
+        Status = open_hive(windir, &hive, &ns, &read_ns, &size);
+        if (EFI_ERROR(Status)) {
+            printf("%s: OpenHive returned %s.\n", label, error_string(Status));
+            return;
+        }
+
+        hive->Close(hive);
+
+        if (ns < best)
+            best = ns;
+
+        if (read_ns < best_read)
+            best_read = read_ns;
+
+        total += ns;
+        runs++;
+    }
+
+    printf("%s: %.1f MB\n", label, (double)size / 1048576);
+    printf("  %-28s %10.2f ms (%.0f MB/s; reading the file alone %.2f ms)\n", "OpenHive", (double)best / 1000000,
+           ((double)size / 1048576) / ((double)best / 1000000000), (double)best_read / 1000000);
+
+    Status = open_hive(windir, &hive, NULL, NULL, NULL);
+    if (EFI_ERROR(Status))
+        return;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.hive = hive;
+
+    if (!get_services(&ctx)) {
+        hive->Close(hive);
+        free_lookups(&ctx);
+        return;
+    }
+
+    printf("  %u keys in Services\n", ctx.count);
+
+    print_ns("FindKey Services\\<name>", best_time(bench_find_hits, &ctx), ctx.count);
+    print_ns("FindKey, missing", best_time(bench_find_misses, &ctx), ctx.count);
+    print_ns("FindKey ControlSet\\...\\<name>", best_time(bench_find_paths, &ctx), ctx.count);
+    print_ns("EnumKeys over Services", best_time(bench_enum_keys, &ctx), ctx.count);
+    print_ns("NextKey over Services", best_time(bench_next_key, &ctx), ctx.count);
+    print_ns("QueryValue ImagePath", best_time(bench_query_value, &ctx), ctx.count);
+    print_ns("QueryValues, 5 values", best_time(bench_query_values, &ctx), ctx.count);
+
+    hive->Close(hive);
+    free_lookups(&ctx);
+
+    // Compact, on a freshly opened hive each time
+
+    best = UINT64_MAX;
+    total = 0;
+    runs = 0;
+
+    while (runs < BENCH_MIN_RUNS || total < BENCH_NS) {
+        uint64_t start, ns;
+
+        Status = open_hive(windir, &hive, NULL, NULL, NULL);
+        if (EFI_ERROR(Status))
+            return;
+
+        start = host_ns();
+        Status = hive->Compact(hive);
+        ns = host_ns() - start;
+
+        hive->Close(hive);
+
+        if (EFI_ERROR(Status)) {
+            printf("  Compact returned %s.\n", error_string(Status));
+            break;
+        }
+
+        if (ns < best)
+            best = ns;
+
+        total += ns;
+        runs++;
+    }
+
+    if (!EFI_ERROR(Status))
+        printf("  %-28s %10.2f ms\n", "Compact", (double)best / 1000000);
+
+    // the boot
+
+    for (unsigned int i = 0; i < NUM_REPLAYS; i++) {
+        replay_result res;
+        char s[256];
+
+        best = UINT64_MAX;
+        total = 0;
+        runs = 0;
+
+        while (runs < BENCH_MIN_RUNS || total < BENCH_NS) {
+            uint64_t start, ns;
+
+            host_reset_counters();
+
+            start = host_ns();
+            Status = replay_boot(windir, &replays[i], &res);
+            ns = host_ns() - start;
+
+            if (EFI_ERROR(Status)) {
+                printf("  replay %s returned %s.\n", replays[i].label, error_string(Status));
+                free_replay(&res);
+                break;
+            }
+
+            if (ns < best)
+                best = ns;
+
+            total += ns;
+            runs++;
+
+            if (total >= BENCH_NS && runs >= BENCH_MIN_RUNS)
+                break;
+
+            free_replay(&res);
+        }
+
+        if (EFI_ERROR(Status))
+            continue;
+
+        snprintf(s, sizeof(s), "boot, %s", replays[i].label);
+        printf("  %-28s %10.2f ms (%u boot drivers)\n", s, (double)best / 1000000, res.num_drivers);
+
+        host_print_counters("    ");
+
+        free_replay(&res);
+    }
+}
+
+static int do_bench(int argc, char** argv) {
+    static const unsigned int sizes[] = { 1000, 10000, 50000 };
+    char tmp[] = "/tmp/reg_test.XXXXXX";
+
+    if (argc > 0) {
+        for (int i = 0; i < argc; i++) {
+            bench_windir(argv[i], argv[i]);
+        }
+
+        return failures > 0 ? 1 : 0;
+    }
+
+    if (!mkdtemp(tmp)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        hive_params params;
+        char windir[4096], label[64];
+        unsigned int num_keys;
+        uint32_t hive_size;
+
+        memset(&params, 0, sizeof(params));
+        params.services = sizes[i];
+        params.boot_drivers = 150;
+        params.leaf_size = 511;
+        params.garbage = 10;
+        params.seed = i + 1;
+
+        snprintf(windir, sizeof(windir), "%s/%u", tmp, sizes[i]);
+
+        if (!make_windir(windir, &params, NULL, &num_keys, &hive_size))
+            break;
+
+        snprintf(label, sizeof(label), "%u services, %u keys", sizes[i], num_keys);
+
+        bench_windir(windir, label);
+    }
+
+    remove_tree(tmp);
+
+    return failures > 0 ? 1 : 0;
+}
+
+static int do_gen(int argc, char** argv) {
+    hive_params params;
+    unsigned int num_keys;
+    uint32_t hive_size;
+
+    if (argc < 2) {
+        printf("Usage: reg_test gen <dir> <services> [seed]\n");
+        return 1;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.services = atoi(argv[1]);
+    params.boot_drivers = 150;
+    params.leaf_size = 511;
+    params.garbage = 10;
+    params.seed = argc > 2 ? atoi(argv[2]) : 1;
+
+    if (!make_windir(argv[0], &params, NULL, &num_keys, &hive_size))
+        return 1;
+
+    printf("%s: %u services, %u keys, %u bytes\n", argv[0], params.services, num_keys, hive_size);
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    EFI_GUID reg_guid = WINDOWS_REGISTRY_PROTOCOL;
+    EFI_STATUS Status;
+
+    host_init();
+
+    Status = reg_register(bs);
+    if (EFI_ERROR(Status)) {
+        printf("reg_register returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    Status = bs->LocateProtocol(&reg_guid, NULL, (void**)&reg);
+    if (EFI_ERROR(Status)) {
+        printf("LocateProtocol returned %s.\n", error_string(Status));
+        return 1;
+    }
+
+    if (argc >= 2 && !strcmp(argv[1], "bench"))
+        return do_bench(argc - 2, argv + 2);
+    else if (argc >= 2 && !strcmp(argv[1], "gen"))
+        return do_gen(argc - 2, argv + 2);
+    else if (argc == 1 || !strcmp(argv[1], "check"))
+        return do_check();
+
+    printf("Usage: reg_test [check | gen <dir> <services> [seed] | bench [dir...]]\n");
+
+    return 1;
+}
@@ -0,0 +1,514 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host.h"
+#include "replay.h"
+#include "x86.h"
+#include "misc.h"
+#include "print.h"
+
+extern void* apiset; // apiset.c
+
+static EFI_BOOT_SERVICES* bs = &host_bs;
+
+static uint64_t load_ns;
+
+// as boot.c's verify_data_file, without /VERIFY
+EFI_STATUS verify_data_file(EFI_BOOT_SERVICES* bs, EFI_FILE_HANDLE dir, const WCHAR* name, command_line* cmdline,
+                            void** data, size_t* size) {
+    (void)bs;
+    (void)dir;
+    (void)name;
+    (void)cmdline;
+    (void)size;
+
+    *data = NULL;
+
+    return EFI_SUCCESS;
+}
+
+// as boot.c's load_image, without the debugger and kernel and HAL overrides, and without
+// verifying signatures
+EFI_STATUS load_image(image* img, WCHAR* name, EFI_PE_LOADER_PROTOCOL* pe, void* va, EFI_FILE_HANDLE dir,
+                      command_line* cmdline, uint16_t build) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE file;
+    uint64_t start;
+
+    (void)cmdline;
+    (void)build;
+
+    Status = open_file(dir, &file, name);
+    if (EFI_ERROR(Status)) {
+        if (Status != EFI_NOT_FOUND) {
+            char s[255], *p;
+
+            p = stpcpy(s, "Loading of ");
+            p = stpcpy_utf16(p, name);
+            p = stpcpy(p, " failed.\n");
+
+            print_string(s);
+
+            print_error("file open", Status);
+        }
+
+        return Status;
+    }
+
+    img->va = va;
+
+    start = host_ns();
+
+    Status = pe->LoadAt(file, va, NULL, &img->img);
+
+    load_ns += host_ns() - start;
+
+    if (EFI_ERROR(Status)) {
+        print_error("PE load", Status);
+        file->Close(file);
+        return Status;
+    }
+
+    file->Close(file);
+
+    return EFI_SUCCESS;
+}
+
+// The API set schema is only mapped for NT's benefit.
+EFI_STATUS add_mapping(EFI_BOOT_SERVICES* bs, LIST_ENTRY* mappings, void* va, void* pa, unsigned int pages,
+                       TYPE_OF_MEMORY type) {
+    (void)bs;
+    (void)mappings;
+    (void)va;
+    (void)pa;
+    (void)pages;
+    (void)type;
+
+    return EFI_SUCCESS;
+}
+
+// boot replay
+
+void free_images(LIST_ENTRY* images, uint16_t version) {
+    while (!IsListEmpty(images)) {
+        image* img = _CR(images->Flink, image, list_entry);
+
+        RemoveEntryList(&img->list_entry);
+
+        if (img->img)
+            img->img->Free(img->img);
+
+        if (img->import_list)
+            bs->FreePool(img->import_list);
+
+        bs->FreePool(img);
+    }
+
+    init_images();
+
+    // on 8.1 and later read_api_set_section allocates the schema, on 8 it's part of the DLL
+    if (version > _WIN32_WINNT_WIN8 && apiset) {
+        bs->FreePages((EFI_PHYSICAL_ADDRESS)(uintptr_t)apiset, PAGE_COUNT(apisetsize));
+        apiset = NULL;
+    }
+}
+
+static uint64_t fnv64_update(uint64_t hash, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+// Checksums each image as it is in memory once everything's done, in the order NT gets them.
+static void checksum_images(LIST_ENTRY* images, load_result* res) {
+    LIST_ENTRY* le = images->Flink;
+
+    res->checksum = 0xcbf29ce484222325;
+    res->num_images = 0;
+    res->image_bytes = 0;
+
+    while (le != images) {
+        image* img = _CR(le, image, list_entry);
+        UINT32 size = img->img->GetSize(img->img);
+
+        res->checksum = fnv64_update(res->checksum, (uint8_t*)img->name, wcslen(img->name) * sizeof(WCHAR));
+        res->checksum = fnv64_update(res->checksum, img->img->Data, size);
+        res->num_images++;
+        res->image_bytes += size;
+
+        le = le->Flink;
+    }
+}
+
+EFI_STATUS replay_load(EFI_PE_LOADER_PROTOCOL* pe, EFI_FILE_HANDLE windir, uint16_t version,
+                       const boot_driver* drivers, unsigned int num_drivers, const load_mode* mode,
+                       LIST_ENTRY* images, load_result* res) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE system32 = NULL, drivers_dir = NULL;
+    LIST_ENTRY* le;
+    void* va;
+    void* va2;
+    uint64_t start, loop_start, loop_load_ns;
+    image* kernel;
+
+    static const WCHAR drivers_dir_path[] = L"system32\\drivers";
+
+    memset(res, 0, sizeof(load_result));
+    load_ns = 0;
+
+    InitializeListHead(images);
+    init_images();
+
+    start = host_ns();
+
+    Status = open_file(windir, &system32, L"system32");
+    if (EFI_ERROR(Status)) {
+        print_error("open_file", Status);
+        return Status;
+    }
+
+    Status = add_image(bs, images, L"ntoskrnl.exe", LoaderSystemCode, L"system32", false, NULL, 0, false);
+    if (EFI_ERROR(Status)) {
+        print_error("add_image", Status);
+        goto end;
+    }
+
+    Status = add_image(bs, images, L"hal.dll", LoaderHalCode, L"system32", true, NULL, 0, false);
+    if (EFI_ERROR(Status)) {
+        print_error("add_image", Status);
+        goto end;
+    }
+
+    va = (void*)0xfffff80000000000;
+    va2 = (void*)0xfffff80800000000;
+
+    pe->DeferRelocations(mode->defer);
+    pe->HashFiles(mode->hash);
+
+    kernel = _CR(images->Flink, image, list_entry);
+
+    Status = load_image(kernel, L"ntoskrnl.exe", pe, va2, system32, NULL, 0);
+    if (EFI_ERROR(Status)) {
+        print_error("load_image", Status);
+        goto end;
+    }
+
+    // generated kernels don't have a version resource, so the caller says what they are
+    if (version == 0) {
+        UINT32 version_ms, version_ls;
+        uint16_t build;
+
+        Status = kernel->img->GetVersion(kernel->img, &version_ms, &version_ls);
+        if (EFI_ERROR(Status)) {
+            print_error("GetVersion", Status);
+            goto end;
+        }
+
+        version = ((version_ms >> 16) << 8) | (version_ms & 0xff);
+        build = version_ls >> 16;
+
+        if (build == 9200)
+            version = _WIN32_WINNT_WIN8;
+        else if (build == 9600)
+            version = _WIN32_WINNT_WINBLUE;
+        else if (version == 0x0700)
+            version = _WIN32_WINNT_WIN7;
+    }
+
+    res->version = version;
+
+    // as load_drivers
+    for (unsigned int i = 0; i < num_drivers; i++) {
+        Status = add_image(bs, images, drivers[i].file, LoaderSystemCode, drivers[i].dir, false, NULL, i + 1, false);
+        if (EFI_ERROR(Status)) {
+            print_error("add_image", Status);
+            goto end;
+        }
+    }
+
+    if (version >= _WIN32_WINNT_WIN8) {
+        Status = load_api_set(bs, images, pe, system32, &va, version, NULL, NULL);
+        if (EFI_ERROR(Status)) {
+            print_error("load_api_set", Status);
+            goto end;
+        }
+    }
+
+    if (version >= _WIN32_WINNT_WINBLUE) {
+        Status = add_image(bs, images, L"crashdmp.sys", LoaderSystemCode, drivers_dir_path, false, NULL, 0, false);
+        if (EFI_ERROR(Status)) {
+            print_error("add_image", Status);
+            goto end;
+        }
+    }
+
+    va = va2;
+
+    Status = open_file(windir, &drivers_dir, drivers_dir_path);
+    if (EFI_ERROR(Status))
+        drivers_dir = NULL;
+
+    loop_start = host_ns();
+    loop_load_ns = load_ns;
+
+    le = images->Flink;
+    while (le != images) {
+        image* img = _CR(le, image, list_entry);
+
+        if (!img->img) {
+            if (drivers_dir && !wcsicmp(img->dir, drivers_dir_path))
+                Status = load_image(img, img->name, pe, va, drivers_dir, NULL, 0);
+            else {
+                EFI_FILE_HANDLE dir;
+
+                Status = open_file(windir, &dir, img->dir);
+                if (EFI_ERROR(Status)) {
+                    print_error("open_file", Status);
+                    goto end;
+                }
+
+                Status = load_image(img, img->name, pe, va, dir, NULL, 0);
+
+                dir->Close(dir);
+
+                if (Status == EFI_NOT_FOUND && drivers_dir)
+                    Status = load_image(img, img->name, pe, va, drivers_dir, NULL, 0);
+            }
+
+            if (EFI_ERROR(Status)) {
+                char s[255], *p;
+
+                p = stpcpy(s, "Could not load ");
+                p = stpcpy_utf16(p, img->name);
+                p = stpcpy(p, ".\n");
+                print_string(s);
+
+                print_error("load_image", Status);
+                goto end;
+            }
+        }
+
+        {
+            UINT32 size = img->img->GetSize(img->img);
+
+            if ((size % EFI_PAGE_SIZE) != 0)
+                size = ((size / EFI_PAGE_SIZE) + 1) * EFI_PAGE_SIZE;
+
+            va = (uint8_t*)va + size;
+        }
+
+        Status = add_image_imports(bs, images, img, version);
+        if (EFI_ERROR(Status)) {
+            print_error("add_image_imports", Status);
+            goto end;
+        }
+
+        le = le->Flink;
+    }
+
+    res->imports_ns = host_ns() - loop_start - (load_ns - loop_load_ns);
+
+    if (mode->defer) {
+        uint64_t reloc_start = host_ns();
+
+        pe->DeferRelocations(false);
+
+        le = images->Flink;
+        while (le != images) {
+            image* img = _CR(le, image, list_entry);
+
+            Status = img->img->Prepare(img->img);
+            if (EFI_ERROR(Status)) {
+                print_error("Prepare", Status);
+                goto end;
+            }
+
+            le = le->Flink;
+        }
+
+        res->reloc_ns = host_ns() - reloc_start;
+    }
+
+    fix_image_order(images);
+
+    {
+        uint64_t resolve_start = host_ns();
+
+        Status = resolve_image_imports(images, version);
+        if (EFI_ERROR(Status)) {
+            print_error("resolve_image_imports", Status);
+            goto end;
+        }
+
+        res->resolve_ns = host_ns() - resolve_start;
+    }
+
+    res->load_ns = load_ns;
+    res->total_ns = host_ns() - start;
+
+    checksum_images(images, res);
+
+end:
+    pe->DeferRelocations(false);
+    pe->HashFiles(false);
+
+    if (drivers_dir)
+        drivers_dir->Close(drivers_dir);
+
+    system32->Close(system32);
+
+    return Status;
+}
+
+// Reads the boot drivers out of System32\config\SYSTEM, as load_drivers does - but without
+// sorting them by group, which only changes the order they're loaded in.
+bool get_boot_drivers(EFI_REGISTRY_PROTOCOL* reg, EFI_FILE_HANDLE windir, boot_driver** drivers, unsigned int* num_drivers) {
+    EFI_STATUS Status;
+    EFI_FILE_HANDLE file;
+    EFI_REGISTRY_HIVE* hive;
+    HKEY root, key, ccs, services;
+    WCHAR name[255], ccs_name[14];
+    UINT32 position = 0;
+    uint32_t set, length = sizeof(set), type;
+    unsigned int alloc = 0;
+    bool ret = false;
+
+    static const WCHAR system_root[] = L"\\SystemRoot\\";
+
+    *drivers = NULL;
+    *num_drivers = 0;
+
+    Status = open_file(windir, &file, L"system32\\config\\SYSTEM");
+    if (EFI_ERROR(Status)) {
+        printf("Could not open System32\\config\\SYSTEM.\n");
+        return false;
+    }
+
+    Status = reg->OpenHive(file, &hive);
+
+    file->Close(file);
+
+    if (EFI_ERROR(Status)) {
+        printf("OpenHive returned %s.\n", error_string(Status));
+        return false;
+    }
+
+    hive->FindRoot(hive, &root);
+
+    if (EFI_ERROR(hive->FindKey(hive, root, L"Select", &key)) ||
+        EFI_ERROR(hive->QueryValue(hive, key, L"Default", &set, &length, &type))) {
+        printf("Could not read Select\\Default.\n");
+        goto end;
+    }
+
+    wcsncpy(ccs_name, L"ControlSet00x", sizeof(ccs_name) / sizeof(WCHAR));
+    ccs_name[12] = (set % 10) + '0';
+
+    if (EFI_ERROR(hive->FindKey(hive, root, ccs_name, &ccs)) ||
+        EFI_ERROR(hive->FindKey(hive, ccs, L"Services", &services))) {
+        printf("Could not find Services key.\n");
+        goto end;
+    }
+
+    while (true) {
+        EFI_REGISTRY_VALUE_QUERY values[3];
+        uint32_t start;
+        WCHAR image_path[MAX_PATH];
+        size_t pos;
+        boot_driver* d;
+
+        Status = hive->NextKey(hive, services, &position, &key, name, sizeof(name) / sizeof(WCHAR));
+        if (Status == EFI_NOT_FOUND)
+            break;
+        else if (EFI_ERROR(Status))
+            continue;
+
+        values[0].Name = L"Type";
+        values[1].Name = L"Start";
+        values[2].Name = L"ImagePath";
+
+        if (EFI_ERROR(hive->QueryValues(hive, key, values, sizeof(values) / sizeof(values[0]))))
+            continue;
+
+        if (EFI_ERROR(values[0].Status) || values[0].Type != REG_DWORD || values[0].DataLength != sizeof(uint32_t))
+            continue;
+
+        type = *(uint32_t*)values[0].Data;
+
+        if (type != SERVICE_KERNEL_DRIVER && type != SERVICE_FILE_SYSTEM_DRIVER)
+            continue;
+
+        if (EFI_ERROR(values[1].Status) || values[1].Type != REG_DWORD || values[1].DataLength != sizeof(uint32_t))
+            continue;
+
+        start = *(uint32_t*)values[1].Data;
+
+        if (start != SERVICE_BOOT_START)
+            continue;
+
+        if (!EFI_ERROR(values[2].Status) && (values[2].Type == REG_SZ || values[2].Type == REG_EXPAND_SZ) &&
+            values[2].DataLength + sizeof(WCHAR) <= sizeof(image_path)) {
+            memcpy(image_path, values[2].Data, values[2].DataLength);
+            image_path[values[2].DataLength / sizeof(WCHAR)] = 0;
+        } else {
+            wcsncpy(image_path, L"system32\\drivers\\", sizeof(image_path) / sizeof(WCHAR));
+            wcsncat(image_path, name, sizeof(image_path) / sizeof(WCHAR));
+            wcsncat(image_path, L".sys", sizeof(image_path) / sizeof(WCHAR));
+        }
+
+        if (wcslen(image_path) > (sizeof(system_root) / sizeof(WCHAR)) - 1 &&
+            !memcmp(image_path, system_root, sizeof(system_root) - sizeof(WCHAR))) {
+            memmove(image_path, &image_path[(sizeof(system_root) / sizeof(WCHAR)) - 1],
+                    (wcslen(image_path) + 2) * sizeof(WCHAR) - sizeof(system_root));
+        }
+
+        pos = wcslen(image_path);
+        while (pos > 0 && image_path[pos - 1] != '\\') {
+            pos--;
+        }
+
+        if (pos == 0)
+            continue;
+
+        if (*num_drivers == alloc) {
+            alloc = alloc == 0 ? 256 : alloc * 2;
+            *drivers = realloc(*drivers, alloc * sizeof(boot_driver));
+        }
+
+        d = &(*drivers)[*num_drivers];
+
+        image_path[pos - 1] = 0;
+        wcsncpy(d->dir, image_path, MAX_PATH);
+        wcsncpy(d->file, &image_path[pos], MAX_PATH);
+
+        (*num_drivers)++;
+    }
+
+    ret = true;
+
+end:
+    hive->Close(hive);
+
+    return ret;
+}
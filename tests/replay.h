@@ -0,0 +1,58 @@
+/* Copyright (c) Mark Harmstone 2020
+ *
+ * This file is part of Quibble.
+ *
+ * Quibble is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public Licence as published by
+ * the Free Software Foundation, either version 3 of the Licence, or
+ * (at your option) any later version.
+ *
+ * Quibble is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public Licence for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public Licence
+ * along with Quibble.  If not, see <http://www.gnu.org/licenses/>. */
+
+// The boot replay shared by pe_test and btrfs_test: it loads the images of a boot exactly as
+// boot.c's boot() does, from adding the kernel and HAL to resolving the imports, so keep it in
+// step with boot.c. The test provides open_file, which is what the replay opens everything with.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "quibble.h"
+#include "peload.h"
+#include "reg.h"
+
+typedef struct {
+    WCHAR dir[MAX_PATH];
+    WCHAR file[MAX_PATH];
+} boot_driver;
+
+typedef struct {
+    const char* label;
+    bool defer; // as with /PARALLELLOAD, though Prepare is called on one processor here
+    bool hash; // as with /VERIFY
+} load_mode;
+
+typedef struct {
+    uint16_t version;
+    unsigned int num_images;
+    uint64_t image_bytes;
+    uint64_t load_ns;
+    uint64_t imports_ns; // not counting the time spent in LoadAt
+    uint64_t reloc_ns; // 0 unless relocations are deferred, as otherwise LoadAt does them
+    uint64_t resolve_ns;
+    uint64_t total_ns;
+    uint64_t checksum;
+} load_result;
+
+EFI_STATUS replay_load(EFI_PE_LOADER_PROTOCOL* pe, EFI_FILE_HANDLE windir, uint16_t version,
+                       const boot_driver* drivers, unsigned int num_drivers, const load_mode* mode,
+                       LIST_ENTRY* images, load_result* res);
+void free_images(LIST_ENTRY* images, uint16_t version);
+bool get_boot_drivers(EFI_REGISTRY_PROTOCOL* reg, EFI_FILE_HANDLE windir, boot_driver** drivers,
+                      unsigned int* num_drivers);